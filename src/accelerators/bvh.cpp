@@ -34,10 +34,29 @@
 // accelerators/bvh.cpp*
 #include "accelerators/bvh.h"
 #include "interaction.h"
+#include "shapes/triangle.h"
 #include "paramset.h"
 #include "stats.h"
 #include "parallel.h"
+#include "simd.h"
 #include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <errno.h>
+#include <queue>
+#include <unordered_map>
+#ifdef PBRT_HAVE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+#ifdef PBRT_IS_WINDOWS
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
 
 namespace pbrt {
 
@@ -45,6 +64,14 @@ STAT_MEMORY_COUNTER("Memory/BVH tree", treeBytes);
 STAT_RATIO("BVH/Primitives per leaf node", totalPrimitives, totalLeafNodes);
 STAT_COUNTER("BVH/Interior nodes", interiorNodes);
 STAT_COUNTER("BVH/Leaf nodes", leafNodes);
+STAT_COUNTER("BVH/Wide nodes", wideNodes);
+STAT_FLOAT_DISTRIBUTION("BVH/Build time (seconds)", buildTime);
+STAT_FLOAT_DISTRIBUTION("BVH/Refit time (seconds)", refitTime);
+STAT_COUNTER("BVH/Spatial split references", spatialSplitReferences);
+STAT_RATIO("BVH/Nodes visited per ray", nodesVisited, raysTraversed);
+STAT_COUNTER("BVH/Cache hits", cacheHits);
+STAT_COUNTER("BVH/Cache misses", cacheMisses);
+STAT_RATIO("BVH/Leaves with packed triangles", packedLeaves, totalLeaves);
 
 // BVHAccel Local Declarations
 struct BVHPrimitiveInfo {
@@ -94,6 +121,25 @@ struct BVHBuildNode {
     size_t firstPrimOffset, nPrimitives;
 };
 
+// A subtree whose construction has been deferred so that it can be built in
+// parallel with the others; _node_ is filled in with the subtree's root.
+struct BVHSubtreeBuild {
+    BVHBuildNode *node;
+    size_t start, end;
+};
+
+// Bounds of a BVH node at the start and end of the time range over which
+// its primitives move; interpolating them bounds the node at any time in
+// between.
+struct LinearBVHMotionBounds {
+    Bounds3f At(Float t) const {
+        return Bounds3f(
+            bounds[0].pMin + t * (bounds[1].pMin - bounds[0].pMin),
+            bounds[0].pMax + t * (bounds[1].pMax - bounds[0].pMax));
+    }
+    Bounds3f bounds[2];
+};
+
 struct MortonPrimitive {
     size_t primitiveIndex;
     uint32_t mortonCode;
@@ -115,6 +161,261 @@ struct LinearBVHNode {
     uint8_t pad[1];        // ensure 32 byte total size
 };
 
+// _LinearWideBVHNode_ stores the bounds of up to _N_ children in
+// structure-of-arrays form so that all of them can be tested against a ray
+// with a single set of SIMD operations. The bounds are rounded outward to
+// single precision so that the test remains conservative.
+template <int N>
+struct
+#ifdef PBRT_HAVE_ALIGNAS
+alignas(32)
+#endif // PBRT_HAVE_ALIGNAS
+    LinearWideBVHNode {
+    enum { width = N };
+    void SetBounds(const Bounds3f *childBounds) {
+        for (int i = 0; i < nChildren; ++i)
+            for (int axis = 0; axis < 3; ++axis) {
+                bounds[axis][i] = RoundFloatDown(childBounds[i].pMin[axis]);
+                bounds[3 + axis][i] = RoundFloatUp(childBounds[i].pMax[axis]);
+            }
+    }
+    float bounds[6][N];       // pMin.x, pMin.y, pMin.z, pMax.x, pMax.y, pMax.z
+    int32_t offset[N];        // interior child: node index, leaf: primitives
+    uint16_t nPrimitives[N];  // 0 -> interior child
+    uint8_t nChildren;
+};
+
+// _LinearQuantizedBVHNode_ is a compressed form of _LinearWideBVHNode_ that
+// stores each child's bounds as _Q_-sized integers on a per-axis grid that
+// spans the node's own bounds. Grid spacings are powers of two, so
+// dequantized coordinates are computed with a single rounding, and the
+// quantized values are chosen so that they always enclose the child.
+template <int N, typename Q>
+struct LinearQuantizedBVHNode {
+    enum { width = N };
+    void SetBounds(const Bounds3f *childBounds) {
+        PBRT_CONSTEXPR int qMax = std::numeric_limits<Q>::max();
+        for (int axis = 0; axis < 3; ++axis) {
+            // Find grid origin and the smallest spacing that covers the node
+            Float lo = Infinity, hi = -Infinity;
+            for (int i = 0; i < nChildren; ++i) {
+                lo = std::min(lo, childBounds[i].pMin[axis]);
+                hi = std::max(hi, childBounds[i].pMax[axis]);
+            }
+            origin[axis] = RoundFloatDown(lo);
+            int exponent = -100;
+            if (hi > origin[axis])
+                exponent = std::max(
+                    exponent,
+                    (int)std::ceil(std::log2((hi - origin[axis]) / qMax)));
+            while (exponent < 127 &&
+                   origin[axis] + qMax * std::ldexp(1.f, exponent) < hi)
+                ++exponent;
+            scale[axis] = std::ldexp(1.f, exponent);
+
+            // Quantize child bounds, rounding outward
+            for (int i = 0; i < nChildren; ++i) {
+                Float cLo = childBounds[i].pMin[axis];
+                Float cHi = childBounds[i].pMax[axis];
+                int qLo = Clamp((int)std::floor((cLo - origin[axis]) /
+                                                scale[axis]), 0, qMax);
+                while (qLo > 0 && dequantize(axis, qLo) > cLo) --qLo;
+                int qHi = Clamp((int)std::ceil((cHi - origin[axis]) /
+                                               scale[axis]), 0, qMax);
+                while (qHi < qMax && dequantize(axis, qHi) < cHi) ++qHi;
+                qBounds[axis][i] = qLo;
+                qBounds[3 + axis][i] = qHi;
+            }
+        }
+    }
+    float dequantize(int axis, int q) const {
+        return origin[axis] + float(q) * scale[axis];
+    }
+    float origin[3], scale[3];
+    Q qBounds[6][N];          // quantized pMin.xyz, pMax.xyz
+    int32_t offset[N];        // interior child: node index, leaf: primitives
+    uint16_t nPrimitives[N];  // 0 -> interior child
+    uint8_t nChildren;
+};
+
+// Per-ray values used to test a ray against _LinearWideBVHNode_ bounds. The
+// origin is rounded separately for the near and far slab planes so that
+// its conversion to single precision only ever grows the parametric
+// interval.
+struct WideBVHRay {
+    WideBVHRay(const Ray &ray) {
+        for (int i = 0; i < 3; ++i) {
+            Float inv = 1 / ray.d[i];
+            invDir[i] = (float)inv;
+            bool dirIsNeg = inv < 0;
+            nearIndex[i] = dirIsNeg ? 3 + i : i;
+            farIndex[i] = dirIsNeg ? i : 3 + i;
+            oNear[i] = dirIsNeg ? RoundFloatDown(ray.o[i])
+                                : RoundFloatUp(ray.o[i]);
+            oFar[i] = dirIsNeg ? RoundFloatUp(ray.o[i])
+                               : RoundFloatDown(ray.o[i]);
+        }
+    }
+    float oNear[3], oFar[3], invDir[3];
+    int nearIndex[3], farIndex[3];
+};
+
+struct WideBVHStackEntry {
+    int32_t offset;
+    int32_t nPrimitives;  // 0 -> interior node
+    float tNear;
+};
+
+// Returns a bitmask of the children of _node_ that the ray overlaps
+// before _tMax_, storing their entry distances in _tNear_.
+template <int N>
+inline int IntersectWideNode(const LinearWideBVHNode<N> &node,
+                             const WideBVHRay &r, float tMax, float *tNear) {
+    // Update _tFar_ to ensure robust ray--bounds intersection; the extra
+    // rounding comes from converting the reciprocal direction to float
+    const SIMDFloat<N> errorScale(1 + 2 * SinglePrecisionGamma(4));
+    SIMDFloat<N> t0(0.f), t1(tMax);
+    for (int i = 0; i < 3; ++i) {
+        SIMDFloat<N> invDir(r.invDir[i]);
+        SIMDFloat<N> tNearSlab =
+            (SIMDFloat<N>::Load(node.bounds[r.nearIndex[i]]) -
+             SIMDFloat<N>(r.oNear[i])) * invDir;
+        SIMDFloat<N> tFarSlab =
+            (SIMDFloat<N>::Load(node.bounds[r.farIndex[i]]) -
+             SIMDFloat<N>(r.oFar[i])) * invDir * errorScale;
+        // A NaN slab distance (ray origin on a slab plane of a zero
+        // direction component) leaves the interval unchanged
+        t0 = Max(tNearSlab, t0);
+        t1 = Min(tFarSlab, t1);
+    }
+    t0.Store(tNear);
+    return LessEqualMask(t0, t1) & ((1 << node.nChildren) - 1);
+}
+
+template <int N, typename Q>
+inline int IntersectWideNode(const LinearQuantizedBVHNode<N, Q> &node,
+                             const WideBVHRay &r, float tMax, float *tNear) {
+    // Dequantize the children's bounds and test them as usual
+    LinearWideBVHNode<N> bounds;
+    for (int b = 0; b < 6; ++b)
+        for (int i = 0; i < N; ++i)
+            bounds.bounds[b][i] = node.dequantize(b % 3, node.qBounds[b][i]);
+    bounds.nChildren = node.nChildren;
+    return IntersectWideNode(bounds, r, tMax, tNear);
+}
+
+// Per-ray values for the watertight ray--triangle test used with packed
+// triangle leaves; see _Triangle::Intersect()_, whose arithmetic
+// _IntersectTriangleLanes()_ reproduces exactly.
+struct TriangleLeafRay {
+    TriangleLeafRay() {}
+    TriangleLeafRay(const Ray &ray) {
+        kz = MaxDimension(Abs(ray.d));
+        kx = kz + 1;
+        if (kx == 3) kx = 0;
+        ky = kx + 1;
+        if (ky == 3) ky = 0;
+        o = Point3f(ray.o[kx], ray.o[ky], ray.o[kz]);
+        Sx = -ray.d[kx] / ray.d[kz];
+        Sy = -ray.d[ky] / ray.d[kz];
+        Sz = 1.f / ray.d[kz];
+    }
+    int kx, ky, kz;
+    Point3f o;
+    Float Sx, Sy, Sz;
+};
+
+// Maximum number of triangles tested together by _IntersectTriangleLanes()_
+static PBRT_CONSTEXPR int triangleLanes = 8;
+
+// Tests the ray against the _n_ packed triangles starting at _first_,
+// independently of the ray's _tMax_. For each triangle, _tScaled_ and _det_
+// are set as in _Triangle::Intersect()_ and _valid_ records whether the
+// triangle passed all other tests.
+static void IntersectTriangleLanes(const TriangleLeafRay &r,
+                                   const Float *const vertices[3][3],
+                                   size_t first, int n, Float *tScaled,
+                                   Float *det, bool *valid) {
+    // Permuting the vertex components just selects different arrays
+    const Float *p0x = vertices[0][r.kx] + first;
+    const Float *p0y = vertices[0][r.ky] + first;
+    const Float *p0z = vertices[0][r.kz] + first;
+    const Float *p1x = vertices[1][r.kx] + first;
+    const Float *p1y = vertices[1][r.ky] + first;
+    const Float *p1z = vertices[1][r.kz] + first;
+    const Float *p2x = vertices[2][r.kx] + first;
+    const Float *p2y = vertices[2][r.ky] + first;
+    const Float *p2z = vertices[2][r.kz] + first;
+    for (int i = 0; i < n; ++i) {
+        // Translate and shear vertices into ray coordinate space
+        Point3f p0t(p0x[i] - r.o.x, p0y[i] - r.o.y, p0z[i] - r.o.z);
+        Point3f p1t(p1x[i] - r.o.x, p1y[i] - r.o.y, p1z[i] - r.o.z);
+        Point3f p2t(p2x[i] - r.o.x, p2y[i] - r.o.y, p2z[i] - r.o.z);
+        p0t.x += r.Sx * p0t.z;
+        p0t.y += r.Sy * p0t.z;
+        p1t.x += r.Sx * p1t.z;
+        p1t.y += r.Sy * p1t.z;
+        p2t.x += r.Sx * p2t.z;
+        p2t.y += r.Sy * p2t.z;
+
+        // Compute edge function coefficients _e0_, _e1_, and _e2_
+        Float e0 = p1t.x * p2t.y - p1t.y * p2t.x;
+        Float e1 = p2t.x * p0t.y - p2t.y * p0t.x;
+        Float e2 = p0t.x * p1t.y - p0t.y * p1t.x;
+        if (sizeof(Float) == sizeof(float) &&
+            (e0 == 0.0f || e1 == 0.0f || e2 == 0.0f)) {
+            double p2txp1ty = (double)p2t.x * (double)p1t.y;
+            double p2typ1tx = (double)p2t.y * (double)p1t.x;
+            e0 = (float)(p2typ1tx - p2txp1ty);
+            double p0txp2ty = (double)p0t.x * (double)p2t.y;
+            double p0typ2tx = (double)p0t.y * (double)p2t.x;
+            e1 = (float)(p0typ2tx - p0txp2ty);
+            double p1txp0ty = (double)p1t.x * (double)p0t.y;
+            double p1typ0tx = (double)p1t.y * (double)p0t.x;
+            e2 = (float)(p1typ0tx - p1txp0ty);
+        }
+        det[i] = e0 + e1 + e2;
+        p0t.z *= r.Sz;
+        p1t.z *= r.Sz;
+        p2t.z *= r.Sz;
+        tScaled[i] = e0 * p0t.z + e1 * p1t.z + e2 * p2t.z;
+
+        // Compute conservative bound on error in the hit's $t$ value
+        Float maxZt = std::max(std::abs(p0t.z),
+                               std::max(std::abs(p1t.z), std::abs(p2t.z)));
+        Float deltaZ = gamma(3) * maxZt;
+        Float maxXt = std::max(std::abs(p0t.x),
+                               std::max(std::abs(p1t.x), std::abs(p2t.x)));
+        Float maxYt = std::max(std::abs(p0t.y),
+                               std::max(std::abs(p1t.y), std::abs(p2t.y)));
+        Float deltaX = gamma(5) * (maxXt + maxZt);
+        Float deltaY = gamma(5) * (maxYt + maxZt);
+        Float deltaE =
+            2 * (gamma(2) * maxXt * maxYt + deltaY * maxXt + deltaX * maxYt);
+        Float maxE =
+            std::max(std::abs(e0), std::max(std::abs(e1), std::abs(e2)));
+        Float invDet = 1 / det[i];
+        Float deltaT =
+            3 * (gamma(3) * maxE * maxZt + deltaE * maxZt + deltaZ * maxE) *
+            std::abs(invDet);
+
+        // Perform the tests from _Triangle::Intersect()_ that don't
+        // depend on _tMax_, written so that NaNs are handled identically
+        valid[i] = !((e0 < 0 || e1 < 0 || e2 < 0) &&
+                     (e0 > 0 || e1 > 0 || e2 > 0)) &&
+                   det[i] != 0 && !(det[i] < 0 && tScaled[i] >= 0) &&
+                   !(det[i] > 0 && tScaled[i] <= 0) &&
+                   !(tScaled[i] * invDet <= deltaT);
+    }
+}
+
+// Returns whether a triangle with the given _IntersectTriangleLanes()_
+// results passes _Triangle::Intersect()_'s test against _tMax_.
+inline bool TriangleHitBefore(Float tScaled, Float det, Float tMax) {
+    return !(det < 0 && tScaled < tMax * det) &&
+           !(det > 0 && tScaled > tMax * det);
+}
+
 // BVHAccel Utility Functions
 inline uint32_t LeftShift3(uint32_t x) {
     CHECK_LE(x, uint32_t(1 << 10));
@@ -148,6 +449,10 @@ inline uint32_t EncodeMorton3(const Vector3f &v) {
     return (LeftShift3(v.z) << 2) | (LeftShift3(v.y) << 1) | LeftShift3(v.x);
 }
 
+// _RadixSort()_ counts and scatters chunks of this many values in
+// parallel.
+static PBRT_CONSTEXPR size_t radixSortChunkSize = 16 * 1024;
+
 static void RadixSort(std::vector<MortonPrimitive> *v) {
     std::vector<MortonPrimitive> tempVector(v->size());
     PBRT_CONSTEXPR int bitsPerPass = 6;
@@ -155,6 +460,14 @@ static void RadixSort(std::vector<MortonPrimitive> *v) {
     static_assert((nBits % bitsPerPass) == 0,
                   "Radix sort bitsPerPass must evenly divide nBits");
     PBRT_CONSTEXPR int nPasses = nBits / bitsPerPass;
+    PBRT_CONSTEXPR int nBuckets = 1 << bitsPerPass;
+    PBRT_CONSTEXPR int bitMask = (1 << bitsPerPass) - 1;
+
+    // Allocate bucket counts for each chunk of values
+    const size_t nValues = v->size();
+    const int64_t nChunks =
+        (nValues + radixSortChunkSize - 1) / radixSortChunkSize;
+    std::vector<int> chunkBucketCount(nChunks * nBuckets);
 
     for (int pass = 0; pass < nPasses; ++pass) {
         // Perform one pass of radix sort, sorting _bitsPerPass_ bits
@@ -164,28 +477,40 @@ static void RadixSort(std::vector<MortonPrimitive> *v) {
         std::vector<MortonPrimitive> &in = (pass & 1) ? tempVector : *v;
         std::vector<MortonPrimitive> &out = (pass & 1) ? *v : tempVector;
 
-        // Count number of zero bits in array for current radix sort bit
-        PBRT_CONSTEXPR int nBuckets = 1 << bitsPerPass;
-        int bucketCount[nBuckets] = {0};
-        PBRT_CONSTEXPR int bitMask = (1 << bitsPerPass) - 1;
-        for (const MortonPrimitive &mp : in) {
-            int bucket = (mp.mortonCode >> lowBit) & bitMask;
-            CHECK_GE(bucket, 0);
-            CHECK_LT(bucket, nBuckets);
-            ++bucketCount[bucket];
-        }
-
-        // Compute starting index in output array for each bucket
-        int outIndex[nBuckets];
-        outIndex[0] = 0;
-        for (int i = 1; i < nBuckets; ++i)
-            outIndex[i] = outIndex[i - 1] + bucketCount[i - 1];
+        // Count number of values in each bucket for each chunk of _in_
+        std::fill(chunkBucketCount.begin(), chunkBucketCount.end(), 0);
+        ParallelFor([&](int64_t c) {
+            int *bucketCount = &chunkBucketCount[c * nBuckets];
+            size_t chunkEnd = std::min(nValues, (c + 1) * radixSortChunkSize);
+            for (size_t i = c * radixSortChunkSize; i < chunkEnd; ++i) {
+                int bucket = (in[i].mortonCode >> lowBit) & bitMask;
+                CHECK_GE(bucket, 0);
+                CHECK_LT(bucket, nBuckets);
+                ++bucketCount[bucket];
+            }
+        }, nChunks);
+
+        // Compute starting index in output array for each chunk's bucket;
+        // within a bucket, earlier chunks' values go first so that the sort
+        // remains stable
+        int outIndex = 0;
+        for (int bucket = 0; bucket < nBuckets; ++bucket)
+            for (int64_t c = 0; c < nChunks; ++c) {
+                int &count = chunkBucketCount[c * nBuckets + bucket];
+                int chunkOutIndex = outIndex;
+                outIndex += count;
+                count = chunkOutIndex;
+            }
 
         // Store sorted values in output array
-        for (const MortonPrimitive &mp : in) {
-            int bucket = (mp.mortonCode >> lowBit) & bitMask;
-            out[outIndex[bucket]++] = mp;
-        }
+        ParallelFor([&](int64_t c) {
+            int *chunkOutIndex = &chunkBucketCount[c * nBuckets];
+            size_t chunkEnd = std::min(nValues, (c + 1) * radixSortChunkSize);
+            for (size_t i = c * radixSortChunkSize; i < chunkEnd; ++i) {
+                int bucket = (in[i].mortonCode >> lowBit) & bitMask;
+                out[chunkOutIndex[bucket]++] = in[i];
+            }
+        }, nChunks);
     }
     // Copy final result from _tempVector_, if needed
     if (nPasses & 1) std::swap(*v, tempVector);
@@ -193,31 +518,174 @@ static void RadixSort(std::vector<MortonPrimitive> *v) {
 
 // BVHAccel Method Definitions
 BVHAccel::BVHAccel(std::vector<std::shared_ptr<Primitive>> p,
-                   int maxPrimsInNode, SplitMethod splitMethod)
+                   int maxPrimsInNode, SplitMethod splitMethod, int width,
+                   Float splitBudget, const std::string &cacheDir,
+                   int quantizeBits, bool packTriangles)
     : maxPrimsInNode(std::min(255, maxPrimsInNode)),
       splitMethod(splitMethod),
-      primitives(std::move(p)) {
+      primitives(std::move(p)),
+      width(width),
+      quantizeBits(quantizeBits) {
     ProfilePhase _(Prof::AccelConstruction);
     if (primitives.empty()) return;
     // Build BVH from _primitives_
 
-    // Initialize _primitiveInfo_ array for primitives
+    // Initialize _primitiveInfo_ array for primitives, in parallel since
+    // finding the bounds of transformed instances isn't cheap
     std::vector<BVHPrimitiveInfo> primitiveInfo(primitives.size());
-    for (size_t i = 0; i < primitives.size(); ++i) {
-        primitiveInfo[i] = {i, primitives[i]->WorldBound()};
+    ParallelFor([&](int64_t i) {
+        primitiveInfo[i] = {size_t(i), primitives[i]->WorldBound()};
+    }, primitives.size(), 4096);
+
+    // Reuse a tree previously built from the same inputs if there is one
+    // in _cacheDir_; spatial splits depend on more than the primitives'
+    // bounds, so SBVH trees are never cached
+    std::string cacheFilename;
+    uint64_t cacheHash = 0;
+    if (!cacheDir.empty() && splitMethod != SplitMethod::SBVH) {
+        cacheHash = hashBuildInputs(primitiveInfo);
+        cacheFilename =
+            cacheDir + "/" +
+            StringPrintf("bvh-%016llx.bin", (unsigned long long)cacheHash);
+    }
+    int totalNodes;
+    if (!cacheFilename.empty() &&
+        readCache(cacheFilename, cacheHash, &totalNodes)) {
+        ++cacheHits;
+        LOG(INFO) << StringPrintf("Read BVH with %d nodes from \"%s\"",
+                                  totalNodes, cacheFilename.c_str());
+    } else {
+        std::vector<std::shared_ptr<Primitive>> originalPrims;
+        if (!cacheFilename.empty()) originalPrims = primitives;
+        totalNodes = build(primitiveInfo, splitBudget);
+        if (!cacheFilename.empty()) {
+            ++cacheMisses;
+            writeCache(cacheFilename, cacheHash, totalNodes, originalPrims);
+        }
+    }
+    bounds = nodes[0].bounds;
+    treeBytes += sizeof(*this) + primitives.size() * sizeof(primitives[0]);
+    if (packTriangles) packTriangleLeaves(totalNodes);
+
+    // Store bounds at the start and end of any primitive motion so that
+    // rays are tested against bounds at their time rather than ones
+    // enclosing the whole motion
+    Float time0 = Infinity, time1 = -Infinity;
+    for (const std::shared_ptr<Primitive> &prim : primitives) {
+        Float primTime0, primTime1;
+        if (prim->MotionTimeRange(&primTime0, &primTime1)) {
+            time0 = std::min(time0, primTime0);
+            time1 = std::max(time1, primTime1);
+        }
+    }
+    if (time0 < time1) {
+        if (quantizeBits != 0)
+            Warning("BVH with quantized nodes can't store motion bounds; "
+                    "moving primitives will be bounded over their entire "
+                    "motion.");
+        else {
+            motionTime0 = time0;
+            motionTime1 = time1;
+            motionBounds = AllocAligned<LinearBVHMotionBounds>(totalNodes);
+            computeMotionBounds(totalNodes);
+            treeBytes += totalNodes * sizeof(LinearBVHMotionBounds);
+        }
     }
 
+    if (quantizeBits != 0) {
+        // Replace the binary BVH with a compressed one of the given width
+        int nQuantizedNodes = 0;
+        if (quantizeBits == 8)
+            quantizedNodes =
+                width == 2 ? quantize<2, uint8_t>(&nQuantizedNodes)
+                : width == 4 ? quantize<4, uint8_t>(&nQuantizedNodes)
+                             : quantize<8, uint8_t>(&nQuantizedNodes);
+        else
+            quantizedNodes =
+                width == 2 ? quantize<2, uint16_t>(&nQuantizedNodes)
+                : width == 4 ? quantize<4, uint16_t>(&nQuantizedNodes)
+                             : quantize<8, uint16_t>(&nQuantizedNodes);
+        if (cacheData)
+            freeCacheData();
+        else
+            FreeAligned(nodes);
+        nodes = nullptr;
+        LOG(INFO) << StringPrintf("Compressed BVH to %d %d-wide nodes "
+                                  "with %d-bit bounds", nQuantizedNodes,
+                                  width, quantizeBits);
+        return;
+    }
+    treeBytes += totalNodes * sizeof(LinearBVHNode);
+
+    // Collapse the binary BVH into a wide BVH for SIMD traversal, if
+    // requested; wide nodes don't store motion bounds, so the binary nodes
+    // are used when the primitives move
+    int nWideNodes = 0;
+    if (motionBounds && width > 2)
+        Warning("Using a binary BVH rather than a %d-wide one in order to "
+                "use bounds that account for primitive motion.", width);
+    else if (width == 4) {
+        nodes4 = collapseToWideBVH<LinearWideBVHNode<4>>(&nWideNodes);
+        treeBytes += nWideNodes * sizeof(LinearWideBVHNode<4>);
+    } else if (width == 8) {
+        nodes8 = collapseToWideBVH<LinearWideBVHNode<8>>(&nWideNodes);
+        treeBytes += nWideNodes * sizeof(LinearWideBVHNode<8>);
+    }
+    // Count the wide nodes here rather than in _collapseToWideBVH()_,
+    // which _Refit()_ calls again
+    wideNodes += nWideNodes;
+    if (nWideNodes > 0)
+        LOG(INFO) << StringPrintf("Collapsed BVH to %d %d-wide nodes",
+                                  nWideNodes, width);
+}
+
+int BVHAccel::build(std::vector<BVHPrimitiveInfo> &primitiveInfo,
+                    Float splitBudget) {
     // Build BVH tree for primitives using _primitiveInfo_
+    std::chrono::steady_clock::time_point buildStart =
+        std::chrono::steady_clock::now();
     MemoryArena arena(1024 * 1024);
+    std::vector<MemoryArena> threadArenas(MaxThreadIndex());
     int totalNodes = 0;
     std::vector<std::shared_ptr<Primitive>> orderedPrims;
-    orderedPrims.reserve(primitives.size());
     BVHBuildNode *root;
-    if (splitMethod == SplitMethod::HLBVH)
-        root = HLBVHBuild(arena, primitiveInfo, &totalNodes, orderedPrims);
-    else
+    if (splitMethod == SplitMethod::HLBVH) {
+        orderedPrims.reserve(primitives.size());
+        root = HLBVHBuild(arena, threadArenas, primitiveInfo, &totalNodes,
+                          orderedPrims);
+    } else if (splitMethod == SplitMethod::SBVH) {
+        // Allow up to _splitBudget_ times more references than primitives
+        // to be created by spatial splits
+        orderedPrims.reserve(primitives.size());
+        Bounds3f rootBounds;
+        for (const BVHPrimitiveInfo &pi : primitiveInfo)
+            rootBounds = Union(rootBounds, pi.bounds);
+        int64_t budget = splitBudget * primitives.size();
+        root = spatialSplitBuild(arena, primitiveInfo, rootBounds.SurfaceArea(),
+                                 &budget, &totalNodes, orderedPrims);
+    } else {
+        // Build the upper levels of the tree, deferring subtrees below
+        orderedPrims.resize(primitives.size());
+        std::vector<BVHSubtreeBuild> subtrees;
         root = recursiveBuild(arena, primitiveInfo, 0, primitives.size(),
-                              &totalNodes, orderedPrims);
+                              &totalNodes, orderedPrims, &subtrees);
+
+        // Build deferred subtrees in parallel
+        std::atomic<int> subtreeNodes(0);
+        ParallelFor([&](int64_t i) {
+            const BVHSubtreeBuild &subtree = subtrees[i];
+            int nodesCreated = 0;
+            BVHBuildNode *subtreeRoot = recursiveBuild(
+                threadArenas[ThreadIndex], primitiveInfo, subtree.start,
+                subtree.end, &nodesCreated, orderedPrims);
+            *subtree.node = *subtreeRoot;
+            subtreeNodes += nodesCreated;
+        }, subtrees.size());
+        totalNodes += subtreeNodes;
+    }
+    ReportValue(buildTime,
+                std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - buildStart).count());
     //root->Dump("root");
     //exit(0);
     primitives.swap(orderedPrims);
@@ -231,16 +699,205 @@ BVHAccel::BVHAccel(std::vector<std::shared_ptr<Primitive>> p,
                               (1024.f * 1024.f));
 
     // Compute representation of depth-first traversal of BVH tree
-    treeBytes += totalNodes * sizeof(LinearBVHNode) + sizeof(*this) +
-                 primitives.size() * sizeof(primitives[0]);
     nodes = AllocAligned<LinearBVHNode>(totalNodes);
     int offset = 0;
     flattenBVHTree(root, &offset);
     CHECK_EQ(totalNodes, offset);
+    return totalNodes;
+}
+
+// Returns the triangle _prim_ holds if it's one that
+// _IntersectTriangleLanes()_ can handle; alpha masked and degenerate
+// triangles may be rejected after passing the ray--triangle test, so
+// they're left to _Triangle::Intersect()_.
+static const Triangle *PackableTriangle(const Primitive *prim) {
+    const GeometricPrimitive *gp =
+        dynamic_cast<const GeometricPrimitive *>(prim);
+    const Triangle *tri =
+        gp ? dynamic_cast<const Triangle *>(gp->GetShape()) : nullptr;
+    if (!tri || tri->HasAlphaMask()) return nullptr;
+    Point3f p0, p1, p2;
+    tri->GetVertices(&p0, &p1, &p2);
+    if (Cross(p2 - p0, p1 - p0).LengthSquared() == 0) return nullptr;
+    return tri;
+}
+
+void BVHAccel::packTriangleLeaves(int totalNodes) {
+    // Find the triangles that _IntersectTriangleLanes()_ can handle
+    std::vector<const Triangle *> triangles(primitives.size(), nullptr);
+    for (size_t i = 0; i < primitives.size(); ++i)
+        triangles[i] = PackableTriangle(primitives[i].get());
+
+    // Mark leaves that hold only such triangles
+    std::vector<uint8_t> packed(primitives.size(), 0);
+    bool anyPacked = false;
+    for (int i = 0; i < totalNodes; ++i) {
+        const LinearBVHNode &node = nodes[i];
+        if (node.nPrimitives == 0) continue;
+        ++totalLeaves;
+        bool allTriangles = true;
+        for (int j = 0; j < node.nPrimitives; ++j)
+            allTriangles &= triangles[node.primitivesOffset + j] != nullptr;
+        if (allTriangles) {
+            packed[node.primitivesOffset] = 1;
+            anyPacked = true;
+            ++packedLeaves;
+        }
+    }
+    if (!anyPacked) return;
+
+    // Copy vertex positions into structure-of-arrays form
+    size_t n = primitives.size();
+    Float *data = AllocAligned<Float>(9 * n);
+    for (int v = 0; v < 3; ++v)
+        for (int axis = 0; axis < 3; ++axis)
+            triangleVertices[v][axis] = data + (3 * v + axis) * n;
+    for (size_t i = 0; i < n; ++i) {
+        Point3f p[3];
+        if (triangles[i]) triangles[i]->GetVertices(&p[0], &p[1], &p[2]);
+        for (int v = 0; v < 3; ++v)
+            for (int axis = 0; axis < 3; ++axis)
+                triangleVertices[v][axis][i] = p[v][axis];
+    }
+    packedLeaf.swap(packed);
+    treeBytes += 9 * n * sizeof(Float) + n * sizeof(packedLeaf[0]);
+}
+
+Bounds3f BVHAccel::WorldBound() const { return bounds; }
+
+// Returns one past the index of the last node in the subtree rooted at
+// _nodeIndex_, which is its rightmost leaf in the depth-first layout.
+static int SubtreeEnd(const LinearBVHNode *nodes, int nodeIndex) {
+    while (nodes[nodeIndex].nPrimitives == 0)
+        nodeIndex = nodes[nodeIndex].secondChildOffset;
+    return nodeIndex + 1;
 }
 
-Bounds3f BVHAccel::WorldBound() const {
-    return nodes ? nodes[0].bounds : Bounds3f();
+bool BVHAccel::SameTree(const BVHAccel &other) const {
+    if (primitives != other.primitives) return false;
+    if (!nodes || !other.nodes) return nodes == other.nodes;
+    int totalNodes = SubtreeEnd(nodes, 0);
+    if (SubtreeEnd(other.nodes, 0) != totalNodes) return false;
+    for (int i = 0; i < totalNodes; ++i) {
+        const LinearBVHNode &a = nodes[i], &b = other.nodes[i];
+        if (!(a.bounds == b.bounds) || a.nPrimitives != b.nPrimitives ||
+            a.primitivesOffset != b.primitivesOffset ||
+            (a.nPrimitives == 0 && a.axis != b.axis))
+            return false;
+    }
+    return true;
+}
+
+void BVHAccel::computeMotionBounds(int totalNodes) {
+    // Compute linear motion bounds of the primitives in parallel
+    std::vector<LinearBVHMotionBounds> primBounds(primitives.size());
+    ParallelFor([&](int64_t i) {
+        primitives[i]->LinearMotionBounds(motionTime0, motionTime1,
+                                          &primBounds[i].bounds[0],
+                                          &primBounds[i].bounds[1]);
+    }, primitives.size(), 1024);
+
+    // Combine them into the nodes' bounds bottom-up
+    for (int nodeIndex = totalNodes - 1; nodeIndex >= 0; --nodeIndex) {
+        const LinearBVHNode &node = nodes[nodeIndex];
+        LinearBVHMotionBounds &mb = motionBounds[nodeIndex];
+        for (int t = 0; t < 2; ++t) {
+            if (node.nPrimitives > 0) {
+                mb.bounds[t] = Bounds3f();
+                for (int i = 0; i < node.nPrimitives; ++i)
+                    mb.bounds[t] = Union(
+                        mb.bounds[t],
+                        primBounds[node.primitivesOffset + i].bounds[t]);
+            } else
+                mb.bounds[t] =
+                    Union(motionBounds[nodeIndex + 1].bounds[t],
+                          motionBounds[node.secondChildOffset].bounds[t]);
+        }
+    }
+}
+
+void BVHAccel::Refit() {
+    ProfilePhase _(Prof::AccelConstruction);
+    if (!nodes) {
+        Error("BVH with quantized nodes can't be refit.");
+        return;
+    }
+    std::chrono::steady_clock::time_point refitStart =
+        std::chrono::steady_clock::now();
+
+    // Split the tree into subtrees that can be refit in parallel and the
+    // nodes above them
+    int totalNodes = SubtreeEnd(nodes, 0);
+    int maxSubtreeNodes = std::max(totalNodes / (8 * MaxThreadIndex()), 1024);
+    std::vector<int> subtreeRoots, upperNodes;
+    std::function<void(int)> findSubtrees = [&](int nodeIndex) {
+        if (SubtreeEnd(nodes, nodeIndex) - nodeIndex <= maxSubtreeNodes) {
+            subtreeRoots.push_back(nodeIndex);
+            return;
+        }
+        upperNodes.push_back(nodeIndex);
+        findSubtrees(nodeIndex + 1);
+        findSubtrees(nodes[nodeIndex].secondChildOffset);
+    };
+    findSubtrees(0);
+
+    // Recompute node bounds bottom-up; children always follow their parent
+    // in _nodes_, so visiting nodes in reverse order handles them first
+    auto refitNode = [&](int nodeIndex) {
+        LinearBVHNode &node = nodes[nodeIndex];
+        if (node.nPrimitives == 0) {
+            node.bounds = Union(nodes[nodeIndex + 1].bounds,
+                                nodes[node.secondChildOffset].bounds);
+            return;
+        }
+        Bounds3f b;
+        int offset = node.primitivesOffset;
+        if (!packedLeaf.empty() && packedLeaf[offset]) {
+            // Update the leaf's packed vertices along with its bounds; the
+            // triangles are known to be ones that _PackableTriangle()_
+            // accepted, but they may have become degenerate
+            for (int i = 0; i < node.nPrimitives; ++i) {
+                const Triangle *tri = static_cast<const Triangle *>(
+                    static_cast<const GeometricPrimitive *>(
+                        primitives[offset + i].get())->GetShape());
+                Point3f p[3];
+                tri->GetVertices(&p[0], &p[1], &p[2]);
+                if (Cross(p[2] - p[0], p[1] - p[0]).LengthSquared() == 0)
+                    packedLeaf[offset] = 0;
+                for (int v = 0; v < 3; ++v)
+                    for (int axis = 0; axis < 3; ++axis)
+                        triangleVertices[v][axis][offset + i] = p[v][axis];
+                b = Union(Union(b, Bounds3f(p[0], p[1])), p[2]);
+            }
+        } else
+            for (int i = 0; i < node.nPrimitives; ++i)
+                b = Union(b, primitives[offset + i]->WorldBound());
+        node.bounds = b;
+    };
+    ParallelFor([&](int64_t i) {
+        int root = subtreeRoots[i];
+        for (int n = SubtreeEnd(nodes, root) - 1; n >= root; --n)
+            refitNode(n);
+    }, subtreeRoots.size());
+    for (auto iter = upperNodes.rbegin(); iter != upperNodes.rend(); ++iter)
+        refitNode(*iter);
+    bounds = nodes[0].bounds;
+
+    if (motionBounds) computeMotionBounds(totalNodes);
+
+    // Rebuild the wide nodes from the refit binary ones
+    if (nodes4) {
+        int nWideNodes;
+        FreeAligned(nodes4);
+        nodes4 = collapseToWideBVH<LinearWideBVHNode<4>>(&nWideNodes);
+    } else if (nodes8) {
+        int nWideNodes;
+        FreeAligned(nodes8);
+        nodes8 = collapseToWideBVH<LinearWideBVHNode<8>>(&nWideNodes);
+    }
+    ReportValue(refitTime,
+                std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - refitStart).count());
 }
 
 struct BucketInfo {
@@ -248,40 +905,74 @@ struct BucketInfo {
     Bounds3f bounds;
 };
 
+// Ranges of primitives at least this large have their bounds and SAH
+// buckets computed in parallel.
+static PBRT_CONSTEXPR size_t parallelBinningThreshold = 64 * 1024;
+
 BVHBuildNode *BVHAccel::recursiveBuild(
     MemoryArena &arena, std::vector<BVHPrimitiveInfo> &primitiveInfo, size_t start,
     size_t end, int *totalNodes,
-    std::vector<std::shared_ptr<Primitive>> &orderedPrims) {
+    std::vector<std::shared_ptr<Primitive>> &orderedPrims,
+    std::vector<BVHSubtreeBuild> *deferredSubtrees) {
 
     CHECK_NE(start, end);
     BVHBuildNode *node = arena.Alloc<BVHBuildNode>();
-    (*totalNodes)++;
-    // Compute bounds of all primitives in BVH node
-    Bounds3f bounds;
-    for (size_t i = start; i < end; ++i) {
-        //std::cout << primitiveInfo[i].bounds << std::endl;
-        bounds = Union(bounds, primitiveInfo[i].bounds);
+    size_t nPrimitives = end - start;
+    // Only the upper levels of the tree, built by the calling thread
+    // before any subtrees are deferred, use parallel loops.
+    bool parallelBinning = deferredSubtrees &&
+        nPrimitives >= parallelBinningThreshold;
+    const size_t chunkSize = parallelBinningThreshold / 4;
+    const int64_t nChunks = (nPrimitives + chunkSize - 1) / chunkSize;
+
+    // Compute bounds of all primitives and of their centroids in BVH node
+    Bounds3f bounds, centroidBounds;
+    if (parallelBinning) {
+        std::vector<Bounds3f> chunkBounds(nChunks), chunkCentroidBounds(nChunks);
+        ParallelFor([&](int64_t c) {
+            size_t chunkEnd = std::min(end, start + (c + 1) * chunkSize);
+            for (size_t i = start + c * chunkSize; i < chunkEnd; ++i) {
+                chunkBounds[c] = Union(chunkBounds[c], primitiveInfo[i].bounds);
+                chunkCentroidBounds[c] =
+                    Union(chunkCentroidBounds[c], primitiveInfo[i].centroid);
+            }
+        }, nChunks);
+        for (int64_t c = 0; c < nChunks; ++c) {
+            bounds = Union(bounds, chunkBounds[c]);
+            centroidBounds = Union(centroidBounds, chunkCentroidBounds[c]);
+        }
+    } else {
+        for (size_t i = start; i < end; ++i) {
+            //std::cout << primitiveInfo[i].bounds << std::endl;
+            bounds = Union(bounds, primitiveInfo[i].bounds);
+            //std::cout << "primitive centroid: " << primitiveInfo[i].centroid << std::endl;
+            centroidBounds = Union(centroidBounds, primitiveInfo[i].centroid);
+        }
     }
     //std::cout << start << " " << end << " " << bounds << std::endl;
+    //std::cout << "centroidBounds " << centroidBounds << std::endl;
     assert(start <= end);
-    size_t nPrimitives = end - start;
+
+    // Defer small enough subtrees so that they can be built in parallel
+    if (deferredSubtrees &&
+        nPrimitives <= std::max<size_t>(
+            primitives.size() / (8 * MaxThreadIndex()), 1024)) {
+        node->bounds = bounds;
+        deferredSubtrees->push_back({node, start, end});
+        return node;
+    }
+    (*totalNodes)++;
+
     if (nPrimitives == 1) {
         // Create leaf _BVHBuildNode_
-        size_t firstPrimOffset = orderedPrims.size();
         for (size_t i = start; i < end; ++i) {
             size_t primNum = primitiveInfo[i].primitiveNumber;
-            orderedPrims.push_back(primitives[primNum]);
+            orderedPrims[i] = primitives[primNum];
         }
-        node->InitLeaf(firstPrimOffset, nPrimitives, bounds);
+        node->InitLeaf(start, nPrimitives, bounds);
         return node;
     } else {
-        // Compute bound of primitive centroids, choose split dimension _dim_
-        Bounds3f centroidBounds;
-        for (size_t i = start; i < end; ++i) {
-            //std::cout << "primitive centroid: " << primitiveInfo[i].centroid << std::endl;
-            centroidBounds = Union(centroidBounds, primitiveInfo[i].centroid);
-        }
-        //std::cout << "centroidBounds " << centroidBounds << std::endl;
+        // Choose split dimension _dim_
         int dim = centroidBounds.MaximumExtent();
         //std::cout << dim << std::endl;
 
@@ -290,12 +981,11 @@ BVHBuildNode *BVHAccel::recursiveBuild(
         if (centroidBounds.pMax[dim] == centroidBounds.pMin[dim]) {
             //std::cout << "leaf" << std::endl;
             // Create leaf _BVHBuildNode_
-            size_t firstPrimOffset = orderedPrims.size();
             for (size_t i = start; i < end; ++i) {
                 size_t primNum = primitiveInfo[i].primitiveNumber;
-                orderedPrims.push_back(primitives[primNum]);
+                orderedPrims[i] = primitives[primNum];
             }
-            node->InitLeaf(firstPrimOffset, nPrimitives, bounds);
+            node->InitLeaf(start, nPrimitives, bounds);
             return node;
         } else {
             //std::cout << "interior" << std::endl;
@@ -355,17 +1045,41 @@ BVHBuildNode *BVHAccel::recursiveBuild(
                     BucketInfo buckets[nBuckets];
 
                     // Initialize _BucketInfo_ for SAH partition buckets
-                    for (size_t i = start; i < end; ++i) {
-                        int b = nBuckets *
-                                centroidBounds.Offset(
-                                    primitiveInfo[i].centroid)[dim];
-                        if (b == nBuckets) b = nBuckets - 1;
-                        CHECK_GE(b, 0);
-                        CHECK_LT(b, nBuckets);
-                        buckets[b].count++;
-                        buckets[b].bounds =
-                            Union(buckets[b].bounds, primitiveInfo[i].bounds);
-                    }
+                    auto binPrimitives = [&](size_t binStart, size_t binEnd,
+                                             BucketInfo *buckets) {
+                        for (size_t i = binStart; i < binEnd; ++i) {
+                            int b = nBuckets *
+                                    centroidBounds.Offset(
+                                        primitiveInfo[i].centroid)[dim];
+                            if (b == nBuckets) b = nBuckets - 1;
+                            CHECK_GE(b, 0);
+                            CHECK_LT(b, nBuckets);
+                            buckets[b].count++;
+                            buckets[b].bounds = Union(buckets[b].bounds,
+                                                      primitiveInfo[i].bounds);
+                        }
+                    };
+                    if (parallelBinning) {
+                        // Bin chunks of primitives in parallel and merge
+                        // their buckets; the result is identical to serial
+                        // binning
+                        std::vector<BucketInfo> chunkBuckets(nChunks * nBuckets);
+                        ParallelFor([&](int64_t c) {
+                            binPrimitives(
+                                start + c * chunkSize,
+                                std::min(end, start + (c + 1) * chunkSize),
+                                &chunkBuckets[c * nBuckets]);
+                        }, nChunks);
+                        for (int64_t c = 0; c < nChunks; ++c)
+                            for (int b = 0; b < nBuckets; ++b) {
+                                const BucketInfo &cb =
+                                    chunkBuckets[c * nBuckets + b];
+                                buckets[b].count += cb.count;
+                                buckets[b].bounds =
+                                    Union(buckets[b].bounds, cb.bounds);
+                            }
+                    } else
+                        binPrimitives(start, end, buckets);
 
                     // Compute costs for splitting after each bucket
                     Float cost[nBuckets - 1];
@@ -413,12 +1127,11 @@ BVHBuildNode *BVHAccel::recursiveBuild(
                         mid = pmid - &primitiveInfo[0];
                     } else {
                         // Create leaf _BVHBuildNode_
-                        size_t firstPrimOffset = orderedPrims.size();
                         for (size_t i = start; i < end; ++i) {
                             size_t primNum = primitiveInfo[i].primitiveNumber;
-                            orderedPrims.push_back(primitives[primNum]);
+                            orderedPrims[i] = primitives[primNum];
                         }
-                        node->InitLeaf(firstPrimOffset, nPrimitives, bounds);
+                        node->InitLeaf(start, nPrimitives, bounds);
                         return node;
                     }
                 }
@@ -427,8 +1140,12 @@ BVHBuildNode *BVHAccel::recursiveBuild(
             }
 
             //std::cout << "InitInterior: " << start << " " << mid << " " << end << std::endl;
-            auto left = recursiveBuild(arena, primitiveInfo, start, mid, totalNodes, orderedPrims);
-            auto right = recursiveBuild(arena, primitiveInfo, mid, end, totalNodes, orderedPrims);
+            auto left = recursiveBuild(arena, primitiveInfo, start, mid,
+                                       totalNodes, orderedPrims,
+                                       deferredSubtrees);
+            auto right = recursiveBuild(arena, primitiveInfo, mid, end,
+                                        totalNodes, orderedPrims,
+                                        deferredSubtrees);
             node->InitInterior(dim, left, right);
             //node->InitInterior(dim,
             //                   recursiveBuild(arena, primitiveInfo, start, mid,
@@ -440,14 +1157,210 @@ BVHBuildNode *BVHAccel::recursiveBuild(
     return node;
 }
 
+BVHBuildNode *BVHAccel::spatialSplitBuild(
+    MemoryArena &arena, std::vector<BVHPrimitiveInfo> &references,
+    Float rootArea, int64_t *splitBudget, int *totalNodes,
+    std::vector<std::shared_ptr<Primitive>> &orderedPrims) {
+    // The entries of _references_ are _BVHPrimitiveInfo_s whose bounds may
+    // have been clipped by spatial splits higher in the tree, so the same
+    // primitive may be referenced by more than one leaf.
+    CHECK(!references.empty());
+    BVHBuildNode *node = arena.Alloc<BVHBuildNode>();
+    (*totalNodes)++;
+    Bounds3f bounds, centroidBounds;
+    for (const BVHPrimitiveInfo &ref : references) {
+        bounds = Union(bounds, ref.bounds);
+        centroidBounds = Union(centroidBounds, ref.centroid);
+    }
+    size_t nReferences = references.size();
+    auto createLeaf = [&]() {
+        size_t firstPrimOffset = orderedPrims.size();
+        for (const BVHPrimitiveInfo &ref : references)
+            orderedPrims.push_back(primitives[ref.primitiveNumber]);
+        node->InitLeaf(firstPrimOffset, nReferences, bounds);
+        return node;
+    };
+    if (nReferences == 1) return createLeaf();
+
+    // Find the best object split using the bucketed SAH over centroids
+    PBRT_CONSTEXPR int nBuckets = 12;
+    int objectDim = centroidBounds.MaximumExtent();
+    Float objectCost = Infinity, objectOverlapArea = 0;
+    int objectSplitBucket = -1;
+    auto bucketIndex = [&](const BVHPrimitiveInfo &ref) {
+        int b = nBuckets * centroidBounds.Offset(ref.centroid)[objectDim];
+        return std::min(b, nBuckets - 1);
+    };
+    if (centroidBounds.pMax[objectDim] > centroidBounds.pMin[objectDim]) {
+        BucketInfo buckets[nBuckets];
+        for (const BVHPrimitiveInfo &ref : references) {
+            int b = bucketIndex(ref);
+            buckets[b].count++;
+            buckets[b].bounds = Union(buckets[b].bounds, ref.bounds);
+        }
+        for (int i = 0; i < nBuckets - 1; ++i) {
+            Bounds3f b0, b1;
+            int count0 = 0, count1 = 0;
+            for (int j = 0; j <= i; ++j) {
+                b0 = Union(b0, buckets[j].bounds);
+                count0 += buckets[j].count;
+            }
+            for (int j = i + 1; j < nBuckets; ++j) {
+                b1 = Union(b1, buckets[j].bounds);
+                count1 += buckets[j].count;
+            }
+            Float cost = 1 + (count0 * b0.SurfaceArea() +
+                              count1 * b1.SurfaceArea()) /
+                                 bounds.SurfaceArea();
+            if (cost < objectCost) {
+                objectCost = cost;
+                objectSplitBucket = i;
+                objectOverlapArea = Overlaps(b0, b1)
+                                        ? pbrt::Intersect(b0, b1).SurfaceArea()
+                                        : 0;
+            }
+        }
+    }
+
+    // Consider spatial splits if the object split's children overlap
+    // significantly and the reference budget isn't exhausted
+    PBRT_CONSTEXPR Float spatialSplitAlpha = 1e-5f;
+    Float spatialCost = Infinity, spatialPlane = 0;
+    int spatialDim = -1;
+    if (*splitBudget > 0 && objectOverlapArea > spatialSplitAlpha * rootArea) {
+        PBRT_CONSTEXPR int nBins = 16;
+        for (int dim = 0; dim < 3; ++dim) {
+            Float extent = bounds.pMax[dim] - bounds.pMin[dim];
+            if (extent <= 0) continue;
+            auto binIndex = [&](Float x) {
+                return Clamp(int(nBins * (x - bounds.pMin[dim]) / extent), 0,
+                             nBins - 1);
+            };
+            auto binPlane = [&](int i) {
+                return i == nBins ? bounds.pMax[dim]
+                                  : bounds.pMin[dim] + extent * i / nBins;
+            };
+
+            // Accumulate clipped reference bounds and entry/exit counts in
+            // each bin
+            struct SpatialBin {
+                Bounds3f bounds;
+                int entries = 0, exits = 0;
+            };
+            SpatialBin bins[nBins];
+            for (const BVHPrimitiveInfo &ref : references) {
+                int firstBin = binIndex(ref.bounds.pMin[dim]);
+                int lastBin = binIndex(ref.bounds.pMax[dim]);
+                for (int b = firstBin; b <= lastBin; ++b) {
+                    Bounds3f slab = ref.bounds;
+                    slab.pMin[dim] = std::max(slab.pMin[dim], binPlane(b));
+                    slab.pMax[dim] = std::min(slab.pMax[dim], binPlane(b + 1));
+                    bins[b].bounds = Union(
+                        bins[b].bounds,
+                        primitives[ref.primitiveNumber]->ClippedWorldBound(slab));
+                }
+                bins[firstBin].entries++;
+                bins[lastBin].exits++;
+            }
+
+            // Compute costs for splitting at each interior bin plane
+            for (int i = 0; i < nBins - 1; ++i) {
+                Bounds3f b0, b1;
+                int count0 = 0, count1 = 0;
+                for (int j = 0; j <= i; ++j) {
+                    b0 = Union(b0, bins[j].bounds);
+                    count0 += bins[j].entries;
+                }
+                for (int j = i + 1; j < nBins; ++j) {
+                    b1 = Union(b1, bins[j].bounds);
+                    count1 += bins[j].exits;
+                }
+                if (count0 == 0 || count1 == 0) continue;
+                Float cost = 1 + (count0 * b0.SurfaceArea() +
+                                  count1 * b1.SurfaceArea()) /
+                                     bounds.SurfaceArea();
+                if (cost < spatialCost) {
+                    spatialCost = cost;
+                    spatialDim = dim;
+                    spatialPlane = binPlane(i + 1);
+                }
+            }
+        }
+    }
+
+    // Either create leaf or split references with the cheaper split
+    Float minCost = std::min(objectCost, spatialCost);
+    if (minCost == Infinity ||
+        (nReferences <= (size_t)maxPrimsInNode && minCost >= nReferences))
+        return createLeaf();
+    std::vector<BVHPrimitiveInfo> left, right;
+    int dim = objectDim;
+    if (spatialCost < objectCost) {
+        // Split references at _spatialPlane_, clipping those that straddle
+        // it into both children
+        int64_t nDuplicated = 0;
+        for (const BVHPrimitiveInfo &ref : references) {
+            if (ref.bounds.pMax[spatialDim] <= spatialPlane)
+                left.push_back(ref);
+            else if (ref.bounds.pMin[spatialDim] >= spatialPlane)
+                right.push_back(ref);
+            else {
+                const Primitive &prim = *primitives[ref.primitiveNumber];
+                Bounds3f b0 = ref.bounds, b1 = ref.bounds;
+                b0.pMax[spatialDim] = b1.pMin[spatialDim] = spatialPlane;
+                b0 = prim.ClippedWorldBound(b0);
+                b1 = prim.ClippedWorldBound(b1);
+                bool inLeft = b0.pMin[spatialDim] <= b0.pMax[spatialDim];
+                bool inRight = b1.pMin[spatialDim] <= b1.pMax[spatialDim];
+                if (inLeft) left.push_back({ref.primitiveNumber, b0});
+                if (inRight) right.push_back({ref.primitiveNumber, b1});
+                if (inLeft && inRight) ++nDuplicated;
+            }
+        }
+        if (left.empty() || right.empty()) {
+            left.clear();
+            right.clear();
+        } else {
+            dim = spatialDim;
+            *splitBudget -= nDuplicated;
+            spatialSplitReferences += nDuplicated;
+        }
+    }
+    if (left.empty() && right.empty()) {
+        if (objectSplitBucket == -1) return createLeaf();
+        for (const BVHPrimitiveInfo &ref : references) {
+            if (bucketIndex(ref) <= objectSplitBucket)
+                left.push_back(ref);
+            else
+                right.push_back(ref);
+        }
+    }
+
+    // Free this node's references before building its children
+    std::vector<BVHPrimitiveInfo>().swap(references);
+    BVHBuildNode *c0 = spatialSplitBuild(arena, left, rootArea, splitBudget,
+                                         totalNodes, orderedPrims);
+    BVHBuildNode *c1 = spatialSplitBuild(arena, right, rootArea, splitBudget,
+                                         totalNodes, orderedPrims);
+    node->InitInterior(dim, c0, c1);
+    return node;
+}
+
 BVHBuildNode *BVHAccel::HLBVHBuild(
-    MemoryArena &arena, const std::vector<BVHPrimitiveInfo> &primitiveInfo,
-    int *totalNodes,
+    MemoryArena &arena, std::vector<MemoryArena> &threadArenas,
+    const std::vector<BVHPrimitiveInfo> &primitiveInfo, int *totalNodes,
     std::vector<std::shared_ptr<Primitive>> &orderedPrims) const {
     // Compute bounding box of all primitive centroids
+    const size_t chunkSize = parallelBinningThreshold / 4;
+    const int64_t nChunks = (primitiveInfo.size() + chunkSize - 1) / chunkSize;
+    std::vector<Bounds3f> chunkBounds(nChunks);
+    ParallelFor([&](int64_t c) {
+        size_t chunkEnd = std::min(primitiveInfo.size(), (c + 1) * chunkSize);
+        for (size_t i = c * chunkSize; i < chunkEnd; ++i)
+            chunkBounds[c] = Union(chunkBounds[c], primitiveInfo[i].centroid);
+    }, nChunks);
     Bounds3f bounds;
-    for (const BVHPrimitiveInfo &pi : primitiveInfo)
-        bounds = Union(bounds, pi.centroid);
+    for (const Bounds3f &b : chunkBounds) bounds = Union(bounds, b);
 
     // Compute Morton indices of primitives
     std::vector<MortonPrimitive> mortonPrims(primitiveInfo.size());
@@ -506,8 +1419,24 @@ BVHBuildNode *BVHAccel::HLBVHBuild(
     finishedTreelets.reserve(treeletsToBuild.size());
     for (LBVHTreelet &treelet : treeletsToBuild)
         finishedTreelets.push_back(treelet.buildNodes);
-    return buildUpperSAH(arena, finishedTreelets, 0, finishedTreelets.size(),
-                         totalNodes);
+    std::vector<BVHSubtreeBuild> subtrees;
+    BVHBuildNode *root = buildUpperSAH(arena, finishedTreelets, 0,
+                                       finishedTreelets.size(), totalNodes,
+                                       &subtrees);
+
+    // Build deferred upper-level subtrees in parallel
+    std::atomic<int> subtreeNodes(0);
+    ParallelFor([&](int64_t i) {
+        const BVHSubtreeBuild &subtree = subtrees[i];
+        int nodesCreated = 0;
+        BVHBuildNode *subtreeRoot =
+            buildUpperSAH(threadArenas[ThreadIndex], finishedTreelets,
+                          subtree.start, subtree.end, &nodesCreated);
+        *subtree.node = *subtreeRoot;
+        subtreeNodes += nodesCreated;
+    }, subtrees.size());
+    *totalNodes += subtreeNodes;
+    return root;
 }
 
 BVHBuildNode *BVHAccel::emitLBVH(
@@ -577,11 +1506,12 @@ BVHBuildNode *BVHAccel::emitLBVH(
 BVHBuildNode *BVHAccel::buildUpperSAH(MemoryArena &arena,
                                       std::vector<BVHBuildNode *> &treeletRoots,
                                       size_t start, size_t end,
-                                      int *totalNodes) const {
+                                      int *totalNodes,
+                                      std::vector<BVHSubtreeBuild>
+                                          *deferredSubtrees) const {
     CHECK_LT(start, end);
     size_t nNodes = end - start;
     if (nNodes == 1) return treeletRoots[start];
-    (*totalNodes)++;
     BVHBuildNode *node = arena.Alloc<BVHBuildNode>();
 
     // Compute bounds of all nodes under this HLBVH node
@@ -589,6 +1519,17 @@ BVHBuildNode *BVHAccel::buildUpperSAH(MemoryArena &arena,
     for (size_t i = start; i < end; ++i)
         bounds = Union(bounds, treeletRoots[i]->bounds);
 
+    // Defer small enough ranges of treelets so that the upper levels above
+    // them can be built in parallel
+    if (deferredSubtrees &&
+        nNodes <= std::max<size_t>(
+            treeletRoots.size() / (8 * MaxThreadIndex()), 16)) {
+        node->bounds = bounds;
+        deferredSubtrees->push_back({node, start, end});
+        return node;
+    }
+    (*totalNodes)++;
+
     // Compute bound of HLBVH node centroids, choose split dimension _dim_
     Bounds3f centroidBounds;
     for (size_t i = start; i < end; ++i) {
@@ -671,8 +1612,11 @@ BVHBuildNode *BVHAccel::buildUpperSAH(MemoryArena &arena,
     CHECK_GT(mid, start);
     CHECK_LT(mid, end);
     node->InitInterior(
-        dim, this->buildUpperSAH(arena, treeletRoots, start, mid, totalNodes),
-        this->buildUpperSAH(arena, treeletRoots, mid, end, totalNodes));
+        dim,
+        this->buildUpperSAH(arena, treeletRoots, start, mid, totalNodes,
+                            deferredSubtrees),
+        this->buildUpperSAH(arena, treeletRoots, mid, end, totalNodes,
+                            deferredSubtrees));
     return node;
 }
 
@@ -697,27 +1641,517 @@ int BVHAccel::flattenBVHTree(BVHBuildNode *node, int *offset) {
     return myOffset;
 }
 
-BVHAccel::~BVHAccel() { FreeAligned(nodes); }
+// Wide BVH nodes are laid out in treelets of about this many bytes, so
+// that traversals tend to stay within a few pages of memory. The binary
+// _nodes_ keep their depth-first layout, since their traversal, _Refit()_,
+// the motion bounds and the cache rely on each node's first child
+// following it and on subtrees being contiguous.
+static PBRT_CONSTEXPR size_t bvhTreeletBytes = 4096;
+
+template <typename WideNode>
+WideNode *BVHAccel::collapseToWideBVH(int *nWideNodes) const {
+    PBRT_CONSTEXPR int N = WideNode::width;
+    // Choose the children of each wide node by repeatedly opening the
+    // interior child with the largest surface area, recording the indices
+    // of the binary nodes that end up as children
+    struct WideCollapseNode {
+        int binaryChild[N];
+        int wideChild[N];
+        int nChildren;
+    };
+    std::vector<WideCollapseNode> collapsed;
+    std::function<int(int)> collapse = [&](int nodeIndex) -> int {
+        WideCollapseNode c;
+        c.nChildren = 0;
+        const LinearBVHNode *node = &nodes[nodeIndex];
+        if (node->nPrimitives > 0)
+            c.binaryChild[c.nChildren++] = nodeIndex;
+        else {
+            c.binaryChild[c.nChildren++] = nodeIndex + 1;
+            c.binaryChild[c.nChildren++] = node->secondChildOffset;
+        }
+        while (c.nChildren < N) {
+            int best = -1;
+            Float bestArea = -1;
+            for (int i = 0; i < c.nChildren; ++i) {
+                const LinearBVHNode &child = nodes[c.binaryChild[i]];
+                if (child.nPrimitives == 0 &&
+                    child.bounds.SurfaceArea() > bestArea) {
+                    best = i;
+                    bestArea = child.bounds.SurfaceArea();
+                }
+            }
+            if (best == -1) break;
+            int opened = c.binaryChild[best];
+            c.binaryChild[best] = opened + 1;
+            c.binaryChild[c.nChildren++] = nodes[opened].secondChildOffset;
+        }
+
+        // Recursively collapse interior children
+        int wideIndex = collapsed.size();
+        collapsed.push_back(c);
+        for (int i = 0; i < c.nChildren; ++i) {
+            int wideChild = -1;
+            if (nodes[c.binaryChild[i]].nPrimitives == 0)
+                wideChild = collapse(c.binaryChild[i]);
+            collapsed[wideIndex].wideChild[i] = wideChild;
+        }
+        return wideIndex;
+    };
+    collapse(0);
+
+    // Lay out the nodes in page-sized treelets. Each one is grown from its
+    // root by repeatedly adding the child with the largest surface area,
+    // which rays are most likely to visit, of the nodes already in it; the
+    // children left over when it's full are the roots of later treelets
+    const size_t treeletSize =
+        std::max<size_t>(bvhTreeletBytes / sizeof(WideNode), 1);
+    std::vector<int> order, newIndex(collapsed.size());
+    order.reserve(collapsed.size());
+    std::vector<int> treeletRoots(1, 0);
+    for (size_t t = 0; t < treeletRoots.size(); ++t) {
+        std::priority_queue<std::pair<Float, int>> candidates;
+        candidates.push(std::make_pair(Float(0), treeletRoots[t]));
+        for (size_t n = 0; n < treeletSize && !candidates.empty(); ++n) {
+            int wideIndex = candidates.top().second;
+            candidates.pop();
+            newIndex[wideIndex] = order.size();
+            order.push_back(wideIndex);
+            const WideCollapseNode &c = collapsed[wideIndex];
+            for (int i = 0; i < c.nChildren; ++i)
+                if (c.wideChild[i] != -1)
+                    candidates.push(std::make_pair(
+                        nodes[c.binaryChild[i]].bounds.SurfaceArea(),
+                        c.wideChild[i]));
+        }
+        for (; !candidates.empty(); candidates.pop())
+            treeletRoots.push_back(candidates.top().second);
+    }
+    CHECK_EQ(order.size(), collapsed.size());
+
+    // Initialize _WideNode_s from the collapsed nodes
+    *nWideNodes = collapsed.size();
+    WideNode *wide = AllocAligned<WideNode>(collapsed.size());
+    for (size_t n = 0; n < collapsed.size(); ++n) {
+        const WideCollapseNode &c = collapsed[order[n]];
+        WideNode &w = wide[n];
+        memset(&w, 0, sizeof(w));
+        w.nChildren = c.nChildren;
+        Bounds3f childBounds[N];
+        for (int i = 0; i < c.nChildren; ++i) {
+            const LinearBVHNode &child = nodes[c.binaryChild[i]];
+            childBounds[i] = child.bounds;
+            if (child.nPrimitives > 0) {
+                w.offset[i] = child.primitivesOffset;
+                w.nPrimitives[i] = child.nPrimitives;
+            } else {
+                w.offset[i] = newIndex[c.wideChild[i]];
+                w.nPrimitives[i] = 0;
+            }
+        }
+        w.SetBounds(childBounds);
+    }
+    return wide;
+}
+
+template <int N, typename Q>
+void *BVHAccel::quantize(int *nQuantizedNodes) const {
+    LinearQuantizedBVHNode<N, Q> *quantized =
+        collapseToWideBVH<LinearQuantizedBVHNode<N, Q>>(nQuantizedNodes);
+    wideNodes += *nQuantizedNodes;
+    treeBytes += *nQuantizedNodes * sizeof(LinearQuantizedBVHNode<N, Q>);
+    return quantized;
+}
+
+// BVH cache file layout: a _BVHCacheHeader_, the _LinearBVHNode_ array, and
+// then, for each entry of the reordered _primitives_ array, the index of
+// that primitive in the array originally passed to the constructor.
+static const char bvhCacheMagic[8] = {'p', 'b', 'r', 't', 'B', 'V', 'H', '\0'};
+static PBRT_CONSTEXPR uint32_t bvhCacheVersion = 1;
+
+struct BVHCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t nodeSize;
+    uint64_t hash;
+    int64_t nPrimitives;
+    int64_t nNodes;
+    int64_t nReferences;
+};
+
+uint64_t BVHAccel::hashBuildInputs(
+    const std::vector<BVHPrimitiveInfo> &primitiveInfo) const {
+    // The tree built by all split methods other than SBVH depends only on
+    // the build parameters and the sequence of primitive bounds, so a 64-bit
+    // FNV-1a hash of those identifies it.
+    uint64_t hash = 14695981039346656037ull;
+    auto hashBytes = [&hash](const void *ptr, size_t size) {
+        const uint8_t *bytes = (const uint8_t *)ptr;
+        for (size_t i = 0; i < size; ++i)
+            hash = (hash ^ bytes[i]) * 1099511628211ull;
+    };
+    int method = (int)splitMethod;
+    hashBytes(&method, sizeof(method));
+    hashBytes(&maxPrimsInNode, sizeof(maxPrimsInNode));
+    for (const BVHPrimitiveInfo &pi : primitiveInfo)
+        hashBytes(&pi.bounds, sizeof(pi.bounds));
+    return hash;
+}
+
+bool BVHAccel::readCache(const std::string &filename, uint64_t hash,
+                         int *totalNodes) {
+    // Map the cache file into memory, or read it in if mapping isn't
+    // available; _nodes_ then points directly into its contents
+#ifdef PBRT_HAVE_MMAP
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd == -1) return false;
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return false;
+    }
+    size_t len = st.st_size;
+    // Pages are mapped copy-on-write so that the nodes may be modified
+    void *ptr = len > 0 ? mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE, fd, 0)
+                        : MAP_FAILED;
+    close(fd);
+    if (ptr == MAP_FAILED) return false;
+#else
+    FILE *fp = fopen(filename.c_str(), "rb");
+    if (!fp) return false;
+    fseek(fp, 0, SEEK_END);
+    long fileLength = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    size_t len = fileLength > 0 ? fileLength : 0;
+    void *ptr = AllocAligned<uint8_t>(len);
+    bool readOk = fread(ptr, 1, len, fp) == len;
+    fclose(fp);
+    if (!readOk) {
+        FreeAligned(ptr);
+        return false;
+    }
+#endif
+    cacheData = ptr;
+    cacheDataLength = len;
+
+    BVHCacheHeader header;
+    const uint8_t *data = (const uint8_t *)ptr;
+    bool ok = len >= sizeof(header);
+    if (ok) {
+        memcpy(&header, data, sizeof(header));
+        ok = memcmp(header.magic, bvhCacheMagic, sizeof(bvhCacheMagic)) == 0 &&
+             header.version == bvhCacheVersion &&
+             header.nodeSize == sizeof(LinearBVHNode) && header.hash == hash &&
+             header.nPrimitives == (int64_t)primitives.size() &&
+             header.nNodes > 0 &&
+             header.nNodes <= std::numeric_limits<int>::max() &&
+             header.nReferences > 0 &&
+             header.nReferences <= std::numeric_limits<int32_t>::max() &&
+             len == sizeof(header) + header.nNodes * sizeof(LinearBVHNode) +
+                        header.nReferences * sizeof(int32_t);
+    }
+    if (!ok) {
+        Warning("%s: BVH cache file doesn't match scene; ignoring it.",
+                filename.c_str());
+        freeCacheData();
+        return false;
+    }
+    LinearBVHNode *cachedNodes = (LinearBVHNode *)(data + sizeof(header));
+    const int32_t *order =
+        (const int32_t *)(data + sizeof(header) +
+                          header.nNodes * sizeof(LinearBVHNode));
+
+    // Make sure that the tree can be traversed safely before using it
+    for (int64_t i = 0; ok && i < header.nNodes; ++i) {
+        const LinearBVHNode &node = cachedNodes[i];
+        if (node.nPrimitives > 0)
+            ok = node.primitivesOffset >= 0 &&
+                 node.primitivesOffset + node.nPrimitives <= header.nReferences;
+        else
+            ok = node.secondChildOffset > i &&
+                 node.secondChildOffset < header.nNodes;
+    }
+    for (int64_t i = 0; ok && i < header.nReferences; ++i)
+        ok = order[i] >= 0 && order[i] < header.nPrimitives;
+    if (!ok) {
+        Warning("%s: BVH cache file is corrupt; ignoring it.",
+                filename.c_str());
+        freeCacheData();
+        return false;
+    }
+
+    std::vector<std::shared_ptr<Primitive>> orderedPrims(header.nReferences);
+    for (int64_t i = 0; i < header.nReferences; ++i)
+        orderedPrims[i] = primitives[order[i]];
+    primitives.swap(orderedPrims);
+    nodes = cachedNodes;
+    *totalNodes = header.nNodes;
+    return true;
+}
+
+void BVHAccel::freeCacheData() {
+    if (!cacheData) return;
+#ifdef PBRT_HAVE_MMAP
+    if (munmap(cacheData, cacheDataLength) != 0)
+        Error("munmap: %s", strerror(errno));
+#else
+    FreeAligned(cacheData);
+#endif
+    cacheData = nullptr;
+    cacheDataLength = 0;
+}
+
+void BVHAccel::writeCache(
+    const std::string &filename, uint64_t hash, int totalNodes,
+    const std::vector<std::shared_ptr<Primitive>> &originalPrims) const {
+    // Recover the permutation applied to _originalPrims_ by the build
+    std::unordered_map<const Primitive *, int32_t> originalIndex;
+    originalIndex.reserve(originalPrims.size());
+    for (size_t i = 0; i < originalPrims.size(); ++i)
+        originalIndex[originalPrims[i].get()] = i;
+    std::vector<int32_t> order(primitives.size());
+    for (size_t i = 0; i < primitives.size(); ++i)
+        order[i] = originalIndex[primitives[i].get()];
+
+    BVHCacheHeader header;
+    memcpy(header.magic, bvhCacheMagic, sizeof(bvhCacheMagic));
+    header.version = bvhCacheVersion;
+    header.nodeSize = sizeof(LinearBVHNode);
+    header.hash = hash;
+    header.nPrimitives = originalPrims.size();
+    header.nNodes = totalNodes;
+    header.nReferences = order.size();
+
+    // Write to a temporary file and then rename it, so that other pbrt
+    // processes sharing the cache never see a partially written file. The
+    // name is unique to this process and write, so that concurrent writers
+    // never share a temporary file.
+    static std::atomic<int> nCacheWrites{0};
+#ifdef PBRT_IS_WINDOWS
+    int pid = _getpid();
+#else
+    int pid = getpid();
+#endif
+    std::string tmpFilename = filename + StringPrintf(".%d.%d.tmp", pid,
+                                                      nCacheWrites++);
+    FILE *fp = fopen(tmpFilename.c_str(), "wb");
+    if (!fp) {
+        Warning("%s: unable to create BVH cache file.", tmpFilename.c_str());
+        return;
+    }
+    bool ok =
+        fwrite(&header, sizeof(header), 1, fp) == 1 &&
+        fwrite(nodes, sizeof(LinearBVHNode), totalNodes, fp) ==
+            (size_t)totalNodes &&
+        fwrite(order.data(), sizeof(int32_t), order.size(), fp) == order.size();
+    if (fclose(fp) != 0) ok = false;
+    if (!ok || std::rename(tmpFilename.c_str(), filename.c_str()) != 0) {
+        Warning("%s: unable to write BVH cache file.", filename.c_str());
+        std::remove(tmpFilename.c_str());
+        return;
+    }
+    LOG(INFO) << StringPrintf("Wrote BVH with %d nodes to \"%s\"", totalNodes,
+                              filename.c_str());
+}
+
+BVHAccel::~BVHAccel() {
+    // Nodes read from a cache file live in _cacheData_
+    if (cacheData)
+        freeCacheData();
+    else
+        FreeAligned(nodes);
+    FreeAligned(nodes4);
+    FreeAligned(nodes8);
+    FreeAligned(quantizedNodes);
+    FreeAligned(triangleVertices[0][0]);
+    FreeAligned(motionBounds);
+}
+
+template <typename WideNode>
+bool BVHAccel::wideIntersect(const WideNode *wideNodes, const Ray &ray,
+                             SurfaceInteraction *isect) const {
+    PBRT_CONSTEXPR int N = WideNode::width;
+    ProfilePhase p(Prof::AccelIntersect);
+    bool hit = false;
+    ++raysTraversed;
+    WideBVHRay wideRay(ray);
+    TriangleLeafRay triRay(ray);
+    // Follow ray through wide BVH nodes, visiting the closest hit child of
+    // each node first and skipping entries beyond the current closest hit
+    PBRT_CONSTEXPR int maxToVisit = 64 * (N - 1) + 1;
+    WideBVHStackEntry nodesToVisit[maxToVisit];
+    int toVisitOffset = 0;
+    nodesToVisit[toVisitOffset++] = {0, 0, 0.f};
+    while (toVisitOffset > 0) {
+        const WideBVHStackEntry entry = nodesToVisit[--toVisitOffset];
+        if (entry.tNear > ray.tMax) continue;
+        if (entry.nPrimitives > 0) {
+            // Intersect ray with primitives in leaf BVH node
+            if (intersectLeaf(ray, triRay, entry.offset, entry.nPrimitives,
+                              isect))
+                hit = true;
+            continue;
+        }
+
+        // Push overlapped children so that the closest one is on top
+        const WideNode &node = wideNodes[entry.offset];
+        ++nodesVisited;
+        float tNear[N];
+        int mask =
+            IntersectWideNode(node, wideRay, RoundFloatUp(ray.tMax), tNear);
+        int first = toVisitOffset;
+        for (int i = 0; i < node.nChildren; ++i) {
+            if (!(mask & (1 << i))) continue;
+            WideBVHStackEntry child = {node.offset[i], node.nPrimitives[i],
+                                       tNear[i]};
+            int j = toVisitOffset++;
+            CHECK_LT(toVisitOffset, maxToVisit);
+            while (j > first && nodesToVisit[j - 1].tNear < child.tNear) {
+                nodesToVisit[j] = nodesToVisit[j - 1];
+                --j;
+            }
+            nodesToVisit[j] = child;
+        }
+    }
+    return hit;
+}
+
+template <typename WideNode>
+const Primitive *BVHAccel::wideFindOccluder(const WideNode *wideNodes,
+                                            const Ray &ray) const {
+    PBRT_CONSTEXPR int N = WideNode::width;
+    ProfilePhase p(Prof::AccelIntersectP);
+    ++raysTraversed;
+    WideBVHRay wideRay(ray);
+    TriangleLeafRay triRay(ray);
+    const float tMax = RoundFloatUp(ray.tMax);
+    PBRT_CONSTEXPR int maxToVisit = 64 * (N - 1) + 1;
+    WideBVHStackEntry nodesToVisit[maxToVisit];
+    int toVisitOffset = 0;
+    nodesToVisit[toVisitOffset++] = {0, 0, 0.f};
+    while (toVisitOffset > 0) {
+        const WideBVHStackEntry entry = nodesToVisit[--toVisitOffset];
+        if (entry.nPrimitives > 0) {
+            if (const Primitive *occluder = leafOccluder(
+                    ray, triRay, entry.offset, entry.nPrimitives))
+                return occluder;
+            continue;
+        }
+        const WideNode &node = wideNodes[entry.offset];
+        ++nodesVisited;
+        float tNear[N];
+        int mask = IntersectWideNode(node, wideRay, tMax, tNear);
+        for (int i = 0; i < node.nChildren; ++i)
+            if (mask & (1 << i)) {
+                CHECK_LT(toVisitOffset, maxToVisit);
+                nodesToVisit[toVisitOffset++] = {
+                    node.offset[i], node.nPrimitives[i], tNear[i]};
+            }
+    }
+    return nullptr;
+}
+
+bool BVHAccel::intersectLeaf(const Ray &ray, const TriangleLeafRay &triRay,
+                             int offset, int nPrimitives,
+                             SurfaceInteraction *isect) const {
+    if (packedLeaf.empty() || !packedLeaf[offset]) {
+        bool hit = false;
+        for (int i = 0; i < nPrimitives; ++i)
+            if (primitives[offset + i]->Intersect(ray, isect)) hit = true;
+        return hit;
+    }
+
+    // Test packed triangles together and compute the full intersection
+    // only for the closest one
+    bool hit = false;
+    for (int start = 0; start < nPrimitives; start += triangleLanes) {
+        int n = std::min(triangleLanes, nPrimitives - start);
+        Float tScaled[triangleLanes], det[triangleLanes];
+        bool valid[triangleLanes];
+        IntersectTriangleLanes(triRay, triangleVertices, offset + start, n,
+                               tScaled, det, valid);
+        // Find the triangle that testing them in order would report
+        int closest = -1;
+        Float tMax = ray.tMax;
+        for (int i = 0; i < n; ++i)
+            if (valid[i] && TriangleHitBefore(tScaled[i], det[i], tMax)) {
+                closest = i;
+                tMax = tScaled[i] * (1 / det[i]);
+            }
+        if (closest != -1) {
+            bool closestHit =
+                primitives[offset + start + closest]->Intersect(ray, isect);
+            DCHECK(closestHit);
+            hit |= closestHit;
+        }
+    }
+    return hit;
+}
+
+const Primitive *BVHAccel::leafOccluder(const Ray &ray,
+                                        const TriangleLeafRay &triRay,
+                                        int offset, int nPrimitives) const {
+    if (packedLeaf.empty() || !packedLeaf[offset]) {
+        for (int i = 0; i < nPrimitives; ++i)
+            if (primitives[offset + i]->IntersectP(ray))
+                return primitives[offset + i].get();
+        return nullptr;
+    }
+    for (int start = 0; start < nPrimitives; start += triangleLanes) {
+        int n = std::min(triangleLanes, nPrimitives - start);
+        Float tScaled[triangleLanes], det[triangleLanes];
+        bool valid[triangleLanes];
+        IntersectTriangleLanes(triRay, triangleVertices, offset + start, n,
+                               tScaled, det, valid);
+        for (int i = 0; i < n; ++i)
+            if (valid[i] && TriangleHitBefore(tScaled[i], det[i], ray.tMax))
+                return primitives[offset + start + i].get();
+    }
+    return nullptr;
+}
 
 bool BVHAccel::Intersect(const Ray &ray, SurfaceInteraction *isect) const {
+    if (quantizedNodes) {
+        if (quantizeBits == 8) {
+            if (width == 2)
+                return wideIntersect(quantized<2, uint8_t>(), ray, isect);
+            if (width == 4)
+                return wideIntersect(quantized<4, uint8_t>(), ray, isect);
+            return wideIntersect(quantized<8, uint8_t>(), ray, isect);
+        }
+        if (width == 2)
+            return wideIntersect(quantized<2, uint16_t>(), ray, isect);
+        if (width == 4)
+            return wideIntersect(quantized<4, uint16_t>(), ray, isect);
+        return wideIntersect(quantized<8, uint16_t>(), ray, isect);
+    }
     if (!nodes) return false;
+    if (nodes4) return wideIntersect(nodes4, ray, isect);
+    if (nodes8) return wideIntersect(nodes8, ray, isect);
     ProfilePhase p(Prof::AccelIntersect);
+    ++raysTraversed;
     bool hit = false;
+    TriangleLeafRay triRay(ray);
     Vector3f invDir(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
     int dirIsNeg[3] = {invDir.x < 0, invDir.y < 0, invDir.z < 0};
+    Float motionTime = motionBounds ? motionTimeFraction(ray.time) : 0;
     // Follow ray through BVH nodes to find primitive intersections
     int toVisitOffset = 0, currentNodeIndex = 0;
     int nodesToVisit[64];
     while (true) {
         const LinearBVHNode *node = &nodes[currentNodeIndex];
-        // Check ray against BVH node
-        if (node->bounds.IntersectP(ray, invDir, dirIsNeg)) {
+        ++nodesVisited;
+        // Check ray against BVH node, at the ray's time if primitives move
+        if (motionBounds ? motionBounds[currentNodeIndex]
+                               .At(motionTime)
+                               .IntersectP(ray, invDir, dirIsNeg)
+                         : node->bounds.IntersectP(ray, invDir, dirIsNeg)) {
             if (node->nPrimitives > 0) {
                 // Intersect ray with primitives in leaf BVH node
-                for (int i = 0; i < node->nPrimitives; ++i)
-                    if (primitives[node->primitivesOffset + i]->Intersect(
-                            ray, isect))
-                        hit = true;
+                if (intersectLeaf(ray, triRay, node->primitivesOffset,
+                                  node->nPrimitives, isect))
+                    hit = true;
                 if (toVisitOffset == 0) break;
                 currentNodeIndex = nodesToVisit[--toVisitOffset];
             } else {
@@ -739,24 +2173,45 @@ bool BVHAccel::Intersect(const Ray &ray, SurfaceInteraction *isect) const {
     return hit;
 }
 
-bool BVHAccel::IntersectP(const Ray &ray) const {
-    if (!nodes) return false;
+const Primitive *BVHAccel::FindOccluder(const Ray &ray) const {
+    if (quantizedNodes) {
+        if (quantizeBits == 8) {
+            if (width == 2)
+                return wideFindOccluder(quantized<2, uint8_t>(), ray);
+            if (width == 4)
+                return wideFindOccluder(quantized<4, uint8_t>(), ray);
+            return wideFindOccluder(quantized<8, uint8_t>(), ray);
+        }
+        if (width == 2)
+            return wideFindOccluder(quantized<2, uint16_t>(), ray);
+        if (width == 4)
+            return wideFindOccluder(quantized<4, uint16_t>(), ray);
+        return wideFindOccluder(quantized<8, uint16_t>(), ray);
+    }
+    if (!nodes) return nullptr;
+    if (nodes4) return wideFindOccluder(nodes4, ray);
+    if (nodes8) return wideFindOccluder(nodes8, ray);
     ProfilePhase p(Prof::AccelIntersectP);
+    ++raysTraversed;
+    TriangleLeafRay triRay(ray);
     Vector3f invDir(1.f / ray.d.x, 1.f / ray.d.y, 1.f / ray.d.z);
     int dirIsNeg[3] = {invDir.x < 0, invDir.y < 0, invDir.z < 0};
+    Float motionTime = motionBounds ? motionTimeFraction(ray.time) : 0;
     int nodesToVisit[64];
     int toVisitOffset = 0, currentNodeIndex = 0;
     while (true) {
         const LinearBVHNode *node = &nodes[currentNodeIndex];
-        if (node->bounds.IntersectP(ray, invDir, dirIsNeg)) {
+        ++nodesVisited;
+        if (motionBounds ? motionBounds[currentNodeIndex]
+                               .At(motionTime)
+                               .IntersectP(ray, invDir, dirIsNeg)
+                         : node->bounds.IntersectP(ray, invDir, dirIsNeg)) {
             // Process BVH node _node_ for traversal
             if (node->nPrimitives > 0) {
-                for (int i = 0; i < node->nPrimitives; ++i) {
-                    if (primitives[node->primitivesOffset + i]->IntersectP(
-                            ray)) {
-                        return true;
-                    }
-                }
+                if (const Primitive *occluder =
+                        leafOccluder(ray, triRay, node->primitivesOffset,
+                                     node->nPrimitives))
+                    return occluder;
                 if (toVisitOffset == 0) break;
                 currentNodeIndex = nodesToVisit[--toVisitOffset];
             } else {
@@ -774,7 +2229,195 @@ bool BVHAccel::IntersectP(const Ray &ray) const {
             currentNodeIndex = nodesToVisit[--toVisitOffset];
         }
     }
-    return false;
+    return nullptr;
+}
+
+bool BVHAccel::IntersectP(const Ray &ray) const {
+    return FindOccluder(ray) != nullptr;
+}
+
+// Rays are traced by _IntersectN()_ and _IntersectPN()_ in packets of up
+// to this many; each node of the BVH is tested against the rays of a
+// packet in order, starting with the first one that overlapped its parent.
+static PBRT_CONSTEXPR int maxPacketSize = 64;
+
+// Returns whether there are enough rays and their directions all lie in
+// the same octant, which is when they follow similar enough paths through
+// the BVH for packet traversal to pay off.
+static bool CoherentPacket(const Ray *rays, int n) {
+    if (n < 4) return false;
+    for (int i = 1; i < n; ++i)
+        for (int axis = 0; axis < 3; ++axis)
+            if ((rays[i].d[axis] < 0) != (rays[0].d[axis] < 0)) return false;
+    return true;
+}
+
+struct PacketStackEntry {
+    int nodeIndex;
+    int firstActive, endActive;
+};
+
+void BVHAccel::IntersectN(const Ray *rays, SurfaceInteraction *isects,
+                          bool *hits, int n) const {
+    // Packets are traced through the binary BVH, which isn't kept with
+    // quantized nodes; with wide nodes, tracing rays individually through
+    // them is faster, and rays at different times see different motion
+    // bounds
+    if (!nodes || width != 2 || motionBounds) {
+        Primitive::IntersectN(rays, isects, hits, n);
+        return;
+    }
+    ProfilePhase p(Prof::AccelIntersect);
+    for (int start = 0; start < n; start += maxPacketSize) {
+        // Initialize per-ray values for packet of rays starting at _start_
+        int packetSize = std::min(maxPacketSize, n - start);
+        const Ray *r = rays + start;
+        if (!CoherentPacket(r, packetSize)) {
+            for (int i = 0; i < packetSize; ++i)
+                hits[start + i] = Intersect(r[i], &isects[start + i]);
+            continue;
+        }
+        Vector3f invDir[maxPacketSize];
+        int dirIsNeg[maxPacketSize][3];
+        TriangleLeafRay triRays[maxPacketSize];
+        for (int i = 0; i < packetSize; ++i) {
+            hits[start + i] = false;
+            invDir[i] = Vector3f(1 / r[i].d.x, 1 / r[i].d.y, 1 / r[i].d.z);
+            for (int axis = 0; axis < 3; ++axis)
+                dirIsNeg[i][axis] = invDir[i][axis] < 0;
+            triRays[i] = TriangleLeafRay(r[i]);
+        }
+        raysTraversed += packetSize;
+
+        // Follow packet through BVH nodes to find primitive intersections
+        auto overlaps = [&](const LinearBVHNode *node, int i) {
+            return node->bounds.IntersectP(r[i], invDir[i], dirIsNeg[i]);
+        };
+        PacketStackEntry nodesToVisit[64];
+        int toVisitOffset = 0, currentNodeIndex = 0;
+        int firstActive = 0, endActive = packetSize;
+        while (true) {
+            const LinearBVHNode *node = &nodes[currentNodeIndex];
+            ++nodesVisited;
+            // Find the first and last rays in the packet that overlap
+            // _node_; only rays between them need to be considered below
+            int first = firstActive;
+            while (first < endActive && !overlaps(node, first)) ++first;
+            if (first < endActive) {
+                int end = endActive;
+                while (end - 1 > first && !overlaps(node, end - 1)) --end;
+                if (node->nPrimitives > 0) {
+                    // Intersect overlapping rays with primitives in leaf
+                    for (int i = first; i < end; ++i)
+                        if ((i == first || i == end - 1 ||
+                             overlaps(node, i)) &&
+                            intersectLeaf(r[i], triRays[i],
+                                          node->primitivesOffset,
+                                          node->nPrimitives,
+                                          &isects[start + i]))
+                            hits[start + i] = true;
+                } else {
+                    // Visit the near child for the first overlapping ray
+                    // next and put the far one on _nodesToVisit_
+                    if (dirIsNeg[first][node->axis]) {
+                        nodesToVisit[toVisitOffset++] = {currentNodeIndex + 1,
+                                                         first, end};
+                        currentNodeIndex = node->secondChildOffset;
+                    } else {
+                        nodesToVisit[toVisitOffset++] = {
+                            node->secondChildOffset, first, end};
+                        currentNodeIndex = currentNodeIndex + 1;
+                    }
+                    firstActive = first;
+                    endActive = end;
+                    continue;
+                }
+            }
+            if (toVisitOffset == 0) break;
+            --toVisitOffset;
+            currentNodeIndex = nodesToVisit[toVisitOffset].nodeIndex;
+            firstActive = nodesToVisit[toVisitOffset].firstActive;
+            endActive = nodesToVisit[toVisitOffset].endActive;
+        }
+    }
+}
+
+void BVHAccel::IntersectPN(const Ray *rays, bool *occluded, int n) const {
+    if (!nodes || width != 2 || motionBounds) {
+        Primitive::IntersectPN(rays, occluded, n);
+        return;
+    }
+    ProfilePhase p(Prof::AccelIntersectP);
+    for (int start = 0; start < n; start += maxPacketSize) {
+        int packetSize = std::min(maxPacketSize, n - start);
+        const Ray *r = rays + start;
+        bool *rayOccluded = occluded + start;
+        if (!CoherentPacket(r, packetSize)) {
+            for (int i = 0; i < packetSize; ++i)
+                rayOccluded[i] = IntersectP(r[i]);
+            continue;
+        }
+        Vector3f invDir[maxPacketSize];
+        int dirIsNeg[maxPacketSize][3];
+        TriangleLeafRay triRays[maxPacketSize];
+        for (int i = 0; i < packetSize; ++i) {
+            rayOccluded[i] = false;
+            invDir[i] = Vector3f(1 / r[i].d.x, 1 / r[i].d.y, 1 / r[i].d.z);
+            for (int axis = 0; axis < 3; ++axis)
+                dirIsNeg[i][axis] = invDir[i][axis] < 0;
+            triRays[i] = TriangleLeafRay(r[i]);
+        }
+        raysTraversed += packetSize;
+
+        // Rays drop out of the packet once an occluder has been found
+        int nUnoccluded = packetSize;
+        auto overlaps = [&](const LinearBVHNode *node, int i) {
+            return !rayOccluded[i] &&
+                   node->bounds.IntersectP(r[i], invDir[i], dirIsNeg[i]);
+        };
+        PacketStackEntry nodesToVisit[64];
+        int toVisitOffset = 0, currentNodeIndex = 0;
+        int firstActive = 0, endActive = packetSize;
+        while (nUnoccluded > 0) {
+            const LinearBVHNode *node = &nodes[currentNodeIndex];
+            ++nodesVisited;
+            int first = firstActive;
+            while (first < endActive && !overlaps(node, first)) ++first;
+            if (first < endActive) {
+                int end = endActive;
+                while (end - 1 > first && !overlaps(node, end - 1)) --end;
+                if (node->nPrimitives > 0) {
+                    for (int i = first; i < end; ++i)
+                        if ((i == first || i == end - 1 ||
+                             overlaps(node, i)) &&
+                            leafOccluder(r[i], triRays[i],
+                                         node->primitivesOffset,
+                                         node->nPrimitives)) {
+                            rayOccluded[i] = true;
+                            --nUnoccluded;
+                        }
+                } else {
+                    if (dirIsNeg[first][node->axis]) {
+                        nodesToVisit[toVisitOffset++] = {currentNodeIndex + 1,
+                                                         first, end};
+                        currentNodeIndex = node->secondChildOffset;
+                    } else {
+                        nodesToVisit[toVisitOffset++] = {
+                            node->secondChildOffset, first, end};
+                        currentNodeIndex = currentNodeIndex + 1;
+                    }
+                    firstActive = first;
+                    endActive = end;
+                    continue;
+                }
+            }
+            if (toVisitOffset == 0) break;
+            --toVisitOffset;
+            currentNodeIndex = nodesToVisit[toVisitOffset].nodeIndex;
+            firstActive = nodesToVisit[toVisitOffset].firstActive;
+            endActive = nodesToVisit[toVisitOffset].endActive;
+        }
+    }
 }
 
 std::shared_ptr<BVHAccel> CreateBVHAccelerator(
@@ -783,6 +2426,8 @@ std::shared_ptr<BVHAccel> CreateBVHAccelerator(
     BVHAccel::SplitMethod splitMethod;
     if (splitMethodName == "sah")
         splitMethod = BVHAccel::SplitMethod::SAH;
+    else if (splitMethodName == "sbvh")
+        splitMethod = BVHAccel::SplitMethod::SBVH;
     else if (splitMethodName == "hlbvh")
         splitMethod = BVHAccel::SplitMethod::HLBVH;
     else if (splitMethodName == "middle")
@@ -796,7 +2441,36 @@ std::shared_ptr<BVHAccel> CreateBVHAccelerator(
     }
 
     int maxPrimsInNode = ps.FindOneInt("maxnodeprims", 4);
-    return std::make_shared<BVHAccel>(std::move(prims), maxPrimsInNode, splitMethod);
+    // Branching factor of the BVH used for traversal; 4- and 8-wide
+    // nodes test all of their children's bounds together using SIMD.
+    int width = ps.FindOneInt("width", 2);
+    if (width != 2 && width != 4 && width != 8) {
+        Warning("BVH width %d unsupported; must be 2, 4, or 8. Using 2.",
+                width);
+        width = 2;
+    }
+    // Maximum growth in the number of primitive references due to spatial
+    // splits, as a fraction of the number of primitives (SBVH only)
+    Float splitBudget = ps.FindOneFloat("splitbudget", 0.3f);
+    // Directory in which built trees are saved so that later renders of
+    // the same geometry can skip construction
+    std::string cacheDir = ps.FindOneFilename("cachedir", "");
+    if (!cacheDir.empty() && splitMethod == BVHAccel::SplitMethod::SBVH)
+        Warning("BVH caching isn't supported with \"sbvh\" splits.");
+    // Store node bounds quantized to 8 or 16 bits to reduce memory use
+    int quantizeBits = ps.FindOneInt("quantizebits", 0);
+    if (quantizeBits != 0 && quantizeBits != 8 && quantizeBits != 16) {
+        Warning("BVH quantizebits %d unsupported; must be 0, 8, or 16. "
+                "Using 0.", quantizeBits);
+        quantizeBits = 0;
+    }
+    // Store the vertices of leaves made up of triangles together, so that
+    // they can be tested against rays without virtual function calls. This
+    // takes another nine _Float_s per triangle, so it's off by default.
+    bool packTriangles = ps.FindOneBool("packtriangles", false);
+    return std::make_shared<BVHAccel>(std::move(prims), maxPrimsInNode,
+                                      splitMethod, width, splitBudget,
+                                      cacheDir, quantizeBits, packTriangles);
 }
 
 }  // namespace pbrt
@@ -48,33 +48,62 @@ struct BVHBuildNode;
 
 // BVHAccel Forward Declarations
 struct BVHPrimitiveInfo;
+struct BVHSubtreeBuild;
 struct MortonPrimitive;
 struct LinearBVHNode;
+struct LinearBVHMotionBounds;
+template <int N>
+struct LinearWideBVHNode;
+template <int N, typename Q>
+struct LinearQuantizedBVHNode;
+struct TriangleLeafRay;
 
 // BVHAccel Declarations
 class BVHAccel : public Aggregate {
   public:
     // BVHAccel Public Types
-    enum class SplitMethod { SAH, HLBVH, Middle, EqualCounts };
+    enum class SplitMethod { SAH, SBVH, HLBVH, Middle, EqualCounts };
 
     // BVHAccel Public Methods
     BVHAccel(std::vector<std::shared_ptr<Primitive>> p,
              int maxPrimsInNode = 1,
-             SplitMethod splitMethod = SplitMethod::SAH);
+             SplitMethod splitMethod = SplitMethod::SAH, int width = 2,
+             Float splitBudget = 0.3f, const std::string &cacheDir = "",
+             int quantizeBits = 0, bool packTriangles = false);
     Bounds3f WorldBound() const;
     ~BVHAccel();
+    // Recomputes the bounds of all nodes after the primitives have moved
+    // (e.g. after _TriangleMesh::UpdateVertices()_), keeping the tree's
+    // topology; it's much faster than rebuilding, though the tree becomes
+    // less efficient the further the primitives move.
+    void Refit();
     bool Intersect(const Ray &ray, SurfaceInteraction *isect) const;
     bool IntersectP(const Ray &ray) const;
+    const Primitive *FindOccluder(const Ray &ray) const;
+    void IntersectN(const Ray *rays, SurfaceInteraction *isects, bool *hits,
+                    int n) const;
+    void IntersectPN(const Ray *rays, bool *occluded, int n) const;
+    // Returns whether the tree was read from the cache rather than built.
+    bool ReadFromCache() const { return cacheData != nullptr; }
+    // Returns whether _other_ has the same binary nodes and primitive
+    // order, e.g. to check that builds are deterministic.
+    bool SameTree(const BVHAccel &other) const;
 
   private:
     // BVHAccel Private Methods
+    int build(std::vector<BVHPrimitiveInfo> &primitiveInfo, Float splitBudget);
     BVHBuildNode *recursiveBuild(
         MemoryArena &arena, std::vector<BVHPrimitiveInfo> &primitiveInfo,
         size_t start, size_t end, int *totalNodes,
+        std::vector<std::shared_ptr<Primitive>> &orderedPrims,
+        std::vector<BVHSubtreeBuild> *deferredSubtrees = nullptr);
+    BVHBuildNode *spatialSplitBuild(
+        MemoryArena &arena, std::vector<BVHPrimitiveInfo> &references,
+        Float rootArea, int64_t *splitBudget, int *totalNodes,
         std::vector<std::shared_ptr<Primitive>> &orderedPrims);
     BVHBuildNode *HLBVHBuild(
-        MemoryArena &arena, const std::vector<BVHPrimitiveInfo> &primitiveInfo,
-        int *totalNodes,
+        MemoryArena &arena, std::vector<MemoryArena> &threadArenas,
+        const std::vector<BVHPrimitiveInfo> &primitiveInfo, int *totalNodes,
         std::vector<std::shared_ptr<Primitive>> &orderedPrims) const;
     BVHBuildNode *emitLBVH(
         BVHBuildNode *&buildNodes,
@@ -82,16 +111,73 @@ class BVHAccel : public Aggregate {
         MortonPrimitive *mortonPrims, int nPrimitives, int *totalNodes,
         std::vector<std::shared_ptr<Primitive>> &orderedPrims,
         std::atomic<int> *orderedPrimsOffset, int bitIndex) const;
-    BVHBuildNode *buildUpperSAH(MemoryArena &arena,
-                                std::vector<BVHBuildNode *> &treeletRoots,
-                                size_t start, size_t end, int *totalNodes) const;
+    BVHBuildNode *buildUpperSAH(
+        MemoryArena &arena, std::vector<BVHBuildNode *> &treeletRoots,
+        size_t start, size_t end, int *totalNodes,
+        std::vector<BVHSubtreeBuild> *deferredSubtrees = nullptr) const;
     int flattenBVHTree(BVHBuildNode *node, int *offset);
+    uint64_t hashBuildInputs(
+        const std::vector<BVHPrimitiveInfo> &primitiveInfo) const;
+    bool readCache(const std::string &filename, uint64_t hash,
+                   int *totalNodes);
+    void writeCache(
+        const std::string &filename, uint64_t hash, int totalNodes,
+        const std::vector<std::shared_ptr<Primitive>> &originalPrims) const;
+    void freeCacheData();
+    template <typename WideNode>
+    WideNode *collapseToWideBVH(int *nWideNodes) const;
+    template <int N, typename Q>
+    void *quantize(int *nQuantizedNodes) const;
+    template <int N, typename Q>
+    const LinearQuantizedBVHNode<N, Q> *quantized() const {
+        return (const LinearQuantizedBVHNode<N, Q> *)quantizedNodes;
+    }
+    void packTriangleLeaves(int totalNodes);
+    void computeMotionBounds(int totalNodes);
+    Float motionTimeFraction(Float time) const {
+        return Clamp((time - motionTime0) / (motionTime1 - motionTime0), 0,
+                     1);
+    }
+    bool intersectLeaf(const Ray &ray, const TriangleLeafRay &triRay,
+                       int offset, int nPrimitives,
+                       SurfaceInteraction *isect) const;
+    const Primitive *leafOccluder(const Ray &ray,
+                                  const TriangleLeafRay &triRay, int offset,
+                                  int nPrimitives) const;
+    template <typename WideNode>
+    bool wideIntersect(const WideNode *wideNodes, const Ray &ray,
+                       SurfaceInteraction *isect) const;
+    template <typename WideNode>
+    const Primitive *wideFindOccluder(const WideNode *wideNodes,
+                                      const Ray &ray) const;
 
     // BVHAccel Private Data
     const int maxPrimsInNode;
     const SplitMethod splitMethod;
     std::vector<std::shared_ptr<Primitive>> primitives;
     LinearBVHNode *nodes = nullptr;
+    // Collapsed 4- or 8-wide representation of _nodes_ used for traversal
+    // when _width_ is greater than two.
+    const int width;
+    LinearWideBVHNode<4> *nodes4 = nullptr;
+    LinearWideBVHNode<8> *nodes8 = nullptr;
+    // Compressed nodes with bounds quantized to _quantizeBits_; when
+    // present, they replace _nodes_
+    const int quantizeBits;
+    void *quantizedNodes = nullptr;
+    Bounds3f bounds;
+    // Contents of the cache file that _nodes_ was read from, if any
+    void *cacheData = nullptr;
+    size_t cacheDataLength = 0;
+    // Vertex positions of the triangles in leaves that hold only triangles,
+    // stored as nine arrays indexed like _primitives_, and a flag at the
+    // first primitive of each such leaf
+    Float *triangleVertices[3][3] = {};
+    std::vector<uint8_t> packedLeaf;
+    // Bounds of _nodes_ at _motionTime0_ and _motionTime1_, if any
+    // primitives move
+    LinearBVHMotionBounds *motionBounds = nullptr;
+    Float motionTime0 = 0, motionTime1 = 1;
 };
 
 std::shared_ptr<BVHAccel> CreateBVHAccelerator(
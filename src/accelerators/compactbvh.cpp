@@ -0,0 +1,143 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+
+// accelerators/compactbvh.cpp*
+#include "accelerators/compactbvh.h"
+#include <algorithm>
+
+namespace pbrt {
+
+// CompactBVH Function Definitions
+int BuildCompactBVH(std::vector<CompactBVHNode> &nodes,
+                    const std::vector<CompactBVHItemInfo> &itemInfo,
+                    std::vector<int> &items, int start, int end,
+                    int maxItemsInNode) {
+    CHECK_NE(start, end);
+    int nodeIndex = nodes.size();
+    nodes.push_back(CompactBVHNode());
+    int nItems = end - start;
+
+    // Compute bounds of the items and of their centroids
+    Bounds3f bounds, centroidBounds;
+    for (int i = start; i < end; ++i) {
+        bounds = Union(bounds, itemInfo[items[i]].bounds);
+        centroidBounds = Union(centroidBounds, itemInfo[items[i]].centroid);
+    }
+    int dim = centroidBounds.MaximumExtent();
+
+    auto initLeaf = [&]() {
+        CompactBVHNode &node = nodes[nodeIndex];
+        node.bounds = bounds;
+        node.itemsOffset = start;
+        node.nItems = nItems;
+        return nodeIndex;
+    };
+    if (nItems == 1) return initLeaf();
+
+    int mid;
+    if (centroidBounds.pMax[dim] == centroidBounds.pMin[dim]) {
+        // Create a leaf if the items can't be told apart, unless there
+        // are too many of them for one
+        if (nItems <= maxItemsInNode) return initLeaf();
+        mid = (start + end) / 2;
+    } else if (nItems <= 2) {
+        mid = (start + end) / 2;
+        std::nth_element(&items[start], &items[mid], &items[end - 1] + 1,
+                         [&](int a, int b) {
+                             return itemInfo[a].centroid[dim] <
+                                    itemInfo[b].centroid[dim];
+                         });
+    } else {
+        // Partition items using approximate SAH, as _BVHAccel_ does
+        PBRT_CONSTEXPR int nBuckets = 12;
+        int counts[nBuckets] = {};
+        Bounds3f bucketBounds[nBuckets];
+        auto bucket = [&](int item) {
+            int b = nBuckets *
+                    centroidBounds.Offset(itemInfo[item].centroid)[dim];
+            return std::min(b, nBuckets - 1);
+        };
+        for (int i = start; i < end; ++i) {
+            int b = bucket(items[i]);
+            ++counts[b];
+            bucketBounds[b] = Union(bucketBounds[b], itemInfo[items[i]].bounds);
+        }
+
+        // Find bucket to split at that minimizes SAH metric, sweeping the
+        // buckets from both ends to compute the costs
+        Float areaBelow[nBuckets - 1];
+        int countBelow[nBuckets - 1];
+        Bounds3f b0;
+        int count0 = 0;
+        for (int i = 0; i < nBuckets - 1; ++i) {
+            b0 = Union(b0, bucketBounds[i]);
+            count0 += counts[i];
+            areaBelow[i] = b0.SurfaceArea();
+            countBelow[i] = count0;
+        }
+        Float minCost = Infinity;
+        int minCostSplitBucket = 0;
+        Bounds3f b1;
+        for (int i = nBuckets - 2; i >= 0; --i) {
+            b1 = Union(b1, bucketBounds[i + 1]);
+            Float cost = 1 + (countBelow[i] * areaBelow[i] +
+                              (nItems - countBelow[i]) * b1.SurfaceArea()) /
+                                 bounds.SurfaceArea();
+            if (cost <= minCost) {
+                minCost = cost;
+                minCostSplitBucket = i;
+            }
+        }
+
+        // Either create leaf or split items at selected SAH bucket
+        if (nItems <= maxItemsInNode && minCost >= nItems)
+            return initLeaf();
+        mid = std::partition(&items[start], &items[end - 1] + 1, [&](int item) {
+                  return bucket(item) <= minCostSplitBucket;
+              }) - &items[0];
+        if (mid == start || mid == end) mid = (start + end) / 2;
+    }
+
+    // Build the children; the first one immediately follows its parent
+    BuildCompactBVH(nodes, itemInfo, items, start, mid, maxItemsInNode);
+    int secondChild =
+        BuildCompactBVH(nodes, itemInfo, items, mid, end, maxItemsInNode);
+    CompactBVHNode &node = nodes[nodeIndex];
+    node.bounds = bounds;
+    node.secondChildOffset = secondChild;
+    node.nItems = 0;
+    node.axis = dim;
+    return nodeIndex;
+}
+
+}  // namespace pbrt
@@ -0,0 +1,116 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+#if defined(_MSC_VER)
+#define NOMINMAX
+#pragma once
+#endif
+
+#ifndef PBRT_ACCELERATORS_COMPACTBVH_H
+#define PBRT_ACCELERATORS_COMPACTBVH_H
+
+// accelerators/compactbvh.h*
+#include "pbrt.h"
+#include "geometry.h"
+
+namespace pbrt {
+
+// CompactBVH Declarations
+// A small BVH over items that a primitive identifies by index, such as the
+// triangles of a _MeshPrimitive_; nodes are stored in depth-first order
+// and leaves refer to ranges of the primitive's item index array.
+struct CompactBVHNode {
+    Bounds3f bounds;
+    union {
+        int32_t itemsOffset;    // leaf
+        int secondChildOffset;  // interior
+    };
+    uint16_t nItems;  // 0 -> interior node
+    uint8_t axis;     // interior node: xyz
+    uint8_t pad[1];   // 8 bytes after the bounds
+};
+// 32 bytes when _Float_ is _float_, 56 when it's _double_
+static_assert(sizeof(CompactBVHNode) == sizeof(Bounds3f) + 8,
+              "CompactBVHNode has unexpected padding");
+
+struct CompactBVHItemInfo {
+    Bounds3f bounds;
+    Point3f centroid;
+};
+
+// Builds the BVH's nodes over _items_[_start_, _end_), which index
+// _itemInfo_, using approximate SAH; _items_ is reordered so that each
+// leaf's are contiguous. Returns the index of the subtree's root.
+int BuildCompactBVH(std::vector<CompactBVHNode> &nodes,
+                    const std::vector<CompactBVHItemInfo> &itemInfo,
+                    std::vector<int> &items, int start, int end,
+                    int maxItemsInNode);
+
+// Calls _intersectLeaf(offset, count)_ for the leaves of the BVH that
+// _ray_ passes through, nearest first, until it returns _true_. The
+// function may shorten _ray.tMax_ to cull farther nodes.
+template <typename IntersectLeaf>
+inline void TraverseCompactBVH(const std::vector<CompactBVHNode> &nodes,
+                               const Ray &ray, IntersectLeaf intersectLeaf) {
+    if (nodes.empty()) return;
+    Vector3f invDir(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
+    int dirIsNeg[3] = {invDir.x < 0, invDir.y < 0, invDir.z < 0};
+    int toVisitOffset = 0, currentNodeIndex = 0;
+    int nodesToVisit[64];
+    while (true) {
+        const CompactBVHNode *node = &nodes[currentNodeIndex];
+        if (node->bounds.IntersectP(ray, invDir, dirIsNeg)) {
+            if (node->nItems > 0) {
+                if (intersectLeaf(node->itemsOffset, node->nItems)) return;
+                if (toVisitOffset == 0) break;
+                currentNodeIndex = nodesToVisit[--toVisitOffset];
+            } else {
+                // Put far BVH node on _nodesToVisit_ stack, advance to near
+                // node
+                if (dirIsNeg[node->axis]) {
+                    nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
+                    currentNodeIndex = node->secondChildOffset;
+                } else {
+                    nodesToVisit[toVisitOffset++] = node->secondChildOffset;
+                    currentNodeIndex = currentNodeIndex + 1;
+                }
+            }
+        } else {
+            if (toVisitOffset == 0) break;
+            currentNodeIndex = nodesToVisit[--toVisitOffset];
+        }
+    }
+}
+
+}  // namespace pbrt
+
+#endif  // PBRT_ACCELERATORS_COMPACTBVH_H
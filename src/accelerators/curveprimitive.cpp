@@ -0,0 +1,393 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+// accelerators/curveprimitive.cpp*
+#include "accelerators/curveprimitive.h"
+#include "interaction.h"
+#include "stats.h"
+#include <algorithm>
+
+namespace pbrt {
+
+STAT_MEMORY_COUNTER("Memory/Curve primitives", curvePrimitiveBytes);
+STAT_RATIO("Scene/Curve segments per curve primitive",
+           nCurvePrimitiveSegments, nCurvePrimitives);
+STAT_PERCENT("Intersections/Curve segment oriented bound culls", nCulled,
+             nSegmentTests);
+
+// CurveArray Method Definitions
+void CurveArray::Add(const CurveDescription &curve) {
+    CHECK(curve.type == type);
+    int nCurves = curve.width.size() / 2;
+    cp.reserve(cp.size() + 4 * nCurves);
+    width.reserve(width.size() + 2 * nCurves);
+    refinementDepth.reserve(refinementDepth.size() + nCurves);
+    for (int i = 0; i < nCurves; ++i) {
+        const Point3f *c = &curve.cp[4 * i];
+        for (int j = 0; j < 4; ++j) cp.push_back(Point3<float>(c[j]));
+        width.push_back(curve.width[2 * i]);
+        width.push_back(curve.width[2 * i + 1]);
+        if (type == CurveType::Ribbon)
+            for (int j = 0; j < 2; ++j)
+                n.push_back(EncodeOctahedral(Vector3f(curve.n[2 * i + j])));
+
+        // Compute the curve's refinement depth as _Curve::Intersect()_ does
+        // for each ray, using lengths of the control points' second
+        // differences, which bound them in any coordinate system
+        Float L0 = 0;
+        for (int j = 0; j < 2; ++j)
+            L0 = std::max(L0, ((c[j] + c[j + 2]) - 2 * c[j + 1]).Length());
+        Float eps = std::max(curve.width[2 * i], curve.width[2 * i + 1]) * .05f;
+        Float r = 1.41421356237f * 6.f * L0 / (8.f * eps);
+        int depth =
+            r < 1 ? 0 : int(std::round(std::log2(std::min(r, Float(1e6))))) / 2;
+        refinementDepth.push_back(Clamp(depth, 0, 10));
+    }
+}
+
+// CurvePrimitive Method Definitions
+CurvePrimitive::CurvePrimitive(std::unique_ptr<CurveArray> c,
+                               const Transform *ObjectToWorld,
+                               const Transform *WorldToObject,
+                               bool reverseOrientation,
+                               const std::shared_ptr<Material> &material,
+                               const MediumInterface &mediumInterface,
+                               int maxSegmentsInNode)
+    : curves(std::move(c)),
+      ObjectToWorld(ObjectToWorld),
+      WorldToObject(WorldToObject),
+      flipNormals(reverseOrientation ^ ObjectToWorld->SwapsHandedness()),
+      material(material),
+      mediumInterface(mediumInterface) {
+    ++nCurvePrimitives;
+    int nSegments = curves->size() << curves->splitDepth;
+    nCurvePrimitiveSegments += nSegments;
+
+    // Compute the bounds, centroid and chord capsule radius of each segment
+    std::vector<CompactBVHItemInfo> segmentInfo(nSegments);
+    std::vector<int> items(nSegments);
+    std::vector<float> radii(nSegments);
+    for (int i = 0; i < nSegments; ++i) {
+        Point3f cp[4];
+        Float u0, u1;
+        GetSegment(Segment{uint32_t(i), 0.f}, cp, &u0, &u1);
+        int curve = i >> curves->splitDepth;
+        Float halfWidth = .5f * std::max(Lerp(u0, curves->width[2 * curve],
+                                              curves->width[2 * curve + 1]),
+                                         Lerp(u1, curves->width[2 * curve],
+                                              curves->width[2 * curve + 1]));
+        Bounds3f b = Union(Bounds3f(cp[0], cp[1]), Bounds3f(cp[2], cp[3]));
+        segmentInfo[i].bounds = Expand(b, halfWidth);
+        segmentInfo[i].centroid = .5f * b.pMin + .5f * b.pMax;
+        items[i] = i;
+
+        // The segment lies in its control points' convex hull, so the
+        // capsule needs to reach the two inner ones
+        Vector3f chord = cp[3] - cp[0];
+        Float radius = 0;
+        for (int j = 1; j < 3; ++j) {
+            Float t = chord.LengthSquared() > 0
+                          ? Clamp(Dot(cp[j] - cp[0], chord) /
+                                      chord.LengthSquared(),
+                                  0, 1)
+                          : 0;
+            radius = std::max(radius, Distance(cp[j], cp[0] + t * chord));
+        }
+        radius += halfWidth;
+        radii[i] = float(radius);
+        if (radii[i] < radius) radii[i] = NextFloatUp(radii[i]);
+    }
+
+    // Build the BVH over the segments and store them in its leaf order
+    if (nSegments > 0)
+        BuildCompactBVH(nodes, segmentInfo, items, 0, nSegments,
+                        std::min(255, maxSegmentsInNode));
+    nodes.shrink_to_fit();
+    segments.resize(nSegments);
+    for (int i = 0; i < nSegments; ++i)
+        segments[i] = Segment{uint32_t(items[i]), radii[items[i]]};
+    curvePrimitiveBytes += sizeof(*this) + curves->BytesUsed() +
+                           nodes.size() * sizeof(CompactBVHNode) +
+                           segments.size() * sizeof(Segment);
+}
+
+void CurvePrimitive::GetSegment(const Segment &segment, Point3f cp[4],
+                                Float *u0, Float *u1) const {
+    int curve = segment.index >> curves->splitDepth;
+    int index = segment.index & ((1 << curves->splitDepth) - 1);
+    Float invSegments = 1 / Float(1 << curves->splitDepth);
+    *u0 = index * invSegments;
+    *u1 = (index + 1) * invSegments;
+    Point3f cpCurve[4];
+    for (int i = 0; i < 4; ++i) cpCurve[i] = Point3f(curves->cp[4 * curve + i]);
+    cp[0] = BlossomBezier(cpCurve, *u0, *u0, *u0);
+    cp[1] = BlossomBezier(cpCurve, *u0, *u0, *u1);
+    cp[2] = BlossomBezier(cpCurve, *u0, *u1, *u1);
+    cp[3] = BlossomBezier(cpCurve, *u1, *u1, *u1);
+}
+
+Bounds3f CurvePrimitive::WorldBound() const {
+    return nodes.empty() ? Bounds3f() : (*ObjectToWorld)(nodes[0].bounds);
+}
+
+bool CurvePrimitive::intersectSegment(const Ray &ray, const Segment &segment,
+                                      Float *tHit,
+                                      SurfaceInteraction *isect) const {
+    ++nSegmentTests;
+    Point3f cp[4];
+    Float u0, u1;
+    GetSegment(segment, cp, &u0, &u1);
+
+    // Test the ray's line against the segment's chord capsule, finding the
+    // point on the chord closest to the line
+    Vector3f chord = cp[3] - cp[0], w = cp[0] - ray.o;
+    Float a = Dot(ray.d, ray.d), b = Dot(ray.d, chord), c = Dot(chord, chord);
+    Float denom = a * c - b * b;
+    Float s = denom > 0
+                  ? Clamp((b * Dot(ray.d, w) - a * Dot(chord, w)) / denom, 0, 1)
+                  : 0;
+    Vector3f q = w + s * chord;
+    Float qd = Dot(q, ray.d);
+    if (q.LengthSquared() - qd * qd / a > segment.radius * segment.radius) {
+        ++nCulled;
+        return false;
+    }
+
+    // Project the control points into a coordinate system with the ray
+    // along $+z$ and the chord roughly along $x$, as _Curve::Intersect()_
+    // does, without building a _Transform_
+    Float rayLength = std::sqrt(a);
+    Vector3f dir = ray.d / rayLength;
+    Vector3f up = Cross(ray.d, chord);
+    if (up.LengthSquared() == 0) {
+        Vector3f dy;
+        CoordinateSystem(dir, &up, &dy);
+    }
+    Vector3f frame[3];
+    frame[0] = Normalize(Cross(Normalize(up), dir));
+    frame[1] = Cross(dir, frame[0]);
+    frame[2] = dir;
+    Point3f cpRay[4];
+    for (int i = 0; i < 4; ++i) {
+        Vector3f v = cp[i] - ray.o;
+        cpRay[i] = Point3f(Dot(v, frame[0]), Dot(v, frame[1]), Dot(v, frame[2]));
+    }
+
+    // Test the ray against the projected segment's bounds
+    int curve = segment.index >> curves->splitDepth;
+    Float width0 = curves->width[2 * curve], width1 = curves->width[2 * curve + 1];
+    Float halfWidth =
+        .5f * std::max(Lerp(u0, width0, width1), Lerp(u1, width0, width1));
+    Bounds3f rayBounds =
+        Union(Bounds3f(cpRay[0], cpRay[1]), Bounds3f(cpRay[2], cpRay[3]));
+    if (rayBounds.pMax.y + halfWidth < 0 || rayBounds.pMin.y - halfWidth > 0 ||
+        rayBounds.pMax.x + halfWidth < 0 || rayBounds.pMin.x - halfWidth > 0 ||
+        rayBounds.pMax.z + halfWidth < 0 ||
+        rayBounds.pMin.z - halfWidth > rayLength * ray.tMax)
+        return false;
+
+    // Each split halves the curve's second differences twice over, so the
+    // segment needs _splitDepth_ fewer refinement levels than the curve
+    int depth = std::max(0, curves->refinementDepth[curve] - curves->splitDepth);
+    return recursiveIntersect(ray, tHit, isect, cpRay, frame, curve, u0, u1,
+                              depth);
+}
+
+bool CurvePrimitive::recursiveIntersect(const Ray &ray, Float *tHit,
+                                        SurfaceInteraction *isect,
+                                        const Point3f cp[4],
+                                        const Vector3f frame[3], int curve,
+                                        Float u0, Float u1, int depth) const {
+    Float rayLength = ray.d.Length();
+    Float width0 = curves->width[2 * curve], width1 = curves->width[2 * curve + 1];
+
+    if (depth > 0) {
+        // Split curve segment into sub-segments and test for intersection
+        Point3f cpSplit[7];
+        SubdivideBezier(cp, cpSplit);
+        bool hit = false;
+        Float u[3] = {u0, (u0 + u1) / 2.f, u1};
+        const Point3f *cps = cpSplit;
+        for (int seg = 0; seg < 2; ++seg, cps += 3) {
+            Float halfWidth = .5f * std::max(Lerp(u[seg], width0, width1),
+                                             Lerp(u[seg + 1], width0, width1));
+            Bounds3f b =
+                Union(Bounds3f(cps[0], cps[1]), Bounds3f(cps[2], cps[3]));
+            if (b.pMax.y + halfWidth < 0 || b.pMin.y - halfWidth > 0 ||
+                b.pMax.x + halfWidth < 0 || b.pMin.x - halfWidth > 0 ||
+                b.pMax.z + halfWidth < 0 ||
+                b.pMin.z - halfWidth > rayLength * ray.tMax)
+                continue;
+            hit |= recursiveIntersect(ray, tHit, isect, cps, frame, curve,
+                                      u[seg], u[seg + 1], depth - 1);
+            // If we found an intersection and this is a shadow ray,
+            // we can exit out immediately.
+            if (hit && !tHit) return true;
+        }
+        return hit;
+    }
+
+    // Intersect ray with curve segment
+
+    // Test sample point against tangent perpendiculars at curve ends
+    Float edge = (cp[1].y - cp[0].y) * -cp[0].y + cp[0].x * (cp[0].x - cp[1].x);
+    if (edge < 0) return false;
+    edge = (cp[2].y - cp[3].y) * -cp[3].y + cp[3].x * (cp[3].x - cp[2].x);
+    if (edge < 0) return false;
+
+    // Compute line $w$ that gives minimum distance to sample point
+    Vector2f segmentDirection = Point2f(cp[3]) - Point2f(cp[0]);
+    Float denom = segmentDirection.LengthSquared();
+    if (denom == 0) return false;
+    Float w = Dot(-Vector2f(cp[0]), segmentDirection) / denom;
+
+    // Compute $u$ coordinate of curve intersection point and _hitWidth_
+    Float u = Clamp(Lerp(w, u0, u1), u0, u1);
+    Float hitWidth = Lerp(u, width0, width1);
+    Normal3f nHit;
+    if (curves->type == CurveType::Ribbon) {
+        // Scale _hitWidth_ based on ribbon orientation
+        Normal3f n0(DecodeOctahedral(curves->n[2 * curve]));
+        Normal3f n1(DecodeOctahedral(curves->n[2 * curve + 1]));
+        Float normalAngle = std::acos(Clamp(Dot(n0, n1), 0, 1));
+        if (normalAngle > 0) {
+            Float invSinNormalAngle = 1 / std::sin(normalAngle);
+            nHit = std::sin((1 - u) * normalAngle) * invSinNormalAngle * n0 +
+                   std::sin(u * normalAngle) * invSinNormalAngle * n1;
+        } else
+            nHit = n0;
+        hitWidth *= AbsDot(nHit, ray.d) / rayLength;
+    }
+
+    // Test intersection point against curve width
+    Vector3f dpcdw;
+    Point3f pc = EvalBezier(cp, Clamp(w, 0, 1), &dpcdw);
+    Float ptCurveDist2 = pc.x * pc.x + pc.y * pc.y;
+    if (ptCurveDist2 > hitWidth * hitWidth * .25) return false;
+    if (pc.z < 0 || pc.z > rayLength * ray.tMax) return false;
+
+    // Compute $v$ coordinate of curve intersection point
+    Float ptCurveDist = std::sqrt(ptCurveDist2);
+    Float edgeFunc = dpcdw.x * -pc.y + pc.x * dpcdw.y;
+    Float v = (edgeFunc > 0) ? 0.5f + ptCurveDist / hitWidth
+                             : 0.5f - ptCurveDist / hitWidth;
+
+    if (tHit) {
+        // Compute hit _t_ and partial derivatives for curve intersection
+        *tHit = pc.z / rayLength;
+        Vector3f pError(2 * hitWidth, 2 * hitWidth, 2 * hitWidth);
+        Point3f cpCurve[4];
+        for (int i = 0; i < 4; ++i)
+            cpCurve[i] = Point3f(curves->cp[4 * curve + i]);
+        Vector3f dpdu, dpdv;
+        EvalBezier(cpCurve, u, &dpdu);
+        if (curves->type == CurveType::Ribbon)
+            dpdv = Normalize(Cross(nHit, dpdu)) * hitWidth;
+        else {
+            // Compute curve $\dpdv$ for flat and cylinder curves in the
+            // ray's coordinate system
+            Vector3f dpduPlane(Dot(dpdu, frame[0]), Dot(dpdu, frame[1]),
+                               Dot(dpdu, frame[2]));
+            Vector3f dpdvPlane =
+                Normalize(Vector3f(-dpduPlane.y, dpduPlane.x, 0)) * hitWidth;
+            if (curves->type == CurveType::Cylinder) {
+                // Rotate _dpdvPlane_ to give cylindrical appearance
+                Float theta = Lerp(v, -90., 90.);
+                Transform rot = Rotate(-theta, dpduPlane);
+                dpdvPlane = rot(dpdvPlane);
+            }
+            dpdv = dpdvPlane.x * frame[0] + dpdvPlane.y * frame[1] +
+                   dpdvPlane.z * frame[2];
+        }
+        *isect = SurfaceInteraction(ray(*tHit), pError, Point2f(u, v), -ray.d,
+                                    dpdu, dpdv, Normal3f(0, 0, 0),
+                                    Normal3f(0, 0, 0), ray.time, nullptr);
+        if (flipNormals) isect->n = isect->shading.n = -isect->n;
+    }
+    return true;
+}
+
+bool CurvePrimitive::Intersect(const Ray &r, SurfaceInteraction *isect) const {
+    if (nodes.empty()) return false;
+    ProfilePhase p(Prof::CurveIntersect);
+    Vector3f oErr, dErr;
+    Ray ray = (*WorldToObject)(r, &oErr, &dErr);
+    bool hit = false;
+    TraverseCompactBVH(nodes, ray, [&](int offset, int count) {
+        for (int i = 0; i < count; ++i) {
+            Float tHit;
+            if (intersectSegment(ray, segments[offset + i], &tHit, isect)) {
+                ray.tMax = tHit;
+                hit = true;
+            }
+        }
+        return false;
+    });
+    if (!hit) return false;
+
+    // Transform the closest hit to world space and initialize the parts of
+    // _isect_ that a _GeometricPrimitive_ would
+    r.tMax = ray.tMax;
+    *isect = (*ObjectToWorld)(*isect);
+    isect->primitive = this;
+    if (mediumInterface.IsMediumTransition())
+        isect->mediumInterface = mediumInterface;
+    else
+        isect->mediumInterface = MediumInterface(r.medium);
+    return true;
+}
+
+bool CurvePrimitive::IntersectP(const Ray &r) const {
+    if (nodes.empty()) return false;
+    ProfilePhase p(Prof::CurveIntersectP);
+    Vector3f oErr, dErr;
+    Ray ray = (*WorldToObject)(r, &oErr, &dErr);
+    bool hit = false;
+    TraverseCompactBVH(nodes, ray, [&](int offset, int count) {
+        for (int i = 0; i < count; ++i)
+            if (intersectSegment(ray, segments[offset + i], nullptr, nullptr))
+                return hit = true;
+        return false;
+    });
+    return hit;
+}
+
+void CurvePrimitive::ComputeScatteringFunctions(
+    SurfaceInteraction *isect, MemoryArena &arena, TransportMode mode,
+    bool allowMultipleLobes) const {
+    ProfilePhase p(Prof::ComputeScatteringFuncs);
+    if (material)
+        material->ComputeScatteringFunctions(isect, arena, mode,
+                                             allowMultipleLobes);
+}
+
+}  // namespace pbrt
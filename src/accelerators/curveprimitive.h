@@ -0,0 +1,134 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+#if defined(_MSC_VER)
+#define NOMINMAX
+#pragma once
+#endif
+
+#ifndef PBRT_ACCELERATORS_CURVEPRIMITIVE_H
+#define PBRT_ACCELERATORS_CURVEPRIMITIVE_H
+
+// accelerators/curveprimitive.h*
+#include "pbrt.h"
+#include "primitive.h"
+#include "accelerators/compactbvh.h"
+#include "shapes/curve.h"
+
+namespace pbrt {
+
+// CurveArray Declarations
+// Compact object-space storage for many cubic Bezier curves of one type:
+// single-precision control points and widths, octahedrally encoded ribbon
+// normals, and the refinement depth each curve's intersection tests use.
+struct CurveArray {
+    // CurveArray Public Methods
+    CurveArray(CurveType type, int splitDepth)
+        : type(type), splitDepth(splitDepth) {}
+    // Appends the segments of _curve_, which must have the array's type.
+    void Add(const CurveDescription &curve);
+    int size() const { return int(refinementDepth.size()); }
+    size_t BytesUsed() const {
+        return sizeof(*this) + cp.capacity() * sizeof(cp[0]) +
+               width.capacity() * sizeof(width[0]) +
+               n.capacity() * sizeof(n[0]) + refinementDepth.capacity();
+    }
+
+    // CurveArray Data
+    const CurveType type;
+    // Each curve is split into $2^\roman{splitDepth}$ segments, which the
+    // _CurvePrimitive_'s BVH holds.
+    const int splitDepth;
+    std::vector<Point3<float>> cp;  // 4 per curve
+    std::vector<float> width;       // 2 per curve
+    std::vector<uint32_t> n;        // 2 per curve, for ribbons
+    std::vector<uint8_t> refinementDepth;
+};
+
+// CurvePrimitive Declarations
+// _CurvePrimitive_ holds the curves of a _CurveArray_ with a single
+// material and transformation, replacing the _Curve_ shape and
+// _GeometricPrimitive_ that each curve segment would otherwise need. Its
+// BVH is built over the segments in object space; each segment also has
+// an oriented bound, a capsule around its chord, that is tested before
+// the curve itself.
+class CurvePrimitive : public Primitive {
+  public:
+    // CurvePrimitive Public Methods
+    CurvePrimitive(std::unique_ptr<CurveArray> curves,
+                   const Transform *ObjectToWorld,
+                   const Transform *WorldToObject, bool reverseOrientation,
+                   const std::shared_ptr<Material> &material,
+                   const MediumInterface &mediumInterface,
+                   int maxSegmentsInNode = 4);
+    Bounds3f WorldBound() const;
+    bool Intersect(const Ray &r, SurfaceInteraction *isect) const;
+    bool IntersectP(const Ray &r) const;
+    const AreaLight *GetAreaLight() const { return nullptr; }
+    const Material *GetMaterial() const { return material.get(); }
+    void ComputeScatteringFunctions(SurfaceInteraction *isect,
+                                    MemoryArena &arena, TransportMode mode,
+                                    bool allowMultipleLobes) const;
+
+  private:
+    // CurvePrimitive Private Declarations
+    struct Segment {
+        // The curve's index, shifted left by the split depth, plus the
+        // segment's index within the curve
+        uint32_t index;
+        // Radius of a capsule around the segment's chord that bounds it
+        float radius;
+    };
+
+    // CurvePrimitive Private Methods
+    void GetSegment(const Segment &segment, Point3f cp[4], Float *u0,
+                    Float *u1) const;
+    bool intersectSegment(const Ray &ray, const Segment &segment,
+                          Float *tHit, SurfaceInteraction *isect) const;
+    bool recursiveIntersect(const Ray &ray, Float *tHit,
+                            SurfaceInteraction *isect, const Point3f cp[4],
+                            const Vector3f frame[3], int curve, Float u0,
+                            Float u1, int depth) const;
+
+    // CurvePrimitive Private Data
+    std::unique_ptr<CurveArray> curves;
+    const Transform *ObjectToWorld, *WorldToObject;
+    const bool flipNormals;
+    std::shared_ptr<Material> material;
+    MediumInterface mediumInterface;
+    std::vector<CompactBVHNode> nodes;
+    std::vector<Segment> segments;
+};
+
+}  // namespace pbrt
+
+#endif  // PBRT_ACCELERATORS_CURVEPRIMITIVE_H
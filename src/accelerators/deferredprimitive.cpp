@@ -0,0 +1,235 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+
+// accelerators/deferredprimitive.cpp*
+#include "accelerators/deferredprimitive.h"
+#include "accelerators/bvh.h"
+#include "accelerators/meshprimitive.h"
+#include "interaction.h"
+#include "shape.h"
+#include "stats.h"
+
+namespace pbrt {
+
+STAT_COUNTER("Scene/Deferred primitives", nDeferredPrimitives);
+STAT_COUNTER("Geometry cache/Tessellations", nTessellations);
+STAT_COUNTER("Geometry cache/Evictions", nEvictions);
+STAT_MEMORY_COUNTER("Memory/Tessellated geometry", tessellatedBytes);
+
+// DeferredPrimitive Local Definitions
+// _OrientationShape_ only records the orientation of a deferred shape's
+// triangles, which is all that _SurfaceInteraction_ needs from its shape
+// once the intersection has been found.
+class OrientationShape : public Shape {
+  public:
+    OrientationShape(const Transform *ObjectToWorld,
+                     const Transform *WorldToObject, bool reverseOrientation)
+        : Shape(ObjectToWorld, WorldToObject, reverseOrientation) {}
+    Bounds3f ObjectBound() const { return Bounds3f(); }
+    bool Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
+                   bool testAlphaTexture) const {
+        return false;
+    }
+    Float Area() const { return 0; }
+    Interaction Sample(const Point2f &u, Float *pdf) const {
+        LOG(FATAL) << "OrientationShape::Sample() shouldn't be called";
+        return Interaction();
+    }
+};
+
+// GeometryCache Method Definitions
+void GeometryCache::SetMaxBytes(size_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex);
+    maxBytes = bytes;
+    EvictIfNeeded(nullptr);
+}
+
+size_t GeometryCache::BytesUsed() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return bytesUsed;
+}
+
+void GeometryCache::Clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (const auto &entry : resident) Evict(entry.first);
+    resident.clear();
+    bytesUsed = 0;
+    FreeEvicted();
+}
+
+void GeometryCache::Insert(const DeferredPrimitive *prim, size_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex);
+    CHECK(resident.find(prim) == resident.end());
+    resident[prim] = bytes;
+    bytesUsed += bytes;
+    prim->lastUse.store(++epoch, std::memory_order_relaxed);
+    EvictIfNeeded(prim);
+    FreeEvicted();
+}
+
+void GeometryCache::Remove(const DeferredPrimitive *prim) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto iter = resident.find(prim);
+    if (iter == resident.end()) return;
+    bytesUsed -= iter->second;
+    resident.erase(iter);
+}
+
+void GeometryCache::EvictIfNeeded(const DeferredPrimitive *keep) {
+    // Evict the least recently used geometry other than _keep_ until the
+    // cache fits in its budget; a scan is cheap next to tessellation.
+    while (bytesUsed > maxBytes) {
+        auto victim = resident.end();
+        uint64_t oldest = ~uint64_t(0);
+        for (auto iter = resident.begin(); iter != resident.end(); ++iter) {
+            uint64_t use = iter->first->lastUse.load(std::memory_order_relaxed);
+            if (iter->first != keep && use <= oldest) {
+                victim = iter;
+                oldest = use;
+            }
+        }
+        if (victim == resident.end()) return;
+        Evict(victim->first);
+        bytesUsed -= victim->second;
+        resident.erase(victim);
+        ++nEvictions;
+    }
+}
+
+void GeometryCache::Evict(const DeferredPrimitive *prim) {
+    // Stop new rays from using the geometry, but keep it until the rays
+    // that may already be using it are done
+    prim->geometryPtr.store(nullptr);
+    evicted.push_back(
+        std::atomic_exchange(&prim->geometry, std::shared_ptr<Primitive>()));
+}
+
+void GeometryCache::FreeEvicted() {
+    // A ray that starts using geometry after its counter is read as zero
+    // here also reads _geometryPtr_ after it was cleared, so if all of the
+    // counters are zero, no ray can be using evicted geometry.
+    if (evicted.empty()) return;
+    for (const UseCount &use : useCounts)
+        if (use.count.load() != 0) return;
+    evicted.clear();
+}
+
+GeometryCache &GetGeometryCache() {
+    // The cache is never freed so that it outlives any static primitives.
+    static GeometryCache *cache = new GeometryCache;
+    return *cache;
+}
+
+// DeferredPrimitive Method Definitions
+DeferredPrimitive::DeferredPrimitive(
+    std::function<std::vector<std::shared_ptr<Shape>>()> tessellate,
+    const Bounds3f &worldBound, const Transform *ObjectToWorld,
+    const Transform *WorldToObject, bool reverseOrientation,
+    const std::shared_ptr<Material> &material,
+    const MediumInterface &mediumInterface, GeometryCache *cache)
+    : tessellate(std::move(tessellate)),
+      worldBound(worldBound),
+      orientation(std::make_shared<OrientationShape>(
+          ObjectToWorld, WorldToObject, reverseOrientation)),
+      material(material),
+      mediumInterface(mediumInterface),
+      cache(cache),
+      geometryPtr(nullptr),
+      lastUse(0) {
+    ++nDeferredPrimitives;
+}
+
+DeferredPrimitive::~DeferredPrimitive() { cache->Remove(this); }
+
+std::shared_ptr<Primitive> DeferredPrimitive::Tessellate() const {
+    // Tessellate the shape, unless another thread just did. During
+    // rendering this runs inside a parallel loop, so the _ParallelFor()_s
+    // of tessellation and of the fallback BVH's construction run serially.
+    std::lock_guard<std::mutex> lock(tessellateMutex);
+    std::shared_ptr<Primitive> geom = std::atomic_load(&geometry);
+    if (geom) return geom;
+    std::vector<std::shared_ptr<Shape>> shapes = tessellate();
+    size_t bytes;
+    std::shared_ptr<MeshPrimitive> mesh =
+        CreateMeshPrimitive(shapes, material, mediumInterface);
+    if (mesh) {
+        bytes = mesh->BytesUsed();
+        geom = mesh;
+    } else {
+        // Fall back to a BVH over the individual shapes
+        std::vector<std::shared_ptr<Primitive>> prims;
+        for (const auto &s : shapes)
+            prims.push_back(std::make_shared<GeometricPrimitive>(
+                s, material, nullptr, mediumInterface));
+        // Roughly account for each shape, its primitive, and a BVH node
+        bytes = sizeof(BVHAccel) + shapes.size() * 256;
+        geom = std::make_shared<BVHAccel>(std::move(prims));
+    }
+    ++nTessellations;
+    tessellatedBytes += bytes;
+    std::atomic_store(&geometry, geom);
+    geometryPtr.store(geom.get());
+    cache->Insert(this, bytes);
+    return geom;
+}
+
+bool DeferredPrimitive::Intersect(const Ray &r,
+                                  SurfaceInteraction *isect) const {
+    if (!worldBound.IntersectP(r)) return false;
+    if (!WithGeometry([&](const Primitive *geom) {
+            return geom->Intersect(r, isect);
+        }))
+        return false;
+    // Don't leave pointers to geometry that may be evicted in _isect_
+    isect->primitive = this;
+    isect->shape = orientation.get();
+    return true;
+}
+
+bool DeferredPrimitive::IntersectP(const Ray &r) const {
+    if (!worldBound.IntersectP(r)) return false;
+    return WithGeometry(
+        [&](const Primitive *geom) { return geom->IntersectP(r); });
+}
+
+void DeferredPrimitive::ComputeScatteringFunctions(
+    SurfaceInteraction *isect, MemoryArena &arena, TransportMode mode,
+    bool allowMultipleLobes) const {
+    ProfilePhase p(Prof::ComputeScatteringFuncs);
+    if (material)
+        material->ComputeScatteringFunctions(isect, arena, mode,
+                                             allowMultipleLobes);
+    CHECK_GE(Dot(isect->n, isect->shading.n), 0.);
+}
+
+}  // namespace pbrt
@@ -0,0 +1,181 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+
+#if defined(_MSC_VER)
+#define NOMINMAX
+#pragma once
+#endif
+
+#ifndef PBRT_ACCELERATORS_DEFERREDPRIMITIVE_H
+#define PBRT_ACCELERATORS_DEFERREDPRIMITIVE_H
+
+// accelerators/deferredprimitive.h*
+#include "pbrt.h"
+#include "primitive.h"
+#include "parallel.h"
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace pbrt {
+
+// DeferredPrimitive Forward Declarations
+class DeferredPrimitive;
+
+// GeometryCache Declarations
+// _GeometryCache_ bounds the memory used by the tessellated geometry of
+// _DeferredPrimitive_s. When it goes over budget, it evicts the geometry
+// that was least recently used, which is measured in insertions into the
+// cache, so that using geometry only costs an atomic load. Rays use the
+// geometry through a raw pointer and count themselves in per-thread
+// counters rather than holding a reference, so that threads don't contend
+// on reference counts; evicted geometry is only freed once no rays are
+// using any, which may leave the cache briefly over budget.
+class GeometryCache {
+  public:
+    // GeometryCache Public Methods
+    GeometryCache(size_t maxBytes = 1024ull * 1024 * 1024)
+        : maxBytes(maxBytes) {}
+    void SetMaxBytes(size_t bytes);
+    size_t BytesUsed() const;
+    uint64_t Epoch() const { return epoch.load(std::memory_order_relaxed); }
+    // Evicts all of the cached geometry.
+    void Clear();
+
+  private:
+    // GeometryCache Private Methods
+    friend class DeferredPrimitive;
+    void Insert(const DeferredPrimitive *prim, size_t bytes);
+    void Remove(const DeferredPrimitive *prim);
+    void EvictIfNeeded(const DeferredPrimitive *keep);
+    void Evict(const DeferredPrimitive *prim);
+    void FreeEvicted();
+    void BeginUse() { useCounts[ThreadIndex % nUseCounts].count++; }
+    void EndUse() {
+        useCounts[ThreadIndex % nUseCounts].count.fetch_sub(
+            1, std::memory_order_release);
+    }
+
+    // GeometryCache Private Data
+    mutable std::mutex mutex;
+    std::unordered_map<const DeferredPrimitive *, size_t> resident;
+    size_t maxBytes, bytesUsed = 0;
+    std::atomic<uint64_t> epoch{0};
+    // Evicted geometry that rays may still be using
+    std::vector<std::shared_ptr<Primitive>> evicted;
+    // Numbers of rays using geometry, by thread; threads whose indices
+    // are equal modulo _nUseCounts_ share a counter
+    struct UseCount {
+        std::atomic<int> count{0};
+        char pad[64 - sizeof(std::atomic<int>)];
+    };
+    static PBRT_CONSTEXPR int nUseCounts = 64;
+    UseCount useCounts[nUseCounts];
+};
+
+// Returns the cache that _DeferredPrimitive_s use by default.
+GeometryCache &GetGeometryCache();
+
+// DeferredPrimitive Declarations
+// _DeferredPrimitive_ stands in for a shape whose tessellation is
+// expensive in time or memory. Only its bounds are kept until a ray
+// reaches them; the shape is then tessellated into a _MeshPrimitive_,
+// which the _GeometryCache_ may later free again.
+class DeferredPrimitive : public Primitive {
+  public:
+    // DeferredPrimitive Public Methods
+    DeferredPrimitive(
+        std::function<std::vector<std::shared_ptr<Shape>>()> tessellate,
+        const Bounds3f &worldBound, const Transform *ObjectToWorld,
+        const Transform *WorldToObject, bool reverseOrientation,
+        const std::shared_ptr<Material> &material,
+        const MediumInterface &mediumInterface,
+        GeometryCache *cache = &GetGeometryCache());
+    ~DeferredPrimitive();
+    Bounds3f WorldBound() const { return worldBound; }
+    bool Intersect(const Ray &r, SurfaceInteraction *isect) const;
+    bool IntersectP(const Ray &r) const;
+    const AreaLight *GetAreaLight() const { return nullptr; }
+    const Material *GetMaterial() const { return material.get(); }
+    void ComputeScatteringFunctions(SurfaceInteraction *isect,
+                                    MemoryArena &arena, TransportMode mode,
+                                    bool allowMultipleLobes) const;
+    bool IsResident() const { return geometryPtr.load() != nullptr; }
+
+  private:
+    // DeferredPrimitive Private Methods
+    friend class GeometryCache;
+    std::shared_ptr<Primitive> Tessellate() const;
+    // Returns _f_ called with the geometry, tessellating it if needed.
+    template <typename F>
+    bool WithGeometry(F f) const {
+        cache->BeginUse();
+        const Primitive *geom = geometryPtr.load();
+        if (geom) {
+            // Note the use of _geom_, without writing if nothing has changed
+            uint64_t epoch = cache->Epoch();
+            if (lastUse.load(std::memory_order_relaxed) != epoch)
+                lastUse.store(epoch, std::memory_order_relaxed);
+            bool result = f(geom);
+            cache->EndUse();
+            return result;
+        }
+        cache->EndUse();
+        // Hold a reference to newly tessellated geometry, which may be
+        // evicted by other threads at any time
+        std::shared_ptr<Primitive> tessellated = Tessellate();
+        return f(tessellated.get());
+    }
+
+    // DeferredPrimitive Private Data
+    const std::function<std::vector<std::shared_ptr<Shape>>()> tessellate;
+    const Bounds3f worldBound;
+    // Stored in _SurfaceInteraction_s in place of the tessellated
+    // triangles, which may be freed while the interaction is still in use.
+    std::shared_ptr<Shape> orientation;
+    std::shared_ptr<Material> material;
+    MediumInterface mediumInterface;
+    GeometryCache *cache;
+    mutable std::shared_ptr<Primitive> geometry;
+    // _geometry_'s primitive, which rays use between _BeginUse()_ and
+    // _EndUse()_
+    mutable std::atomic<const Primitive *> geometryPtr;
+    mutable std::atomic<uint64_t> lastUse;
+    mutable std::mutex tessellateMutex;
+};
+
+}  // namespace pbrt
+
+#endif  // PBRT_ACCELERATORS_DEFERREDPRIMITIVE_H
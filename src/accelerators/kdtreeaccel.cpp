@@ -36,19 +36,48 @@
 #include "paramset.h"
 #include "interaction.h"
 #include "stats.h"
+#include "parallel.h"
 #include <algorithm>
 
 namespace pbrt {
 
+STAT_RATIO("Kd-Tree/Nodes visited per ray", nodesVisited, raysTraversed);
+
 // KdTreeAccel Local Declarations
+enum class EdgeType { Start, End };
+struct BoundEdge {
+    // BoundEdge Public Methods
+    BoundEdge() {}
+    BoundEdge(Float t, int primNum, bool starting) : t(t), primNum(primNum) {
+        type = starting ? EdgeType::Start : EdgeType::End;
+    }
+    bool operator<(const BoundEdge &e) const {
+        // Break ties by primitive number so that the tree built doesn't
+        // depend on the order in which edges were sorted
+        if (t != e.t) return t < e.t;
+        if (type != e.type) return (int)type < (int)e.type;
+        return primNum < e.primNum;
+    }
+    Float t;
+    int primNum;
+    EdgeType type;
+};
+
 struct KdAccelNode {
     // KdAccelNode Methods
-    void InitLeaf(size_t *primNums, size_t np, std::vector<size_t> *primitiveIndices);
+    void InitLeaf(const BoundEdge *edges, int np,
+                  std::vector<size_t> *primitiveIndices);
     void InitInterior(int axis, int ac, Float s) {
         split = s;
         flags = axis;
         aboveChild |= (ac << 2);
     }
+    void Relocate(int nodeOffset, int primitiveIndicesOffsetDelta) {
+        if (!IsLeaf())
+            InitInterior(SplitAxis(), AboveChild() + nodeOffset, split);
+        else if (nPrimitives() > 1)
+            primitiveIndicesOffset += primitiveIndicesOffsetDelta;
+    }
     Float SplitPos() const { return split; }
     int nPrimitives() const { return nPrims >> 2; }
     int SplitAxis() const { return flags & 3; }
@@ -68,16 +97,22 @@ struct KdAccelNode {
     };
 };
 
-enum class EdgeType { Start, End };
-struct BoundEdge {
-    // BoundEdge Public Methods
-    BoundEdge() {}
-    BoundEdge(Float t, size_t primNum, bool starting) : t(t), primNum(primNum) {
-        type = starting ? EdgeType::Start : EdgeType::End;
-    }
-    Float t;
-    size_t primNum;
-    EdgeType type;
+// Nodes of a kd-tree, or of a subtree of one, in depth-first order along
+// with the primitive indices of its leaves; child and primitive indices are
+// relative to the start of these arrays.
+struct KdSubtree {
+    std::vector<KdAccelNode> nodes;
+    std::vector<size_t> primitiveIndices;
+};
+
+// A subtree whose construction has been deferred so that it can be built in
+// parallel with the others; it replaces the placeholder leaf at _nodeNum_.
+struct KdSubtreeBuild {
+    int nodeNum;
+    Bounds3f bounds;
+    int nPrimitives, depth, badRefines;
+    std::vector<BoundEdge> edges;
+    KdSubtree tree;
 };
 
 // KdTreeAccel Method Definitions
@@ -91,7 +126,6 @@ KdTreeAccel::KdTreeAccel(std::vector<std::shared_ptr<Primitive>> p,
       primitives(std::move(p)) {
     // Build kd-tree for accelerator
     ProfilePhase _(Prof::AccelConstruction);
-    nextFreeNode = nAllocedNodes = 0;
     if (maxDepth <= 0)
         maxDepth = std::round(8 + 1.3f * Log2Int(int64_t(primitives.size())));
 
@@ -104,61 +138,132 @@ KdTreeAccel::KdTreeAccel(std::vector<std::shared_ptr<Primitive>> p,
         primBounds.push_back(b);
     }
 
-    // Allocate working memory for kd-tree construction
-    std::unique_ptr<BoundEdge[]> edges[3];
-    for (int i = 0; i < 3; ++i)
-        edges[i].reset(new BoundEdge[2 * primitives.size()]);
-    std::unique_ptr<size_t[]> prims0(new size_t[primitives.size()]);
-    std::unique_ptr<size_t[]> prims1(new size_t[(maxDepth + 1) * primitives.size()]);
-
-    // Initialize _primNums_ for kd-tree construction
-    std::unique_ptr<size_t[]> primNums(new size_t[primitives.size()]);
-    for (size_t i = 0; i < primitives.size(); ++i) primNums[i] = i;
-
-    // Start recursive construction of kd-tree
-    buildTree(0, bounds, primBounds, primNums.get(), primitives.size(),
-              maxDepth, edges, prims0.get(), prims1.get());
+    // Sort the primitives' bounding box edges along each axis just once;
+    // _buildTree()_ keeps them sorted as it distributes them to children
+    int nPrimitives = primitives.size();
+    std::vector<BoundEdge> edges(6 * size_t(nPrimitives));
+    ParallelFor([&](int64_t axis) {
+        BoundEdge *axisEdges = edges.data() + 2 * axis * nPrimitives;
+        for (int i = 0; i < nPrimitives; ++i) {
+            axisEdges[2 * i] = BoundEdge(primBounds[i].pMin[axis], i, true);
+            axisEdges[2 * i + 1] =
+                BoundEdge(primBounds[i].pMax[axis], i, false);
+        }
+        std::sort(axisEdges, axisEdges + 2 * nPrimitives);
+    }, 3);
+
+    // Build the upper levels of the kd-tree, deferring subtrees below
+    std::vector<std::vector<uint8_t>> threadPrimSides(MaxThreadIndex());
+    threadPrimSides[ThreadIndex].resize(nPrimitives);
+    KdSubtree upper;
+    std::vector<KdSubtreeBuild> subtrees;
+    buildTree(&upper, bounds, edges, 0, nPrimitives, maxDepth,
+              threadPrimSides[ThreadIndex].data(), &subtrees);
+    std::vector<BoundEdge>().swap(edges);
+
+    // Build deferred subtrees in parallel
+    ParallelFor([&](int64_t i) {
+        KdSubtreeBuild &subtree = subtrees[i];
+        std::vector<uint8_t> &primSides = threadPrimSides[ThreadIndex];
+        if (primSides.empty()) primSides.resize(primitives.size());
+        buildTree(&subtree.tree, subtree.bounds, subtree.edges, 0,
+                  subtree.nPrimitives, subtree.depth, primSides.data(),
+                  nullptr, subtree.badRefines);
+        std::vector<BoundEdge>().swap(subtree.edges);
+    }, subtrees.size());
+
+    // Assemble _nodes_ in depth-first order, with each deferred subtree's
+    // nodes in place of its placeholder
+    size_t totalNodes = upper.nodes.size() - subtrees.size();
+    for (const KdSubtreeBuild &subtree : subtrees)
+        totalNodes += subtree.tree.nodes.size();
+    nodes = AllocAligned<KdAccelNode>(totalNodes);
+    primitiveIndices.swap(upper.primitiveIndices);
+    std::vector<int> nodeIndex(upper.nodes.size());
+    int offset = 0;
+    size_t nextSubtree = 0;
+    for (size_t i = 0; i < upper.nodes.size(); ++i) {
+        nodeIndex[i] = offset;
+        if (nextSubtree < subtrees.size() &&
+            subtrees[nextSubtree].nodeNum == int(i)) {
+            const KdSubtree &tree = subtrees[nextSubtree++].tree;
+            int indicesOffset = primitiveIndices.size();
+            primitiveIndices.insert(primitiveIndices.end(),
+                                    tree.primitiveIndices.begin(),
+                                    tree.primitiveIndices.end());
+            for (KdAccelNode node : tree.nodes) {
+                node.Relocate(nodeIndex[i], indicesOffset);
+                nodes[offset++] = node;
+            }
+        } else
+            nodes[offset++] = upper.nodes[i];
+    }
+    CHECK_EQ(offset, int(totalNodes));
+    for (size_t i = 0; i < upper.nodes.size(); ++i) {
+        const KdAccelNode &node = upper.nodes[i];
+        if (!node.IsLeaf())
+            nodes[nodeIndex[i]].InitInterior(
+                node.SplitAxis(), nodeIndex[node.AboveChild()],
+                node.SplitPos());
+    }
 }
 
-void KdAccelNode::InitLeaf(size_t *primNums, size_t np,
+void KdAccelNode::InitLeaf(const BoundEdge *edges, int np,
                            std::vector<size_t> *primitiveIndices) {
     flags = 3;
     nPrims |= (np << 2);
-    // Store primitive ids for leaf node
+    // Store primitive ids for leaf node, taken from the start edges of the
+    // leaf's _2 * np_ edges along an axis
     if (np == 0)
         onePrimitive = 0;
     else if (np == 1)
-        onePrimitive = static_cast<int32_t>(primNums[0]);
+        onePrimitive = edges[0].primNum;
     else {
         primitiveIndicesOffset = static_cast<int32_t>(primitiveIndices->size());
-        for (int i = 0; i < np; ++i) primitiveIndices->push_back(primNums[i]);
+        for (int i = 0; i < 2 * np; ++i)
+            if (edges[i].type == EdgeType::Start)
+                primitiveIndices->push_back(edges[i].primNum);
     }
 }
 
 KdTreeAccel::~KdTreeAccel() { FreeAligned(nodes); }
 
-void KdTreeAccel::buildTree(int nodeNum, const Bounds3f &nodeBounds,
-                            const std::vector<Bounds3f> &allPrimBounds,
-                            size_t *primNums, size_t nPrimitives, int depth,
-                            const std::unique_ptr<BoundEdge[]> edges[3],
-                            size_t *prims0, size_t *prims1, int badRefines) {
-    CHECK_EQ(nodeNum, nextFreeNode);
-    // Get next free node from _nodes_ array
-    if (nextFreeNode == nAllocedNodes) {
-        int nNewAllocNodes = std::max(2 * nAllocedNodes, 512);
-        KdAccelNode *n = AllocAligned<KdAccelNode>(nNewAllocNodes);
-        if (nAllocedNodes > 0) {
-            memcpy(n, nodes, nAllocedNodes * sizeof(KdAccelNode));
-            FreeAligned(nodes);
-        }
-        nodes = n;
-        nAllocedNodes = nNewAllocNodes;
-    }
-    ++nextFreeNode;
+void KdTreeAccel::buildTree(KdSubtree *tree, const Bounds3f &nodeBounds,
+                            std::vector<BoundEdge> &edgeStack,
+                            size_t edgeOffset, int nPrimitives, int depth,
+                            uint8_t *primSides,
+                            std::vector<KdSubtreeBuild> *deferredSubtrees,
+                            int badRefines) {
+    // Get next free node from _tree_'s nodes
+    int nodeNum = tree->nodes.size();
+    tree->nodes.push_back(KdAccelNode());
+
+    // The node's sorted edges along each axis are stored one axis after
+    // another starting at _edgeOffset_ in _edgeStack_
+    auto axisEdges = [&](int axis) {
+        return edgeStack.data() + edgeOffset + 2 * axis * size_t(nPrimitives);
+    };
 
     // Initialize leaf node if termination criteria met
     if (nPrimitives <= maxPrims || depth == 0) {
-        nodes[nodeNum].InitLeaf(primNums, nPrimitives, &primitiveIndices);
+        tree->nodes[nodeNum].InitLeaf(axisEdges(0), nPrimitives,
+                                      &tree->primitiveIndices);
+        return;
+    }
+
+    // Defer small enough subtrees so that they can be built in parallel
+    if (deferredSubtrees &&
+        nPrimitives <= std::max<int>(
+            primitives.size() / (8 * MaxThreadIndex()), 1024)) {
+        tree->nodes[nodeNum].InitLeaf(nullptr, 0, nullptr);
+        KdSubtreeBuild subtree;
+        subtree.nodeNum = nodeNum;
+        subtree.bounds = nodeBounds;
+        subtree.nPrimitives = nPrimitives;
+        subtree.depth = depth;
+        subtree.badRefines = badRefines;
+        subtree.edges.assign(axisEdges(0), axisEdges(0) + 6 * nPrimitives);
+        deferredSubtrees->push_back(std::move(subtree));
         return;
     }
 
@@ -177,28 +282,12 @@ void KdTreeAccel::buildTree(int nodeNum, const Bounds3f &nodeBounds,
     int retries = 0;
 retrySplit:
 
-    // Initialize edges for _axis_
-    for (int i = 0; i < nPrimitives; ++i) {
-        size_t pn = primNums[i];
-        const Bounds3f &bounds = allPrimBounds[pn];
-        edges[axis][2 * i] = BoundEdge(bounds.pMin[axis], pn, true);
-        edges[axis][2 * i + 1] = BoundEdge(bounds.pMax[axis], pn, false);
-    }
-
-    // Sort _edges_ for _axis_
-    std::sort(&edges[axis][0], &edges[axis][2 * nPrimitives],
-              [](const BoundEdge &e0, const BoundEdge &e1) -> bool {
-                  if (e0.t == e1.t)
-                      return (int)e0.type < (int)e1.type;
-                  else
-                      return e0.t < e1.t;
-              });
-
     // Compute cost of all splits for _axis_ to find best
-    size_t nBelow = 0, nAbove = nPrimitives;
+    const BoundEdge *edges = axisEdges(axis);
+    int nBelow = 0, nAbove = nPrimitives;
     for (int i = 0; i < 2 * nPrimitives; ++i) {
-        if (edges[axis][i].type == EdgeType::End) --nAbove;
-        Float edgeT = edges[axis][i].t;
+        if (edges[i].type == EdgeType::End) --nAbove;
+        Float edgeT = edges[i].t;
         if (edgeT > nodeBounds.pMin[axis] && edgeT < nodeBounds.pMax[axis]) {
             // Compute cost for split at _i_th edge
 
@@ -224,7 +313,7 @@ retrySplit:
                 bestOffset = i;
             }
         }
-        if (edges[axis][i].type == EdgeType::Start) ++nBelow;
+        if (edges[i].type == EdgeType::Start) ++nBelow;
     }
     CHECK(nBelow == nPrimitives && nAbove == 0);
 
@@ -237,33 +326,58 @@ retrySplit:
     if (bestCost > oldCost) ++badRefines;
     if ((bestCost > 4 * oldCost && nPrimitives < 16) || bestAxis == -1 ||
         badRefines == 3) {
-        nodes[nodeNum].InitLeaf(primNums, nPrimitives, &primitiveIndices);
+        tree->nodes[nodeNum].InitLeaf(axisEdges(0), nPrimitives,
+                                      &tree->primitiveIndices);
         return;
     }
 
     // Classify primitives with respect to split
+    edges = axisEdges(bestAxis);
+    Float tSplit = edges[bestOffset].t;
+    for (int i = 0; i < 2 * nPrimitives; ++i) primSides[edges[i].primNum] = 0;
     int n0 = 0, n1 = 0;
     for (int i = 0; i < bestOffset; ++i)
-        if (edges[bestAxis][i].type == EdgeType::Start)
-            prims0[n0++] = edges[bestAxis][i].primNum;
+        if (edges[i].type == EdgeType::Start) {
+            primSides[edges[i].primNum] |= 1;
+            ++n0;
+        }
     for (int i = bestOffset + 1; i < 2 * nPrimitives; ++i)
-        if (edges[bestAxis][i].type == EdgeType::End)
-            prims1[n1++] = edges[bestAxis][i].primNum;
+        if (edges[i].type == EdgeType::End) {
+            primSides[edges[i].primNum] |= 2;
+            ++n1;
+        }
+
+    // Distribute the node's edges to its children, keeping them sorted; the
+    // above child's go first so that the below child, which is built
+    // first, can use the space after its own for its descendants
+    size_t aboveOffset = edgeOffset + 6 * size_t(nPrimitives);
+    size_t belowOffset = aboveOffset + 6 * size_t(n1);
+    if (edgeStack.size() < belowOffset + 6 * size_t(n0))
+        edgeStack.resize(belowOffset + 6 * size_t(n0));
+    for (int a = 0; a < 3; ++a) {
+        const BoundEdge *e = axisEdges(a);
+        BoundEdge *below = edgeStack.data() + belowOffset + 2 * a * size_t(n0);
+        BoundEdge *above = edgeStack.data() + aboveOffset + 2 * a * size_t(n1);
+        for (int i = 0; i < 2 * nPrimitives; ++i) {
+            if (primSides[e[i].primNum] & 1) *below++ = e[i];
+            if (primSides[e[i].primNum] & 2) *above++ = e[i];
+        }
+    }
 
     // Recursively initialize children nodes
-    Float tSplit = edges[bestAxis][bestOffset].t;
     Bounds3f bounds0 = nodeBounds, bounds1 = nodeBounds;
     bounds0.pMax[bestAxis] = bounds1.pMin[bestAxis] = tSplit;
-    buildTree(nodeNum + 1, bounds0, allPrimBounds, prims0, n0, depth - 1, edges,
-              prims0, prims1 + nPrimitives, badRefines);
-    int aboveChild = nextFreeNode;
-    nodes[nodeNum].InitInterior(bestAxis, aboveChild, tSplit);
-    buildTree(aboveChild, bounds1, allPrimBounds, prims1, n1, depth - 1, edges,
-              prims0, prims1 + nPrimitives, badRefines);
+    buildTree(tree, bounds0, edgeStack, belowOffset, n0, depth - 1, primSides,
+              deferredSubtrees, badRefines);
+    int aboveChild = tree->nodes.size();
+    tree->nodes[nodeNum].InitInterior(bestAxis, aboveChild, tSplit);
+    buildTree(tree, bounds1, edgeStack, aboveOffset, n1, depth - 1, primSides,
+              deferredSubtrees, badRefines);
 }
 
 bool KdTreeAccel::Intersect(const Ray &ray, SurfaceInteraction *isect) const {
     ProfilePhase p(Prof::AccelIntersect);
+    ++raysTraversed;
     // Compute initial parametric range of ray inside kd-tree extent
     Float tMin, tMax;
     if (!bounds.IntersectP(ray, &tMin, &tMax)) {
@@ -282,6 +396,7 @@ bool KdTreeAccel::Intersect(const Ray &ray, SurfaceInteraction *isect) const {
     while (node != nullptr) {
         // Bail out if we found a hit closer than the current node
         if (ray.tMax < tMin) break;
+        ++nodesVisited;
         if (!node->IsLeaf()) {
             // Process kd-tree interior node
 
@@ -347,12 +462,13 @@ bool KdTreeAccel::Intersect(const Ray &ray, SurfaceInteraction *isect) const {
     return hit;
 }
 
-bool KdTreeAccel::IntersectP(const Ray &ray) const {
+const Primitive *KdTreeAccel::FindOccluder(const Ray &ray) const {
     ProfilePhase p(Prof::AccelIntersectP);
+    ++raysTraversed;
     // Compute initial parametric range of ray inside kd-tree extent
     Float tMin, tMax;
     if (!bounds.IntersectP(ray, &tMin, &tMax)) {
-        return false;
+        return nullptr;
     }
 
     // Prepare to traverse kd-tree for ray
@@ -362,6 +478,7 @@ bool KdTreeAccel::IntersectP(const Ray &ray) const {
     int todoPos = 0;
     const KdAccelNode *node = &nodes[0];
     while (node != nullptr) {
+        ++nodesVisited;
         if (node->IsLeaf()) {
             // Check for shadow ray intersections inside leaf node
             int nPrimitives = node->nPrimitives();
@@ -369,7 +486,7 @@ bool KdTreeAccel::IntersectP(const Ray &ray) const {
                 const std::shared_ptr<Primitive> &p =
                     primitives[node->onePrimitive];
                 if (p->IntersectP(ray)) {
-                    return true;
+                    return p.get();
                 }
             } else {
                 for (int i = 0; i < nPrimitives; ++i) {
@@ -378,7 +495,7 @@ bool KdTreeAccel::IntersectP(const Ray &ray) const {
                     const std::shared_ptr<Primitive> &prim =
                         primitives[primitiveIndex];
                     if (prim->IntersectP(ray)) {
-                        return true;
+                        return prim.get();
                     }
                 }
             }
@@ -427,7 +544,11 @@ bool KdTreeAccel::IntersectP(const Ray &ray) const {
             }
         }
     }
-    return false;
+    return nullptr;
+}
+
+bool KdTreeAccel::IntersectP(const Ray &ray) const {
+    return FindOccluder(ray) != nullptr;
 }
 
 std::shared_ptr<KdTreeAccel> CreateKdTreeAccelerator(
@@ -47,6 +47,8 @@ namespace pbrt {
 // KdTreeAccel Declarations
 struct KdAccelNode;
 struct BoundEdge;
+struct KdSubtree;
+struct KdSubtreeBuild;
 class KdTreeAccel : public Aggregate {
   public:
     // KdTreeAccel Public Methods
@@ -57,14 +59,15 @@ class KdTreeAccel : public Aggregate {
     ~KdTreeAccel();
     bool Intersect(const Ray &ray, SurfaceInteraction *isect) const;
     bool IntersectP(const Ray &ray) const;
+    const Primitive *FindOccluder(const Ray &ray) const;
 
   private:
     // KdTreeAccel Private Methods
-    void buildTree(int nodeNum, const Bounds3f &bounds,
-                   const std::vector<Bounds3f> &primBounds, size_t *primNums,
-                   size_t nprims, int depth,
-                   const std::unique_ptr<BoundEdge[]> edges[3], size_t *prims0,
-                   size_t *prims1, int badRefines = 0);
+    void buildTree(KdSubtree *tree, const Bounds3f &bounds,
+                   std::vector<BoundEdge> &edgeStack, size_t edgeOffset,
+                   int nPrimitives, int depth, uint8_t *primSides,
+                   std::vector<KdSubtreeBuild> *deferredSubtrees = nullptr,
+                   int badRefines = 0);
 
     // KdTreeAccel Private Data
     const int isectCost, traversalCost, maxPrims;
@@ -72,7 +75,6 @@ class KdTreeAccel : public Aggregate {
     std::vector<std::shared_ptr<Primitive>> primitives;
     std::vector<size_t> primitiveIndices;
     KdAccelNode *nodes;
-    int nAllocedNodes, nextFreeNode;
     Bounds3f bounds;
 };
 
@@ -0,0 +1,171 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+
+// accelerators/meshprimitive.cpp*
+#include "accelerators/meshprimitive.h"
+#include "interaction.h"
+#include "shapes/triangle.h"
+#include "stats.h"
+#include <algorithm>
+
+namespace pbrt {
+
+STAT_MEMORY_COUNTER("Memory/Mesh primitive BVHs", meshBVHBytes);
+STAT_RATIO("Scene/Triangles per mesh primitive", nMeshPrimitiveTris,
+           nMeshPrimitives);
+
+// MeshPrimitive Method Definitions
+MeshPrimitive::MeshPrimitive(const std::shared_ptr<TriangleMesh> &mesh,
+                             const std::shared_ptr<Shape> &shape,
+                             const std::shared_ptr<Material> &material,
+                             const MediumInterface &mediumInterface,
+                             int maxTrisInNode)
+    : mesh(mesh),
+      shape(shape),
+      material(material),
+      mediumInterface(mediumInterface),
+      maxTrisInNode(std::min(255, maxTrisInNode)) {
+    ++nMeshPrimitives;
+    nMeshPrimitiveTris += mesh->nTriangles;
+    if (mesh->nTriangles == 0) return;
+
+    // Compute the bounds and centroid of each triangle
+    std::vector<CompactBVHItemInfo> triangleInfo(mesh->nTriangles);
+    triangles.resize(mesh->nTriangles);
+    for (int i = 0; i < mesh->nTriangles; ++i) {
+        int v[3];
+        mesh->GetVertexIndices(i, v);
+        triangleInfo[i].bounds =
+            Union(Bounds3f(mesh->p[v[0]], mesh->p[v[1]]), mesh->p[v[2]]);
+        triangleInfo[i].centroid = .5f * triangleInfo[i].bounds.pMin +
+                                   .5f * triangleInfo[i].bounds.pMax;
+        triangles[i] = i;
+    }
+
+    // Build the BVH over the triangles' indices in depth-first order
+    nodes.reserve(2 * mesh->nTriangles / std::max(1, maxTrisInNode / 2));
+    BuildCompactBVH(nodes, triangleInfo, triangles, 0, mesh->nTriangles,
+                    maxTrisInNode);
+    nodes.shrink_to_fit();
+    meshBVHBytes += sizeof(*this) + nodes.size() * sizeof(CompactBVHNode) +
+                    triangles.size() * sizeof(int);
+}
+
+MeshPrimitive::~MeshPrimitive() {}
+
+size_t MeshPrimitive::BytesUsed() const {
+    return sizeof(*this) + nodes.capacity() * sizeof(CompactBVHNode) +
+           triangles.capacity() * sizeof(int) + mesh->BytesUsed();
+}
+
+Bounds3f MeshPrimitive::WorldBound() const {
+    return nodes.empty() ? Bounds3f() : nodes[0].bounds;
+}
+
+bool MeshPrimitive::Intersect(const Ray &ray,
+                              SurfaceInteraction *isect) const {
+    if (nodes.empty()) return false;
+    ProfilePhase p(Prof::AccelIntersect);
+    bool hit = false;
+    // Follow ray through BVH nodes to find triangle intersections
+    TraverseCompactBVH(nodes, ray, [&](int offset, int count) {
+        for (int i = 0; i < count; ++i) {
+            Float tHit;
+            if (IntersectTriangle(*mesh, triangles[offset + i], shape.get(),
+                                  ray, &tHit, isect)) {
+                ray.tMax = tHit;
+                hit = true;
+            }
+        }
+        return false;
+    });
+    if (!hit) return false;
+
+    // Initialize the parts of _isect_ that a _GeometricPrimitive_ would
+    isect->primitive = this;
+    CHECK_GE(Dot(isect->n, isect->shading.n), 0.);
+    if (mediumInterface.IsMediumTransition())
+        isect->mediumInterface = mediumInterface;
+    else
+        isect->mediumInterface = MediumInterface(ray.medium);
+    return true;
+}
+
+bool MeshPrimitive::IntersectP(const Ray &ray) const {
+    if (nodes.empty()) return false;
+    ProfilePhase p(Prof::AccelIntersectP);
+    bool hit = false;
+    TraverseCompactBVH(nodes, ray, [&](int offset, int count) {
+        for (int i = 0; i < count; ++i)
+            if (IntersectPTriangle(*mesh, triangles[offset + i], shape.get(),
+                                   ray))
+                return hit = true;
+        return false;
+    });
+    return hit;
+}
+
+void MeshPrimitive::ComputeScatteringFunctions(
+    SurfaceInteraction *isect, MemoryArena &arena, TransportMode mode,
+    bool allowMultipleLobes) const {
+    ProfilePhase p(Prof::ComputeScatteringFuncs);
+    if (material)
+        material->ComputeScatteringFunctions(isect, arena, mode,
+                                             allowMultipleLobes);
+    CHECK_GE(Dot(isect->n, isect->shading.n), 0.);
+}
+
+std::shared_ptr<MeshPrimitive> CreateMeshPrimitive(
+    std::vector<std::shared_ptr<Shape>> &shapes,
+    const std::shared_ptr<Material> &material,
+    const MediumInterface &mediumInterface) {
+    // Make sure that _shapes_ are all of the triangles of one mesh
+    if (shapes.empty()) return nullptr;
+    const Triangle *first = dynamic_cast<const Triangle *>(shapes[0].get());
+    if (!first) return nullptr;
+    std::shared_ptr<TriangleMesh> mesh = first->GetMesh();
+    if (mesh->nTriangles != (int)shapes.size()) return nullptr;
+    for (const auto &s : shapes) {
+        const Triangle *tri = dynamic_cast<const Triangle *>(s.get());
+        if (!tri || tri->GetMesh() != mesh) return nullptr;
+    }
+
+    // Free the other triangles before building the mesh's BVH
+    std::shared_ptr<Shape> shape = shapes[0];
+    shapes.clear();
+    shapes.shrink_to_fit();
+    return std::make_shared<MeshPrimitive>(mesh, shape, material,
+                                           mediumInterface);
+}
+
+}  // namespace pbrt
@@ -0,0 +1,99 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+#if defined(_MSC_VER)
+#define NOMINMAX
+#pragma once
+#endif
+
+#ifndef PBRT_ACCELERATORS_MESHPRIMITIVE_H
+#define PBRT_ACCELERATORS_MESHPRIMITIVE_H
+
+// accelerators/meshprimitive.h*
+#include "pbrt.h"
+#include "primitive.h"
+#include "accelerators/compactbvh.h"
+
+namespace pbrt {
+
+// MeshPrimitive Forward Declarations
+struct TriangleMesh;
+
+// MeshPrimitive Declarations
+// _MeshPrimitive_ holds all of the triangles of a _TriangleMesh_ with a
+// single material. Its BVH refers to triangles by their index in the mesh,
+// so no _Triangle_ or _GeometricPrimitive_ is needed for each one; the
+// triangles cost only the BVH's nodes and a 4-byte index apiece.
+class MeshPrimitive : public Primitive {
+  public:
+    // MeshPrimitive Public Methods
+    MeshPrimitive(const std::shared_ptr<TriangleMesh> &mesh,
+                  const std::shared_ptr<Shape> &shape,
+                  const std::shared_ptr<Material> &material,
+                  const MediumInterface &mediumInterface,
+                  int maxTrisInNode = 4);
+    ~MeshPrimitive();
+    // Returns the memory used by the primitive and its mesh.
+    size_t BytesUsed() const;
+    Bounds3f WorldBound() const;
+    bool Intersect(const Ray &r, SurfaceInteraction *isect) const;
+    bool IntersectP(const Ray &r) const;
+    const AreaLight *GetAreaLight() const { return nullptr; }
+    const Material *GetMaterial() const { return material.get(); }
+    void ComputeScatteringFunctions(SurfaceInteraction *isect,
+                                    MemoryArena &arena, TransportMode mode,
+                                    bool allowMultipleLobes) const;
+
+  private:
+    // MeshPrimitive Private Data
+    std::shared_ptr<TriangleMesh> mesh;
+    // One of the mesh's _Triangle_s; it's stored in _SurfaceInteraction_s
+    // for all of them and gives their orientation.
+    std::shared_ptr<Shape> shape;
+    std::shared_ptr<Material> material;
+    MediumInterface mediumInterface;
+    const int maxTrisInNode;
+    std::vector<CompactBVHNode> nodes;
+    std::vector<int> triangles;
+};
+
+// Returns a _MeshPrimitive_ for _shapes_ if they are all of the triangles
+// of a single mesh, in which case _shapes_ is cleared, and _nullptr_
+// otherwise.
+std::shared_ptr<MeshPrimitive> CreateMeshPrimitive(
+    std::vector<std::shared_ptr<Shape>> &shapes,
+    const std::shared_ptr<Material> &material,
+    const MediumInterface &mediumInterface);
+
+}  // namespace pbrt
+
+#endif  // PBRT_ACCELERATORS_MESHPRIMITIVE_H
@@ -42,7 +42,10 @@
 
 // API Additional Headers
 #include "accelerators/bvh.h"
+#include "accelerators/curveprimitive.h"
+#include "accelerators/deferredprimitive.h"
 #include "accelerators/kdtreeaccel.h"
+#include "accelerators/meshprimitive.h"
 #include "cameras/environment.h"
 #include "cameras/orthographic.h"
 #include "cameras/perspective.h"
@@ -87,6 +90,7 @@
 #include "samplers/sobol.h"
 #include "samplers/stratified.h"
 #include "samplers/zerotwosequence.h"
+#include "shapes/bilinear.h"
 #include "shapes/cone.h"
 #include "shapes/curve.h"
 #include "shapes/cylinder.h"
@@ -171,6 +175,17 @@ struct RenderOptions {
     ParamSet SamplerParams;
     std::string AcceleratorName = "bvh";
     ParamSet AcceleratorParams;
+    // Accelerator parameters that are used when shapes are turned into
+    // primitives rather than by _MakeAccelerator()_; _pbrtAccelerator()_
+    // reads them. They request that meshes' triangles be held by a single
+    // _MeshPrimitive_ ("meshprimitives"), that static curves be gathered
+    // into _CurvePrimitive_s ("curveprimitives"), and that tessellation of
+    // static "loopsubdiv" and "nurbs" shapes be deferred until rays reach
+    // them ("deferredtessellation"), with the tessellations kept in a
+    // cache of _geometryCacheBytes_ ("geometrycachemb").
+    bool useMeshPrimitives = false, useCurvePrimitives = false;
+    bool useDeferredTessellation = false;
+    size_t geometryCacheBytes = size_t(1024) * 1024 * 1024;
     std::string IntegratorName = "path";
     ParamSet IntegratorParams;
     std::string CameraName = "perspective";
@@ -182,6 +197,18 @@ struct RenderOptions {
     std::map<std::string, std::vector<std::shared_ptr<Primitive>>> instances;
     std::vector<std::shared_ptr<Primitive>> *currentInstance = nullptr;
     bool haveScatteringMedia = false;
+
+    // Curves that are being gathered into a single _CurvePrimitive_; see
+    // _FlushCurves()_.
+    struct CurveBatch {
+        std::unique_ptr<CurveArray> curves;
+        const Transform *ObjectToWorld = nullptr, *WorldToObject = nullptr;
+        bool reverseOrientation = false;
+        std::shared_ptr<Material> material;
+        MediumInterface mediumInterface;
+        std::vector<std::shared_ptr<Primitive>> *destination = nullptr;
+    };
+    CurveBatch pendingCurves;
 };
 
 // MaterialInstance represents both an instance of a material as well as
@@ -373,6 +400,7 @@ static std::vector<GraphicsState> pushedGraphicsStates;
 static std::vector<TransformSet> pushedTransforms;
 static std::vector<uint32_t> pushedActiveTransformBits;
 static TransformCache transformCache;
+static WorldEndCallback worldEndCallback;
 int catIndentCount = 0;
 
 // API Forward Declarations
@@ -519,7 +547,10 @@ std::vector<std::shared_ptr<Shape>> MakeShapes(const std::string &name,
             shapes = CreateTriangleMeshShape(object2world, world2object,
                                              reverseOrientation, paramSet,
                                              &*graphicsState.floatTextures);
-    } else if (name == "plymesh")
+    } else if (name == "bilinearmesh")
+        shapes = CreateBilinearPatchMeshShape(object2world, world2object,
+                                              reverseOrientation, paramSet);
+    else if (name == "plymesh")
         shapes = CreatePLYMesh(object2world, world2object, reverseOrientation,
                                paramSet, &*graphicsState.floatTextures);
     else if (name == "heightfield")
@@ -771,6 +802,91 @@ std::shared_ptr<AreaLight> MakeAreaLight(const std::string &name,
     return area;
 }
 
+// Creates a _CurvePrimitive_ for the curves gathered by _AddCurves()_, if
+// any, and adds it where the curves were declared.
+static void FlushCurves() {
+    RenderOptions::CurveBatch &batch = renderOptions->pendingCurves;
+    if (!batch.curves) return;
+    batch.destination->push_back(std::make_shared<CurvePrimitive>(
+        std::move(batch.curves), batch.ObjectToWorld, batch.WorldToObject,
+        batch.reverseOrientation, batch.material, batch.mediumInterface));
+    batch = RenderOptions::CurveBatch();
+}
+
+// Adds the "curve" shape described by _params_ to the pending batch of
+// curves, first flushing the batch if the shape doesn't share its
+// transformation, material, medium and curve type.
+static void AddCurves(const Transform *ObjToWorld, const Transform *WorldToObj,
+                      const ParamSet &params) {
+    CurveDescription curve;
+    if (!GetCurveDescription(params, &curve)) return;
+    std::shared_ptr<Material> mtl = graphicsState.GetMaterialForShape(params);
+    params.ReportUnused();
+    MediumInterface mi = graphicsState.CreateMediumInterface();
+    std::vector<std::shared_ptr<Primitive>> *destination =
+        renderOptions->currentInstance ? renderOptions->currentInstance
+                                       : &renderOptions->primitives;
+
+    RenderOptions::CurveBatch &batch = renderOptions->pendingCurves;
+    if (batch.curves &&
+        (batch.ObjectToWorld != ObjToWorld ||
+         batch.reverseOrientation != graphicsState.reverseOrientation ||
+         batch.material != mtl ||
+         batch.mediumInterface.inside != mi.inside ||
+         batch.mediumInterface.outside != mi.outside ||
+         batch.curves->type != curve.type ||
+         batch.curves->splitDepth != curve.splitDepth ||
+         batch.destination != destination))
+        FlushCurves();
+    if (!batch.curves) {
+        batch.curves.reset(new CurveArray(curve.type, curve.splitDepth));
+        batch.ObjectToWorld = ObjToWorld;
+        batch.WorldToObject = WorldToObj;
+        batch.reverseOrientation = graphicsState.reverseOrientation;
+        batch.material = mtl;
+        batch.mediumInterface = mi;
+        batch.destination = destination;
+    }
+    batch.curves->Add(curve);
+}
+
+// Adds a _DeferredPrimitive_ for the shape _name_ described by _params_.
+// Returns false if the shape should be created right away instead.
+static bool AddDeferredShape(const std::string &name,
+                             const Transform *ObjToWorld,
+                             const Transform *WorldToObj,
+                             const ParamSet &params) {
+    Bounds3f objectBound;
+    std::function<std::vector<std::shared_ptr<Shape>>()> tessellate;
+    if (name == "loopsubdiv")
+        tessellate = DeferLoopSubdiv(ObjToWorld, WorldToObj,
+                                     graphicsState.reverseOrientation, params,
+                                     &objectBound);
+    else if (name == "nurbs")
+        tessellate =
+            DeferNURBS(ObjToWorld, WorldToObj,
+                       graphicsState.reverseOrientation, params, &objectBound);
+    else
+        return false;
+    // Invalid parameters have already been reported
+    if (!tessellate) return true;
+    // Without a bound, the shape can't be deferred
+    if (objectBound.pMin.x > objectBound.pMax.x) return false;
+
+    std::shared_ptr<Material> mtl = graphicsState.GetMaterialForShape(params);
+    params.ReportUnused();
+    MediumInterface mi = graphicsState.CreateMediumInterface();
+    GetGeometryCache().SetMaxBytes(renderOptions->geometryCacheBytes);
+    std::shared_ptr<Primitive> prim = std::make_shared<DeferredPrimitive>(
+        std::move(tessellate), (*ObjToWorld)(objectBound), ObjToWorld,
+        WorldToObj, graphicsState.reverseOrientation, mtl, mi);
+    if (renderOptions->currentInstance)
+        renderOptions->currentInstance->push_back(prim);
+    else
+        renderOptions->primitives.push_back(prim);
+    return true;
+}
+
 std::shared_ptr<Primitive> MakeAccelerator(
     const std::string &name,
     std::vector<std::shared_ptr<Primitive>> prims,
@@ -1059,6 +1175,15 @@ void pbrtAccelerator(const std::string &name, const ParamSet &params) {
     VERIFY_OPTIONS("Accelerator");
     renderOptions->AcceleratorName = name;
     renderOptions->AcceleratorParams = params;
+    renderOptions->useMeshPrimitives =
+        params.FindOneBool("meshprimitives", false);
+    renderOptions->useCurvePrimitives =
+        params.FindOneBool("curveprimitives", false);
+    renderOptions->useDeferredTessellation =
+        params.FindOneBool("deferredtessellation", false);
+    renderOptions->geometryCacheBytes =
+        size_t(std::max<Int>(params.FindOneInt("geometrycachemb", 1024), 0)) *
+        1024 * 1024;
     if (PbrtOptions.cat || PbrtOptions.toPly) {
         printf("%*sAccelerator \"%s\" ", catIndentCount, "", name.c_str());
         params.Print(catIndentCount);
@@ -1346,6 +1471,18 @@ void pbrtShape(const std::string &name, const ParamSet &params) {
         // Create shapes for shape _name_
         Transform *ObjToWorld = transformCache.Lookup(curTransform[0]);
         Transform *WorldToObj = transformCache.Lookup(Inverse(curTransform[0]));
+        if (name == "curve" && graphicsState.areaLight == "" &&
+            !(PbrtOptions.cat || PbrtOptions.toPly) &&
+            renderOptions->useCurvePrimitives) {
+            AddCurves(ObjToWorld, WorldToObj, params);
+            return;
+        }
+        if ((name == "loopsubdiv" || name == "nurbs") &&
+            graphicsState.areaLight == "" &&
+            !(PbrtOptions.cat || PbrtOptions.toPly) &&
+            renderOptions->useDeferredTessellation &&
+            AddDeferredShape(name, ObjToWorld, WorldToObj, params))
+            return;
         std::vector<std::shared_ptr<Shape>> shapes =
             MakeShapes(name, ObjToWorld, WorldToObj,
                        graphicsState.reverseOrientation, params);
@@ -1353,6 +1490,10 @@ void pbrtShape(const std::string &name, const ParamSet &params) {
         std::shared_ptr<Material> mtl = graphicsState.GetMaterialForShape(params);
         params.ReportUnused();
         MediumInterface mi = graphicsState.CreateMediumInterface();
+        std::shared_ptr<Primitive> meshPrim;
+        if (graphicsState.areaLight == "" && renderOptions->useMeshPrimitives)
+            meshPrim = CreateMeshPrimitive(shapes, mtl, mi);
+        if (meshPrim) prims.push_back(meshPrim);
         prims.reserve(shapes.size());
         for (auto s : shapes) {
             // Possibly create area light for shape
@@ -1382,6 +1523,10 @@ void pbrtShape(const std::string &name, const ParamSet &params) {
         std::shared_ptr<Material> mtl = graphicsState.GetMaterialForShape(params);
         params.ReportUnused();
         MediumInterface mi = graphicsState.CreateMediumInterface();
+        std::shared_ptr<Primitive> meshPrim;
+        if (renderOptions->useMeshPrimitives)
+            meshPrim = CreateMeshPrimitive(shapes, mtl, mi);
+        if (meshPrim) prims.push_back(meshPrim);
         prims.reserve(shapes.size());
         for (auto s : shapes)
             prims.push_back(
@@ -1526,6 +1671,7 @@ void pbrtObjectBegin(const std::string &name) {
     pbrtAttributeBegin();
     if (renderOptions->currentInstance)
         Error("ObjectBegin called inside of instance definition");
+    FlushCurves();
     renderOptions->instances[name] = std::vector<std::shared_ptr<Primitive>>();
     renderOptions->currentInstance = &renderOptions->instances[name];
     if (PbrtOptions.cat || PbrtOptions.toPly)
@@ -1538,6 +1684,7 @@ void pbrtObjectEnd() {
     VERIFY_WORLD("ObjectEnd");
     if (!renderOptions->currentInstance)
         Error("ObjectEnd called outside of instance definition");
+    FlushCurves();
     renderOptions->currentInstance = nullptr;
     pbrtAttributeEnd();
     ++nObjectInstancesCreated;
@@ -1578,19 +1725,31 @@ void pbrtObjectInstance(const std::string &name) {
     }
     static_assert(MaxTransforms == 2,
                   "TransformCache assumes only two transforms");
-    // Create _animatedInstanceToWorld_ transform for instance
+    // Create _Primitive_ that places the instance with its transformation
     Transform *InstanceToWorld[2] = {
         transformCache.Lookup(curTransform[0]),
         transformCache.Lookup(curTransform[1])
     };
-    AnimatedTransform animatedInstanceToWorld(
-        InstanceToWorld[0], renderOptions->transformStartTime,
-        InstanceToWorld[1], renderOptions->transformEndTime);
-    std::shared_ptr<Primitive> prim(
-        std::make_shared<TransformedPrimitive>(in[0], animatedInstanceToWorld));
+    std::shared_ptr<Primitive> prim;
+    if (*InstanceToWorld[0] == *InstanceToWorld[1] &&
+        InstanceToWorld[0]->IsAffine())
+        // Use the compact representation for instances that don't move
+        prim = std::make_shared<StaticTransformedPrimitive>(
+            in[0], *InstanceToWorld[0]);
+    else {
+        AnimatedTransform animatedInstanceToWorld(
+            InstanceToWorld[0], renderOptions->transformStartTime,
+            InstanceToWorld[1], renderOptions->transformEndTime);
+        prim = std::make_shared<TransformedPrimitive>(in[0],
+                                                      animatedInstanceToWorld);
+    }
     renderOptions->primitives.push_back(prim);
 }
 
+void pbrtSetWorldEndCallback(WorldEndCallback callback) {
+    worldEndCallback = std::move(callback);
+}
+
 void pbrtWorldEnd() {
     VERIFY_WORLD("WorldEnd");
     // Ensure there are no pushed graphics states
@@ -1603,10 +1762,20 @@ void pbrtWorldEnd() {
         Warning("Missing end to pbrtTransformBegin()");
         pushedTransforms.pop_back();
     }
+    FlushCurves();
 
     // Create scene and render
     if (PbrtOptions.cat || PbrtOptions.toPly) {
         printf("%*sWorldEnd\n", catIndentCount, "");
+    } else if (worldEndCallback) {
+        std::unique_ptr<Camera> camera(renderOptions->MakeCamera());
+        if (camera)
+            worldEndCallback(*camera, renderOptions->primitives,
+                             renderOptions->lights,
+                             renderOptions->AcceleratorName,
+                             renderOptions->AcceleratorParams);
+        else
+            Error("Unable to create camera");
     } else {
         std::unique_ptr<Integrator> integrator(renderOptions->MakeIntegrator());
         std::unique_ptr<Scene> scene(renderOptions->MakeScene());
@@ -40,6 +40,7 @@
 
 // core/api.h*
 #include "pbrt.h"
+#include <functional>
 
 namespace pbrt {
 
@@ -88,6 +89,15 @@ void pbrtObjectEnd();
 void pbrtObjectInstance(const std::string &name);
 void pbrtWorldEnd();
 
+// If a callback is set, pbrtWorldEnd() passes it the scene's camera,
+// primitives, lights and accelerator settings instead of building the
+// scene and rendering it; this lets tools work with parsed scenes.
+using WorldEndCallback = std::function<void(
+    const Camera &camera, std::vector<std::shared_ptr<Primitive>> &primitives,
+    std::vector<std::shared_ptr<Light>> &lights,
+    const std::string &acceleratorName, const ParamSet &acceleratorParams)>;
+void pbrtSetWorldEndCallback(WorldEndCallback callback);
+
 void pbrtParseFile(std::string filename);
 void pbrtParseString(std::string str);
 
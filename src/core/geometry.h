@@ -1030,6 +1030,41 @@ inline void CoordinateSystem(const Vector3<T> &v1, Vector3<T> *v2,
     *v3 = Cross(v1, *v2);
 }
 
+// Encodes the direction of _v_ in 32 bits using the octahedral mapping,
+// with 16 bits for each coordinate; _DecodeOctahedral()_ returns a unit
+// vector within about 0.005 degrees of it. Zero vectors have no direction
+// and encode as $+z$; callers that need to preserve them must not encode
+// them.
+inline uint32_t EncodeOctahedral(const Vector3f &v) {
+    if (v.x == 0 && v.y == 0 && v.z == 0)
+        return EncodeOctahedral(Vector3f(0, 0, 1));
+    Float invL1Norm = 1 / (std::abs(v.x) + std::abs(v.y) + std::abs(v.z));
+    Float x = v.x * invL1Norm, y = v.y * invL1Norm;
+    if (v.z < 0) {
+        // Fold the lower hemisphere over the diagonals
+        Float xFolded = (1 - std::abs(y)) * std::copysign(Float(1), x);
+        y = (1 - std::abs(x)) * std::copysign(Float(1), y);
+        x = xFolded;
+    }
+    auto encode = [](Float f) {
+        return (uint32_t)std::round(Clamp((f + 1) / 2, 0, 1) * 65535);
+    };
+    return encode(x) | (encode(y) << 16);
+}
+
+inline Vector3f DecodeOctahedral(uint32_t e) {
+    Vector3f v(-1 + 2 * (Float)(e & 0xffff) / 65535,
+               -1 + 2 * (Float)(e >> 16) / 65535, 0);
+    v.z = 1 - (std::abs(v.x) + std::abs(v.y));
+    if (v.z < 0) {
+        // Unfold the lower hemisphere
+        Float xUnfolded = (1 - std::abs(v.y)) * std::copysign(Float(1), v.x);
+        v.y = (1 - std::abs(v.x)) * std::copysign(Float(1), v.y);
+        v.x = xUnfolded;
+    }
+    return Normalize(v);
+}
+
 template <typename T>
 Vector2<T>::Vector2(const Point2<T> &p)
     : x(p.x), y(p.y) {
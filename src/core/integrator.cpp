@@ -145,7 +145,7 @@ Spectrum EstimateDirect(const Interaction &it, const Point2f &uScattering,
                 Li *= visibility.Tr(scene, sampler);
                 VLOG(2) << "  after Tr, Li: " << Li;
             } else {
-              if (!visibility.Unoccluded(scene)) {
+              if (!visibility.Unoccluded(scene, light)) {
                 VLOG(2) << "  shadow ray blocked";
                 Li = Spectrum(0.f);
               } else
@@ -232,6 +232,164 @@ std::unique_ptr<Distribution1D> ComputeLightPowerDistribution(
 }
 
 // SamplerIntegrator Method Definitions
+Spectrum SamplerIntegrator::LiFromIntersection(const RayDifferential &ray,
+                                               SurfaceInteraction *isect,
+                                               const Scene &scene,
+                                               Sampler &sampler,
+                                               MemoryArena &arena) const {
+    return Li(ray, scene, sampler, arena);
+}
+
+Float SamplerIntegrator::GenerateCameraRay(Sampler &sampler,
+                                           const Point2i &pixel,
+                                           CameraSample *cameraSample,
+                                           RayDifferential *ray) const {
+    *cameraSample = sampler.GetCameraSample(pixel);
+    Float rayWeight = camera->GenerateRayDifferential(*cameraSample, ray);
+    ray->ScaleDifferentials(1 / std::sqrt((Float)sampler.samplesPerPixel));
+    ++nCameraRays;
+    return rayWeight;
+}
+
+void SamplerIntegrator::AddSample(FilmTile *filmTile, const Point2i &pixel,
+                                  const Sampler &sampler,
+                                  const CameraSample &cameraSample,
+                                  const RayDifferential &ray, Spectrum L,
+                                  Float rayWeight) const {
+    // Issue warning if unexpected radiance value returned
+    if (L.HasNaNs()) {
+        LOG(ERROR) << StringPrintf(
+            "Not-a-number radiance value returned "
+            "for pixel (%d, %d), sample %d. Setting to black.",
+            pixel.x, pixel.y, (int)sampler.CurrentSampleNumber());
+        L = Spectrum(0.f);
+    } else if (L.y() < -1e-5) {
+        LOG(ERROR) << StringPrintf(
+            "Negative luminance value, %f, returned "
+            "for pixel (%d, %d), sample %d. Setting to black.",
+            L.y(), pixel.x, pixel.y, (int)sampler.CurrentSampleNumber());
+        L = Spectrum(0.f);
+    } else if (std::isinf(L.y())) {
+        LOG(ERROR) << StringPrintf(
+            "Infinite luminance value returned "
+            "for pixel (%d, %d), sample %d. Setting to black.",
+            pixel.x, pixel.y, (int)sampler.CurrentSampleNumber());
+        L = Spectrum(0.f);
+    }
+    VLOG(1) << "Camera sample: " << cameraSample << " -> ray: " << ray
+            << " -> L = " << L;
+
+    // Add camera ray's contribution to image
+    filmTile->AddSample(cameraSample.pFilm, L, rayWeight);
+}
+
+void SamplerIntegrator::RenderTile(const Scene &scene,
+                                   const Bounds2i &tileBounds,
+                                   Sampler &tileSampler, FilmTile *filmTile,
+                                   MemoryArena &arena) const {
+    // Allocate storage for camera rays that are intersected together
+    bool batchCameraRays = BatchCameraRays();
+    std::vector<CameraSample> batchCameraSamples;
+    std::vector<RayDifferential> batchRays;
+    std::vector<Float> batchRayWeights;
+    std::vector<Ray> batchIntersectRays;
+    std::vector<int> batchIntersectIndex;
+    std::vector<SurfaceInteraction> batchIsects;
+    std::unique_ptr<bool[]> batchHits;
+    if (batchCameraRays) {
+        int64_t spp = tileSampler.samplesPerPixel;
+        batchCameraSamples.resize(spp);
+        batchRays.resize(spp);
+        batchRayWeights.resize(spp);
+        batchIntersectRays.reserve(spp);
+        batchIntersectIndex.resize(spp);
+        batchIsects.resize(spp);
+        batchHits.reset(new bool[spp]);
+    }
+
+    // Loop over pixels in tile to render them
+    for (Point2i pixel : tileBounds) {
+        {
+            ProfilePhase pp(Prof::StartPixel);
+            tileSampler.StartPixel(pixel);
+        }
+
+        // Do this check after the StartPixel() call; this keeps
+        // the usage of RNG values from (most) Samplers that use
+        // RNGs consistent, which improves reproducability /
+        // debugging.
+        if (!InsideExclusive(pixel, pixelBounds))
+            continue;
+
+        if (batchCameraRays) {
+            // Generate camera rays for all of the pixel's samples
+            // and find their intersections with a single call
+            int nSamples = 0;
+            batchIntersectRays.clear();
+            do {
+                batchRayWeights[nSamples] =
+                    GenerateCameraRay(tileSampler, pixel,
+                                      &batchCameraSamples[nSamples],
+                                      &batchRays[nSamples]);
+                batchIntersectIndex[nSamples] = -1;
+                if (batchRayWeights[nSamples] > 0) {
+                    batchIntersectIndex[nSamples] =
+                        batchIntersectRays.size();
+                    batchIntersectRays.push_back(batchRays[nSamples]);
+                }
+                ++nSamples;
+            } while (tileSampler.StartNextSample());
+            scene.IntersectN(batchIntersectRays.data(),
+                             batchIsects.data(), batchHits.get(),
+                             batchIntersectRays.size());
+            tileSampler.SetSampleNumber(0);
+        }
+
+        int sampleIndex = 0;
+        do {
+            // Generate camera ray for current sample
+            CameraSample cameraSample;
+            RayDifferential ray;
+            Float rayWeight;
+            if (batchCameraRays) {
+                // _SetSampleNumber(0)_ reset the sampler to the first
+                // dimension of each sample, so the camera sample must be
+                // drawn again for _Li()_'s samples to come from the same
+                // dimensions as in an unbatched render. The re-drawn
+                // values are discarded: samplers like _RandomSampler_
+                // don't repeat a sample's values when it's revisited,
+                // and the batched rays are the ones already intersected.
+                tileSampler.GetCameraSample(pixel);
+                cameraSample = batchCameraSamples[sampleIndex];
+                ray = batchRays[sampleIndex];
+                rayWeight = batchRayWeights[sampleIndex];
+            } else
+                rayWeight =
+                    GenerateCameraRay(tileSampler, pixel, &cameraSample, &ray);
+
+            // Evaluate radiance along camera ray
+            Spectrum L(0.f);
+            if (rayWeight > 0 && batchCameraRays) {
+                int i = batchIntersectIndex[sampleIndex];
+                ray.tMax = batchIntersectRays[i].tMax;
+                L = LiFromIntersection(
+                    ray, batchHits[i] ? &batchIsects[i] : nullptr,
+                    scene, tileSampler, arena);
+            } else if (rayWeight > 0)
+                L = Li(ray, scene, tileSampler, arena);
+            //std::cout << "integrator radiance L: " << L << std::endl;
+
+            AddSample(filmTile, pixel, tileSampler, cameraSample, ray, L,
+                      rayWeight);
+
+            // Free _MemoryArena_ memory from computing image sample
+            // value
+            arena.Reset();
+            ++sampleIndex;
+        } while (tileSampler.StartNextSample());
+    }
+}
+
 void SamplerIntegrator::Render(const Scene &scene) {
     Preprocess(scene, *sampler);
     // Render image tiles in parallel
@@ -279,72 +437,7 @@ void SamplerIntegrator::Render(const Scene &scene) {
             std::unique_ptr<FilmTile> filmTile =
                 camera->film->GetFilmTile(tileBounds);
 
-            // Loop over pixels in tile to render them
-            for (Point2i pixel : tileBounds) {
-                {
-                    ProfilePhase pp(Prof::StartPixel);
-                    tileSampler->StartPixel(pixel);
-                }
-
-                // Do this check after the StartPixel() call; this keeps
-                // the usage of RNG values from (most) Samplers that use
-                // RNGs consistent, which improves reproducability /
-                // debugging.
-                if (!InsideExclusive(pixel, pixelBounds))
-                    continue;
-
-                do {
-                    // Initialize _CameraSample_ for current sample
-                    CameraSample cameraSample =
-                        tileSampler->GetCameraSample(pixel);
-
-                    // Generate camera ray for current sample
-                    RayDifferential ray;
-                    Float rayWeight =
-                        camera->GenerateRayDifferential(cameraSample, &ray);
-                    ray.ScaleDifferentials(
-                        1 / std::sqrt((Float)tileSampler->samplesPerPixel));
-                    ++nCameraRays;
-
-                    // Evaluate radiance along camera ray
-                    Spectrum L(0.f);
-                    if (rayWeight > 0) L = Li(ray, scene, *tileSampler, arena);
-                    //std::cout << "integrator radiance L: " << L << std::endl;
-
-                    // Issue warning if unexpected radiance value returned
-                    if (L.HasNaNs()) {
-                        LOG(ERROR) << StringPrintf(
-                            "Not-a-number radiance value returned "
-                            "for pixel (%d, %d), sample %d. Setting to black.",
-                            pixel.x, pixel.y,
-                            (int)tileSampler->CurrentSampleNumber());
-                        L = Spectrum(0.f);
-                    } else if (L.y() < -1e-5) {
-                        LOG(ERROR) << StringPrintf(
-                            "Negative luminance value, %f, returned "
-                            "for pixel (%d, %d), sample %d. Setting to black.",
-                            L.y(), pixel.x, pixel.y,
-                            (int)tileSampler->CurrentSampleNumber());
-                        L = Spectrum(0.f);
-                    } else if (std::isinf(L.y())) {
-                          LOG(ERROR) << StringPrintf(
-                            "Infinite luminance value returned "
-                            "for pixel (%d, %d), sample %d. Setting to black.",
-                            pixel.x, pixel.y,
-                            (int)tileSampler->CurrentSampleNumber());
-                        L = Spectrum(0.f);
-                    }
-                    VLOG(1) << "Camera sample: " << cameraSample << " -> ray: " <<
-                        ray << " -> L = " << L;
-
-                    // Add camera ray's contribution to image
-                    filmTile->AddSample(cameraSample.pFilm, L, rayWeight);
-
-                    // Free _MemoryArena_ memory from computing image sample
-                    // value
-                    arena.Reset();
-                } while (tileSampler->StartNextSample());
-            }
+            RenderTile(scene, tileBounds, *tileSampler, filmTile.get(), arena);
             LOG(INFO) << "Finished image tile " << tileBounds;
 
             // Merge image tile into _Film_
@@ -80,12 +80,28 @@ class SamplerIntegrator : public Integrator {
     SamplerIntegrator(std::shared_ptr<const Camera> camera,
                       std::shared_ptr<Sampler> sampler,
                       const Bounds2i &pixelBounds)
-        : camera(camera), sampler(sampler), pixelBounds(pixelBounds) {}
+        : camera(camera), pixelBounds(pixelBounds), sampler(sampler) {}
     virtual void Preprocess(const Scene &scene, Sampler &sampler) {}
     void Render(const Scene &scene);
     virtual Spectrum Li(const RayDifferential &ray, const Scene &scene,
                         Sampler &sampler, MemoryArena &arena,
                         int depth = 0) const = 0;
+    // Integrators that start by finding the camera ray's closest
+    // intersection can return true from _BatchCameraRays()_ and implement
+    // _LiFromIntersection()_, which is given that intersection (or
+    // _nullptr_ if there is none). _Render()_ then intersects the camera
+    // rays for all of a pixel's samples together.
+    virtual bool BatchCameraRays() const { return false; }
+    virtual Spectrum LiFromIntersection(const RayDifferential &ray,
+                                        SurfaceInteraction *isect,
+                                        const Scene &scene, Sampler &sampler,
+                                        MemoryArena &arena) const;
+    // Renders the samples of the pixels in _tileBounds_ into _filmTile_.
+    // Integrators may override it to process a tile's samples together
+    // rather than one after another.
+    virtual void RenderTile(const Scene &scene, const Bounds2i &tileBounds,
+                            Sampler &tileSampler, FilmTile *filmTile,
+                            MemoryArena &arena) const;
     Spectrum SpecularReflect(const RayDifferential &ray,
                              const SurfaceInteraction &isect,
                              const Scene &scene, Sampler &sampler,
@@ -96,13 +112,22 @@ class SamplerIntegrator : public Integrator {
                               MemoryArena &arena, int depth) const;
 
   protected:
+    // SamplerIntegrator Protected Methods
+    Float GenerateCameraRay(Sampler &sampler, const Point2i &pixel,
+                            CameraSample *cameraSample,
+                            RayDifferential *ray) const;
+    void AddSample(FilmTile *filmTile, const Point2i &pixel,
+                   const Sampler &sampler, const CameraSample &cameraSample,
+                   const RayDifferential &ray, Spectrum L,
+                   Float rayWeight) const;
+
     // SamplerIntegrator Protected Data
     std::shared_ptr<const Camera> camera;
+    const Bounds2i pixelBounds;
 
   private:
     // SamplerIntegrator Private Data
     std::shared_ptr<Sampler> sampler;
-    const Bounds2i pixelBounds;
 };
 
 }  // namespace pbrt
@@ -62,6 +62,11 @@ bool VisibilityTester::Unoccluded(const Scene &scene) const {
     return notIntersected;
 }
 
+bool VisibilityTester::Unoccluded(const Scene &scene,
+                                  const Light &light) const {
+    return !scene.IntersectP(p0.SpawnRayTo(p1), &light);
+}
+
 Spectrum VisibilityTester::Tr(const Scene &scene, Sampler &sampler) const {
     Ray ray(p0.SpawnRayTo(p1));
     Spectrum Tr(1.f);
@@ -97,6 +97,9 @@ class VisibilityTester {
     const Interaction &P0() const { return p0; }
     const Interaction &P1() const { return p1; }
     bool Unoccluded(const Scene &scene) const;
+    // Like _Unoccluded()_, but uses the calling thread's cache of the
+    // primitive that last occluded a shadow ray toward _light_.
+    bool Unoccluded(const Scene &scene, const Light &light) const;
     Spectrum Tr(const Scene &scene, Sampler &sampler) const;
 
   private:
@@ -44,6 +44,7 @@
 #include "texture.h"
 #include "stats.h"
 #include "parallel.h"
+#include <mutex>
 
 namespace pbrt {
 
@@ -71,8 +72,17 @@ class MIPMap {
     const T &Texel(int level, int s, int t) const;
     T Lookup(const Point2f &st, Float width = 0.f) const;
     T Lookup(const Point2f &st, Vector2f dstdx, Vector2f dstdy) const;
+    // Sets _*min_ and _*max_ to bounds on the level 0 texels in the
+    // inclusive range _texels_, which may extend past the image and is
+    // wrapped the way _Texel()_ wraps it. The bounds come from a min/max
+    // pyramid that is built on first use, so _T_ must be ordered.
+    void TexelRange(const Bounds2i &texels, T *min, T *max) const;
 
   private:
+    // MIPMap Private Declarations
+    struct MinMax {
+        T min, max;
+    };
     // MIPMap Private Methods
     std::unique_ptr<ResampleWeight[]> resampleWeights(int oldRes, int newRes) {
         CHECK_GE(newRes, oldRes);
@@ -101,6 +111,8 @@ class MIPMap {
     }
     T triangle(int level, const Point2f &st) const;
     T EWA(int level, Point2f st, Vector2f dst0, Vector2f dst1) const;
+    MinMax rangeNode(int level, int s, int t) const;
+    void buildRangePyramid() const;
 
     // MIPMap Private Data
     const bool doTrilinear;
@@ -110,6 +122,12 @@ class MIPMap {
     std::vector<std::unique_ptr<BlockedArray<T>>> pyramid;
     static PBRT_CONSTEXPR int WeightLUTSize = 128;
     static Float weightLut[WeightLUTSize];
+    // Node $(s,t)$ of level $i$ of _rangePyramid_ bounds the level 0
+    // texels of a $2^{i+1} \times 2^{i+1}$ block; single texels bound
+    // themselves.
+    mutable std::once_flag rangePyramidBuilt;
+    mutable std::vector<std::vector<MinMax>> rangePyramid;
+    mutable std::vector<Point2i> rangePyramidRes;
 };
 
 // MIPMap Method Definitions
@@ -352,6 +370,111 @@ T MIPMap<T>::EWA(int level, Point2f st, Vector2f dst0, Vector2f dst1) const {
     return sum / sumWts;
 }
 
+template <typename T>
+typename MIPMap<T>::MinMax MIPMap<T>::rangeNode(int level, int s,
+                                                int t) const {
+    if (level == 0) {
+        const T &texel = (*pyramid[0])(s, t);
+        return MinMax{texel, texel};
+    }
+    return rangePyramid[level - 1][t * rangePyramidRes[level - 1].x + s];
+}
+
+template <typename T>
+void MIPMap<T>::buildRangePyramid() const {
+    Point2i res(pyramid[0]->uSize(), pyramid[0]->vSize());
+    for (int level = 1; res.x > 1 || res.y > 1; ++level) {
+        // Bound up to $2 \times 2$ nodes of the level below with each node
+        Point2i prevRes = res;
+        res = Point2i((res.x + 1) / 2, (res.y + 1) / 2);
+        std::vector<MinMax> nodes(res.x * res.y);
+        for (int t = 0; t < res.y; ++t)
+            for (int s = 0; s < res.x; ++s) {
+                MinMax range = rangeNode(level - 1, 2 * s, 2 * t);
+                for (int c = 1; c < 4; ++c) {
+                    int cs = 2 * s + (c & 1), ct = 2 * t + (c >> 1);
+                    if (cs >= prevRes.x || ct >= prevRes.y) continue;
+                    MinMax child = rangeNode(level - 1, cs, ct);
+                    range.min = std::min(range.min, child.min);
+                    range.max = std::max(range.max, child.max);
+                }
+                nodes[t * res.x + s] = range;
+            }
+        rangePyramid.push_back(std::move(nodes));
+        rangePyramidRes.push_back(res);
+        mipMapMemory += res.x * res.y * sizeof(MinMax);
+    }
+}
+
+template <typename T>
+void MIPMap<T>::TexelRange(const Bounds2i &texels, T *min, T *max) const {
+    std::call_once(rangePyramidBuilt, [this]() { buildRangePyramid(); });
+    // Wrap _texels_ into at most two $[first,last]$ spans per axis
+    Point2i res(pyramid[0]->uSize(), pyramid[0]->vSize());
+    Point2i spans[2][2];
+    int nSpans[2] = {0, 0};
+    bool black = false;
+    for (int axis = 0; axis < 2; ++axis) {
+        Int first = texels.pMin[axis], last = texels.pMax[axis];
+        Point2i *span = spans[axis];
+        int &n = nSpans[axis];
+        switch (wrapMode) {
+        case ImageWrap::Repeat:
+            if (last - first + 1 >= res[axis])
+                span[n++] = Point2i(0, res[axis] - 1);
+            else {
+                int f = Mod(first, Int(res[axis]));
+                int l = Mod(last, Int(res[axis]));
+                if (f <= l)
+                    span[n++] = Point2i(f, l);
+                else {
+                    span[n++] = Point2i(f, res[axis] - 1);
+                    span[n++] = Point2i(0, l);
+                }
+            }
+            break;
+        case ImageWrap::Clamp:
+            span[n++] = Point2i(Clamp(first, 0, res[axis] - 1),
+                                Clamp(last, 0, res[axis] - 1));
+            break;
+        case ImageWrap::Black:
+            if (first < 0 || last >= res[axis]) black = true;
+            first = std::max<Int>(first, 0);
+            last = std::min<Int>(last, res[axis] - 1);
+            if (first <= last) span[n++] = Point2i(first, last);
+            break;
+        }
+    }
+
+    // Bound each pair of spans using the finest pyramid level that covers
+    // it with at most $4 \times 4$ nodes
+    bool empty = true;
+    if (black) {
+        *min = *max = T(0.f);
+        empty = false;
+    }
+    for (int i = 0; i < nSpans[0]; ++i)
+        for (int j = 0; j < nSpans[1]; ++j) {
+            Point2i s = spans[0][i], t = spans[1][j];
+            int level = 0;
+            while ((s[1] >> level) - (s[0] >> level) > 3 ||
+                   (t[1] >> level) - (t[0] >> level) > 3)
+                ++level;
+            for (int nt = t[0] >> level; nt <= t[1] >> level; ++nt)
+                for (int ns = s[0] >> level; ns <= s[1] >> level; ++ns) {
+                    MinMax range = rangeNode(level, ns, nt);
+                    if (empty) {
+                        *min = range.min;
+                        *max = range.max;
+                        empty = false;
+                    } else {
+                        *min = std::min(*min, range.min);
+                        *max = std::max(*max, range.max);
+                    }
+                }
+        }
+}
+
 template <typename T>
 Float MIPMap<T>::weightLut[WeightLUTSize];
 
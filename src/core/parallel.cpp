@@ -47,6 +47,11 @@ static bool shutdownThreads = false;
 class ParallelForLoop;
 static ParallelForLoop *workList = nullptr;
 static std::mutex workListMutex;
+// Set while a thread runs iterations of a parallel loop. Loops started then,
+// such as the tessellation of deferred geometry during rendering, run
+// serially in the calling thread: the work list only handles loops that
+// are taken off of it in the order they were added.
+static PBRT_THREAD_LOCAL bool inParallelLoop = false;
 
 // Bookkeeping variables to help with the implementation of
 // MergeWorkerThreadStats().
@@ -157,6 +162,7 @@ static void workerThreadFunc(int tIndex, std::shared_ptr<Barrier> barrier) {
 
             // Run loop indices in _[indexStart, indexEnd)_
             lock.unlock();
+            inParallelLoop = true;
             for (int64_t index = indexStart; index < indexEnd; ++index) {
                 uint64_t oldState = ProfilerState;
                 ProfilerState = loop.profilerState;
@@ -170,6 +176,7 @@ static void workerThreadFunc(int tIndex, std::shared_ptr<Barrier> barrier) {
                 }
                 ProfilerState = oldState;
             }
+            inParallelLoop = false;
             lock.lock();
 
             // Update _loop_ to reflect completion of iterations
@@ -185,8 +192,9 @@ void ParallelFor(std::function<void(int64_t)> func, int64_t count,
                  int chunkSize) {
     CHECK(threads.size() > 0 || MaxThreadIndex() == 1);
 
-    // Run iterations immediately if not using threads or if _count_ is small
-    if (threads.empty() || count < chunkSize) {
+    // Run iterations immediately if not using threads, if _count_ is small,
+    // or if this is a nested loop
+    if (threads.empty() || count < chunkSize || inParallelLoop) {
         for (int64_t i = 0; i < count; ++i) func(i);
         return;
     }
@@ -218,6 +226,7 @@ void ParallelFor(std::function<void(int64_t)> func, int64_t count,
 
         // Run loop indices in _[indexStart, indexEnd)_
         lock.unlock();
+        inParallelLoop = true;
         for (int64_t index = indexStart; index < indexEnd; ++index) {
             uint64_t oldState = ProfilerState;
             ProfilerState = loop.profilerState;
@@ -231,6 +240,7 @@ void ParallelFor(std::function<void(int64_t)> func, int64_t count,
             }
             ProfilerState = oldState;
         }
+        inParallelLoop = false;
         lock.lock();
 
         // Update _loop_ to reflect completion of iterations
@@ -247,7 +257,7 @@ int MaxThreadIndex() {
 void ParallelFor2D(std::function<void(Point2i)> func, const Point2i &count) {
     CHECK(threads.size() > 0 || MaxThreadIndex() == 1);
 
-    if (threads.empty() || count.x * count.y <= 1) {
+    if (threads.empty() || count.x * count.y <= 1 || inParallelLoop) {
         for (int y = 0; y < count.y; ++y)
             for (int x = 0; x < count.x; ++x) func(Point2i(x, y));
         return;
@@ -278,6 +288,7 @@ void ParallelFor2D(std::function<void(Point2i)> func, const Point2i &count) {
 
         // Run loop indices in _[indexStart, indexEnd)_
         lock.unlock();
+        inParallelLoop = true;
         for (int64_t index = indexStart; index < indexEnd; ++index) {
             uint64_t oldState = ProfilerState;
             ProfilerState = loop.profilerState;
@@ -291,6 +302,7 @@ void ParallelFor2D(std::function<void(Point2i)> func, const Point2i &count) {
             }
             ProfilerState = oldState;
         }
+        inParallelLoop = false;
         lock.lock();
 
         // Update _loop_ to reflect completion of iterations
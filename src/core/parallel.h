@@ -98,6 +98,8 @@ class Barrier {
     int count;
 };
 
+// Loops started from inside another loop's iterations run serially in the
+// thread that starts them.
 void ParallelFor(std::function<void(int64_t)> func, int64_t count,
                  int chunkSize = 1);
 extern PBRT_THREAD_LOCAL int ThreadIndex;
@@ -259,6 +259,46 @@ inline double BitsToFloat(uint64_t ui) {
     return f;
 }
 
+// Converts _f_ to the nearest IEEE half-precision value, rounding ties to
+// even; values too large for a half become infinity.
+inline uint16_t FloatToHalf(float f) {
+    uint32_t bits = FloatToBits(f);
+    uint32_t sign = bits & 0x80000000u;
+    bits ^= sign;
+    uint16_t h;
+    if (bits >= (127u + 16) << 23)
+        // Handle overflow, infinity and NaN
+        h = bits > 0x7f800000u ? 0x7e00 : 0x7c00;
+    else if (bits < (127u - 14) << 23) {
+        // Handle values that become half denormals or zero; adding
+        // _denormMagic_ lets the FPU do the rounding
+        const float denormMagic = BitsToFloat((127u - 14 + 23 - 10) << 23);
+        h = FloatToBits(BitsToFloat(bits) + denormMagic) -
+            FloatToBits(denormMagic);
+    } else {
+        // Rebias the exponent and round the mantissa to 10 bits
+        uint32_t mantissaOdd = (bits >> 13) & 1;
+        bits += ((15u - 127) << 23) + 0xfff + mantissaOdd;
+        h = bits >> 13;
+    }
+    return h | (sign >> 16);
+}
+
+inline float HalfToFloat(uint16_t h) {
+    uint32_t bits = uint32_t(h & 0x7fff) << 13;
+    uint32_t exponent = bits & (0x7c00u << 13);
+    bits += (127u - 15) << 23;
+    if (exponent == 0x7c00u << 13)
+        // Infinity or NaN
+        bits += (128u - 16) << 23;
+    else if (exponent == 0) {
+        // Zero or denormal; renormalize
+        bits += 1 << 23;
+        bits = FloatToBits(BitsToFloat(bits) - BitsToFloat((127u - 14) << 23));
+    }
+    return BitsToFloat(bits | uint32_t(h & 0x8000) << 16);
+}
+
 inline float NextFloatUp(float v) {
     // Handle infinity and negative zero for _NextFloatUp()_
     if (std::isinf(v) && v > 0.) return v;
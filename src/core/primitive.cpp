@@ -43,6 +43,31 @@ STAT_MEMORY_COUNTER("Memory/Primitives", primitiveMemory);
 
 // Primitive Method Definitions
 Primitive::~Primitive() {}
+
+Bounds3f Primitive::ClippedWorldBound(const Bounds3f &clip) const {
+    Bounds3f worldBound = WorldBound();
+    if (!Overlaps(worldBound, clip)) return Bounds3f();
+    return pbrt::Intersect(worldBound, clip);
+}
+
+void Primitive::IntersectN(const Ray *rays, SurfaceInteraction *isects,
+                           bool *hits, int n) const {
+    for (int i = 0; i < n; ++i) hits[i] = Intersect(rays[i], &isects[i]);
+}
+
+void Primitive::IntersectPN(const Ray *rays, bool *occluded, int n) const {
+    for (int i = 0; i < n; ++i) occluded[i] = IntersectP(rays[i]);
+}
+
+const Primitive *Primitive::FindOccluder(const Ray &r) const {
+    return IntersectP(r) ? this : nullptr;
+}
+
+void Primitive::LinearMotionBounds(Float time0, Float time1, Bounds3f *b0,
+                                   Bounds3f *b1) const {
+    *b0 = *b1 = WorldBound();
+}
+
 const AreaLight *Aggregate::GetAreaLight() const {
     LOG(FATAL) <<
         "Aggregate::GetAreaLight() method"
@@ -95,6 +120,122 @@ bool TransformedPrimitive::IntersectP(const Ray &r) const {
     return primitive->IntersectP(InterpolatedWorldToPrim(r));
 }
 
+bool TransformedPrimitive::MotionTimeRange(Float *time0, Float *time1) const {
+    if (!PrimitiveToWorld.IsAnimated()) return false;
+    *time0 = PrimitiveToWorld.StartTime();
+    *time1 = PrimitiveToWorld.EndTime();
+    return true;
+}
+
+void TransformedPrimitive::LinearMotionBounds(Float time0, Float time1,
+                                              Bounds3f *b0,
+                                              Bounds3f *b1) const {
+    if (!PrimitiveToWorld.IsAnimated()) {
+        Primitive::LinearMotionBounds(time0, time1, b0, b1);
+        return;
+    }
+    // Bound the primitive's motion over segments of the time range
+    PBRT_CONSTEXPR int nSegments = 8;
+    Bounds3f primBounds = primitive->WorldBound();
+    Bounds3f segmentBounds[nSegments];
+    for (int i = 0; i < nSegments; ++i)
+        segmentBounds[i] = PrimitiveToWorld.MotionBounds(
+            primBounds, Lerp(Float(i) / nSegments, time0, time1),
+            Lerp(Float(i + 1) / nSegments, time0, time1));
+
+    // Fit lines to the segments' bounds along each axis, offsetting them
+    // so that they bound every segment at both of its ends
+    for (int axis = 0; axis < 3; ++axis) {
+        Float lo0 = segmentBounds[0].pMin[axis];
+        Float lo1 = segmentBounds[nSegments - 1].pMin[axis];
+        Float hi0 = segmentBounds[0].pMax[axis];
+        Float hi1 = segmentBounds[nSegments - 1].pMax[axis];
+        Float loShift = 0, hiShift = 0;
+        for (int i = 0; i < nSegments; ++i)
+            for (int end = i; end <= i + 1; ++end) {
+                Float u = Float(end) / nSegments;
+                loShift = std::max(loShift, lo0 + u * (lo1 - lo0) -
+                                                segmentBounds[i].pMin[axis]);
+                hiShift = std::max(hiShift, segmentBounds[i].pMax[axis] -
+                                                (hi0 + u * (hi1 - hi0)));
+            }
+        // Also allow for round-off error when the lines are interpolated
+        loShift += gamma(3) * std::max(std::abs(lo0), std::abs(lo1));
+        hiShift += gamma(3) * std::max(std::abs(hi0), std::abs(hi1));
+        b0->pMin[axis] = lo0 - loShift;
+        b1->pMin[axis] = lo1 - loShift;
+        b0->pMax[axis] = hi0 + hiShift;
+        b1->pMax[axis] = hi1 + hiShift;
+    }
+}
+
+// StaticTransformedPrimitive Method Definitions
+StaticTransformedPrimitive::StaticTransformedPrimitive(
+    const std::shared_ptr<Primitive> &primitive,
+    const Transform &PrimitiveToWorld)
+    : primitive(primitive) {
+    CHECK(PrimitiveToWorld.IsAffine());
+    for (int i = 0; i < 3; ++i)
+        for (int j = 0; j < 4; ++j) {
+            primToWorld[i][j] = PrimitiveToWorld.GetMatrix().m[i][j];
+            worldToPrim[i][j] = PrimitiveToWorld.GetInverseMatrix().m[i][j];
+        }
+    primitiveMemory += sizeof(*this);
+}
+
+Transform StaticTransformedPrimitive::PrimitiveToWorld() const {
+    Matrix4x4 m, mInv;
+    for (int i = 0; i < 3; ++i)
+        for (int j = 0; j < 4; ++j) {
+            m.m[i][j] = primToWorld[i][j];
+            mInv.m[i][j] = worldToPrim[i][j];
+        }
+    return Transform(m, mInv);
+}
+
+Ray StaticTransformedPrimitive::WorldToPrimitive(const Ray &r) const {
+    // Transform _r_ as _Transform::operator()_ would, skipping the
+    // homogeneous divide, which is unnecessary for affine transformations
+    Point3f o;
+    Vector3f oError, d;
+    for (int i = 0; i < 3; ++i) {
+        const Float *m = worldToPrim[i];
+        o[i] = m[0] * r.o.x + m[1] * r.o.y + m[2] * r.o.z + m[3];
+        oError[i] = gamma(3) * (std::abs(m[0] * r.o.x) +
+                                std::abs(m[1] * r.o.y) +
+                                std::abs(m[2] * r.o.z) + std::abs(m[3]));
+        d[i] = m[0] * r.d.x + m[1] * r.d.y + m[2] * r.d.z;
+    }
+    // Offset ray origin to edge of error bounds and compute _tMax_
+    Float lengthSquared = d.LengthSquared();
+    Float tMax = r.tMax;
+    if (lengthSquared > 0) {
+        Float dt = Dot(Abs(d), oError) / lengthSquared;
+        o += d * dt;
+        tMax -= dt;
+    }
+    return Ray(o, d, tMax, r.time, r.medium);
+}
+
+Bounds3f StaticTransformedPrimitive::WorldBound() const {
+    return PrimitiveToWorld()(primitive->WorldBound());
+}
+
+bool StaticTransformedPrimitive::Intersect(const Ray &r,
+                                           SurfaceInteraction *isect) const {
+    Ray ray = WorldToPrimitive(r);
+    if (!primitive->Intersect(ray, isect)) return false;
+    r.tMax = ray.tMax;
+    // Transform instance's intersection data to world space
+    *isect = PrimitiveToWorld()(*isect);
+    CHECK_GE(Dot(isect->n, isect->shading.n), 0);
+    return true;
+}
+
+bool StaticTransformedPrimitive::IntersectP(const Ray &r) const {
+    return primitive->IntersectP(WorldToPrimitive(r));
+}
+
 // GeometricPrimitive Method Definitions
 GeometricPrimitive::GeometricPrimitive(const std::shared_ptr<Shape> &shape,
                                        const std::shared_ptr<Material> &material,
@@ -109,6 +250,10 @@ GeometricPrimitive::GeometricPrimitive(const std::shared_ptr<Shape> &shape,
 
 Bounds3f GeometricPrimitive::WorldBound() const { return shape->WorldBound(); }
 
+Bounds3f GeometricPrimitive::ClippedWorldBound(const Bounds3f &clip) const {
+    return shape->ClippedWorldBound(clip);
+}
+
 bool GeometricPrimitive::IntersectP(const Ray &r) const {
     return shape->IntersectP(r);
 }
@@ -137,6 +282,8 @@ const Material *GeometricPrimitive::GetMaterial() const {
     return material.get();
 }
 
+const Shape *GeometricPrimitive::GetShape() const { return shape.get(); }
+
 void GeometricPrimitive::ComputeScatteringFunctions(
     SurfaceInteraction *isect, MemoryArena &arena, TransportMode mode,
     bool allowMultipleLobes) const {
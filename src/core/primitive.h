@@ -53,8 +53,29 @@ class Primitive {
     // Primitive Interface
     virtual ~Primitive();
     virtual Bounds3f WorldBound() const = 0;
+    virtual Bounds3f ClippedWorldBound(const Bounds3f &clip) const;
     virtual bool Intersect(const Ray &r, SurfaceInteraction *) const = 0;
     virtual bool IntersectP(const Ray &r) const = 0;
+    // Batched versions of _Intersect()_ and _IntersectP()_ for _n_ rays;
+    // aggregates may override them to trace coherent rays together.
+    virtual void IntersectN(const Ray *rays, SurfaceInteraction *isects,
+                            bool *hits, int n) const;
+    virtual void IntersectPN(const Ray *rays, bool *occluded, int n) const;
+    // Returns a primitive that _r_ intersects, or _nullptr_ if
+    // _IntersectP()_ would return false; aggregates return the primitive
+    // in the leaf that was hit so that it can be tested first for similar
+    // rays.
+    virtual const Primitive *FindOccluder(const Ray &r) const;
+    // Returns whether the primitive moves, and if so, the times its motion
+    // starts and ends.
+    virtual bool MotionTimeRange(Float *time0, Float *time1) const {
+        return false;
+    }
+    // Computes bounds at _time0_ and _time1_ whose linear interpolation
+    // bounds the primitive at every time in between; both are
+    // _WorldBound()_ for primitives that don't move.
+    virtual void LinearMotionBounds(Float time0, Float time1, Bounds3f *b0,
+                                    Bounds3f *b1) const;
     virtual const AreaLight *GetAreaLight() const = 0;
     virtual const Material *GetMaterial() const = 0;
     virtual void ComputeScatteringFunctions(SurfaceInteraction *isect,
@@ -68,6 +89,7 @@ class GeometricPrimitive : public Primitive {
   public:
     // GeometricPrimitive Public Methods
     virtual Bounds3f WorldBound() const;
+    virtual Bounds3f ClippedWorldBound(const Bounds3f &clip) const;
     virtual bool Intersect(const Ray &r, SurfaceInteraction *isect) const;
     virtual bool IntersectP(const Ray &r) const;
     GeometricPrimitive(const std::shared_ptr<Shape> &shape,
@@ -76,6 +98,7 @@ class GeometricPrimitive : public Primitive {
                        const MediumInterface &mediumInterface);
     const AreaLight *GetAreaLight() const;
     const Material *GetMaterial() const;
+    const Shape *GetShape() const;
     void ComputeScatteringFunctions(SurfaceInteraction *isect,
                                     MemoryArena &arena, TransportMode mode,
                                     bool allowMultipleLobes) const;
@@ -108,6 +131,9 @@ class TransformedPrimitive : public Primitive {
     Bounds3f WorldBound() const {
         return PrimitiveToWorld.MotionBounds(primitive->WorldBound());
     }
+    bool MotionTimeRange(Float *time0, Float *time1) const;
+    void LinearMotionBounds(Float time0, Float time1, Bounds3f *b0,
+                            Bounds3f *b1) const;
 
   private:
     // TransformedPrimitive Private Data
@@ -115,6 +141,38 @@ class TransformedPrimitive : public Primitive {
     const AnimatedTransform PrimitiveToWorld;
 };
 
+// StaticTransformedPrimitive Declarations
+class StaticTransformedPrimitive : public Primitive {
+  public:
+    // StaticTransformedPrimitive Public Methods
+    StaticTransformedPrimitive(const std::shared_ptr<Primitive> &primitive,
+                               const Transform &PrimitiveToWorld);
+    Bounds3f WorldBound() const;
+    bool Intersect(const Ray &r, SurfaceInteraction *in) const;
+    bool IntersectP(const Ray &r) const;
+    const AreaLight *GetAreaLight() const { return nullptr; }
+    const Material *GetMaterial() const { return nullptr; }
+    void ComputeScatteringFunctions(SurfaceInteraction *isect,
+                                    MemoryArena &arena, TransportMode mode,
+                                    bool allowMultipleLobes) const {
+        LOG(FATAL) << "StaticTransformedPrimitive::"
+                      "ComputeScatteringFunctions() shouldn't be called";
+    }
+
+  private:
+    // StaticTransformedPrimitive Private Methods
+    Transform PrimitiveToWorld() const;
+    Ray WorldToPrimitive(const Ray &r) const;
+
+    // StaticTransformedPrimitive Private Data
+    std::shared_ptr<Primitive> primitive;
+    // Top three rows of the affine transformation from the primitive's
+    // space to world space and of its inverse; unlike
+    // _TransformedPrimitive_'s _AnimatedTransform_, nothing is stored to
+    // support motion, which keeps scenes with many instances small.
+    Float primToWorld[3][4], worldToPrim[3][4];
+};
+
 // Aggregate Declarations
 class Aggregate : public Primitive {
   public:
@@ -40,6 +40,24 @@ namespace pbrt {
 STAT_COUNTER("Intersections/Regular ray intersection tests",
              nIntersectionTests);
 STAT_COUNTER("Intersections/Shadow ray intersection tests", nShadowTests);
+STAT_PERCENT("Intersections/Shadow ray occluder cache hits",
+             nOccluderCacheHits, nOccluderCacheLookups);
+
+// OccluderCacheEntry Declarations
+struct OccluderCacheEntry {
+    uint64_t sceneId;
+    const Light *light;
+    const Primitive *occluder;
+};
+
+// Last primitive that occluded a shadow ray traced by this thread toward
+// each light, indexed by a hash of the light's address
+static PBRT_CONSTEXPR int occluderCacheBits = 6;
+static PBRT_THREAD_LOCAL OccluderCacheEntry
+    occluderCache[1 << occluderCacheBits];
+
+// Scene Static Data
+std::atomic<uint64_t> Scene::nextId{1};
 
 // Scene Method Definitions
 bool Scene::Intersect(const Ray &ray, SurfaceInteraction *isect) const {
@@ -54,6 +72,42 @@ bool Scene::IntersectP(const Ray &ray) const {
     return aggregate->IntersectP(ray);
 }
 
+bool Scene::IntersectP(const Ray &ray, const Light *light) const {
+    ++nShadowTests;
+    DCHECK_NE(ray.d, Vector3f(0,0,0));
+    // Test the light's last occluder before traversing the aggregate
+    uint64_t lightHash = (uint64_t)(uintptr_t)light * 0x9e3779b97f4a7c15ull;
+    OccluderCacheEntry &entry =
+        occluderCache[lightHash >> (64 - occluderCacheBits)];
+    ++nOccluderCacheLookups;
+    if (entry.sceneId == id && entry.light == light && entry.occluder) {
+        if (entry.occluder->IntersectP(ray)) {
+            ++nOccluderCacheHits;
+            return true;
+        }
+    }
+
+    // Find the ray's occluder, if any, and record it for the next ray
+    const Primitive *occluder = aggregate->FindOccluder(ray);
+    entry.sceneId = id;
+    entry.light = light;
+    entry.occluder = occluder != aggregate.get() ? occluder : nullptr;
+    return occluder != nullptr;
+}
+
+void Scene::IntersectN(const Ray *rays, SurfaceInteraction *isects,
+                       bool *hits, int n) const {
+    nIntersectionTests += n;
+    for (int i = 0; i < n; ++i) DCHECK_NE(rays[i].d, Vector3f(0, 0, 0));
+    aggregate->IntersectN(rays, isects, hits, n);
+}
+
+void Scene::IntersectPN(const Ray *rays, bool *occluded, int n) const {
+    nShadowTests += n;
+    for (int i = 0; i < n; ++i) DCHECK_NE(rays[i].d, Vector3f(0, 0, 0));
+    aggregate->IntersectPN(rays, occluded, n);
+}
+
 bool Scene::IntersectTr(Ray ray, Sampler &sampler, SurfaceInteraction *isect,
                         Spectrum *Tr) const {
     *Tr = Spectrum(1.f);
@@ -43,6 +43,7 @@
 #include "geometry.h"
 #include "primitive.h"
 #include "light.h"
+#include <atomic>
 
 namespace pbrt {
 
@@ -52,7 +53,7 @@ class Scene {
     // Scene Public Methods
     Scene(std::shared_ptr<Primitive> aggregate,
           const std::vector<std::shared_ptr<Light>> &lights)
-        : lights(lights), aggregate(aggregate) {
+        : lights(lights), aggregate(aggregate), id(nextId++) {
         // Scene Constructor Implementation
         worldBound = aggregate->WorldBound();
         for (const auto &light : lights) {
@@ -64,6 +65,12 @@ class Scene {
     const Bounds3f &WorldBound() const { return worldBound; }
     bool Intersect(const Ray &ray, SurfaceInteraction *isect) const;
     bool IntersectP(const Ray &ray) const;
+    // Like _IntersectP()_, but first tests the primitive that occluded the
+    // last shadow ray that the calling thread traced toward _light_.
+    bool IntersectP(const Ray &ray, const Light *light) const;
+    void IntersectN(const Ray *rays, SurfaceInteraction *isects, bool *hits,
+                    int n) const;
+    void IntersectPN(const Ray *rays, bool *occluded, int n) const;
     bool IntersectTr(Ray ray, Sampler &sampler, SurfaceInteraction *isect,
                      Spectrum *transmittance) const;
 
@@ -77,6 +84,10 @@ class Scene {
     // Scene Private Data
     std::shared_ptr<Primitive> aggregate;
     Bounds3f worldBound;
+    // Distinguishes this scene's entries in the per-thread occluder cache
+    // from those of scenes that were rendered before it
+    const uint64_t id;
+    static std::atomic<uint64_t> nextId;
 };
 
 }  // namespace pbrt
@@ -53,6 +53,12 @@ Shape::Shape(const Transform *ObjectToWorld, const Transform *WorldToObject,
 
 Bounds3f Shape::WorldBound() const { return (*ObjectToWorld)(ObjectBound()); }
 
+Bounds3f Shape::ClippedWorldBound(const Bounds3f &clip) const {
+    Bounds3f worldBound = WorldBound();
+    if (!Overlaps(worldBound, clip)) return Bounds3f();
+    return pbrt::Intersect(worldBound, clip);
+}
+
 Interaction Shape::Sample(const Interaction &ref, const Point2f &u,
                           Float *pdf) const {
     Interaction intr = Sample(u, pdf);
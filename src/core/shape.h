@@ -56,6 +56,9 @@ class Shape {
     virtual ~Shape();
     virtual Bounds3f ObjectBound() const = 0;
     virtual Bounds3f WorldBound() const;
+    // Returns a bound on the part of the shape that lies inside _clip_, or
+    // an empty bound if there is none; used by spatial-split BVH builds.
+    virtual Bounds3f ClippedWorldBound(const Bounds3f &clip) const;
     virtual bool Intersect(const Ray &ray, Float *tHit,
                            SurfaceInteraction *isect,
                            bool testAlphaTexture = true) const = 0;
@@ -0,0 +1,204 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+#if defined(_MSC_VER)
+#define NOMINMAX
+#pragma once
+#endif
+
+#ifndef PBRT_CORE_SIMD_H
+#define PBRT_CORE_SIMD_H
+
+// core/simd.h*
+#include "pbrt.h"
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PBRT_HAVE_SSE2
+#include <emmintrin.h>
+#endif
+#if defined(__AVX__)
+#define PBRT_HAVE_AVX
+#include <immintrin.h>
+#endif
+
+namespace pbrt {
+
+// SIMD Declarations
+
+// _SIMDFloat<N>_ is a minimal fixed-width vector of single-precision
+// values, used by code paths that test several bounding boxes or shapes
+// against one ray at once. The generic version is written as plain loops
+// (which compilers will usually vectorize); SSE2 and AVX specializations
+// follow. Note that _Min()_ and _Max()_ follow the x86 convention of
+// returning their second argument if either one is NaN.
+template <int N>
+struct SIMDFloat {
+    // SIMDFloat Public Methods
+    SIMDFloat() {}
+    explicit SIMDFloat(float f) {
+        for (int i = 0; i < N; ++i) v[i] = f;
+    }
+    static SIMDFloat Load(const float *p) {
+        SIMDFloat r;
+        for (int i = 0; i < N; ++i) r.v[i] = p[i];
+        return r;
+    }
+    void Store(float *p) const {
+        for (int i = 0; i < N; ++i) p[i] = v[i];
+    }
+    SIMDFloat operator+(const SIMDFloat &b) const {
+        SIMDFloat r;
+        for (int i = 0; i < N; ++i) r.v[i] = v[i] + b.v[i];
+        return r;
+    }
+    SIMDFloat operator-(const SIMDFloat &b) const {
+        SIMDFloat r;
+        for (int i = 0; i < N; ++i) r.v[i] = v[i] - b.v[i];
+        return r;
+    }
+    SIMDFloat operator*(const SIMDFloat &b) const {
+        SIMDFloat r;
+        for (int i = 0; i < N; ++i) r.v[i] = v[i] * b.v[i];
+        return r;
+    }
+    friend SIMDFloat Min(const SIMDFloat &a, const SIMDFloat &b) {
+        SIMDFloat r;
+        for (int i = 0; i < N; ++i) r.v[i] = a.v[i] < b.v[i] ? a.v[i] : b.v[i];
+        return r;
+    }
+    friend SIMDFloat Max(const SIMDFloat &a, const SIMDFloat &b) {
+        SIMDFloat r;
+        for (int i = 0; i < N; ++i) r.v[i] = a.v[i] > b.v[i] ? a.v[i] : b.v[i];
+        return r;
+    }
+    // Returns a bitmask with bit _i_ set if _a[i] <= b[i]_.
+    friend int LessEqualMask(const SIMDFloat &a, const SIMDFloat &b) {
+        int mask = 0;
+        for (int i = 0; i < N; ++i)
+            if (a.v[i] <= b.v[i]) mask |= 1 << i;
+        return mask;
+    }
+
+    // SIMDFloat Public Data
+    float v[N];
+};
+
+#ifdef PBRT_HAVE_SSE2
+template <>
+struct SIMDFloat<4> {
+    SIMDFloat() {}
+    explicit SIMDFloat(float f) : v(_mm_set1_ps(f)) {}
+    explicit SIMDFloat(__m128 v) : v(v) {}
+    // _p_ must be 16-byte aligned.
+    static SIMDFloat Load(const float *p) { return SIMDFloat(_mm_load_ps(p)); }
+    void Store(float *p) const { _mm_storeu_ps(p, v); }
+    SIMDFloat operator+(const SIMDFloat &b) const {
+        return SIMDFloat(_mm_add_ps(v, b.v));
+    }
+    SIMDFloat operator-(const SIMDFloat &b) const {
+        return SIMDFloat(_mm_sub_ps(v, b.v));
+    }
+    SIMDFloat operator*(const SIMDFloat &b) const {
+        return SIMDFloat(_mm_mul_ps(v, b.v));
+    }
+    friend SIMDFloat Min(const SIMDFloat &a, const SIMDFloat &b) {
+        return SIMDFloat(_mm_min_ps(a.v, b.v));
+    }
+    friend SIMDFloat Max(const SIMDFloat &a, const SIMDFloat &b) {
+        return SIMDFloat(_mm_max_ps(a.v, b.v));
+    }
+    friend int LessEqualMask(const SIMDFloat &a, const SIMDFloat &b) {
+        return _mm_movemask_ps(_mm_cmple_ps(a.v, b.v));
+    }
+    __m128 v;
+};
+#endif  // PBRT_HAVE_SSE2
+
+#ifdef PBRT_HAVE_AVX
+template <>
+struct SIMDFloat<8> {
+    SIMDFloat() {}
+    explicit SIMDFloat(float f) : v(_mm256_set1_ps(f)) {}
+    explicit SIMDFloat(__m256 v) : v(v) {}
+    // _p_ must be 32-byte aligned.
+    static SIMDFloat Load(const float *p) {
+        return SIMDFloat(_mm256_load_ps(p));
+    }
+    void Store(float *p) const { _mm256_storeu_ps(p, v); }
+    SIMDFloat operator+(const SIMDFloat &b) const {
+        return SIMDFloat(_mm256_add_ps(v, b.v));
+    }
+    SIMDFloat operator-(const SIMDFloat &b) const {
+        return SIMDFloat(_mm256_sub_ps(v, b.v));
+    }
+    SIMDFloat operator*(const SIMDFloat &b) const {
+        return SIMDFloat(_mm256_mul_ps(v, b.v));
+    }
+    friend SIMDFloat Min(const SIMDFloat &a, const SIMDFloat &b) {
+        return SIMDFloat(_mm256_min_ps(a.v, b.v));
+    }
+    friend SIMDFloat Max(const SIMDFloat &a, const SIMDFloat &b) {
+        return SIMDFloat(_mm256_max_ps(a.v, b.v));
+    }
+    friend int LessEqualMask(const SIMDFloat &a, const SIMDFloat &b) {
+        return _mm256_movemask_ps(_mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ));
+    }
+    __m256 v;
+};
+#endif  // PBRT_HAVE_AVX
+
+// SIMD Inline Functions
+
+// Conversions from _Float_ to single precision that round toward
+// negative or positive infinity, respectively; these allow bounds and
+// ray parameters computed in _Float_ to be used conservatively by the
+// single-precision SIMD code paths.
+inline float RoundFloatDown(Float v) {
+    float f = (float)v;
+    return (Float)f > v ? NextFloatDown(f) : f;
+}
+
+inline float RoundFloatUp(Float v) {
+    float f = (float)v;
+    return (Float)f < v ? NextFloatUp(f) : f;
+}
+
+// Conservative bound on the relative error of _n_ single-precision
+// floating-point operations, following _gamma()_.
+inline PBRT_CONSTEXPR float SinglePrecisionGamma(int n) {
+    return (n * (std::numeric_limits<float>::epsilon() * 0.5f)) /
+           (1 - n * (std::numeric_limits<float>::epsilon() * 0.5f));
+}
+
+}  // namespace pbrt
+
+#endif  // PBRT_CORE_SIMD_H
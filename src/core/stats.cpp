@@ -90,6 +90,10 @@ void PrintStats(FILE *dest) { statsAccumulator.Print(dest); }
 
 void ClearStats() { statsAccumulator.Clear(); }
 
+void GetStatsRatio(const std::string &title, int64_t *num, int64_t *denom) {
+    statsAccumulator.GetRatio(title, num, denom);
+}
+
 static void getCategoryAndTitle(const std::string &str, std::string *category,
                                 std::string *title) {
     const char *s = str.c_str();
@@ -70,6 +70,9 @@ class StatRegisterer {
 void PrintStats(FILE *dest);
 void ClearStats();
 void ReportThreadStats();
+// Returns the totals reported so far for the ratio statistic with the
+// given title, as passed to _STAT_RATIO()_.
+void GetStatsRatio(const std::string &title, int64_t *num, int64_t *denom);
 
 class StatsAccumulator {
   public:
@@ -119,6 +122,13 @@ class StatsAccumulator {
         ratios[name].second += denom;
     }
 
+    void GetRatio(const std::string &name, int64_t *num,
+                  int64_t *denom) const {
+        auto iter = ratios.find(name);
+        *num = (iter == ratios.end()) ? 0 : iter->second.first;
+        *denom = (iter == ratios.end()) ? 0 : iter->second.second;
+    }
+
     void Print(FILE *file);
     void Clear();
 
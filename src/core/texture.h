@@ -54,6 +54,12 @@ class TextureMapping2D {
     virtual ~TextureMapping2D();
     virtual Point2f Map(const SurfaceInteraction &si, Vector2f *dstdx,
                         Vector2f *dstdy) const = 0;
+    // Sets _*st_ to bounds on the $(s,t)$ that _Map()_ returns at points
+    // whose $(u,v)$ lie in _uv_; mappings that don't depend on $(u,v)$
+    // alone return false.
+    virtual bool MapBounds(const Bounds2f &uv, Bounds2f *st) const {
+        return false;
+    }
 };
 
 class UVMapping2D : public TextureMapping2D {
@@ -62,6 +68,7 @@ class UVMapping2D : public TextureMapping2D {
     UVMapping2D(Float su = 1, Float sv = 1, Float du = 0, Float dv = 0);
     Point2f Map(const SurfaceInteraction &si, Vector2f *dstdx,
                 Vector2f *dstdy) const;
+    bool MapBounds(const Bounds2f &uv, Bounds2f *st) const;
 
   private:
     const Float su, sv, du, dv;
@@ -136,6 +143,13 @@ class Texture {
   public:
     // Texture Interface
     virtual T Evaluate(const SurfaceInteraction &) const = 0;
+    // Sets _*min_ and _*max_ to bounds on the values that _Evaluate()_
+    // returns without filtering, i.e. with zero $(u,v)$ differentials, at
+    // points whose $(u,v)$ lie in _uv_. Textures that can't bound their
+    // values this way return false.
+    virtual bool EvaluateRange(const Bounds2f &uv, T *min, T *max) const {
+        return false;
+    }
     virtual ~Texture() {}
 };
 
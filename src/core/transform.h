@@ -157,6 +157,14 @@ class Transform {
                 m.m[3][0] == 0.f && m.m[3][1] == 0.f && m.m[3][2] == 0.f &&
                 m.m[3][3] == 1.f);
     }
+    // Returns whether the transformation and its inverse both have a
+    // bottom row of (0, 0, 0, 1).
+    bool IsAffine() const {
+        return (m.m[3][0] == 0.f && m.m[3][1] == 0.f && m.m[3][2] == 0.f &&
+                m.m[3][3] == 1.f && mInv.m[3][0] == 0.f &&
+                mInv.m[3][1] == 0.f && mInv.m[3][2] == 0.f &&
+                mInv.m[3][3] == 1.f);
+    }
     const Matrix4x4 &GetMatrix() const { return m; }
     const Matrix4x4 &GetInverseMatrix() const { return mInv; }
     bool HasScale() const {
@@ -430,6 +438,14 @@ class AnimatedTransform {
     }
     Bounds3f MotionBounds(const Bounds3f &b) const;
     Bounds3f BoundPointMotion(const Point3f &p) const;
+    // Versions of _MotionBounds()_ and _BoundPointMotion()_ that only
+    // bound the motion between _time0_ and _time1_.
+    Bounds3f MotionBounds(const Bounds3f &b, Float time0, Float time1) const;
+    Bounds3f BoundPointMotion(const Point3f &p, Float time0,
+                              Float time1) const;
+    bool IsAnimated() const { return actuallyAnimated; }
+    Float StartTime() const { return startTime; }
+    Float EndTime() const { return endTime; }
 
   private:
     // AnimatedTransform Private Data
@@ -37,6 +37,7 @@
 #include "film.h"
 #include "interaction.h"
 #include "paramset.h"
+#include "sampler.h"
 #include "scene.h"
 #include "stats.h"
 
@@ -50,11 +51,13 @@ PathIntegrator::PathIntegrator(int maxDepth,
                                std::shared_ptr<const Camera> camera,
                                std::shared_ptr<Sampler> sampler,
                                const Bounds2i &pixelBounds, Float rrThreshold,
-                               const std::string &lightSampleStrategy)
+                               const std::string &lightSampleStrategy,
+                               bool sortRays)
     : SamplerIntegrator(camera, sampler, pixelBounds),
       maxDepth(maxDepth),
       rrThreshold(rrThreshold),
-      lightSampleStrategy(lightSampleStrategy) {}
+      lightSampleStrategy(lightSampleStrategy),
+      sortRays(sortRays) {}
 
 void PathIntegrator::Preprocess(const Scene &scene, Sampler &sampler) {
     lightDistribution =
@@ -65,133 +68,224 @@ Spectrum PathIntegrator::Li(const RayDifferential &r, const Scene &scene,
                             Sampler &sampler, MemoryArena &arena,
                             int depth) const {
     ProfilePhase p(Prof::SamplerIntegratorLi);
-    Spectrum L(0.f), beta(1.f);
-    RayDifferential ray(r);
-    bool specularBounce = false;
-    int bounces;
-    // Added after book publication: etaScale tracks the accumulated effect
-    // of radiance scaling due to rays passing through refractive
-    // boundaries (see the derivation on p. 527 of the third edition). We
-    // track this value in order to remove it from beta when we apply
-    // Russian roulette; this is worthwhile, since it lets us sometimes
-    // avoid terminating refracted rays that are about to be refracted back
-    // out of a medium and thus have their beta value increased.
-    Float etaScale = 1;
-
-    for (bounces = 0;; ++bounces) {
+    PathState path;
+    path.ray = r;
+    while (true) {
         // Find next path vertex and accumulate contribution
-        VLOG(2) << "Path tracer bounce " << bounces << ", current L = " << L
-                << ", beta = " << beta;
+        VLOG(2) << "Path tracer bounce " << path.bounces << ", current L = "
+                << path.L << ", beta = " << path.beta;
 
-        //std::cout << "bounces: " << bounces << std::endl;
         // Intersect _ray_ with scene and store intersection in _isect_
         SurfaceInteraction isect;
-        bool foundIntersection = scene.Intersect(ray, &isect);
-        //std::cout << "Found intersection: " << foundIntersection << std::endl;
-
-        // Possibly add emitted light at intersection
-        if (bounces == 0 || specularBounce) {
-            // Add emitted light at path vertex or from the environment
-            if (foundIntersection) {
-                L += beta * isect.Le(-ray.d);
-                VLOG(2) << "Added Le -> L = " << L;
-            } else {
-                for (const auto &light : scene.infiniteLights)
-                    L += beta * light->Le(ray);
-                VLOG(2) << "Added infinite area lights -> L = " << L;
-            }
-        }
+        bool foundIntersection = scene.Intersect(path.ray, &isect);
+        if (!ExtendPath(&path, foundIntersection, &isect, scene, sampler,
+                        arena))
+            break;
+    }
+    ReportValue(pathLength, path.bounces);
+    return path.L;
+}
 
-        // Terminate path if ray escaped or _maxDepth_ was reached
-        if (!foundIntersection || bounces >= maxDepth) {
-                //std::cout << "No intersection" << std::endl;
-                break;
-        }
+bool PathIntegrator::ExtendPath(PathState *path, bool foundIntersection,
+                                SurfaceInteraction *isect, const Scene &scene,
+                                Sampler &sampler, MemoryArena &arena) const {
+    Spectrum &L = path->L, &beta = path->beta;
+    RayDifferential &ray = path->ray;
+    bool &specularBounce = path->specularBounce;
+    int &bounces = path->bounces;
 
-        // Compute scattering functions and skip over medium boundaries
-        isect.ComputeScatteringFunctions(ray, arena, true);
-        if (!isect.bsdf) {
-            VLOG(2) << "Skipping intersection due to null bsdf";
-            ray = isect.SpawnRay(ray.d);
-            bounces--;
-            continue;
+    // Possibly add emitted light at intersection
+    if (bounces == 0 || specularBounce) {
+        // Add emitted light at path vertex or from the environment
+        if (foundIntersection) {
+            L += beta * isect->Le(-ray.d);
+            VLOG(2) << "Added Le -> L = " << L;
+        } else {
+            for (const auto &light : scene.infiniteLights)
+                L += beta * light->Le(ray);
+            VLOG(2) << "Added infinite area lights -> L = " << L;
         }
+    }
 
-        const Distribution1D *distrib = lightDistribution->Lookup(isect.p);
-
-        // Sample illumination from lights to find path contribution.
-        // (But skip this for perfectly specular BSDFs.)
-        if (isect.bsdf->NumComponents(BxDFType(BSDF_ALL & ~BSDF_SPECULAR)) >
-            0) {
-            ++totalPaths;
-            Spectrum Ld = beta * UniformSampleOneLight(isect, scene, arena,
-                                                       sampler, false, distrib);
-            VLOG(2) << "Sampled direct lighting Ld = " << Ld;
-            if (Ld.IsBlack()) ++zeroRadiancePaths;
-            CHECK_GE(Ld.y(), 0.f);
-            L += Ld;
-            //std::cout << "Add Ld" << Ld << ", beta: " << beta << std::endl;
-        }
+    // Terminate path if ray escaped or _maxDepth_ was reached
+    if (!foundIntersection || bounces >= maxDepth) return false;
+
+    // Compute scattering functions and skip over medium boundaries
+    isect->ComputeScatteringFunctions(ray, arena, true);
+    if (!isect->bsdf) {
+        VLOG(2) << "Skipping intersection due to null bsdf";
+        ray = isect->SpawnRay(ray.d);
+        return true;
+    }
+
+    const Distribution1D *distrib = lightDistribution->Lookup(isect->p);
+
+    // Sample illumination from lights to find path contribution.
+    // (But skip this for perfectly specular BSDFs.)
+    if (isect->bsdf->NumComponents(BxDFType(BSDF_ALL & ~BSDF_SPECULAR)) > 0) {
+        ++totalPaths;
+        Spectrum Ld = beta * UniformSampleOneLight(*isect, scene, arena,
+                                                   sampler, false, distrib);
+        VLOG(2) << "Sampled direct lighting Ld = " << Ld;
+        if (Ld.IsBlack()) ++zeroRadiancePaths;
+        CHECK_GE(Ld.y(), 0.f);
+        L += Ld;
+    }
+
+    // Sample BSDF to get new path direction
+    Vector3f wo = -ray.d, wi;
+    Float pdf;
+    BxDFType flags;
+    Spectrum f = isect->bsdf->Sample_f(wo, &wi, sampler.Get2D(), &pdf,
+                                      BSDF_ALL, &flags);
+    VLOG(2) << "Sampled BSDF, f = " << f << ", pdf = " << pdf;
+    if (f.IsBlack() || pdf == 0.f) return false;
+    beta *= f * AbsDot(wi, isect->shading.n) / pdf;
+    VLOG(2) << "Updated beta = " << beta;
+    CHECK_GE(beta.y(), 0.f);
+    DCHECK(!std::isinf(beta.y()));
+    specularBounce = (flags & BSDF_SPECULAR) != 0;
+    if ((flags & BSDF_SPECULAR) && (flags & BSDF_TRANSMISSION)) {
+        Float eta = isect->bsdf->eta;
+        // Update the term that tracks radiance scaling for refraction
+        // depending on whether the ray is entering or leaving the
+        // medium.
+        path->etaScale *=
+            (Dot(wo, isect->n) > 0) ? (eta * eta) : 1 / (eta * eta);
+    }
+    ray = isect->SpawnRay(wi);
+
+    // Account for subsurface scattering, if applicable
+    if (isect->bssrdf && (flags & BSDF_TRANSMISSION)) {
+        // Importance sample the BSSRDF
+        SurfaceInteraction pi;
+        Spectrum S = isect->bssrdf->Sample_S(
+            scene, sampler.Get1D(), sampler.Get2D(), arena, &pi, &pdf);
+        DCHECK(!std::isinf(beta.y()));
+        if (S.IsBlack() || pdf == 0) return false;
+        beta *= S / pdf;
+
+        // Account for the direct subsurface scattering component
+        L += beta * UniformSampleOneLight(pi, scene, arena, sampler, false,
+                                          lightDistribution->Lookup(pi.p));
 
-        // Sample BSDF to get new path direction
-        Vector3f wo = -ray.d, wi;
-        Float pdf;
-        BxDFType flags;
-        Spectrum f = isect.bsdf->Sample_f(wo, &wi, sampler.Get2D(), &pdf,
-                                          BSDF_ALL, &flags);
-        VLOG(2) << "Sampled BSDF, f = " << f << ", pdf = " << pdf;
-        if (f.IsBlack() || pdf == 0.f) break;
-        beta *= f * AbsDot(wi, isect.shading.n) / pdf;
-        VLOG(2) << "Updated beta = " << beta;
-        CHECK_GE(beta.y(), 0.f);
+        // Account for the indirect subsurface scattering component
+        Spectrum f = pi.bsdf->Sample_f(pi.wo, &wi, sampler.Get2D(), &pdf,
+                                       BSDF_ALL, &flags);
+        if (f.IsBlack() || pdf == 0) return false;
+        beta *= f * AbsDot(wi, pi.shading.n) / pdf;
         DCHECK(!std::isinf(beta.y()));
         specularBounce = (flags & BSDF_SPECULAR) != 0;
-        if ((flags & BSDF_SPECULAR) && (flags & BSDF_TRANSMISSION)) {
-            Float eta = isect.bsdf->eta;
-            // Update the term that tracks radiance scaling for refraction
-            // depending on whether the ray is entering or leaving the
-            // medium.
-            etaScale *= (Dot(wo, isect.n) > 0) ? (eta * eta) : 1 / (eta * eta);
+        ray = pi.SpawnRay(wi);
+    }
+
+    // Possibly terminate the path with Russian roulette.
+    // Factor out radiance scaling due to refraction in rrBeta.
+    Spectrum rrBeta = beta * path->etaScale;
+    if (rrBeta.MaxComponentValue() < rrThreshold && bounces > 3) {
+        Float q = std::max((Float).05, 1 - rrBeta.MaxComponentValue());
+        if (sampler.Get1D() < q) return false;
+        beta /= 1 - q;
+        DCHECK(!std::isinf(beta.y()));
+    }
+    ++bounces;
+    return true;
+}
+
+// Returns a key that orders rays by direction octant and then by the cell
+// of a 32^3 grid over _bounds_ that holds their origin; origins outside of
+// _bounds_ go to the nearest cell.
+static uint32_t RayCoherenceKey(const Ray &ray, const Bounds3f &bounds) {
+    Vector3f o = bounds.Offset(ray.o);
+    uint32_t key = (ray.d.x < 0) | ((ray.d.y < 0) << 1) | ((ray.d.z < 0) << 2);
+    for (int c = 0; c < 3; ++c)
+        key = (key << 5) | int(Clamp(o[c] * 32, 0, 31));
+    return key;
+}
+
+void PathIntegrator::RenderTile(const Scene &scene, const Bounds2i &tileBounds,
+                                Sampler &tileSampler, FilmTile *filmTile,
+                                MemoryArena &arena) const {
+    if (!sortRays) {
+        SamplerIntegrator::RenderTile(scene, tileBounds, tileSampler,
+                                      filmTile, arena);
+        return;
+    }
+
+    // Start a sampler for each of the tile's pixels so that their paths
+    // can be advanced together
+    std::vector<Point2i> pixels;
+    std::vector<std::unique_ptr<Sampler>> samplers;
+    int xResolution = camera->film->fullResolution.x;
+    for (Point2i pixel : tileBounds) {
+        std::unique_ptr<Sampler> pixelSampler =
+            tileSampler.Clone(pixel.y * xResolution + pixel.x);
+        {
+            ProfilePhase pp(Prof::StartPixel);
+            pixelSampler->StartPixel(pixel);
+        }
+        if (!InsideExclusive(pixel, pixelBounds)) continue;
+        pixels.push_back(pixel);
+        samplers.push_back(std::move(pixelSampler));
+    }
+    size_t nPixels = pixels.size();
+    std::vector<CameraSample> cameraSamples(nPixels);
+    std::vector<RayDifferential> cameraRays(nPixels);
+    std::vector<Float> rayWeights(nPixels);
+    std::vector<PathState> paths(nPixels);
+    std::vector<std::pair<uint32_t, int>> activePaths;
+    std::vector<SurfaceInteraction> isects(nPixels);
+    std::unique_ptr<bool[]> hits(new bool[nPixels]);
+
+    // Trace one sample's path for each pixel at a time
+    Bounds3f sceneBounds = scene.WorldBound();
+    for (int64_t sample = 0; sample < tileSampler.samplesPerPixel; ++sample) {
+        // Generate camera rays to start the paths
+        activePaths.clear();
+        for (size_t i = 0; i < nPixels; ++i) {
+            rayWeights[i] = GenerateCameraRay(*samplers[i], pixels[i],
+                                              &cameraSamples[i], &cameraRays[i]);
+            paths[i] = PathState();
+            paths[i].ray = cameraRays[i];
+            if (rayWeights[i] > 0)
+                activePaths.push_back(std::make_pair(0u, (int)i));
         }
-        ray = isect.SpawnRay(wi);
-
-        // Account for subsurface scattering, if applicable
-        if (isect.bssrdf && (flags & BSDF_TRANSMISSION)) {
-            // Importance sample the BSSRDF
-            SurfaceInteraction pi;
-            Spectrum S = isect.bssrdf->Sample_S(
-                scene, sampler.Get1D(), sampler.Get2D(), arena, &pi, &pdf);
-            DCHECK(!std::isinf(beta.y()));
-            if (S.IsBlack() || pdf == 0) break;
-            beta *= S / pdf;
-
-            // Account for the direct subsurface scattering component
-            L += beta * UniformSampleOneLight(pi, scene, arena, sampler, false,
-                                              lightDistribution->Lookup(pi.p));
-
-            // Account for the indirect subsurface scattering component
-            Spectrum f = pi.bsdf->Sample_f(pi.wo, &wi, sampler.Get2D(), &pdf,
-                                           BSDF_ALL, &flags);
-            if (f.IsBlack() || pdf == 0) break;
-            beta *= f * AbsDot(wi, pi.shading.n) / pdf;
-            DCHECK(!std::isinf(beta.y()));
-            specularBounce = (flags & BSDF_SPECULAR) != 0;
-            ray = pi.SpawnRay(wi);
+
+        // Extend all of the active paths by one vertex at a time, tracing
+        // their rays sorted by direction and origin
+        while (!activePaths.empty()) {
+            ProfilePhase p(Prof::SamplerIntegratorLi);
+            for (auto &ap : activePaths)
+                ap.first = RayCoherenceKey(paths[ap.second].ray, sceneBounds);
+            std::sort(activePaths.begin(), activePaths.end());
+            for (size_t j = 0; j < activePaths.size(); ++j)
+                hits[j] = scene.Intersect(paths[activePaths[j].second].ray,
+                                          &isects[j]);
+
+            size_t nActive = 0;
+            for (size_t j = 0; j < activePaths.size(); ++j) {
+                int i = activePaths[j].second;
+                if (ExtendPath(&paths[i], hits[j], &isects[j], scene,
+                               *samplers[i], arena))
+                    activePaths[nActive++] = activePaths[j];
+                else
+                    ReportValue(pathLength, paths[i].bounces);
+            }
+            activePaths.resize(nActive);
+
+            // Free _MemoryArena_ memory from extending the paths; it's
+            // only used for the vertex being added
+            arena.Reset();
         }
 
-        // Possibly terminate the path with Russian roulette.
-        // Factor out radiance scaling due to refraction in rrBeta.
-        Spectrum rrBeta = beta * etaScale;
-        if (rrBeta.MaxComponentValue() < rrThreshold && bounces > 3) {
-            Float q = std::max((Float).05, 1 - rrBeta.MaxComponentValue());
-            if (sampler.Get1D() < q) break;
-            beta /= 1 - q;
-            DCHECK(!std::isinf(beta.y()));
+        // Add the paths' radiance to the image
+        for (size_t i = 0; i < nPixels; ++i) {
+            Spectrum L = rayWeights[i] > 0 ? paths[i].L : Spectrum(0.f);
+            AddSample(filmTile, pixels[i], *samplers[i], cameraSamples[i],
+                      cameraRays[i], L, rayWeights[i]);
+            samplers[i]->StartNextSample();
         }
     }
-    ReportValue(pathLength, bounces);
-    //std::cout << "Return L: " << L << std::endl;
-    return L;
 }
 
 PathIntegrator *CreatePathIntegrator(const ParamSet &params,
@@ -215,8 +309,9 @@ PathIntegrator *CreatePathIntegrator(const ParamSet &params,
     Float rrThreshold = params.FindOneFloat("rrthreshold", 1.);
     std::string lightStrategy =
         params.FindOneString("lightsamplestrategy", "spatial");
+    bool sortRays = params.FindOneBool("sortrays", false);
     return new PathIntegrator(maxDepth, camera, sampler, pixelBounds,
-                              rrThreshold, lightStrategy);
+                              rrThreshold, lightStrategy, sortRays);
 }
 
 }  // namespace pbrt
@@ -52,17 +52,44 @@ class PathIntegrator : public SamplerIntegrator {
     PathIntegrator(int maxDepth, std::shared_ptr<const Camera> camera,
                    std::shared_ptr<Sampler> sampler,
                    const Bounds2i &pixelBounds, Float rrThreshold = 1,
-                   const std::string &lightSampleStrategy = "spatial");
+                   const std::string &lightSampleStrategy = "spatial",
+                   bool sortRays = false);
 
     void Preprocess(const Scene &scene, Sampler &sampler);
     Spectrum Li(const RayDifferential &ray, const Scene &scene,
                 Sampler &sampler, MemoryArena &arena, int depth) const;
+    void RenderTile(const Scene &scene, const Bounds2i &tileBounds,
+                    Sampler &tileSampler, FilmTile *filmTile,
+                    MemoryArena &arena) const;
 
   private:
+    // PathState Declarations
+    struct PathState {
+        Spectrum L = Spectrum(0.f), beta = Spectrum(1.f);
+        RayDifferential ray;
+        bool specularBounce = false;
+        int bounces = 0;
+        // Added after book publication: etaScale tracks the accumulated
+        // effect of radiance scaling due to rays passing through refractive
+        // boundaries (see the derivation on p. 527 of the third edition).
+        // We track this value in order to remove it from beta when we
+        // apply Russian roulette; this is worthwhile, since it lets us
+        // sometimes avoid terminating refracted rays that are about to be
+        // refracted back out of a medium and thus have their beta value
+        // increased.
+        Float etaScale = 1;
+    };
+
+    // PathIntegrator Private Methods
+    bool ExtendPath(PathState *path, bool foundIntersection,
+                    SurfaceInteraction *isect, const Scene &scene,
+                    Sampler &sampler, MemoryArena &arena) const;
+
     // PathIntegrator Private Data
     const int maxDepth;
     const Float rrThreshold;
     const std::string lightSampleStrategy;
+    const bool sortRays;
     std::unique_ptr<LightDistribution> lightDistribution;
 };
 
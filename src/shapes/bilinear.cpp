@@ -0,0 +1,530 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+// shapes/bilinear.cpp*
+#include "shapes/bilinear.h"
+#include "paramset.h"
+#include "rng.h"
+
+namespace pbrt {
+
+STAT_PERCENT("Intersections/Ray-bilinear patch intersection tests", nHits,
+             nTests);
+STAT_COUNTER("Scene/Bilinear patches", nPatchesCreated);
+
+// BilinearPatch Local Definitions
+template <typename T>
+static T Bilerp(Float u, Float v, const T &p00, const T &p10, const T &p01,
+                const T &p11) {
+    return (1 - u) * (1 - v) * p00 + u * (1 - v) * p10 + (1 - u) * v * p01 +
+           u * v * p11;
+}
+
+// Returns $\dpdu$ and $\dpdv$ of the patch with the given corners at $(u,v)$.
+static void PatchDerivatives(Float u, Float v, const Point3f &p00,
+                             const Point3f &p10, const Point3f &p01,
+                             const Point3f &p11, Vector3f *dpdu,
+                             Vector3f *dpdv) {
+    *dpdu = (1 - v) * (p10 - p00) + v * (p11 - p01);
+    *dpdv = (1 - u) * (p01 - p00) + u * (p11 - p10);
+}
+
+// Bounds the error in computing _Bilerp()_ of the corners at $(u,v)$ in
+// $[0,1]^2$. Each of its four terms is rounded at most four times when it
+// is computed and three more times when they are summed, and any such
+// $(u,v)$ is on the patch, so this bounds the distance to the surface.
+static Vector3f BilerpError(Float u, Float v, const Point3f &p00,
+                            const Point3f &p10, const Point3f &p01,
+                            const Point3f &p11) {
+    return gamma(7) *
+           Vector3f(Bilerp(u, v, Abs(p00), Abs(p10), Abs(p01), Abs(p11)));
+}
+
+// Returns the lengths of $\dpdu \times \dpdv$ at the patch's corners, in
+// the order of its vertices, and whether that length is exactly their
+// bilinear interpolation everywhere, which is the case for planar patches
+// that don't fold over themselves.
+static bool CornerJacobians(const Point3f &p00, const Point3f &p10,
+                            const Point3f &p01, const Point3f &p11,
+                            Float w[4]) {
+    Vector3f c[4];
+    for (int i = 0; i < 4; ++i) {
+        Vector3f dpdu, dpdv;
+        PatchDerivatives(i & 1, i >> 1, p00, p10, p01, p11, &dpdu, &dpdv);
+        c[i] = Cross(dpdu, dpdv);
+        w[i] = c[i].Length();
+    }
+    for (int i = 0; i < 4; ++i)
+        for (int j = i + 1; j < 4; ++j)
+            if (Cross(c[i], c[j]) != Vector3f(0, 0, 0) || Dot(c[i], c[j]) < 0)
+                return false;
+    return true;
+}
+
+// Samples $x \in [0,1)$ with density proportional to $(1-x)a + xb$.
+static Float SampleLinear(Float u, Float a, Float b) {
+    if (a + b == 0) return u;
+    if (u == 0 && a == 0) return 0;
+    Float x = u * (a + b) / (a + std::sqrt(Lerp(u, a * a, b * b)));
+    return std::min(x, OneMinusEpsilon);
+}
+
+// Samples $[0,1)^2$ with density proportional to the bilinear
+// interpolation of the nonnegative corner values _w_; _BilinearPdf()_
+// returns that density.
+static Point2f SampleBilinear(const Point2f &u, const Float w[4]) {
+    Float v = SampleLinear(u[1], w[0] + w[1], w[2] + w[3]);
+    return Point2f(SampleLinear(u[0], Lerp(v, w[0], w[2]), Lerp(v, w[1], w[3])),
+                   v);
+}
+
+static Float BilinearPdf(const Point2f &p, const Float w[4]) {
+    Float sum = w[0] + w[1] + w[2] + w[3];
+    if (sum == 0) return 1;
+    return 4 * Bilerp(p[0], p[1], w[0], w[1], w[2], w[3]) / sum;
+}
+
+// BilinearPatch Function Definitions
+bool IntersectBilinearPatch(const Ray &ray, const Point3f &p00,
+                            const Point3f &p10, const Point3f &p01,
+                            const Point3f &p11, Float *tHit, Float *uHit,
+                            Float *vHit) {
+    // Find the $u$ values where the ray meets the patch's isolines of
+    // constant $u$; they are the roots of $a + b u + c u^2$
+    Vector3f e10 = p10 - p00, e11 = p11 - p10, e00 = p01 - p00;
+    Vector3f q00 = p00 - ray.o, q10 = p10 - ray.o;
+    Float a = Dot(Cross(q00, ray.d), e00);
+    Float c = Dot(Cross(e10, p01 - p11), ray.d);
+    Float b = Dot(Cross(q10, ray.d), e11) - (a + c);
+    Float uRoots[2];
+    int nRoots;
+    if (c == 0) {
+        // The patch's isolines are all parallel to a plane containing the ray
+        if (b == 0) return false;
+        uRoots[0] = -a / b;
+        nRoots = 1;
+    } else {
+        Float discrim = b * b - 4 * a * c;
+        if (discrim < 0) return false;
+        Float q = -.5 * (b + std::copysign(std::sqrt(discrim), b));
+        uRoots[0] = q / c;
+        uRoots[1] = (q != 0) ? a / q : uRoots[0];
+        nRoots = 2;
+    }
+
+    // Intersect the ray with the isoline at each root and keep the closest
+    // hit inside the patch
+    bool hit = false;
+    Float tClosest = ray.tMax;
+    for (int i = 0; i < nRoots; ++i) {
+        Float u = uRoots[i];
+        if (u < 0 || u > 1) continue;
+        Vector3f pa = (1 - u) * q00 + u * q10;
+        Vector3f pb = (1 - u) * e00 + u * e11;
+        Vector3f n = Cross(ray.d, pb);
+        Float det = Dot(n, n);
+        if (det == 0) continue;
+        n = Cross(n, pa);
+        Float v = Dot(n, ray.d) / det;
+        if (v < 0 || v > 1) continue;
+
+        // Skip points where the patch is degenerate and has no normal
+        Vector3f dpdu, dpdv;
+        PatchDerivatives(u, v, p00, p10, p01, p11, &dpdu, &dpdv);
+        if (Cross(dpdu, dpdv).LengthSquared() == 0) continue;
+
+        // Compute $t$ for the hit point and reject it if rounding error
+        // could have moved it from behind the ray's origin. The error in
+        // the point and the dot product's own rounding bound that of
+        // $t$'s numerator; the denominator only adds relative error.
+        Vector3f q = Bilerp(u, v, p00, p10, p01, p11) - ray.o;
+        Vector3f qError =
+            BilerpError(u, v, p00, p10, p01, p11) + gamma(1) * Abs(q);
+        Float dLengthSquared = ray.d.LengthSquared();
+        Float t = Dot(q, ray.d) / dLengthSquared;
+        Float tError = (1 + gamma(4)) *
+                       (Dot(qError, Abs(ray.d)) +
+                        gamma(3) * Dot(Abs(q), Abs(ray.d))) /
+                       dLengthSquared;
+        if (t <= tError || t >= tClosest) continue;
+        tClosest = t;
+        *uHit = u;
+        *vHit = v;
+        hit = true;
+    }
+    if (!hit) return false;
+    *tHit = tClosest;
+    return true;
+}
+
+// BilinearPatch Method Definitions
+BilinearPatchMesh::BilinearPatchMesh(const Transform &ObjectToWorld,
+                                     int nPatches, const Int *vertexIndices,
+                                     int nVertices, const Point3f *P,
+                                     const Normal3f *N, const Point2f *UV)
+    : nPatches(nPatches),
+      nVertices(nVertices),
+      vertexIndices(vertexIndices, vertexIndices + 4 * nPatches) {
+    blpMeshBytes += sizeof(*this) + this->vertexIndices.size() * sizeof(int) +
+                    nVertices * (sizeof(*P) + (N ? sizeof(*N) : 0) +
+                                 (UV ? sizeof(*UV) : 0));
+
+    // Transform mesh vertices to world space
+    p.reset(new Point3f[nVertices]);
+    for (int i = 0; i < nVertices; ++i) p[i] = ObjectToWorld(P[i]);
+
+    // Copy _UV_ and _N_ vertex data, if present
+    if (UV) {
+        uv.reset(new Point2f[nVertices]);
+        memcpy(uv.get(), UV, nVertices * sizeof(Point2f));
+    }
+    if (N) {
+        n.reset(new Normal3f[nVertices]);
+        for (int i = 0; i < nVertices; ++i) n[i] = ObjectToWorld(N[i]);
+    }
+}
+
+BilinearPatch::BilinearPatch(const Transform *ObjectToWorld,
+                             const Transform *WorldToObject,
+                             bool reverseOrientation,
+                             const std::shared_ptr<BilinearPatchMesh> &mesh,
+                             int patchNumber)
+    : Shape(ObjectToWorld, WorldToObject, reverseOrientation),
+      mesh(mesh),
+      patchNumber(patchNumber) {
+    ++nPatchesCreated;
+    blpMeshBytes += sizeof(*this);
+
+    // Compute the patch's area
+    Point3f p00, p10, p01, p11;
+    GetVertices(&p00, &p10, &p01, &p11);
+    if ((p00 - p10) - (p01 - p11) == Vector3f(0, 0, 0))
+        // The patch is a parallelogram
+        area = Cross(p10 - p00, p01 - p00).Length();
+    else {
+        // Integrate $\|\dpdu \times \dpdv\|$ with a $4\times4$ Gauss-Legendre
+        // rule
+        const Float nodes[4] = {0.069431844202973712, 0.33000947820757187,
+                                0.66999052179242813, 0.93056815579702629};
+        const Float weights[4] = {0.17392742256872693, 0.32607257743127307,
+                                  0.32607257743127307, 0.17392742256872693};
+        area = 0;
+        for (int i = 0; i < 4; ++i)
+            for (int j = 0; j < 4; ++j) {
+                Vector3f dpdu, dpdv;
+                PatchDerivatives(nodes[i], nodes[j], p00, p10, p01, p11, &dpdu,
+                                 &dpdv);
+                area += weights[i] * weights[j] * Cross(dpdu, dpdv).Length();
+            }
+    }
+}
+
+Bounds3f BilinearPatch::ObjectBound() const {
+    Point3f p00, p10, p01, p11;
+    GetVertices(&p00, &p10, &p01, &p11);
+    return Union(Bounds3f((*WorldToObject)(p00), (*WorldToObject)(p10)),
+                 Bounds3f((*WorldToObject)(p01), (*WorldToObject)(p11)));
+}
+
+Bounds3f BilinearPatch::WorldBound() const {
+    // A bilinear patch lies inside the convex hull of its corners
+    Point3f p00, p10, p01, p11;
+    GetVertices(&p00, &p10, &p01, &p11);
+    return Union(Bounds3f(p00, p10), Bounds3f(p01, p11));
+}
+
+bool BilinearPatch::IntersectPatch(const Ray &ray, Float *tHit, Float *uHit,
+                                   Float *vHit) const {
+    ++nTests;
+    Point3f p00, p10, p01, p11;
+    GetVertices(&p00, &p10, &p01, &p11);
+    if (!IntersectBilinearPatch(ray, p00, p10, p01, p11, tHit, uHit, vHit))
+        return false;
+    ++nHits;
+    return true;
+}
+
+bool BilinearPatch::Intersect(const Ray &ray, Float *tHit,
+                              SurfaceInteraction *isect,
+                              bool testAlphaTexture) const {
+    ProfilePhase p(Prof::ShapeIntersect);
+    Float t, u, v;
+    if (!IntersectPatch(ray, &t, &u, &v)) return false;
+    Point3f p00, p10, p01, p11;
+    GetVertices(&p00, &p10, &p01, &p11);
+
+    // Compute the hit point and its partial derivatives
+    Point3f pHit = Bilerp(u, v, p00, p10, p01, p11);
+    Vector3f dpdu, dpdv;
+    PatchDerivatives(u, v, p00, p10, p01, p11, &dpdu, &dpdv);
+
+    // Compute $\dndu$ and $\dndv$ from the fundamental forms; only the
+    // mixed second derivative of a bilinear patch is nonzero
+    Vector3f d2Pduv = (p00 - p10) - (p01 - p11);
+    Float E = Dot(dpdu, dpdu);
+    Float F = Dot(dpdu, dpdv);
+    Float G = Dot(dpdv, dpdv);
+    Vector3f N = Normalize(Cross(dpdu, dpdv));
+    Float f = Dot(N, d2Pduv);
+    Float invEGF2 = 1 / (E * G - F * F);
+    Normal3f dndu = Normal3f((f * F) * invEGF2 * dpdu +
+                             (-f * E) * invEGF2 * dpdv);
+    Normal3f dndv = Normal3f((-f * G) * invEGF2 * dpdu +
+                             (f * F) * invEGF2 * dpdv);
+
+    // Reparameterize by the mesh's $(u,v)$s, if present
+    const int *vi = &mesh->vertexIndices[4 * patchNumber];
+    Point2f uvHit(u, v);
+    Float duds = 1, dudt = 0, dvds = 0, dvdt = 1;
+    if (mesh->uv) {
+        const Point2f &uv00 = mesh->uv[vi[0]], &uv10 = mesh->uv[vi[1]];
+        const Point2f &uv01 = mesh->uv[vi[2]], &uv11 = mesh->uv[vi[3]];
+        uvHit = Bilerp(u, v, uv00, uv10, uv01, uv11);
+        Vector2f dstdu = (1 - v) * (uv10 - uv00) + v * (uv11 - uv01);
+        Vector2f dstdv = (1 - u) * (uv01 - uv00) + u * (uv11 - uv10);
+        Float determinant = dstdu[0] * dstdv[1] - dstdu[1] * dstdv[0];
+        if (std::abs(determinant) > 1e-8) {
+            // Invert the Jacobian of $(s,t)$ with respect to $(u,v)$,
+            // keeping the patch's orientation
+            Float invDet = 1 / determinant;
+            duds = dstdv[1] * invDet;
+            dudt = -dstdv[0] * invDet;
+            dvds = -dstdu[1] * invDet;
+            dvdt = dstdu[0] * invDet;
+            if (determinant < 0) {
+                dudt = -dudt;
+                dvdt = -dvdt;
+            }
+        }
+    }
+    auto reparameterize = [&](const Vector3f &du, const Vector3f &dv,
+                              Vector3f *ds, Vector3f *dt) {
+        *ds = duds * du + dvds * dv;
+        *dt = dudt * du + dvdt * dv;
+    };
+    Vector3f dpds, dpdt, dnds, dndt;
+    reparameterize(dpdu, dpdv, &dpds, &dpdt);
+    reparameterize(Vector3f(dndu), Vector3f(dndv), &dnds, &dndt);
+
+    // Compute error bounds for the hit point
+    Vector3f pError = BilerpError(u, v, p00, p10, p01, p11);
+
+    *isect = SurfaceInteraction(pHit, pError, uvHit, -ray.d, dpds, dpdt,
+                                Normal3f(dnds), Normal3f(dndt), ray.time,
+                                this);
+
+    if (mesh->n) {
+        // Initialize shading geometry from the interpolated vertex normals
+        const Normal3f &n00 = mesh->n[vi[0]], &n10 = mesh->n[vi[1]];
+        const Normal3f &n01 = mesh->n[vi[2]], &n11 = mesh->n[vi[3]];
+        Normal3f ns = Bilerp(u, v, n00, n10, n01, n11);
+        if (ns.LengthSquared() > 0) {
+            ns = Normalize(ns);
+            Vector3f ss = Normalize(isect->dpdu);
+            Vector3f ts = Cross(ss, ns);
+            if (ts.LengthSquared() > 0) {
+                ts = Normalize(ts);
+                ss = Cross(ts, ns);
+            } else
+                CoordinateSystem((Vector3f)ns, &ss, &ts);
+            Vector3f dnsdu((1 - v) * (n10 - n00) + v * (n11 - n01));
+            Vector3f dnsdv((1 - u) * (n01 - n00) + u * (n11 - n10));
+            reparameterize(dnsdu, dnsdv, &dnds, &dndt);
+            isect->SetShadingGeometry(ss, ts, Normal3f(dnds), Normal3f(dndt),
+                                      true);
+        }
+    }
+    *tHit = t;
+    return true;
+}
+
+bool BilinearPatch::IntersectP(const Ray &ray, bool testAlphaTexture) const {
+    ProfilePhase p(Prof::ShapeIntersectP);
+    Float t, u, v;
+    return IntersectPatch(ray, &t, &u, &v);
+}
+
+Interaction BilinearPatch::Sample(const Point2f &u, Float *pdf) const {
+    Point3f p00, p10, p01, p11;
+    GetVertices(&p00, &p10, &p01, &p11);
+
+    // Sample $(u,v)$ in proportion to the bilinear interpolation of
+    // $\|\dpdu \times \dpdv\|$ at the corners, which is that length
+    // exactly, and so uniform by area, for planar patches
+    Float w[4];
+    bool exact = CornerJacobians(p00, p10, p01, p11, w);
+    Point2f uv = SampleBilinear(u, w);
+    Vector3f dpdu, dpdv;
+    PatchDerivatives(uv[0], uv[1], p00, p10, p01, p11, &dpdu, &dpdv);
+    Vector3f n = Cross(dpdu, dpdv);
+    *pdf = AreaPdf(uv, w, exact);
+
+    Interaction it;
+    it.p = Bilerp(uv[0], uv[1], p00, p10, p01, p11);
+    it.n = Normal3f(n);
+    if (it.n.LengthSquared() > 0) it.n = Normalize(it.n);
+
+    // Orient the normal as _Intersect()_ does
+    const int *vi = &mesh->vertexIndices[4 * patchNumber];
+    if (mesh->n) {
+        Normal3f ns = Bilerp(uv[0], uv[1], mesh->n[vi[0]], mesh->n[vi[1]],
+                             mesh->n[vi[2]], mesh->n[vi[3]]);
+        it.n = Faceforward(it.n, ns);
+    } else if (reverseOrientation ^ transformSwapsHandedness)
+        it.n *= -1;
+    it.pError = BilerpError(uv[0], uv[1], p00, p10, p01, p11);
+    return it;
+}
+
+Float BilinearPatch::Pdf(const Interaction &it) const {
+    Point3f p00, p10, p01, p11;
+    GetVertices(&p00, &p10, &p01, &p11);
+    Float w[4];
+    if (CornerJacobians(p00, p10, p01, p11, w)) return 1 / Area();
+
+    // Find the point's $(u,v)$ with Gauss-Newton iterations that
+    // minimize its distance to the patch
+    Point2f uv(.5, .5);
+    for (int i = 0; i < 8; ++i) {
+        Vector3f dpdu, dpdv;
+        PatchDerivatives(uv[0], uv[1], p00, p10, p01, p11, &dpdu, &dpdv);
+        Vector3f r = it.p - Bilerp(uv[0], uv[1], p00, p10, p01, p11);
+        Float E = Dot(dpdu, dpdu), F = Dot(dpdu, dpdv), G = Dot(dpdv, dpdv);
+        Float det = E * G - F * F;
+        if (det == 0) break;
+        Float a = Dot(r, dpdu), b = Dot(r, dpdv);
+        uv = Point2f(Clamp(uv[0] + (G * a - F * b) / det, 0, 1),
+                     Clamp(uv[1] + (E * b - F * a) / det, 0, 1));
+    }
+    return AreaPdf(uv, w, false);
+}
+
+Float BilinearPatch::Pdf(const Interaction &ref, const Vector3f &wi) const {
+    Point3f p00, p10, p01, p11;
+    GetVertices(&p00, &p10, &p01, &p11);
+    Float w[4];
+    if (CornerJacobians(p00, p10, p01, p11, w)) return Shape::Pdf(ref, wi);
+
+    // Find the $(u,v)$ of the point that _wi_ hits and convert its area
+    // density to solid angle
+    Ray ray = ref.SpawnRay(wi);
+    Float t, u, v;
+    if (!IntersectPatch(ray, &t, &u, &v)) return 0;
+    Vector3f dpdu, dpdv;
+    PatchDerivatives(u, v, p00, p10, p01, p11, &dpdu, &dpdv);
+    Vector3f n = Normalize(Cross(dpdu, dpdv));
+    Float pdf = AreaPdf(Point2f(u, v), w, false) *
+                DistanceSquared(ref.p, Bilerp(u, v, p00, p10, p01, p11)) /
+                AbsDot(n, -wi);
+    if (std::isinf(pdf)) pdf = 0.f;
+    return pdf;
+}
+
+Float BilinearPatch::AreaPdf(const Point2f &uv, const Float w[4],
+                             bool exact) const {
+    // Planar patches' samples are uniform by area, and their _Area()_ is
+    // exact, so return the same value as _Shape::Pdf()_ does
+    if (exact) return 1 / Area();
+    Point3f p00, p10, p01, p11;
+    GetVertices(&p00, &p10, &p01, &p11);
+    Vector3f dpdu, dpdv;
+    PatchDerivatives(uv[0], uv[1], p00, p10, p01, p11, &dpdu, &dpdv);
+    Float jacobian = Cross(dpdu, dpdv).Length();
+    return jacobian > 0 ? BilinearPdf(uv, w) / jacobian : 0;
+}
+
+std::vector<std::shared_ptr<Shape>> CreateBilinearPatchMesh(
+    const Transform *ObjectToWorld, const Transform *WorldToObject,
+    bool reverseOrientation, int nPatches, const Int *vertexIndices,
+    int nVertices, const Point3f *p, const Normal3f *n, const Point2f *uv) {
+    std::shared_ptr<BilinearPatchMesh> mesh =
+        std::make_shared<BilinearPatchMesh>(*ObjectToWorld, nPatches,
+                                            vertexIndices, nVertices, p, n,
+                                            uv);
+    std::vector<std::shared_ptr<Shape>> patches;
+    patches.reserve(nPatches);
+    for (int i = 0; i < nPatches; ++i)
+        patches.push_back(std::make_shared<BilinearPatch>(
+            ObjectToWorld, WorldToObject, reverseOrientation, mesh, i));
+    return patches;
+}
+
+std::vector<std::shared_ptr<Shape>> CreateBilinearPatchMeshShape(
+    const Transform *o2w, const Transform *w2o, bool reverseOrientation,
+    const ParamSet &params) {
+    int nvi, npi, nuvi, nni;
+    const Int *vi = params.FindInt("indices", &nvi);
+    const Point3f *P = params.FindPoint3f("P", &npi);
+    if (!P) {
+        Error("Vertex positions \"P\" not provided with bilinear mesh shape");
+        return std::vector<std::shared_ptr<Shape>>();
+    }
+    // A single patch may omit its indices
+    const Int defaultIndices[4] = {0, 1, 2, 3};
+    if (!vi) {
+        if (npi != 4) {
+            Error(
+                "Vertex indices \"indices\" not provided with bilinear mesh "
+                "shape");
+            return std::vector<std::shared_ptr<Shape>>();
+        }
+        vi = defaultIndices;
+        nvi = 4;
+    }
+    if (nvi % 4 != 0) {
+        Error("Number of vertex indices %d for bilinear mesh not a multiple "
+              "of 4", nvi);
+        return std::vector<std::shared_ptr<Shape>>();
+    }
+    for (int i = 0; i < nvi; ++i)
+        if (vi[i] < 0 || vi[i] >= npi) {
+            Error(
+                "bilinearmesh has out of-bounds vertex index %" PRId64 " (%d "
+                "\"P\" values were given", (int64_t)vi[i], npi);
+            return std::vector<std::shared_ptr<Shape>>();
+        }
+
+    const Point2f *uvs = params.FindPoint2f("uv", &nuvi);
+    if (uvs && nuvi != npi) {
+        Error("Number of \"uv\"s for bilinear mesh must match \"P\"s");
+        uvs = nullptr;
+    }
+    const Normal3f *N = params.FindNormal3f("N", &nni);
+    if (N && nni != npi) {
+        Error("Number of \"N\"s for bilinear mesh must match \"P\"s");
+        N = nullptr;
+    }
+    return CreateBilinearPatchMesh(o2w, w2o, reverseOrientation, nvi / 4, vi,
+                                   npi, P, N, uvs);
+}
+
+}  // namespace pbrt
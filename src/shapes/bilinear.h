@@ -0,0 +1,131 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+#if defined(_MSC_VER)
+#define NOMINMAX
+#pragma once
+#endif
+
+#ifndef PBRT_SHAPES_BILINEAR_H
+#define PBRT_SHAPES_BILINEAR_H
+
+// shapes/bilinear.h*
+#include "shape.h"
+#include "stats.h"
+#include <map>
+
+namespace pbrt {
+
+STAT_MEMORY_COUNTER("Memory/Bilinear patch meshes", blpMeshBytes);
+
+// BilinearPatch Declarations
+struct BilinearPatchMesh {
+    // BilinearPatchMesh Public Methods
+    BilinearPatchMesh(const Transform &ObjectToWorld, int nPatches,
+                      const Int *vertexIndices, int nVertices,
+                      const Point3f *P, const Normal3f *N, const Point2f *uv);
+
+    // BilinearPatchMesh Data
+    const int nPatches, nVertices;
+    // Each patch has four vertex indices, giving its $(0,0)$, $(1,0)$,
+    // $(0,1)$ and $(1,1)$ corners in that order.
+    std::vector<int> vertexIndices;
+    std::unique_ptr<Point3f[]> p;
+    std::unique_ptr<Normal3f[]> n;
+    std::unique_ptr<Point2f[]> uv;
+};
+
+class BilinearPatch : public Shape {
+  public:
+    // BilinearPatch Public Methods
+    BilinearPatch(const Transform *ObjectToWorld,
+                  const Transform *WorldToObject, bool reverseOrientation,
+                  const std::shared_ptr<BilinearPatchMesh> &mesh,
+                  int patchNumber);
+    Bounds3f ObjectBound() const;
+    Bounds3f WorldBound() const;
+    bool Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
+                   bool testAlphaTexture = true) const;
+    bool IntersectP(const Ray &ray, bool testAlphaTexture = true) const;
+    Float Area() const { return area; }
+
+    using Shape::Sample;  // Bring in the other Sample() overload.
+    // Non-planar patches are sampled close to, but not exactly, uniformly
+    // by area, so their PDFs vary over the patch.
+    Interaction Sample(const Point2f &u, Float *pdf) const;
+    Float Pdf(const Interaction &it) const;
+    Float Pdf(const Interaction &ref, const Vector3f &wi) const;
+
+    // Returns the patch's world space corners.
+    void GetVertices(Point3f *p00, Point3f *p10, Point3f *p01,
+                     Point3f *p11) const {
+        const int *v = &mesh->vertexIndices[4 * patchNumber];
+        *p00 = mesh->p[v[0]];
+        *p10 = mesh->p[v[1]];
+        *p01 = mesh->p[v[2]];
+        *p11 = mesh->p[v[3]];
+    }
+
+  private:
+    // BilinearPatch Private Methods
+    bool IntersectPatch(const Ray &ray, Float *tHit, Float *u,
+                        Float *v) const;
+    // Returns the area density of _Sample()_ at the given $(u,v)$, given the
+    // corner values from _CornerJacobians()_ and whether they're exact.
+    Float AreaPdf(const Point2f &uv, const Float w[4], bool exact) const;
+
+    // BilinearPatch Private Data
+    std::shared_ptr<BilinearPatchMesh> mesh;
+    int patchNumber;
+    // Computing a non-planar patch's area requires numerical integration,
+    // so it's done once when the patch is created.
+    Float area;
+};
+
+// Finds the closest intersection of _ray_ with the bilinear patch with
+// the given corners in $(0,\infty)$ and before _ray.tMax_, returning its
+// $t$ and patch $(u,v)$.
+bool IntersectBilinearPatch(const Ray &ray, const Point3f &p00,
+                            const Point3f &p10, const Point3f &p01,
+                            const Point3f &p11, Float *tHit, Float *uHit,
+                            Float *vHit);
+std::vector<std::shared_ptr<Shape>> CreateBilinearPatchMesh(
+    const Transform *o2w, const Transform *w2o, bool reverseOrientation,
+    int nPatches, const Int *vertexIndices, int nVertices, const Point3f *p,
+    const Normal3f *n, const Point2f *uv);
+std::vector<std::shared_ptr<Shape>> CreateBilinearPatchMeshShape(
+    const Transform *o2w, const Transform *w2o, bool reverseOrientation,
+    const ParamSet &params);
+
+}  // namespace pbrt
+
+#endif  // PBRT_SHAPES_BILINEAR_H
@@ -44,45 +44,6 @@ STAT_INT_DISTRIBUTION("Intersections/Curve refinement level", refinementLevel);
 STAT_COUNTER("Scene/Curves", nCurves);
 STAT_COUNTER("Scene/Split curves", nSplitCurves);
 
-// Curve Utility Functions
-static Point3f BlossomBezier(const Point3f p[4], Float u0, Float u1, Float u2) {
-    Point3f a[3] = {Lerp(u0, p[0], p[1]), Lerp(u0, p[1], p[2]),
-                    Lerp(u0, p[2], p[3])};
-    Point3f b[2] = {Lerp(u1, a[0], a[1]), Lerp(u1, a[1], a[2])};
-    return Lerp(u2, b[0], b[1]);
-}
-
-inline void SubdivideBezier(const Point3f cp[4], Point3f cpSplit[7]) {
-    cpSplit[0] = cp[0];
-    cpSplit[1] = (cp[0] + cp[1]) / 2;
-    cpSplit[2] = (cp[0] + 2 * cp[1] + cp[2]) / 4;
-    cpSplit[3] = (cp[0] + 3 * cp[1] + 3 * cp[2] + cp[3]) / 8;
-    cpSplit[4] = (cp[1] + 2 * cp[2] + cp[3]) / 4;
-    cpSplit[5] = (cp[2] + cp[3]) / 2;
-    cpSplit[6] = cp[3];
-}
-
-static Point3f EvalBezier(const Point3f cp[4], Float u,
-                          Vector3f *deriv = nullptr) {
-    Point3f cp1[3] = {Lerp(u, cp[0], cp[1]), Lerp(u, cp[1], cp[2]),
-                      Lerp(u, cp[2], cp[3])};
-    Point3f cp2[2] = {Lerp(u, cp1[0], cp1[1]), Lerp(u, cp1[1], cp1[2])};
-    if (deriv) {
-        if ((cp2[1] - cp2[0]).LengthSquared() > 0)
-            *deriv = 3 * (cp2[1] - cp2[0]);
-        else {
-            // For a cubic Bezier, if the first three control points (say) are
-            // coincident, then the derivative of the curve is legitimately (0,0,0)
-            // at u=0.  This is problematic for us, though, since we'd like to be
-            // able to compute a surface normal there.  In that case, just punt and
-            // take the difference between the first and last control points, which
-            // ain't great, but will hopefully do.
-            *deriv = cp[3] - cp[0];
-        }
-    }
-    return Lerp(u, cp2[0], cp2[1]);
-}
-
 // Curve Method Definitions
 CurveCommon::CurveCommon(const Point3f c[4], Float width0, Float width1,
                          CurveType type, const Normal3f *norm)
@@ -214,7 +175,8 @@ bool Curve::Intersect(const Ray &r, Float *tHit, SurfaceInteraction *isect,
         std::max(common->width[0], common->width[1]) * .05f;  // width / 20
     auto Log2 = [](Float v) -> int {
         if (v < 1) return 0;
-        uint32_t bits = FloatToBits(v);
+        // Take the bits of a 32-bit float even when _Float_ is _double_.
+        uint32_t bits = FloatToBits(float(v));
         // https://graphics.stanford.edu/~seander/bithacks.html#IntegerLog
         // (With an additional add so get round-to-nearest rather than
         // round down.)
@@ -394,10 +356,7 @@ Interaction Curve::Sample(const Point2f &u, Float *pdf) const {
     return Interaction();
 }
 
-std::vector<std::shared_ptr<Shape>> CreateCurveShape(const Transform *o2w,
-                                                     const Transform *w2o,
-                                                     bool reverseOrientation,
-                                                     const ParamSet &params) {
+bool GetCurveDescription(const ParamSet &params, CurveDescription *curve) {
     Float width = params.FindOneFloat("width", 1.f);
     Float width0 = params.FindOneFloat("width0", width);
     Float width1 = params.FindOneFloat("width1", width);
@@ -406,14 +365,14 @@ std::vector<std::shared_ptr<Shape>> CreateCurveShape(const Transform *o2w,
     if (degree != 2 && degree != 3) {
         Error("Invalid degree %d: only degree 2 and 3 curves are supported.",
               degree);
-        return {};
+        return false;
     }
 
     std::string basis = params.FindOneString("basis", "bezier");
     if (basis != "bezier" && basis != "bspline") {
         Error("Invalid basis \"%s\": only \"bezier\" and \"bspline\" are "
               "supported.", basis.c_str());
-        return {};
+        return false;
     }
 
     int ncp;
@@ -427,14 +386,14 @@ std::vector<std::shared_ptr<Shape>> CreateCurveShape(const Transform *o2w,
             Error("Invalid number of control points %d: for the degree %d "
                   "Bezier basis %d + n * %d are required, for n >= 0.", ncp,
                   degree, degree + 1, degree);
-            return {};
+            return false;
         }
         nSegments = (ncp - 1) / degree;
     } else {
         if (ncp < degree + 1) {
             Error("Invalid number of control points %d: for the degree %d "
                   "b-spline basis, must have >= %d.", ncp, degree, degree + 1);
-            return {};
+            return false;
         }
         nSegments = ncp - degree;
     }
@@ -463,19 +422,28 @@ std::vector<std::shared_ptr<Shape>> CreateCurveShape(const Transform *o2w,
             Error(
                 "Invalid number of normals %d: must provide %d normals for ribbon "
                 "curves with %d segments.", nnorm, nSegments + 1, nSegments);
-            return {};
+            return false;
+        } else {
+            for (int i = 0; i < nnorm; ++i)
+                if (n[i].x == 0 && n[i].y == 0 && n[i].z == 0) {
+                    Error("Ribbon curve normal %d is zero.", i);
+                    return false;
+                }
         }
     } else if (type == CurveType::Ribbon) {
         Error(
             "Must provide normals \"N\" at curve endpoints with ribbon "
             "curves.");
-        return {};
+        return false;
     }
 
-    int sd = params.FindOneInt("splitdepth",
-                               int(params.FindOneFloat("splitdepth", 3)));
+    curve->type = type;
+    curve->splitDepth = params.FindOneInt(
+        "splitdepth", int(params.FindOneFloat("splitdepth", 3)));
+    curve->cp.reserve(4 * nSegments);
+    curve->width.reserve(2 * nSegments);
+    if (n) curve->n.reserve(2 * nSegments);
 
-    std::vector<std::shared_ptr<Shape>> curves;
     // Pointer to the first control point for the current segment. This is
     // updated after each loop iteration depending on the current basis.
     const Point3f *cpBase = cp;
@@ -546,10 +514,29 @@ std::vector<std::shared_ptr<Shape>> CreateCurveShape(const Transform *o2w,
             ++cpBase;
         }
 
-        auto c = CreateCurve(o2w, w2o, reverseOrientation, segCpBezier,
-                             Lerp(Float(seg) / Float(nSegments), width0, width1),
-                             Lerp(Float(seg + 1) / Float(nSegments), width0, width1),
-                             type, n ? &n[seg] : nullptr, sd);
+        curve->cp.insert(curve->cp.end(), segCpBezier, segCpBezier + 4);
+        curve->width.push_back(
+            Lerp(Float(seg) / Float(nSegments), width0, width1));
+        curve->width.push_back(
+            Lerp(Float(seg + 1) / Float(nSegments), width0, width1));
+        if (n) curve->n.insert(curve->n.end(), &n[seg], &n[seg + 2]);
+    }
+    return true;
+}
+
+std::vector<std::shared_ptr<Shape>> CreateCurveShape(const Transform *o2w,
+                                                     const Transform *w2o,
+                                                     bool reverseOrientation,
+                                                     const ParamSet &params) {
+    CurveDescription curve;
+    if (!GetCurveDescription(params, &curve)) return {};
+    std::vector<std::shared_ptr<Shape>> curves;
+    for (size_t seg = 0; seg < curve.width.size() / 2; ++seg) {
+        auto c = CreateCurve(o2w, w2o, reverseOrientation, &curve.cp[4 * seg],
+                             curve.width[2 * seg], curve.width[2 * seg + 1],
+                             curve.type,
+                             curve.n.empty() ? nullptr : &curve.n[2 * seg],
+                             curve.splitDepth);
         curves.insert(curves.end(), c.begin(), c.end());
     }
     return curves;
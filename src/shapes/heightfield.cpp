@@ -33,22 +33,22 @@
 
 // shapes/heightfield.cpp*
 #include "shapes/heightfield.h"
+#include "shapes/bilinear.h"
 #include "shapes/triangle.h"
 #include "paramset.h"
+#include "stats.h"
 
 namespace pbrt {
 
-// Heightfield Definitions
-std::vector<std::shared_ptr<Shape>> CreateHeightfield(
-    const Transform *ObjectToWorld, const Transform *WorldToObject,
-    bool reverseOrientation, const ParamSet &params) {
-    int nx = params.FindOneInt("nu", -1);
-    int ny = params.FindOneInt("nv", -1);
-    int nitems;
-    const Float *z = params.FindFloat("Pz", &nitems);
-    CHECK_EQ(nitems, nx * ny);
-    CHECK(nx != -1 && ny != -1 && z != nullptr);
+STAT_MEMORY_COUNTER("Memory/Heightfields", heightfieldBytes);
+STAT_PERCENT("Intersections/Ray-heightfield cell intersection tests",
+             nCellHits, nCellTests);
 
+// Heightfield Local Definitions
+// Returns the old tessellation of the heightfield into a triangle mesh.
+static std::vector<std::shared_ptr<Shape>> TessellateHeightfield(
+    const Transform *ObjectToWorld, const Transform *WorldToObject,
+    bool reverseOrientation, int nx, int ny, const Float *z) {
     int ntris = 2 * (nx - 1) * (ny - 1);
     std::unique_ptr<Int[]> indices(new Int[3 * ntris]);
     std::unique_ptr<Point3f[]> P(new Point3f[nx * ny]);
@@ -86,4 +86,364 @@ std::vector<std::shared_ptr<Shape>> CreateHeightfield(
                               nullptr, uvs.get(), nullptr, nullptr);
 }
 
+// Heightfield Method Definitions
+Heightfield::Heightfield(const Transform *ObjectToWorld,
+                         const Transform *WorldToObject,
+                         bool reverseOrientation, int nx, int ny,
+                         const Float *zs, HeightfieldSurface surface)
+    : Shape(ObjectToWorld, WorldToObject, reverseOrientation),
+      nx(nx),
+      ny(ny),
+      surface(surface),
+      z(zs, zs + nx * ny) {
+    // Compute the height ranges of the level 0 tiles
+    Point2i res((nx - 1 + TileSize - 1) / TileSize,
+                (ny - 1 + TileSize - 1) / TileSize);
+    pyramid.push_back(std::vector<HeightRange>(res.x * res.y));
+    pyramidRes.push_back(res);
+    for (int ty = 0; ty < res.y; ++ty)
+        for (int tx = 0; tx < res.x; ++tx) {
+            HeightRange range{float(Infinity), -float(Infinity)};
+            for (int y = ty * TileSize;
+                 y <= std::min((ty + 1) * TileSize, ny - 1); ++y)
+                for (int x = tx * TileSize;
+                     x <= std::min((tx + 1) * TileSize, nx - 1); ++x) {
+                    range.min = std::min(range.min, z[y * nx + x]);
+                    range.max = std::max(range.max, z[y * nx + x]);
+                }
+            pyramid[0][ty * res.x + tx] = range;
+        }
+
+    // Build the rest of the pyramid up to a single root node
+    while (res.x > 1 || res.y > 1) {
+        const std::vector<HeightRange> &prev = pyramid.back();
+        Point2i prevRes = res;
+        res = Point2i((res.x + 1) / 2, (res.y + 1) / 2);
+        std::vector<HeightRange> level(res.x * res.y);
+        for (int y = 0; y < res.y; ++y)
+            for (int x = 0; x < res.x; ++x) {
+                HeightRange range{float(Infinity), -float(Infinity)};
+                for (int cy = 2 * y; cy < std::min(2 * y + 2, int(prevRes.y)); ++cy)
+                    for (int cx = 2 * x; cx < std::min(2 * x + 2, int(prevRes.x));
+                         ++cx) {
+                        range.min = std::min(range.min,
+                                             prev[cy * prevRes.x + cx].min);
+                        range.max = std::max(range.max,
+                                             prev[cy * prevRes.x + cx].max);
+                    }
+                level[y * res.x + x] = range;
+            }
+        pyramid.push_back(std::move(level));
+        pyramidRes.push_back(res);
+    }
+
+    // Compute the heightfield's world space area; a bilinear cell's is
+    // integrated with $2 \times 2$-point Gauss-Legendre quadrature
+    Vector3f ex = (*ObjectToWorld)(Vector3f(1. / (nx - 1), 0, 0));
+    Vector3f ey = (*ObjectToWorld)(Vector3f(0, 1. / (ny - 1), 0));
+    Vector3f ez = (*ObjectToWorld)(Vector3f(0, 0, 1));
+    area = 0;
+    for (int y = 0; y < ny - 1; ++y)
+        for (int x = 0; x < nx - 1; ++x) {
+            Float z00 = z[y * nx + x], z10 = z[y * nx + x + 1];
+            Float z01 = z[(y + 1) * nx + x], z11 = z[(y + 1) * nx + x + 1];
+            if (surface == HeightfieldSurface::Triangles) {
+                Vector3f e10 = ex + (z10 - z00) * ez;
+                Vector3f e11 = ex + ey + (z11 - z00) * ez;
+                Vector3f e01 = ey + (z01 - z00) * ez;
+                area += .5f * (Cross(e10, e11).Length() +
+                               Cross(e11, e01).Length());
+            } else {
+                const Float nodes[2] = {.5f - .5f / std::sqrt(Float(3)),
+                                        .5f + .5f / std::sqrt(Float(3))};
+                for (Float u : nodes)
+                    for (Float v : nodes)
+                        area += .25f *
+                                Cross(ex + Lerp(v, z10 - z00, z11 - z01) * ez,
+                                      ey + Lerp(u, z01 - z00, z11 - z10) * ez)
+                                    .Length();
+            }
+        }
+
+    size_t bytes = sizeof(*this) + z.capacity() * sizeof(float);
+    for (const auto &level : pyramid)
+        bytes += level.capacity() * sizeof(HeightRange);
+    heightfieldBytes += bytes;
+}
+
+Bounds3f Heightfield::ObjectBound() const {
+    const HeightRange &root = pyramid.back()[0];
+    return Bounds3f(Point3f(0, 0, root.min), Point3f(1, 1, root.max));
+}
+
+Bounds3f Heightfield::NodeBounds(int level, int x, int y) const {
+    int cells = TileSize << level;
+    const HeightRange &range = pyramid[level][y * pyramidRes[level].x + x];
+    return Bounds3f(
+        Point3f(Float(x * cells) / (nx - 1), Float(y * cells) / (ny - 1),
+                range.min),
+        Point3f(Float(std::min((x + 1) * cells, nx - 1)) / (nx - 1),
+                Float(std::min((y + 1) * cells, ny - 1)) / (ny - 1),
+                range.max));
+}
+
+bool Heightfield::IntersectCell(const Ray &ray, int x, int y, Float *tHit,
+                                CellHit *hit) const {
+    ++nCellTests;
+    Point3f p00 = GridPoint(x, y), p10 = GridPoint(x + 1, y);
+    Point3f p01 = GridPoint(x, y + 1), p11 = GridPoint(x + 1, y + 1);
+    Float u, v;
+    if (surface == HeightfieldSurface::Triangles) {
+        // Intersect the cell's two triangles, $(p_{00}, p_{10}, p_{11})$,
+        // where $u \ge v$, and $(p_{00}, p_{11}, p_{01})$
+        Float b[3];
+        Ray r = ray;
+        bool found = false;
+        if (IntersectTriangleVertices(r, p00, p10, p11, tHit, b)) {
+            u = b[1] + b[2];
+            v = b[2];
+            r.tMax = *tHit;
+            found = true;
+        }
+        if (IntersectTriangleVertices(r, p00, p11, p01, tHit, b)) {
+            u = b[1];
+            v = b[1] + b[2];
+            found = true;
+        }
+        if (!found) return false;
+    } else if (!IntersectBilinearPatch(ray, p00, p10, p01, p11, tHit, &u, &v))
+        return false;
+    ++nCellHits;
+    if (hit) *hit = CellHit{x, y, u, v};
+    return true;
+}
+
+bool Heightfield::IntersectGrid(const Ray &r, Float *tHit,
+                                CellHit *hit) const {
+    // Traverse the pyramid front to back, shortening _ray_ at each hit;
+    // _IntersectP()_ passes a null _hit_ and stops at the first one
+    Ray ray = r;
+    Vector3f invDir(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
+    int dirIsNeg[3] = {invDir.x < 0, invDir.y < 0, invDir.z < 0};
+    struct Node {
+        int level, x, y;
+    };
+    Node nodesToVisit[128];
+    int toVisitOffset = 0;
+    nodesToVisit[toVisitOffset++] = Node{int(pyramid.size()) - 1, 0, 0};
+    bool found = false;
+    while (toVisitOffset > 0) {
+        Node node = nodesToVisit[--toVisitOffset];
+        if (!NodeBounds(node.level, node.x, node.y)
+                 .IntersectP(ray, invDir, dirIsNeg))
+            continue;
+        if (node.level == 0) {
+            // Intersect the ray with the tile's cells whose own height
+            // ranges it passes through
+            int x1 = std::min((node.x + 1) * TileSize, nx - 1);
+            int y1 = std::min((node.y + 1) * TileSize, ny - 1);
+            for (int y = node.y * TileSize; y < y1; ++y)
+                for (int x = node.x * TileSize; x < x1; ++x) {
+                    Float z00 = z[y * nx + x], z10 = z[y * nx + x + 1];
+                    Float z01 = z[(y + 1) * nx + x];
+                    Float z11 = z[(y + 1) * nx + x + 1];
+                    Bounds3f cellBounds(
+                        Point3f(Float(x) / (nx - 1), Float(y) / (ny - 1),
+                                std::min(std::min(z00, z10),
+                                         std::min(z01, z11))),
+                        Point3f(Float(x + 1) / (nx - 1),
+                                Float(y + 1) / (ny - 1),
+                                std::max(std::max(z00, z10),
+                                         std::max(z01, z11))));
+                    if (!cellBounds.IntersectP(ray, invDir, dirIsNeg))
+                        continue;
+                    Float t;
+                    if (IntersectCell(ray, x, y, &t, hit)) {
+                        if (!hit) return true;
+                        ray.tMax = t;
+                        *tHit = t;
+                        found = true;
+                    }
+                }
+        } else {
+            // Push the node's children so that the one nearest the ray's
+            // origin in $x$ and $y$ is visited first
+            const Point2i &res = pyramidRes[node.level - 1];
+            for (int i = 3; i >= 0; --i) {
+                int x = 2 * node.x + ((i & 1) ^ dirIsNeg[0]);
+                int y = 2 * node.y + ((i >> 1) ^ dirIsNeg[1]);
+                if (x < res.x && y < res.y)
+                    nodesToVisit[toVisitOffset++] = Node{node.level - 1, x, y};
+            }
+        }
+    }
+    return found;
+}
+
+void Heightfield::EvaluateCell(const CellHit &hit, Point3f *p,
+                               Vector3f *pError, Vector3f *dpdu,
+                               Vector3f *dpdv, Normal3f *dndu,
+                               Normal3f *dndv) const {
+    Point3f p00 = GridPoint(hit.x, hit.y), p10 = GridPoint(hit.x + 1, hit.y);
+    Point3f p01 = GridPoint(hit.x, hit.y + 1);
+    Point3f p11 = GridPoint(hit.x + 1, hit.y + 1);
+    Float u = hit.u, v = hit.v;
+    // The heightfield's $(u,v)$ are its $x$ and $y$, so the cell's
+    // derivatives are scaled by the number of cells along each
+    Float su = nx - 1, sv = ny - 1;
+    if (surface == HeightfieldSurface::Triangles) {
+        // Compute the hit point from the barycentrics of its triangle
+        bool lower = u >= v;
+        Point3f p1 = lower ? p10 : p11, p2 = lower ? p11 : p01;
+        Float b0 = lower ? 1 - u : 1 - v;
+        Float b1 = lower ? u - v : u;
+        Float b2 = lower ? v : v - u;
+        *p = b0 * p00 + b1 * p1 + b2 * p2;
+        *pError = gamma(7) * Vector3f(Abs(b0 * p00) + Abs(b1 * p1) +
+                                      Abs(b2 * p2));
+        *dpdu = su * (lower ? p10 - p00 : p11 - p01);
+        *dpdv = sv * (lower ? p11 - p10 : p01 - p00);
+        *dndu = *dndv = Normal3f(0, 0, 0);
+    } else {
+        *p = (1 - u) * (1 - v) * p00 + u * (1 - v) * p10 +
+             (1 - u) * v * p01 + u * v * p11;
+        // Each term is rounded at most four times and the sum three more,
+        // as in _BilinearPatch_'s bound
+        *pError = gamma(7) * Vector3f((1 - u) * (1 - v) * Abs(p00) +
+                                      u * (1 - v) * Abs(p10) +
+                                      (1 - u) * v * Abs(p01) +
+                                      u * v * Abs(p11));
+        *dpdu = su * ((1 - v) * (p10 - p00) + v * (p11 - p01));
+        *dpdv = sv * ((1 - u) * (p01 - p00) + u * (p11 - p10));
+
+        // Compute $\dndu$ and $\dndv$ from the fundamental forms, as
+        // _BilinearPatch_ does
+        Vector3f d2Pduv = su * sv * ((p00 - p10) - (p01 - p11));
+        Float E = Dot(*dpdu, *dpdu), F = Dot(*dpdu, *dpdv);
+        Float G = Dot(*dpdv, *dpdv);
+        Float f = Dot(Normalize(Cross(*dpdu, *dpdv)), d2Pduv);
+        Float invEGF2 = 1 / (E * G - F * F);
+        *dndu = Normal3f((f * F) * invEGF2 * *dpdu +
+                         (-f * E) * invEGF2 * *dpdv);
+        *dndv = Normal3f((-f * G) * invEGF2 * *dpdu +
+                         (f * F) * invEGF2 * *dpdv);
+    }
+}
+
+bool Heightfield::Intersect(const Ray &r, Float *tHit,
+                            SurfaceInteraction *isect,
+                            bool testAlphaTexture) const {
+    ProfilePhase p(Prof::ShapeIntersect);
+    // Transform _Ray_ to object space
+    Vector3f oErr, dErr;
+    Ray ray = (*WorldToObject)(r, &oErr, &dErr);
+
+    CellHit hit;
+    if (!IntersectGrid(ray, tHit, &hit)) return false;
+    Point3f pHit;
+    Vector3f pError, dpdu, dpdv;
+    Normal3f dndu, dndv;
+    EvaluateCell(hit, &pHit, &pError, &dpdu, &dpdv, &dndu, &dndv);
+    Point2f uv((hit.x + hit.u) / (nx - 1), (hit.y + hit.v) / (ny - 1));
+    *isect = (*ObjectToWorld)(SurfaceInteraction(pHit, pError, uv, -ray.d,
+                                                 dpdu, dpdv, dndu, dndv,
+                                                 ray.time, this));
+    return true;
+}
+
+bool Heightfield::IntersectP(const Ray &r, bool testAlphaTexture) const {
+    ProfilePhase p(Prof::ShapeIntersectP);
+    Vector3f oErr, dErr;
+    Ray ray = (*WorldToObject)(r, &oErr, &dErr);
+    Float tHit;
+    return IntersectGrid(ray, &tHit, nullptr);
+}
+
+Interaction Heightfield::Sample(const Point2f &u, Float *pdf) const {
+    // Find the cell containing the sampled $(u,v)$
+    Float cx = u[0] * (nx - 1), cy = u[1] * (ny - 1);
+    CellHit cell;
+    cell.x = std::min(int(cx), nx - 2);
+    cell.y = std::min(int(cy), ny - 2);
+    cell.u = cx - cell.x;
+    cell.v = cy - cell.y;
+
+    Point3f pObj;
+    Vector3f pObjError, dpdu, dpdv;
+    Normal3f dndu, dndv;
+    EvaluateCell(cell, &pObj, &pObjError, &dpdu, &dpdv, &dndu, &dndv);
+    Interaction it;
+    it.p = (*ObjectToWorld)(pObj, pObjError, &it.pError);
+    Vector3f n = Cross((*ObjectToWorld)(dpdu), (*ObjectToWorld)(dpdv));
+    it.n = Normalize(Normal3f(n));
+    if (reverseOrientation) it.n *= -1;
+    *pdf = 1 / n.Length();
+    return it;
+}
+
+Float Heightfield::AreaPdf(const Point3f &pWorld) const {
+    // Points are sampled uniformly in $(u,v)$, which are the object space
+    // $x$ and $y$, so the density with respect to area is the inverse of
+    // the parameterization's Jacobian there
+    Point3f pObj = (*WorldToObject)(pWorld);
+    Point2f u(Clamp(pObj.x, 0, 1), Clamp(pObj.y, 0, 1));
+    Float pdf;
+    Sample(u, &pdf);
+    return pdf;
+}
+
+Float Heightfield::Pdf(const Interaction &it) const { return AreaPdf(it.p); }
+
+Float Heightfield::Pdf(const Interaction &ref, const Vector3f &wi) const {
+    // Intersect sample ray with area light geometry
+    Ray ray = ref.SpawnRay(wi);
+    Float tHit;
+    SurfaceInteraction isectLight;
+    if (!Intersect(ray, &tHit, &isectLight, false)) return 0;
+
+    // Convert light sample weight to solid angle measure
+    Float pdf = DistanceSquared(ref.p, isectLight.p) /
+                AbsDot(isectLight.n, -wi) * AreaPdf(isectLight.p);
+    if (std::isinf(pdf)) pdf = 0.f;
+    return pdf;
+}
+
+std::vector<std::shared_ptr<Shape>> CreateHeightfield(
+    const Transform *ObjectToWorld, const Transform *WorldToObject,
+    bool reverseOrientation, const ParamSet &params) {
+    int nx = params.FindOneInt("nu", -1);
+    int ny = params.FindOneInt("nv", -1);
+    int nitems;
+    const Float *z = params.FindFloat("Pz", &nitems);
+    if (nx < 2 || ny < 2) {
+        Error("Heightfield needs at least 2x2 \"Pz\" values; %dx%d given.",
+              nx, ny);
+        return {};
+    }
+    if (!z || nitems != (int64_t)nx * (int64_t)ny) {
+        Error("Heightfield needs %dx%d \"Pz\" values; %d given.", nx, ny,
+              z ? nitems : 0);
+        return {};
+    }
+
+    // The mesh the heightfield used to be converted to is still available
+    if (params.FindOneBool("tessellate", false))
+        return TessellateHeightfield(ObjectToWorld, WorldToObject,
+                                     reverseOrientation, nx, ny, z);
+    std::string surfaceName = params.FindOneString("surface", "triangles");
+    HeightfieldSurface surface;
+    if (surfaceName == "triangles")
+        surface = HeightfieldSurface::Triangles;
+    else if (surfaceName == "bilinear")
+        surface = HeightfieldSurface::Bilinear;
+    else {
+        Error("Heightfield \"surface\" \"%s\" unknown; using \"triangles\".",
+              surfaceName.c_str());
+        surface = HeightfieldSurface::Triangles;
+    }
+    return {std::make_shared<Heightfield>(ObjectToWorld, WorldToObject,
+                                          reverseOrientation, nx, ny, z,
+                                          surface)};
+}
+
 }  // namespace pbrt
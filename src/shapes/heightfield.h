@@ -40,10 +40,76 @@
 
 // shapes/heightfield.h*
 #include "shape.h"
+#include <vector>
 
 namespace pbrt {
 
 // Heightfield Declarations
+enum class HeightfieldSurface { Triangles, Bilinear };
+
+// _Heightfield_ is the surface $z=f(x,y)$ over $[0,1]^2$ in object space
+// given by a grid of $\roman{nx} \times \roman{ny}$ height samples. It is
+// intersected directly rather than tessellated: rays descend a quadtree of
+// minimum and maximum heights to the grid cells they may hit. Each cell is
+// either split into two triangles, as the "heightfield" shape's mesh
+// always was, or interpreted as a bilinear patch.
+class Heightfield : public Shape {
+  public:
+    // Heightfield Public Methods
+    Heightfield(const Transform *ObjectToWorld, const Transform *WorldToObject,
+                bool reverseOrientation, int nx, int ny, const Float *z,
+                HeightfieldSurface surface);
+    Bounds3f ObjectBound() const;
+    bool Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
+                   bool testAlphaTexture) const;
+    bool IntersectP(const Ray &ray, bool testAlphaTexture) const;
+    Float Area() const { return area; }
+
+    // Points are sampled uniformly in $(u,v)$ rather than by area, so
+    // the PDFs are overridden as well.
+    using Shape::Sample;  // Bring in the other Sample() overload.
+    Interaction Sample(const Point2f &u, Float *pdf) const;
+    Float Pdf(const Interaction &it) const;
+    Float Pdf(const Interaction &ref, const Vector3f &wi) const;
+
+  private:
+    // Heightfield Private Declarations
+    struct HeightRange {
+        float min, max;
+    };
+    struct CellHit {
+        int x, y;
+        // The hit's $(u,v)$ within the cell
+        Float u, v;
+    };
+
+    // Heightfield Private Methods
+    Point3f GridPoint(int x, int y) const {
+        return Point3f(Float(x) / (nx - 1), Float(y) / (ny - 1),
+                       z[y * nx + x]);
+    }
+    Bounds3f NodeBounds(int level, int x, int y) const;
+    bool IntersectGrid(const Ray &ray, Float *tHit, CellHit *hit) const;
+    bool IntersectCell(const Ray &ray, int x, int y, Float *tHit,
+                       CellHit *hit) const;
+    void EvaluateCell(const CellHit &hit, Point3f *p, Vector3f *pError,
+                      Vector3f *dpdu, Vector3f *dpdv, Normal3f *dndu,
+                      Normal3f *dndv) const;
+    Float AreaPdf(const Point3f &pWorld) const;
+
+    // Heightfield Private Data
+    const int nx, ny;
+    const HeightfieldSurface surface;
+    std::vector<float> z;
+    // Level 0 of the pyramid bounds the heights of tiles of
+    // $\roman{TileSize} \times \roman{TileSize}$ cells; each level above
+    // bounds $2 \times 2$ nodes of the one below, up to a single root.
+    static constexpr int TileSize = 4;
+    std::vector<std::vector<HeightRange>> pyramid;
+    std::vector<Point2i> pyramidRes;
+    Float area;
+};
+
 std::vector<std::shared_ptr<Shape>> CreateHeightfield(const Transform *o2w,
                                                       const Transform *w2o,
                                                       bool ro,
@@ -35,101 +35,70 @@
 #include "shapes/loopsubdiv.h"
 #include "shapes/triangle.h"
 #include "paramset.h"
-#include <set>
-#include <map>
+#include "parallel.h"
+#include <algorithm>
 
 namespace pbrt {
 
-struct SDFace;
-struct SDVertex;
-
 // LoopSubdiv Macros
 #define NEXT(i) (((i) + 1) % 3)
 #define PREV(i) (((i) + 2) % 3)
 
 // LoopSubdiv Local Structures
-struct SDVertex {
-    // SDVertex Constructor
-    SDVertex(const Point3f &p = Point3f(0, 0, 0)) : p(p) {}
-
-    // SDVertex Methods
-    int valence();
-    void oneRing(Point3f *p);
-    Point3f p;
-    SDFace *startFace = nullptr;
-    SDVertex *child = nullptr;
-    bool regular = false, boundary = false;
-};
-
-struct SDFace {
-    // SDFace Constructor
-    SDFace() {
-        for (int i = 0; i < 3; ++i) {
-            v[i] = nullptr;
-            f[i] = nullptr;
-        }
-        for (int i = 0; i < 4; ++i) children[i] = nullptr;
-    }
-
-    // SDFace Methods
-    int vnum(SDVertex *vert) const {
+// _SDMesh_ holds one level of the subdivision mesh in flat arrays. Faces
+// and vertices refer to each other by index, so that each level can be
+// computed from the previous one in parallel and the previous one freed.
+struct SDMesh {
+    // SDMesh Methods
+    int nFaces() const { return int(v.size() / 3); }
+    int nVertices() const { return int(p.size()); }
+    int vnum(int face, int vert) const {
         for (int i = 0; i < 3; ++i)
-            if (v[i] == vert) return i;
-        LOG(FATAL) << "Basic logic error in SDFace::vnum()";
+            if (v[3 * face + i] == vert) return i;
+        LOG(FATAL) << "Basic logic error in SDMesh::vnum()";
         return -1;
     }
-    SDFace *nextFace(SDVertex *vert) { return f[vnum(vert)]; }
-    SDFace *prevFace(SDVertex *vert) { return f[PREV(vnum(vert))]; }
-    SDVertex *nextVert(SDVertex *vert) { return v[NEXT(vnum(vert))]; }
-    SDVertex *prevVert(SDVertex *vert) { return v[PREV(vnum(vert))]; }
-    SDVertex *otherVert(SDVertex *v0, SDVertex *v1) {
-        for (int i = 0; i < 3; ++i)
-            if (v[i] != v0 && v[i] != v1) return v[i];
-        LOG(FATAL) << "Basic logic error in SDVertex::otherVert()";
-        return nullptr;
+    int nextFace(int face, int vert) const {
+        return f[3 * face + vnum(face, vert)];
     }
-    SDVertex *v[3];
-    SDFace *f[3];
-    SDFace *children[4];
-};
-
-struct SDEdge {
-    // SDEdge Constructor
-    SDEdge(SDVertex *v0 = nullptr, SDVertex *v1 = nullptr) {
-        v[0] = std::min(v0, v1);
-        v[1] = std::max(v0, v1);
-        f[0] = f[1] = nullptr;
-        f0edgeNum = -1;
+    int prevFace(int face, int vert) const {
+        return f[3 * face + PREV(vnum(face, vert))];
     }
-
-    // SDEdge Comparison Function
-    bool operator<(const SDEdge &e2) const {
-        if (v[0] == e2.v[0]) return v[1] < e2.v[1];
-        return v[0] < e2.v[0];
+    int nextVert(int face, int vert) const {
+        return v[3 * face + NEXT(vnum(face, vert))];
     }
-    SDVertex *v[2];
-    SDFace *f[2];
-    int f0edgeNum;
+    int prevVert(int face, int vert) const {
+        return v[3 * face + PREV(vnum(face, vert))];
+    }
+    int valence(int vert) const;
+    void oneRing(int vert, Point3f *ring) const;
+    Point3f weightOneRing(int vert, Float beta) const;
+    Point3f weightBoundary(int vert, Float beta) const;
+
+    // SDMesh Data
+    // The three vertices of each face, and the face across each of its
+    // edges, from vertex $i$ to vertex $i+1$, or -1 on the boundary
+    std::vector<int> v, f;
+    // Each vertex's position, one of the faces around it, and its flags
+    std::vector<Point3f> p;
+    std::vector<int> startFace;
+    std::vector<uint8_t> boundary, regular;
 };
 
-// LoopSubdiv Local Declarations
-static Point3f weightOneRing(SDVertex *vert, Float beta);
-static Point3f weightBoundary(SDVertex *vert, Float beta);
-
 // LoopSubdiv Inline Functions
-inline int SDVertex::valence() {
-    SDFace *f = startFace;
-    if (!boundary) {
+inline int SDMesh::valence(int vert) const {
+    int face = startFace[vert];
+    if (!boundary[vert]) {
         // Compute valence of interior vertex
         int nf = 1;
-        while ((f = f->nextFace(this)) != startFace) ++nf;
+        while ((face = nextFace(face, vert)) != startFace[vert]) ++nf;
         return nf;
     } else {
         // Compute valence of boundary vertex
         int nf = 1;
-        while ((f = f->nextFace(this)) != nullptr) ++nf;
-        f = startFace;
-        while ((f = f->prevFace(this)) != nullptr) ++nf;
+        while ((face = nextFace(face, vert)) != -1) ++nf;
+        face = startFace[vert];
+        while ((face = prevFace(face, vert)) != -1) ++nf;
         return nf + 1;
     }
 }
@@ -146,210 +115,204 @@ inline Float loopGamma(int valence) {
 }
 
 // LoopSubdiv Function Definitions
-static std::vector<std::shared_ptr<Shape>> LoopSubdivide(
-    const Transform *ObjectToWorld, const Transform *WorldToObject,
-    bool reverseOrientation, int nLevels, int nIndices,
-    const Int *vertexIndices, int nVertices, const Point3f *p) {
-    std::vector<SDVertex *> vertices;
-    std::vector<SDFace *> faces;
-    // Allocate _LoopSubdiv_ vertices and faces
-    std::unique_ptr<SDVertex[]> verts(new SDVertex[nVertices]);
-    for (int i = 0; i < nVertices; ++i) {
-        verts[i] = SDVertex(p[i]);
-        vertices.push_back(&verts[i]);
-    }
+// Returns the first level of the subdivision mesh for the control mesh,
+// or an empty one if it has vertices that no face uses.
+static SDMesh BuildControlMesh(int nIndices, const Int *vertexIndices,
+                               int nVertices, const Point3f *p) {
+    SDMesh mesh;
     int nFaces = nIndices / 3;
-    std::unique_ptr<SDFace[]> fs(new SDFace[nFaces]);
-    for (int i = 0; i < nFaces; ++i) faces.push_back(&fs[i]);
-
-    // Set face to vertex pointers
-    const Int *vp = vertexIndices;
-    for (int i = 0; i < nFaces; ++i, vp += 3) {
-        SDFace *f = faces[i];
-        for (int j = 0; j < 3; ++j) {
-            SDVertex *v = vertices[vp[j]];
-            f->v[j] = v;
-            v->startFace = f;
+    mesh.v.assign(vertexIndices, vertexIndices + 3 * nFaces);
+    mesh.p.assign(p, p + nVertices);
+
+    // Set vertex to face indices
+    mesh.startFace.assign(nVertices, -1);
+    for (int i = 0; i < 3 * nFaces; ++i) mesh.startFace[mesh.v[i]] = i / 3;
+    for (int i = 0; i < nVertices; ++i)
+        if (mesh.startFace[i] == -1) {
+            Error("LoopSubdiv vertex %d isn't used by any face.", i);
+            return SDMesh();
         }
-    }
 
-    // Set neighbor pointers in _faces_
-    std::set<SDEdge> edges;
-    for (int i = 0; i < nFaces; ++i) {
-        SDFace *f = faces[i];
-        for (int edgeNum = 0; edgeNum < 3; ++edgeNum) {
-            // Update neighbor pointer for _edgeNum_
-            int v0 = edgeNum, v1 = NEXT(edgeNum);
-            SDEdge e(f->v[v0], f->v[v1]);
-            if (edges.find(e) == edges.end()) {
-                // Handle new edge
-                e.f[0] = f;
-                e.f0edgeNum = edgeNum;
-                edges.insert(e);
-            } else {
-                // Handle previously seen edge
-                e = *edges.find(e);
-                e.f[0]->f[e.f0edgeNum] = f;
-                f->f[edgeNum] = e.f[0];
-                edges.erase(e);
-            }
+    // Set neighbor indices in _faces_
+    // Sort the faces' edges so that the two faces sharing an edge are
+    // adjacent; edges with more than two faces are paired off in order.
+    struct SDEdge {
+        int v0, v1, edge;
+        bool operator<(const SDEdge &e2) const {
+            if (v0 != e2.v0) return v0 < e2.v0;
+            if (v1 != e2.v1) return v1 < e2.v1;
+            return edge < e2.edge;
         }
+    };
+    std::vector<SDEdge> edges(3 * nFaces);
+    for (int i = 0; i < 3 * nFaces; ++i) {
+        int v0 = mesh.v[i], v1 = mesh.v[3 * (i / 3) + NEXT(i % 3)];
+        edges[i] = {std::min(v0, v1), std::max(v0, v1), i};
     }
+    std::sort(edges.begin(), edges.end());
+    mesh.f.assign(3 * nFaces, -1);
+    for (size_t i = 0; i + 1 < edges.size(); ++i)
+        if (edges[i].v0 == edges[i + 1].v0 && edges[i].v1 == edges[i + 1].v1) {
+            mesh.f[edges[i].edge] = edges[i + 1].edge / 3;
+            mesh.f[edges[i + 1].edge] = edges[i].edge / 3;
+            ++i;
+        }
 
     // Finish vertex initialization
-    for (int i = 0; i < nVertices; ++i) {
-        SDVertex *v = vertices[i];
-        SDFace *f = v->startFace;
+    mesh.boundary.resize(nVertices);
+    mesh.regular.resize(nVertices);
+    ParallelFor([&](int64_t i) {
+        int face = mesh.startFace[i];
         do {
-            f = f->nextFace(v);
-        } while (f && f != v->startFace);
-        v->boundary = (f == nullptr);
-        if (!v->boundary && v->valence() == 6)
-            v->regular = true;
-        else if (v->boundary && v->valence() == 4)
-            v->regular = true;
-        else
-            v->regular = false;
-    }
+            face = mesh.nextFace(face, i);
+        } while (face != -1 && face != mesh.startFace[i]);
+        mesh.boundary[i] = (face == -1);
+        int valence = mesh.valence(i);
+        mesh.regular[i] = mesh.boundary[i] ? (valence == 4) : (valence == 6);
+    }, nVertices, 4096);
+    return mesh;
+}
 
-    // Refine _LoopSubdiv_ into triangles
-    std::vector<SDFace *> f = faces;
-    std::vector<SDVertex *> v = vertices;
-    MemoryArena arena;
-    for (int i = 0; i < nLevels; ++i) {
-        // Update _f_ and _v_ for next level of subdivision
-        std::vector<SDFace *> newFaces;
-        std::vector<SDVertex *> newVertices;
-
-        // Allocate next level of children in mesh tree
-        for (SDVertex *vertex : v) {
-            vertex->child = arena.Alloc<SDVertex>();
-            vertex->child->regular = vertex->regular;
-            vertex->child->boundary = vertex->boundary;
-            newVertices.push_back(vertex->child);
+// Returns the next level of subdivision of _mesh_.
+static SDMesh Refine(const SDMesh &mesh) {
+    int nFaces = mesh.nFaces(), nVertices = mesh.nVertices();
+
+    // Number the new odd vertices, one per edge
+    // Each edge's vertex is created by the lower-numbered of its faces.
+    std::vector<int> edgeVerts(3 * nFaces);
+    int nEdges = 0;
+    for (int i = 0; i < nFaces; ++i)
+        for (int k = 0; k < 3; ++k) {
+            int f2 = mesh.f[3 * i + k];
+            if (f2 == -1 || f2 > i) edgeVerts[3 * i + k] = nVertices + nEdges++;
         }
-        for (SDFace *face : f) {
-            for (int k = 0; k < 4; ++k) {
-                face->children[k] = arena.Alloc<SDFace>();
-                newFaces.push_back(face->children[k]);
+    ParallelFor([&](int64_t i) {
+        for (int k = 0; k < 3; ++k) {
+            int f2 = mesh.f[3 * i + k];
+            if (f2 == -1 || f2 > i) continue;
+            // Find the edge's vertex in the neighbor _f2_
+            int v0 = mesh.v[3 * i + k], v1 = mesh.v[3 * i + NEXT(k)];
+            for (int k2 = 0; k2 < 3; ++k2) {
+                int w0 = mesh.v[3 * f2 + k2], w1 = mesh.v[3 * f2 + NEXT(k2)];
+                if (mesh.f[3 * f2 + k2] == i &&
+                    ((w0 == v0 && w1 == v1) || (w0 == v1 && w1 == v0))) {
+                    edgeVerts[3 * i + k] = edgeVerts[3 * f2 + k2];
+                    break;
+                }
             }
         }
-
-        // Update vertex positions and create new edge vertices
-
-        // Update vertex positions for even vertices
-        for (SDVertex *vertex : v) {
-            if (!vertex->boundary) {
-                // Apply one-ring rule for even vertex
-                if (vertex->regular)
-                    vertex->child->p = weightOneRing(vertex, 1.f / 16.f);
-                else
-                    vertex->child->p =
-                        weightOneRing(vertex, beta(vertex->valence()));
-            } else {
-                // Apply boundary rule for even vertex
-                vertex->child->p = weightBoundary(vertex, 1.f / 8.f);
-            }
+    }, nFaces, 4096);
+    int nNewVertices = nVertices + nEdges;
+
+    // Allocate next level of the subdivision mesh
+    SDMesh child;
+    child.v.resize(12 * size_t(nFaces));
+    child.f.resize(12 * size_t(nFaces));
+    child.p.resize(nNewVertices);
+    child.startFace.resize(nNewVertices);
+    child.boundary.resize(nNewVertices);
+    child.regular.resize(nNewVertices);
+
+    // Update vertex positions for even vertices
+    ParallelFor([&](int64_t i) {
+        if (!mesh.boundary[i]) {
+            // Apply one-ring rule for even vertex
+            if (mesh.regular[i])
+                child.p[i] = mesh.weightOneRing(i, 1.f / 16.f);
+            else
+                child.p[i] = mesh.weightOneRing(i, beta(mesh.valence(i)));
+        } else {
+            // Apply boundary rule for even vertex
+            child.p[i] = mesh.weightBoundary(i, 1.f / 8.f);
         }
-
-        // Compute new odd edge vertices
-        std::map<SDEdge, SDVertex *> edgeVerts;
-        for (SDFace *face : f) {
-            for (int k = 0; k < 3; ++k) {
-                // Compute odd vertex on _k_th edge
-                SDEdge edge(face->v[k], face->v[NEXT(k)]);
-                SDVertex *vert = edgeVerts[edge];
-                if (!vert) {
-                    // Create and initialize new odd vertex
-                    vert = arena.Alloc<SDVertex>();
-                    newVertices.push_back(vert);
-                    vert->regular = true;
-                    vert->boundary = (face->f[k] == nullptr);
-                    vert->startFace = face->children[3];
-
-                    // Apply edge rules to compute new vertex position
-                    if (vert->boundary) {
-                        vert->p = 0.5f * edge.v[0]->p;
-                        vert->p += 0.5f * edge.v[1]->p;
-                    } else {
-                        vert->p = 3.f / 8.f * edge.v[0]->p;
-                        vert->p += 3.f / 8.f * edge.v[1]->p;
-                        vert->p += 1.f / 8.f *
-                                   face->otherVert(edge.v[0], edge.v[1])->p;
-                        vert->p +=
-                            1.f / 8.f *
-                            face->f[k]->otherVert(edge.v[0], edge.v[1])->p;
-                    }
-                    edgeVerts[edge] = vert;
+        child.boundary[i] = mesh.boundary[i];
+        child.regular[i] = mesh.regular[i];
+        int face = mesh.startFace[i];
+        child.startFace[i] = 4 * face + mesh.vnum(face, i);
+    }, nVertices, 4096);
+
+    // Compute new odd edge vertices and update mesh topology
+    ParallelFor([&](int64_t i) {
+        const int *v = &mesh.v[3 * i], *f = &mesh.f[3 * i];
+        for (int k = 0; k < 3; ++k) {
+            if (f[k] != -1 && f[k] < i) continue;
+            // Create and initialize new odd vertex on _k_th edge
+            int vert = edgeVerts[3 * i + k];
+            child.regular[vert] = true;
+            child.boundary[vert] = (f[k] == -1);
+            child.startFace[vert] = 4 * i + 3;
+
+            // Apply edge rules to compute new vertex position
+            const Point3f &p0 = mesh.p[v[k]], &p1 = mesh.p[v[NEXT(k)]];
+            if (f[k] == -1)
+                child.p[vert] = 0.5f * p0 + 0.5f * p1;
+            else {
+                int other = -1;
+                for (int k2 = 0; k2 < 3; ++k2) {
+                    int w = mesh.v[3 * f[k] + k2];
+                    if (w != v[k] && w != v[NEXT(k)]) other = w;
                 }
+                CHECK_NE(other, -1);
+                child.p[vert] = 3.f / 8.f * p0 + 3.f / 8.f * p1 +
+                                1.f / 8.f * mesh.p[v[PREV(k)]] +
+                                1.f / 8.f * mesh.p[other];
             }
         }
 
-        // Update new mesh topology
-
-        // Update even vertex face pointers
-        for (SDVertex *vertex : v) {
-            int vertNum = vertex->startFace->vnum(vertex);
-            vertex->child->startFace = vertex->startFace->children[vertNum];
-        }
-
-        // Update face neighbor pointers
-        for (SDFace *face : f) {
-            for (int j = 0; j < 3; ++j) {
-                // Update children _f_ pointers for siblings
-                face->children[3]->f[j] = face->children[NEXT(j)];
-                face->children[j]->f[NEXT(j)] = face->children[3];
-
-                // Update children _f_ pointers for neighbor children
-                SDFace *f2 = face->f[j];
-                face->children[j]->f[j] =
-                    f2 ? f2->children[f2->vnum(face->v[j])] : nullptr;
-                f2 = face->f[PREV(j)];
-                face->children[j]->f[PREV(j)] =
-                    f2 ? f2->children[f2->vnum(face->v[j])] : nullptr;
-            }
+        int c = 4 * i;
+        for (int j = 0; j < 3; ++j) {
+            // Update children's neighbor indices for siblings
+            child.f[3 * (c + 3) + j] = c + NEXT(j);
+            child.f[3 * (c + j) + NEXT(j)] = c + 3;
+
+            // Update children's neighbor indices for neighbor children
+            int f2 = f[j];
+            child.f[3 * (c + j) + j] =
+                f2 != -1 ? 4 * f2 + mesh.vnum(f2, v[j]) : -1;
+            f2 = f[PREV(j)];
+            child.f[3 * (c + j) + PREV(j)] =
+                f2 != -1 ? 4 * f2 + mesh.vnum(f2, v[j]) : -1;
+
+            // Update children's vertex indices; even vertices keep theirs
+            child.v[3 * (c + j) + j] = v[j];
+            int vert = edgeVerts[3 * i + j];
+            child.v[3 * (c + j) + NEXT(j)] = vert;
+            child.v[3 * (c + NEXT(j)) + j] = vert;
+            child.v[3 * (c + 3) + j] = vert;
         }
+    }, nFaces, 4096);
+    return child;
+}
 
-        // Update face vertex pointers
-        for (SDFace *face : f) {
-            for (int j = 0; j < 3; ++j) {
-                // Update child vertex pointer to new even vertex
-                face->children[j]->v[j] = face->v[j]->child;
-
-                // Update child vertex pointer to new odd vertex
-                SDVertex *vert =
-                    edgeVerts[SDEdge(face->v[j], face->v[NEXT(j)])];
-                face->children[j]->v[NEXT(j)] = vert;
-                face->children[NEXT(j)]->v[j] = vert;
-                face->children[3]->v[j] = vert;
-            }
-        }
+static std::vector<std::shared_ptr<Shape>> LoopSubdivide(
+    const Transform *ObjectToWorld, const Transform *WorldToObject,
+    bool reverseOrientation, int nLevels, int nIndices,
+    const Int *vertexIndices, int nVertices, const Point3f *p) {
+    SDMesh mesh = BuildControlMesh(nIndices, vertexIndices, nVertices, p);
+    if (mesh.nFaces() == 0) return std::vector<std::shared_ptr<Shape>>();
 
-        // Prepare for next level of subdivision
-        f = newFaces;
-        v = newVertices;
-    }
+    // Refine _LoopSubdiv_ into triangles, freeing each level in turn
+    for (int i = 0; i < nLevels; ++i) mesh = Refine(mesh);
 
     // Push vertices to limit surface
-    std::unique_ptr<Point3f[]> pLimit(new Point3f[v.size()]);
-    for (size_t i = 0; i < v.size(); ++i) {
-        if (v[i]->boundary)
-            pLimit[i] = weightBoundary(v[i], 1.f / 5.f);
+    std::vector<Point3f> pLimit(mesh.nVertices());
+    ParallelFor([&](int64_t i) {
+        if (mesh.boundary[i])
+            pLimit[i] = mesh.weightBoundary(i, 1.f / 5.f);
         else
-            pLimit[i] = weightOneRing(v[i], loopGamma(v[i]->valence()));
-    }
-    for (size_t i = 0; i < v.size(); ++i) v[i]->p = pLimit[i];
+            pLimit[i] = mesh.weightOneRing(i, loopGamma(mesh.valence(i)));
+    }, mesh.nVertices(), 4096);
+    mesh.p.swap(pLimit);
+    std::vector<Point3f>().swap(pLimit);
 
     // Compute vertex tangents on limit surface
-    std::vector<Normal3f> Ns;
-    Ns.reserve(v.size());
-    std::vector<Point3f> pRing(16, Point3f());
-    for (SDVertex *vertex : v) {
+    std::vector<Normal3f> Ns(mesh.nVertices());
+    ParallelFor([&](int64_t i) {
         Vector3f S(0, 0, 0), T(0, 0, 0);
-        int valence = vertex->valence();
-        if (valence > (int)pRing.size()) pRing.resize(valence);
-        vertex->oneRing(&pRing[0]);
-        if (!vertex->boundary) {
+        int valence = mesh.valence(i);
+        Point3f *pRing = ALLOCA(Point3f, valence);
+        mesh.oneRing(i, pRing);
+        if (!mesh.boundary[i]) {
             // Compute tangents of interior face
             for (int j = 0; j < valence; ++j) {
                 S += std::cos(2 * Pi * j / valence) * Vector3f(pRing[j]);
@@ -357,14 +320,15 @@ static std::vector<std::shared_ptr<Shape>> LoopSubdivide(
             }
         } else {
             // Compute tangents of boundary face
+            const Point3f &p = mesh.p[i];
             S = pRing[valence - 1] - pRing[0];
             if (valence == 2)
-                T = Vector3f(pRing[0] + pRing[1] - 2 * vertex->p);
+                T = Vector3f(pRing[0] + pRing[1] - 2 * p);
             else if (valence == 3)
-                T = pRing[1] - vertex->p;
+                T = pRing[1] - p;
             else if (valence == 4)  // regular
                 T = Vector3f(-1 * pRing[0] + 2 * pRing[1] + 2 * pRing[2] +
-                             -1 * pRing[3] + -2 * vertex->p);
+                             -1 * pRing[3] + -2 * p);
             else {
                 Float theta = Pi / float(valence - 1);
                 T = Vector3f(std::sin(theta) * (pRing[0] + pRing[valence - 1]));
@@ -375,34 +339,25 @@ static std::vector<std::shared_ptr<Shape>> LoopSubdivide(
                 T = -T;
             }
         }
-        Ns.push_back(Normal3f(Cross(S, T)));
-    }
+        Ns[i] = Normal3f(Cross(S, T));
+    }, mesh.nVertices(), 4096);
 
     // Create triangle mesh from subdivision mesh
-    {
-        size_t ntris = f.size();
-        std::unique_ptr<Int[]> verts(new Int[3 * ntris]);
-        Int *vp = verts.get();
-        size_t totVerts = v.size();
-        std::map<SDVertex *, size_t> usedVerts;
-        for (size_t i = 0; i < totVerts; ++i) usedVerts[v[i]] = i;
-        for (size_t i = 0; i < ntris; ++i) {
-            for (int j = 0; j < 3; ++j) {
-                *vp = usedVerts[f[i]->v[j]];
-                ++vp;
-            }
-        }
-        return CreateTriangleMesh(ObjectToWorld, WorldToObject,
-                                  reverseOrientation, ntris, verts.get(),
-                                  totVerts, pLimit.get(), nullptr, &Ns[0],
-                                  nullptr, nullptr, nullptr);
-    }
+    int ntris = mesh.nFaces();
+    std::vector<int>().swap(mesh.f);
+    std::unique_ptr<Int[]> verts(new Int[3 * size_t(ntris)]);
+    std::copy(mesh.v.begin(), mesh.v.end(), verts.get());
+    std::vector<int>().swap(mesh.v);
+    return CreateTriangleMesh(ObjectToWorld, WorldToObject, reverseOrientation,
+                              ntris, verts.get(), mesh.nVertices(),
+                              mesh.p.data(), nullptr, Ns.data(), nullptr,
+                              nullptr, nullptr);
 }
 
-std::vector<std::shared_ptr<Shape>> CreateLoopSubdiv(const Transform *o2w,
-                                                     const Transform *w2o,
-                                                     bool reverseOrientation,
-                                                     const ParamSet &params) {
+
+std::function<std::vector<std::shared_ptr<Shape>>()> DeferLoopSubdiv(
+    const Transform *o2w, const Transform *w2o, bool reverseOrientation,
+    const ParamSet &params, Bounds3f *objectBound) {
     int nLevels = params.FindOneInt("levels",
                                     params.FindOneInt("nlevels", 3));
     int nps, nIndices;
@@ -410,58 +365,80 @@ std::vector<std::shared_ptr<Shape>> CreateLoopSubdiv(const Transform *o2w,
     const Point3f *P = params.FindPoint3f("P", &nps);
     if (!vertexIndices) {
         Error("Vertex indices \"indices\" not provided for LoopSubdiv shape.");
-        return std::vector<std::shared_ptr<Shape>>();
+        return nullptr;
     }
     if (!P) {
         Error("Vertex positions \"P\" not provided for LoopSubdiv shape.");
-        return std::vector<std::shared_ptr<Shape>>();
+        return nullptr;
     }
 
     // don't actually use this for now...
     std::string scheme = params.FindOneString("scheme", "loop");
-    return LoopSubdivide(o2w, w2o, reverseOrientation, nLevels, nIndices,
-                         vertexIndices, nps, P);
+
+    // Loop's rules give each limit point a convex combination of the
+    // control points, so they bound the surface
+    *objectBound = Bounds3f();
+    for (int i = 0; i < nps; ++i) *objectBound = Union(*objectBound, P[i]);
+
+    std::vector<Int> indices(vertexIndices, vertexIndices + nIndices);
+    std::vector<Point3f> p(P, P + nps);
+    return [=]() {
+        return LoopSubdivide(o2w, w2o, reverseOrientation, nLevels, nIndices,
+                             indices.data(), nps, p.data());
+    };
 }
 
-static Point3f weightOneRing(SDVertex *vert, Float beta) {
-    // Put _vert_ one-ring in _pRing_
-    int valence = vert->valence();
-    Point3f *pRing = ALLOCA(Point3f, valence);
-    vert->oneRing(pRing);
-    Point3f p = (1 - valence * beta) * vert->p;
-    for (int i = 0; i < valence; ++i) p += beta * pRing[i];
-    return p;
+std::vector<std::shared_ptr<Shape>> CreateLoopSubdiv(const Transform *o2w,
+                                                     const Transform *w2o,
+                                                     bool reverseOrientation,
+                                                     const ParamSet &params) {
+    Bounds3f objectBound;
+    std::function<std::vector<std::shared_ptr<Shape>>()> subdivide =
+        DeferLoopSubdiv(o2w, w2o, reverseOrientation, params, &objectBound);
+    if (!subdivide) return std::vector<std::shared_ptr<Shape>>();
+    return subdivide();
 }
 
-void SDVertex::oneRing(Point3f *p) {
-    if (!boundary) {
+// SDMesh Method Definitions
+void SDMesh::oneRing(int vert, Point3f *ring) const {
+    if (!boundary[vert]) {
         // Get one-ring vertices for interior vertex
-        SDFace *face = startFace;
+        int face = startFace[vert];
         do {
-            *p++ = face->nextVert(this)->p;
-            face = face->nextFace(this);
-        } while (face != startFace);
+            *ring++ = p[nextVert(face, vert)];
+            face = nextFace(face, vert);
+        } while (face != startFace[vert]);
     } else {
         // Get one-ring vertices for boundary vertex
-        SDFace *face = startFace, *f2;
-        while ((f2 = face->nextFace(this)) != nullptr) face = f2;
-        *p++ = face->nextVert(this)->p;
+        int face = startFace[vert], f2;
+        while ((f2 = nextFace(face, vert)) != -1) face = f2;
+        *ring++ = p[nextVert(face, vert)];
         do {
-            *p++ = face->prevVert(this)->p;
-            face = face->prevFace(this);
-        } while (face != nullptr);
+            *ring++ = p[prevVert(face, vert)];
+            face = prevFace(face, vert);
+        } while (face != -1);
     }
 }
 
-static Point3f weightBoundary(SDVertex *vert, Float beta) {
+Point3f SDMesh::weightOneRing(int vert, Float beta) const {
+    // Put _vert_ one-ring in _pRing_
+    int valence = this->valence(vert);
+    Point3f *pRing = ALLOCA(Point3f, valence);
+    oneRing(vert, pRing);
+    Point3f pw = (1 - valence * beta) * p[vert];
+    for (int i = 0; i < valence; ++i) pw += beta * pRing[i];
+    return pw;
+}
+
+Point3f SDMesh::weightBoundary(int vert, Float beta) const {
     // Put _vert_ one-ring in _pRing_
-    int valence = vert->valence();
+    int valence = this->valence(vert);
     Point3f *pRing = ALLOCA(Point3f, valence);
-    vert->oneRing(pRing);
-    Point3f p = (1 - 2 * beta) * vert->p;
-    p += beta * pRing[0];
-    p += beta * pRing[valence - 1];
-    return p;
+    oneRing(vert, pRing);
+    Point3f pw = (1 - 2 * beta) * p[vert];
+    pw += beta * pRing[0];
+    pw += beta * pRing[valence - 1];
+    return pw;
 }
 
 }  // namespace pbrt
@@ -40,10 +40,20 @@
 
 // shapes/loopsubdiv.h*
 #include "shape.h"
+#include <functional>
 
 namespace pbrt {
 
 // LoopSubdiv Declarations
+// Returns a function that subdivides the "loopsubdiv" shape described by
+// _params_ and returns its triangles, so that they needn't be created
+// until they're needed, or _nullptr_ if _params_ are invalid.
+// _objectBound_ is set to the limit surface's object space bounds. The
+// function may be called during rendering, when its parallel loops run
+// serially in the calling thread.
+std::function<std::vector<std::shared_ptr<Shape>>()> DeferLoopSubdiv(
+    const Transform *o2w, const Transform *w2o, bool reverseOrientation,
+    const ParamSet &params, Bounds3f *objectBound);
 std::vector<std::shared_ptr<Shape>> CreateLoopSubdiv(const Transform *o2w,
                                                      const Transform *w2o,
                                                      bool reverseOrientation,
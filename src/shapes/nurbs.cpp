@@ -142,26 +142,25 @@ static Point3f NURBSEvaluateSurface(int uOrder, const Float *uKnot, int ucp,
     return Point3f(P.x / P.w, P.y / P.w, P.z / P.w);
 }
 
-std::vector<std::shared_ptr<Shape>> CreateNURBS(const Transform *o2w,
-                                                const Transform *w2o,
-                                                bool reverseOrientation,
-                                                const ParamSet &params) {
+std::function<std::vector<std::shared_ptr<Shape>>()> DeferNURBS(
+    const Transform *o2w, const Transform *w2o, bool reverseOrientation,
+    const ParamSet &params, Bounds3f *objectBound) {
     int nu = params.FindOneInt("nu", -1);
     if (nu == -1) {
         Error("Must provide number of control points \"nu\" with NURBS shape.");
-        return std::vector<std::shared_ptr<Shape>>();
+        return nullptr;
     }
 
     int uorder = params.FindOneInt("uorder", -1);
     if (uorder == -1) {
         Error("Must provide u order \"uorder\" with NURBS shape.");
-        return std::vector<std::shared_ptr<Shape>>();
+        return nullptr;
     }
     int nuknots, nvknots;
     const Float *uknots = params.FindFloat("uknots", &nuknots);
     if (!uknots) {
         Error("Must provide u knot vector \"uknots\" with NURBS shape.");
-        return std::vector<std::shared_ptr<Shape>>();
+        return nullptr;
     }
 
     if (nuknots != nu + uorder) {
@@ -169,7 +168,7 @@ std::vector<std::shared_ptr<Shape>> CreateNURBS(const Transform *o2w,
             "Number of knots in u knot vector %d doesn't match sum of "
             "number of u control points %d and u order %d.",
             nuknots, nu, uorder);
-        return std::vector<std::shared_ptr<Shape>>();
+        return nullptr;
     }
 
     Float u0 = params.FindOneFloat("u0", uknots[uorder - 1]);
@@ -178,19 +177,19 @@ std::vector<std::shared_ptr<Shape>> CreateNURBS(const Transform *o2w,
     int nv = params.FindOneInt("nv", -1);
     if (nv == -1) {
         Error("Must provide number of control points \"nv\" with NURBS shape.");
-        return std::vector<std::shared_ptr<Shape>>();
+        return nullptr;
     }
 
     int vorder = params.FindOneInt("vorder", -1);
     if (vorder == -1) {
         Error("Must provide v order \"vorder\" with NURBS shape.");
-        return std::vector<std::shared_ptr<Shape>>();
+        return nullptr;
     }
 
     const Float *vknots = params.FindFloat("vknots", &nvknots);
     if (!vknots) {
         Error("Must provide v knot vector \"vknots\" with NURBS shape.");
-        return std::vector<std::shared_ptr<Shape>>();
+        return nullptr;
     }
 
     if (nvknots != nv + vorder) {
@@ -198,7 +197,7 @@ std::vector<std::shared_ptr<Shape>> CreateNURBS(const Transform *o2w,
             "Number of knots in v knot vector %d doesn't match sum of "
             "number of v control points %d and v order %d.",
             nvknots, nv, vorder);
-        return std::vector<std::shared_ptr<Shape>>();
+        return nullptr;
     }
 
     Float v0 = params.FindOneFloat("v0", vknots[vorder - 1]);
@@ -213,14 +212,14 @@ std::vector<std::shared_ptr<Shape>> CreateNURBS(const Transform *o2w,
             Error(
                 "Must provide control points via \"P\" or \"Pw\" parameter to "
                 "NURBS shape.");
-            return std::vector<std::shared_ptr<Shape>>();
+            return nullptr;
         }
         if ((npts % 4) != 0) {
             Error(
                 "Number of \"Pw\" control points provided to NURBS shape must "
                 "be "
                 "multiple of four");
-            return std::vector<std::shared_ptr<Shape>>();
+            return nullptr;
         }
         npts /= 4;
         isHomogeneous = true;
@@ -228,28 +227,12 @@ std::vector<std::shared_ptr<Shape>> CreateNURBS(const Transform *o2w,
     if (npts != nu * nv) {
         Error("NURBS shape was expecting %dx%d=%d control points, was given %d",
               nu, nv, nu * nv, npts);
-        return std::vector<std::shared_ptr<Shape>>();
+        return nullptr;
     }
 
-    // Compute NURBS dicing rates
-    int diceu = 30, dicev = 30;
-    std::unique_ptr<Float[]> ueval(new Float[diceu]);
-    std::unique_ptr<Float[]> veval(new Float[dicev]);
-    std::unique_ptr<Point3f[]> evalPs(new Point3f[diceu * dicev]);
-    std::unique_ptr<Normal3f[]> evalNs(new Normal3f[diceu * dicev]);
-    int i;
-    for (i = 0; i < diceu; ++i)
-        ueval[i] = Lerp((float)i / (float)(diceu - 1), u0, u1);
-    for (i = 0; i < dicev; ++i)
-        veval[i] = Lerp((float)i / (float)(dicev - 1), v0, v1);
-
-    // Evaluate NURBS over grid of points
-    memset(evalPs.get(), 0, diceu * dicev * sizeof(Point3f));
-    memset(evalNs.get(), 0, diceu * dicev * sizeof(Point3f));
-    std::unique_ptr<Point2f[]> uvs(new Point2f[diceu * dicev]);
-
-    // Turn NURBS into triangles
-    std::unique_ptr<Homogeneous3[]> Pw(new Homogeneous3[nu * nv]);
+    // Copy the control points as homogeneous points, which are needed
+    // when the surface is evaluated
+    std::vector<Homogeneous3> Pw(nu * nv);
     if (isHomogeneous) {
         for (int i = 0; i < nu * nv; ++i) {
             Pw[i].x = P[4 * i];
@@ -266,45 +249,92 @@ std::vector<std::shared_ptr<Shape>> CreateNURBS(const Transform *o2w,
         }
     }
 
-    for (int v = 0; v < dicev; ++v) {
-        for (int u = 0; u < diceu; ++u) {
-            uvs[(v * diceu + u)].x = ueval[u];
-            uvs[(v * diceu + u)].y = veval[v];
-
-            Vector3f dpdu, dpdv;
-            Point3f pt = NURBSEvaluateSurface(uorder, uknots, nu, ueval[u],
-                                              vorder, vknots, nv, veval[v],
-                                              Pw.get(), &dpdu, &dpdv);
-            evalPs[v * diceu + u].x = pt.x;
-            evalPs[v * diceu + u].y = pt.y;
-            evalPs[v * diceu + u].z = pt.z;
-            evalNs[v * diceu + u] = Normal3f(Normalize(Cross(dpdu, dpdv)));
+    // The surface lies in the convex hull of its control points if all of
+    // their weights are positive
+    *objectBound = Bounds3f();
+    for (const Homogeneous3 &p : Pw) {
+        if (p.w <= 0) {
+            *objectBound = Bounds3f();
+            break;
         }
+        *objectBound =
+            Union(*objectBound, Point3f(p.x / p.w, p.y / p.w, p.z / p.w));
     }
 
-    // Generate points-polygons mesh
-    int nTris = 2 * (diceu - 1) * (dicev - 1);
-    std::unique_ptr<Int[]> vertices(new Int[3 * nTris]);
-    Int *vertp = vertices.get();
-    // Compute the vertex offset numbers for the triangles
-    for (int v = 0; v < dicev - 1; ++v) {
-        for (int u = 0; u < diceu - 1; ++u) {
+    std::vector<Float> uknotsCopy(uknots, uknots + nuknots);
+    std::vector<Float> vknotsCopy(vknots, vknots + nvknots);
+    return [=]() {
+        const Float *uknots = uknotsCopy.data(), *vknots = vknotsCopy.data();
+        // Compute NURBS dicing rates
+        int diceu = 30, dicev = 30;
+        std::unique_ptr<Float[]> ueval(new Float[diceu]);
+        std::unique_ptr<Float[]> veval(new Float[dicev]);
+        std::unique_ptr<Point3f[]> evalPs(new Point3f[diceu * dicev]);
+        std::unique_ptr<Normal3f[]> evalNs(new Normal3f[diceu * dicev]);
+        int i;
+        for (i = 0; i < diceu; ++i)
+            ueval[i] = Lerp((float)i / (float)(diceu - 1), u0, u1);
+        for (i = 0; i < dicev; ++i)
+            veval[i] = Lerp((float)i / (float)(dicev - 1), v0, v1);
+
+        // Evaluate NURBS over grid of points
+        memset(evalPs.get(), 0, diceu * dicev * sizeof(Point3f));
+        memset(evalNs.get(), 0, diceu * dicev * sizeof(Point3f));
+        std::unique_ptr<Point2f[]> uvs(new Point2f[diceu * dicev]);
+
+        // Turn NURBS into triangles
+        for (int v = 0; v < dicev; ++v) {
+            for (int u = 0; u < diceu; ++u) {
+                uvs[(v * diceu + u)].x = ueval[u];
+                uvs[(v * diceu + u)].y = veval[v];
+
+                Vector3f dpdu, dpdv;
+                Point3f pt = NURBSEvaluateSurface(
+                    uorder, uknots, nu, ueval[u], vorder, vknots, nv,
+                    veval[v], Pw.data(), &dpdu, &dpdv);
+                evalPs[v * diceu + u].x = pt.x;
+                evalPs[v * diceu + u].y = pt.y;
+                evalPs[v * diceu + u].z = pt.z;
+                evalNs[v * diceu + u] = Normal3f(Normalize(Cross(dpdu, dpdv)));
+            }
+        }
+
+        // Generate points-polygons mesh
+        int nTris = 2 * (diceu - 1) * (dicev - 1);
+        std::unique_ptr<Int[]> vertices(new Int[3 * nTris]);
+        Int *vertp = vertices.get();
+        // Compute the vertex offset numbers for the triangles
+        for (int v = 0; v < dicev - 1; ++v) {
+            for (int u = 0; u < diceu - 1; ++u) {
 #define VN(u, v) ((v)*diceu + (u))
-            *vertp++ = VN(u, v);
-            *vertp++ = VN(u + 1, v);
-            *vertp++ = VN(u + 1, v + 1);
+                *vertp++ = VN(u, v);
+                *vertp++ = VN(u + 1, v);
+                *vertp++ = VN(u + 1, v + 1);
 
-            *vertp++ = VN(u, v);
-            *vertp++ = VN(u + 1, v + 1);
-            *vertp++ = VN(u, v + 1);
+                *vertp++ = VN(u, v);
+                *vertp++ = VN(u + 1, v + 1);
+                *vertp++ = VN(u, v + 1);
 #undef VN
+            }
         }
-    }
-    int nVerts = diceu * dicev;
+        int nVerts = diceu * dicev;
 
-    return CreateTriangleMesh(o2w, w2o, reverseOrientation, nTris,
-                              vertices.get(), nVerts, evalPs.get(), nullptr,
-                              evalNs.get(), uvs.get(), nullptr, nullptr);
+        return CreateTriangleMesh(o2w, w2o, reverseOrientation, nTris,
+                                  vertices.get(), nVerts, evalPs.get(),
+                                  nullptr, evalNs.get(), uvs.get(), nullptr,
+                                  nullptr);
+    };
+}
+
+std::vector<std::shared_ptr<Shape>> CreateNURBS(const Transform *o2w,
+                                                const Transform *w2o,
+                                                bool reverseOrientation,
+                                                const ParamSet &params) {
+    Bounds3f objectBound;
+    std::function<std::vector<std::shared_ptr<Shape>>()> tessellate =
+        DeferNURBS(o2w, w2o, reverseOrientation, params, &objectBound);
+    if (!tessellate) return std::vector<std::shared_ptr<Shape>>();
+    return tessellate();
 }
 
 }  // namespace pbrt
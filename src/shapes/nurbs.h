@@ -42,9 +42,18 @@
 #include "pbrt.h"
 #include "shape.h"
 #include "geometry.h"
+#include <functional>
 
 namespace pbrt {
 
+// Returns a function that creates the triangles of the NURBS surface
+// described by _params_, so that they needn't be created until they're
+// needed, or _nullptr_ if _params_ are invalid. _objectBound_ is set to
+// the surface's object space bounds, or to an empty bound if they can't be
+// found without evaluating it.
+std::function<std::vector<std::shared_ptr<Shape>>()> DeferNURBS(
+    const Transform *o2w, const Transform *w2o, bool reverseOrientation,
+    const ParamSet &params, Bounds3f *objectBound);
 std::vector<std::shared_ptr<Shape>> CreateNURBS(const Transform *o2w,
                                                 const Transform *w2o,
                                                 bool reverseOrientation,
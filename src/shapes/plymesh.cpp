@@ -33,6 +33,7 @@
 
 // shapes/plymesh.cpp*
 #include "shapes/triangle.h"
+#include "shapes/bilinear.h"
 #include "textures/constant.h"
 #include "paramset.h"
 #include "ext/rply.h"
@@ -47,8 +48,15 @@ struct CallbackContext {
     Normal3f *n;
     Point2f *uv;
     Int *indices;
+    // Quads are stored here, in bilinear patch vertex order, unless they
+    // are split into triangles
+    Int *quadIndices;
     Int *faceIndices;
-    int indexCtr, faceIndexCtr;
+    int indexCtr, quadIndexCtr, faceIndexCtr;
+    // Number of faces read so far, and the file face that each triangle
+    // comes from, used to look up their face indices
+    int faceCtr;
+    std::vector<int> triangleFaces;
     int face[4];
     bool error;
     int vertexCount;
@@ -58,9 +66,12 @@ struct CallbackContext {
           n(nullptr),
           uv(nullptr),
           indices(nullptr),
+          quadIndices(nullptr),
           faceIndices(nullptr),
           indexCtr(0),
+          quadIndexCtr(0),
           faceIndexCtr(0),
+          faceCtr(0),
           error(false),
           vertexCount(0) {}
 
@@ -69,6 +80,7 @@ struct CallbackContext {
         delete[] n;
         delete[] uv;
         delete[] indices;
+        delete[] quadIndices;
         delete[] faceIndices;
     }
 };
@@ -108,6 +120,8 @@ int rply_face_callback(p_ply_argument argument) {
 
         long length, value_index;
         ply_get_argument_property(argument, nullptr, &length, &value_index);
+        // Each face's list starts with a call for its length
+        if (value_index < 0) ++context->faceCtr;
 
         if (length != 3 && length != 4) {
             Warning("plymesh: Ignoring face with %i vertices (only triangles and quads "
@@ -117,10 +131,6 @@ int rply_face_callback(p_ply_argument argument) {
         } else if (value_index < 0) {
             return 1;
         }
-        if (length == 4)
-            CHECK(context->faceIndices == nullptr) <<
-                "face_indices not yet supported for quads";
-
         if (value_index >= 0) {
             int value = (int)ply_get_argument_value(argument);
             if (value < 0 || value >= context->vertexCount) {
@@ -133,15 +143,23 @@ int rply_face_callback(p_ply_argument argument) {
             context->face[value_index] = value;
         }
 
-        if (value_index == length - 1) {
+        if (value_index == 3 && context->quadIndices) {
+            /* Keep the quad as a bilinear patch */
+            context->quadIndices[context->quadIndexCtr++] = context->face[0];
+            context->quadIndices[context->quadIndexCtr++] = context->face[1];
+            context->quadIndices[context->quadIndexCtr++] = context->face[3];
+            context->quadIndices[context->quadIndexCtr++] = context->face[2];
+        } else if (value_index == length - 1) {
             for (int i = 0; i < 3; ++i)
                 context->indices[context->indexCtr++] = context->face[i];
+            context->triangleFaces.push_back(context->faceCtr - 1);
 
             if (length == 4) {
                 /* This was a quad */
                 context->indices[context->indexCtr++] = context->face[3];
                 context->indices[context->indexCtr++] = context->face[0];
                 context->indices[context->indexCtr++] = context->face[2];
+                context->triangleFaces.push_back(context->faceCtr - 1);
             }
         }
     } else {
@@ -154,6 +172,28 @@ int rply_face_callback(p_ply_argument argument) {
     return 1;
 }
 
+// Copies just the vertices that _indices_ use into _p_, _n_ and _uv_ and
+// renumbers _indices_ to match, so that files with both triangles and quads
+// don't store all of their vertices in both meshes. Returns the number of
+// vertices kept.
+static int CompactVertices(Int *indices, int nIndices, int nVertices,
+                           const Point3f *P, const Normal3f *N,
+                           const Point2f *UV, std::vector<Point3f> *p,
+                           std::vector<Normal3f> *n, std::vector<Point2f> *uv) {
+    std::vector<Int> remap(nVertices, -1);
+    for (int i = 0; i < nIndices; ++i) {
+        Int &v = indices[i];
+        if (remap[v] == -1) {
+            remap[v] = p->size();
+            p->push_back(P[v]);
+            if (N) n->push_back(N[v]);
+            if (UV) uv->push_back(UV[v]);
+        }
+        v = remap[v];
+    }
+    return p->size();
+}
+
 std::vector<std::shared_ptr<Shape>> CreatePLYMesh(
     const Transform *o2w, const Transform *w2o, bool reverseOrientation,
     const ParamSet &params,
@@ -238,6 +278,20 @@ std::vector<std::shared_ptr<Shape>> CreatePLYMesh(
     context.indices = new Int[faceCount * 6];
     context.vertexCount = vertexCount;
 
+    /* Quads are split into triangles unless the user asks for bilinear
+     * patches and the mesh has no alpha mask, which patches don't support */
+    if (params.FindOneBool("bilinearquads", false)) {
+        if (params.FindTexture("alpha") == "" &&
+            params.FindOneFloat("alpha", 1.f) != 0.f &&
+            params.FindTexture("shadowalpha") == "" &&
+            params.FindOneFloat("shadowalpha", 1.f) != 0.f)
+            context.quadIndices = new Int[faceCount * 4];
+        else
+            Warning("%s: \"bilinearquads\" isn't supported with alpha "
+                    "masks; splitting quads into triangles instead.",
+                    filename.c_str());
+    }
+
     ply_set_read_cb(ply, "face", "vertex_indices", rply_face_callback, &context,
                     0);
     if (ply_set_read_cb(ply, "face", "face_indices", rply_face_callback, &context,
@@ -256,6 +310,21 @@ std::vector<std::shared_ptr<Shape>> CreatePLYMesh(
 
     if (context.error) return std::vector<std::shared_ptr<Shape>>();
 
+    // Look up each triangle's face index by the file face it came from,
+    // since split quads give two triangles and quads kept as patches none
+    std::vector<Int> triangleFaceIndices;
+    if (context.faceIndices) {
+        if (context.faceIndexCtr != context.faceCtr) {
+            Error("%s: %d face indices given for %d faces",
+                  filename.c_str(), context.faceIndexCtr, context.faceCtr);
+            return std::vector<std::shared_ptr<Shape>>();
+        }
+        for (int face : context.triangleFaces)
+            triangleFaceIndices.push_back(context.faceIndices[face]);
+    }
+    const Int *faceIndices =
+        context.faceIndices ? triangleFaceIndices.data() : nullptr;
+
     // Look up an alpha texture, if applicable
     std::shared_ptr<Texture<Float>> alphaTex;
     std::string alphaTexName = params.FindTexture("alpha");
@@ -282,11 +351,44 @@ std::vector<std::shared_ptr<Shape>> CreatePLYMesh(
     } else if (params.FindOneFloat("shadowalpha", 1.f) == 0.f)
         shadowAlphaTex.reset(new ConstantTexture<Float>(0.f));
 
-    return CreateTriangleMesh(o2w, w2o, reverseOrientation,
-                              context.indexCtr / 3, context.indices,
-                              vertexCount, context.p, nullptr, context.n,
-                              context.uv, alphaTex, shadowAlphaTex,
-                              context.faceIndices);
+    bool compact = params.FindOneBool("compact", false);
+
+    std::vector<std::shared_ptr<Shape>> shapes;
+    if (context.indexCtr > 0 && context.quadIndexCtr > 0) {
+        // Give each mesh only the vertices its faces use
+        std::vector<Point3f> p[2];
+        std::vector<Normal3f> n[2];
+        std::vector<Point2f> uv[2];
+        int nTriVertices = CompactVertices(
+            context.indices, context.indexCtr, vertexCount, context.p,
+            context.n, context.uv, &p[0], &n[0], &uv[0]);
+        shapes = CreateTriangleMesh(
+            o2w, w2o, reverseOrientation, context.indexCtr / 3,
+            context.indices, nTriVertices, p[0].data(), nullptr,
+            context.n ? n[0].data() : nullptr,
+            context.uv ? uv[0].data() : nullptr, alphaTex, shadowAlphaTex,
+            faceIndices, compact);
+        int nQuadVertices = CompactVertices(
+            context.quadIndices, context.quadIndexCtr, vertexCount, context.p,
+            context.n, context.uv, &p[1], &n[1], &uv[1]);
+        std::vector<std::shared_ptr<Shape>> patches = CreateBilinearPatchMesh(
+            o2w, w2o, reverseOrientation, context.quadIndexCtr / 4,
+            context.quadIndices, nQuadVertices, p[1].data(),
+            context.n ? n[1].data() : nullptr,
+            context.uv ? uv[1].data() : nullptr);
+        shapes.insert(shapes.end(), patches.begin(), patches.end());
+    } else if (context.indexCtr > 0)
+        shapes = CreateTriangleMesh(o2w, w2o, reverseOrientation,
+                                    context.indexCtr / 3, context.indices,
+                                    vertexCount, context.p, nullptr, context.n,
+                                    context.uv, alphaTex, shadowAlphaTex,
+                                    faceIndices, compact);
+    else if (context.quadIndexCtr > 0)
+        shapes = CreateBilinearPatchMesh(
+            o2w, w2o, reverseOrientation, context.quadIndexCtr / 4,
+            context.quadIndices, vertexCount, context.p, context.n,
+            context.uv);
+    return shapes;
 }
 
 }  // namespace pbrt
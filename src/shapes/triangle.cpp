@@ -37,6 +37,7 @@
 #include "paramset.h"
 #include "sampling.h"
 #include "efloat.h"
+#include "parallel.h"
 #include "ext/rply.h"
 #include <array>
 
@@ -45,29 +46,43 @@ namespace pbrt {
 STAT_PERCENT("Intersections/Ray-triangle intersection tests", nHits, nTests);
 
 // Triangle Local Definitions
+template <typename V>
+static bool HasZeroVector(const V *v, int n) {
+    for (int i = 0; i < n; ++i)
+        if (v[i].x == 0 && v[i].y == 0 && v[i].z == 0) return true;
+    return false;
+}
+
 static void PlyErrorCallback(p_ply, const char *message) {
     Error("PLY writing error: %s", message);
 }
 
 // Triangle Method Definitions
 STAT_RATIO("Scene/Triangles per triangle mesh", nTris, nMeshes);
+STAT_COUNTER("Scene/Compact triangle meshes", nCompactMeshes);
+STAT_MEMORY_COUNTER("Memory/Compact triangle meshes", compactTriMeshBytes);
 TriangleMesh::TriangleMesh(
     const Transform &ObjectToWorld, int nTriangles, const Int *vertexIndices,
     int nVertices, const Point3f *P, const Vector3f *S, const Normal3f *N,
     const Point2f *UV, const std::shared_ptr<Texture<Float>> &alphaMask,
     const std::shared_ptr<Texture<Float>> &shadowAlphaMask,
-    const Int *fIndices)
+    const Int *fIndices, bool compact)
     : nTriangles(nTriangles),
       nVertices(nVertices),
-      vertexIndices(vertexIndices, vertexIndices + 3 * nTriangles),
+      compact(compact),
       alphaMask(alphaMask),
       shadowAlphaMask(shadowAlphaMask) {
     ++nMeshes;
     nTris += nTriangles;
-    triMeshBytes += sizeof(*this) + this->vertexIndices.size() * sizeof(int) +
-                    nVertices * (sizeof(*P) + (N ? sizeof(*N) : 0) +
-                                 (S ? sizeof(*S) : 0) + (UV ? sizeof(*UV) : 0) +
-                                 (fIndices ? sizeof(*fIndices) : 0));
+    if (compact) ++nCompactMeshes;
+
+    // Copy vertex indices, narrowing them to 16 bits if possible
+    if (compact && nVertices <= 65536)
+        vertexIndices16 = std::vector<uint16_t>(vertexIndices,
+                                                vertexIndices + 3 * nTriangles);
+    else
+        this->vertexIndices =
+            std::vector<int>(vertexIndices, vertexIndices + 3 * nTriangles);
 
     // Transform mesh vertices to world space
     p.reset(new Point3f[nVertices]);
@@ -75,20 +90,105 @@ TriangleMesh::TriangleMesh(
 
     // Copy _UV_, _N_, and _S_ vertex data, if present
     if (UV) {
-        uv.reset(new Point2f[nVertices]);
-        memcpy(uv.get(), UV, nVertices * sizeof(Point2f));
+        if (compact) {
+            uvHalf.reset(new uint16_t[2 * nVertices]);
+            for (int i = 0; i < nVertices; ++i) {
+                uvHalf[2 * i] = FloatToHalf(UV[i].x);
+                uvHalf[2 * i + 1] = FloatToHalf(UV[i].y);
+            }
+        } else {
+            uv.reset(new Point2f[nVertices]);
+            memcpy(uv.get(), UV, nVertices * sizeof(Point2f));
+        }
     }
+    // Zero normals and tangents have no direction to encode, so meshes
+    // with any keep them at full precision
     if (N) {
-        n.reset(new Normal3f[nVertices]);
-        for (int i = 0; i < nVertices; ++i) n[i] = ObjectToWorld(N[i]);
+        if (compact && !HasZeroVector(N, nVertices))
+            nEncoded.reset(new uint32_t[nVertices]);
+        else
+            n.reset(new Normal3f[nVertices]);
     }
     if (S) {
-        s.reset(new Vector3f[nVertices]);
-        for (int i = 0; i < nVertices; ++i) s[i] = ObjectToWorld(S[i]);
+        if (compact && !HasZeroVector(S, nVertices))
+            sEncoded.reset(new uint32_t[nVertices]);
+        else
+            s.reset(new Vector3f[nVertices]);
+    }
+    if (N || S) {
+        for (int i = 0; i < nVertices; ++i) {
+            if (N) SetN(i, ObjectToWorld(N[i]));
+            if (S) SetS(i, ObjectToWorld(S[i]));
+        }
     }
 
     if (fIndices)
         faceIndices = std::vector<int>(fIndices, fIndices + nTriangles);
+
+    // Classify the alpha textures' micro-cells
+    if (alphaMask) alphaCells.Build(*this, *alphaMask);
+    if (shadowAlphaMask) shadowAlphaCells.Build(*this, *shadowAlphaMask);
+
+    size_t bytes = BytesUsed();
+    triMeshBytes += bytes;
+    if (compact) compactTriMeshBytes += bytes;
+}
+
+size_t TriangleMesh::BytesUsed() const {
+    size_t bytes = sizeof(*this) + vertexIndices.size() * sizeof(int) +
+                   vertexIndices16.size() * sizeof(uint16_t) +
+                   nVertices * sizeof(Point3f) +
+                   faceIndices.size() * sizeof(int) +
+                   (alphaCells.bits.size() + shadowAlphaCells.bits.size()) *
+                       sizeof(uint64_t);
+    if (HasNormals())
+        bytes += nVertices * (nEncoded ? sizeof(uint32_t) : sizeof(Normal3f));
+    if (HasTangents())
+        bytes += nVertices * (sEncoded ? sizeof(uint32_t) : sizeof(Vector3f));
+    if (HasUVs())
+        bytes += nVertices * (compact ? 2 * sizeof(uint16_t) : sizeof(Point2f));
+    return bytes;
+}
+
+void TriangleMesh::SetN(int i, const Normal3f &N) {
+    if (nEncoded)
+        nEncoded[i] = EncodeOctahedral(Vector3f(N));
+    else
+        n[i] = N;
+}
+
+void TriangleMesh::SetS(int i, const Vector3f &S) {
+    if (sEncoded)
+        sEncoded[i] = EncodeOctahedral(S);
+    else
+        s[i] = S;
+}
+
+void TriangleMesh::UpdateVertices(const Transform &ObjectToWorld,
+                                  const Point3f *P, const Normal3f *N,
+                                  const Vector3f *S) {
+    if (N && !HasNormals()) {
+        Error("Can't add normals to a triangle mesh that has none.");
+        return;
+    }
+    if (S && !HasTangents()) {
+        Error("Can't add tangents to a triangle mesh that has none.");
+        return;
+    }
+    // Encoded normals and tangents can't represent zero vectors
+    if (N && nEncoded && HasZeroVector(N, nVertices)) {
+        Error("Can't store zero normals in a compact triangle mesh.");
+        return;
+    }
+    if (S && sEncoded && HasZeroVector(S, nVertices)) {
+        Error("Can't store zero tangents in a compact triangle mesh.");
+        return;
+    }
+    ParallelFor([&](int64_t i) {
+        p[i] = ObjectToWorld(P[i]);
+        if (N) SetN(i, ObjectToWorld(N[i]));
+        if (S) SetS(i, ObjectToWorld(S[i]));
+    }, nVertices, 4096);
 }
 
 std::vector<std::shared_ptr<Shape>> CreateTriangleMesh(
@@ -97,10 +197,10 @@ std::vector<std::shared_ptr<Shape>> CreateTriangleMesh(
     Int nVertices, const Point3f *p, const Vector3f *s, const Normal3f *n,
     const Point2f *uv, const std::shared_ptr<Texture<Float>> &alphaMask,
     const std::shared_ptr<Texture<Float>> &shadowAlphaMask,
-    const Int *faceIndices) {
+    const Int *faceIndices, bool compact) {
     std::shared_ptr<TriangleMesh> mesh = std::make_shared<TriangleMesh>(
         *ObjectToWorld, nTriangles, vertexIndices, nVertices, p, s, n, uv,
-        alphaMask, shadowAlphaMask, faceIndices);
+        alphaMask, shadowAlphaMask, faceIndices, compact);
     std::vector<std::shared_ptr<Shape>> tris;
     tris.reserve(nTriangles);
     for (int i = 0; i < nTriangles; ++i)
@@ -169,6 +269,8 @@ bool WritePlyFile(const std::string &filename, int nTriangles,
 }
 
 Bounds3f Triangle::ObjectBound() const {
+    int v[3];
+    mesh->GetVertexIndices(triNumber, v);
     // Get triangle vertices in _p0_, _p1_, and _p2_
     const Point3f &p0 = mesh->p[v[0]];
     const Point3f &p1 = mesh->p[v[1]];
@@ -178,6 +280,8 @@ Bounds3f Triangle::ObjectBound() const {
 }
 
 Bounds3f Triangle::WorldBound() const {
+    int v[3];
+    mesh->GetVertexIndices(triNumber, v);
     // Get triangle vertices in _p0_, _p1_, and _p2_
     const Point3f &p0 = mesh->p[v[0]];
     const Point3f &p1 = mesh->p[v[1]];
@@ -185,17 +289,121 @@ Bounds3f Triangle::WorldBound() const {
     return Union(Bounds3f(p0, p1), p2);
 }
 
-bool Triangle::Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
-                         bool testAlphaTexture) const {
-    ProfilePhase p(Prof::TriIntersect);
-    ++nTests;
-    // Get triangle vertices in _p0_, _p1_, and _p2_
-    const Point3f &p0 = mesh->p[v[0]];
-    const Point3f &p1 = mesh->p[v[1]];
-    const Point3f &p2 = mesh->p[v[2]];
+Bounds3f Triangle::ClippedWorldBound(const Bounds3f &clip) const {
+    // Clip the triangle against the six planes of _clip_
+    PBRT_CONSTEXPR int maxVertices = 9;
+    Point3f poly[maxVertices], clipped[maxVertices];
+    int v[3];
+    mesh->GetVertexIndices(triNumber, v);
+    poly[0] = mesh->p[v[0]];
+    poly[1] = mesh->p[v[1]];
+    poly[2] = mesh->p[v[2]];
+    int nVertices = 3;
+    for (int axis = 0; axis < 3 && nVertices > 0; ++axis) {
+        for (int side = 0; side < 2 && nVertices > 0; ++side) {
+            // Keep the part of the polygon on the inside of the plane
+            Float plane = side == 0 ? clip.pMin[axis] : clip.pMax[axis];
+            auto inside = [&](const Point3f &p) {
+                return side == 0 ? p[axis] >= plane : p[axis] <= plane;
+            };
+            int nClipped = 0;
+            for (int i = 0; i < nVertices; ++i) {
+                const Point3f &a = poly[i];
+                const Point3f &b = poly[(i + 1) % nVertices];
+                if (inside(a)) clipped[nClipped++] = a;
+                if (inside(a) != inside(b)) {
+                    Float t = (plane - a[axis]) / (b[axis] - a[axis]);
+                    Point3f p = Lerp(t, a, b);
+                    p[axis] = plane;
+                    clipped[nClipped++] = p;
+                }
+            }
+            CHECK_LE(nClipped, maxVertices);
+            for (int i = 0; i < nClipped; ++i) poly[i] = clipped[i];
+            nVertices = nClipped;
+        }
+    }
+    if (nVertices == 0) return Bounds3f();
+
+    // Bound the clipped polygon, padding it to account for round-off error
+    // in the computed intersection points
+    Bounds3f bounds(poly[0]);
+    for (int i = 1; i < nVertices; ++i) bounds = Union(bounds, poly[i]);
+    Vector3f pad = gamma(7) * Vector3f(Max(Abs(bounds.pMin), Abs(bounds.pMax)));
+    bounds = Bounds3f(bounds.pMin - pad, bounds.pMax + pad);
+    return pbrt::Intersect(bounds, clip);
+}
 
-    // Perform ray--triangle intersection test
+// Returns the $(u,v)$ coordinates of the vertices _v_ of a triangle in
+// _mesh_, or default ones if the mesh has none.
+static void GetTriangleUVs(const TriangleMesh &mesh, const int *v,
+                           Point2f uv[3]) {
+    if (mesh.HasUVs()) {
+        uv[0] = mesh.UV(v[0]);
+        uv[1] = mesh.UV(v[1]);
+        uv[2] = mesh.UV(v[2]);
+    } else {
+        uv[0] = Point2f(0, 0);
+        uv[1] = Point2f(1, 0);
+        uv[2] = Point2f(1, 1);
+    }
+}
+
+STAT_COUNTER("Scene/Triangle meshes with alpha micro-cells", nAlphaCellMeshes);
+void AlphaCells::Build(const TriangleMesh &mesh, const Texture<Float> &alpha) {
+    // Make sure that _alpha_ can be bounded; this also builds any lookup
+    // structures it needs before the parallel loop below
+    Float min, max;
+    if (!alpha.EvaluateRange(Bounds2f(Point2f(0, 0), Point2f(1, 1)), &min,
+                             &max))
+        return;
+    ++nAlphaCellMeshes;
+
+    bits.resize(2 * mesh.nTriangles);
+    ParallelFor([&](int64_t triNumber) {
+        int v[3];
+        mesh.GetVertexIndices(triNumber, v);
+        Point2f uv[3];
+        GetTriangleUVs(mesh, v, uv);
+        uint64_t opaque = 0, transparent = 0;
+        for (int y = 0; y < Res; ++y)
+            // Cells past the triangle's $b_1 + b_2 = 1$ edge are never hit
+            for (int x = 0; x + y <= Res && x < Res; ++x) {
+                // Bound the $(u,v)$ of the cell's corners and classify it
+                Bounds2f uvBounds;
+                for (int c = 0; c < 4; ++c) {
+                    Float b1 = Float(x + (c & 1)) / Res;
+                    Float b2 = Float(y + (c >> 1)) / Res;
+                    uvBounds = Union(uvBounds, (1 - b1 - b2) * uv[0] +
+                                                   b1 * uv[1] + b2 * uv[2]);
+                }
+                Float min, max;
+                if (!alpha.EvaluateRange(uvBounds, &min, &max)) continue;
+                uint64_t bit = uint64_t(1) << (y * Res + x);
+                if (min == 0 && max == 0)
+                    transparent |= bit;
+                else if (min > 0 || max < 0)
+                    opaque |= bit;
+            }
+        bits[2 * triNumber] = opaque;
+        bits[2 * triNumber + 1] = transparent;
+    }, mesh.nTriangles, 256);
+}
 
+STAT_PERCENT("Intersections/Alpha tests resolved by micro-cells",
+             nAlphaCellsResolved, nAlphaTests);
+static AlphaCells::Coverage LookupAlphaCell(const AlphaCells &cells,
+                                            int triNumber, Float b1,
+                                            Float b2) {
+    AlphaCells::Coverage coverage = cells.Lookup(triNumber, b1, b2);
+    ++nAlphaTests;
+    if (coverage != AlphaCells::Partial) ++nAlphaCellsResolved;
+    return coverage;
+}
+
+bool IntersectTriangleVertices(const Ray &ray, const Point3f &p0,
+                               const Point3f &p1, const Point3f &p2,
+                               Float *tHit, Float b[3]) {
     // Transform triangle vertices to ray coordinate space
 
     // Translate vertices based on ray origin
@@ -260,11 +468,8 @@ bool Triangle::Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
     else if (det > 0 && (tScaled <= 0 || tScaled > ray.tMax * det))
         return false;
 
-    // Compute barycentric coordinates and $t$ value for triangle intersection
+    // Compute $t$ value for triangle intersection
     Float invDet = 1 / det;
-    Float b0 = e0 * invDet;
-    Float b1 = e1 * invDet;
-    Float b2 = e2 * invDet;
     Float t = tScaled * invDet;
 
     // Ensure that computed triangle $t$ is conservatively greater than zero
@@ -290,10 +495,35 @@ bool Triangle::Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
                    std::abs(invDet);
     if (t <= deltaT) return false;
 
+    // Compute barycentric coordinates for triangle intersection
+    *tHit = t;
+    b[0] = e0 * invDet;
+    b[1] = e1 * invDet;
+    b[2] = e2 * invDet;
+    return true;
+}
+
+bool IntersectTriangle(const TriangleMesh &mesh, int triNumber,
+                       const Shape *shape, const Ray &ray, Float *tHit,
+                       SurfaceInteraction *isect, bool testAlphaTexture) {
+    ProfilePhase p(Prof::TriIntersect);
+    ++nTests;
+    int v[3];
+    mesh.GetVertexIndices(triNumber, v);
+    // Get triangle vertices in _p0_, _p1_, and _p2_
+    const Point3f &p0 = mesh.p[v[0]];
+    const Point3f &p1 = mesh.p[v[1]];
+    const Point3f &p2 = mesh.p[v[2]];
+
+    // Perform ray--triangle intersection test
+    Float t, b[3];
+    if (!IntersectTriangleVertices(ray, p0, p1, p2, &t, b)) return false;
+    Float b0 = b[0], b1 = b[1], b2 = b[2];
+
     // Compute triangle partial derivatives
     Vector3f dpdu, dpdv;
     Point2f uv[3];
-    GetUVs(uv);
+    GetTriangleUVs(mesh, v, uv);
 
     // Compute deltas for triangle partial derivatives
     Vector2f duv02 = uv[0] - uv[2], duv12 = uv[1] - uv[2];
@@ -330,27 +560,41 @@ bool Triangle::Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
     Point2f uvHit = b0 * uv[0] + b1 * uv[1] + b2 * uv[2];
 
     // Test intersection against alpha texture, if present
-    if (testAlphaTexture && mesh->alphaMask) {
-        SurfaceInteraction isectLocal(pHit, Vector3f(0, 0, 0), uvHit, -ray.d,
-                                      dpdu, dpdv, Normal3f(0, 0, 0),
-                                      Normal3f(0, 0, 0), ray.time, this);
-        if (mesh->alphaMask->Evaluate(isectLocal) == 0) return false;
+    if (testAlphaTexture && mesh.alphaMask) {
+        AlphaCells::Coverage coverage =
+            LookupAlphaCell(mesh.alphaCells, triNumber, b1, b2);
+        if (coverage == AlphaCells::Transparent) return false;
+        if (coverage == AlphaCells::Partial) {
+            SurfaceInteraction isectLocal(pHit, Vector3f(0, 0, 0), uvHit,
+                                          -ray.d, dpdu, dpdv,
+                                          Normal3f(0, 0, 0), Normal3f(0, 0, 0),
+                                          ray.time, shape);
+            if (mesh.alphaMask->Evaluate(isectLocal) == 0) return false;
+        }
     }
 
     // Fill in _SurfaceInteraction_ from triangle hit
     *isect = SurfaceInteraction(pHit, pError, uvHit, -ray.d, dpdu, dpdv,
                                 Normal3f(0, 0, 0), Normal3f(0, 0, 0), ray.time,
-                                this, faceIndex);
+                                shape,
+                                mesh.faceIndices.size()
+                                    ? mesh.faceIndices[triNumber]
+                                    : 0);
 
     // Override surface normal in _isect_ for triangle
     isect->n = isect->shading.n = Normal3f(Normalize(Cross(dp02, dp12)));
-    if (mesh->n || mesh->s) {
+    if (mesh.HasNormals() || mesh.HasTangents()) {
         // Initialize _Triangle_ shading geometry
 
+        // Fetch (and, for compact meshes, decode) the vertex normals
+        Normal3f n[3];
+        if (mesh.HasNormals())
+            for (int i = 0; i < 3; ++i) n[i] = mesh.N(v[i]);
+
         // Compute shading normal _ns_ for triangle
         Normal3f ns;
-        if (mesh->n) {
-            ns = (b0 * mesh->n[v[0]] + b1 * mesh->n[v[1]] + b2 * mesh->n[v[2]]);
+        if (mesh.HasNormals()) {
+            ns = (b0 * n[0] + b1 * n[1] + b2 * n[2]);
             if (ns.LengthSquared() > 0)
                 ns = Normalize(ns);
             else
@@ -360,8 +604,8 @@ bool Triangle::Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
 
         // Compute shading tangent _ss_ for triangle
         Vector3f ss;
-        if (mesh->s) {
-            ss = (b0 * mesh->s[v[0]] + b1 * mesh->s[v[1]] + b2 * mesh->s[v[2]]);
+        if (mesh.HasTangents()) {
+            ss = (b0 * mesh.S(v[0]) + b1 * mesh.S(v[1]) + b2 * mesh.S(v[2]));
             if (ss.LengthSquared() > 0)
                 ss = Normalize(ss);
             else
@@ -379,12 +623,12 @@ bool Triangle::Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
 
         // Compute $\dndu$ and $\dndv$ for triangle shading geometry
         Normal3f dndu, dndv;
-        if (mesh->n) {
+        if (mesh.HasNormals()) {
             // Compute deltas for triangle partial derivatives of normal
             Vector2f duv02 = uv[0] - uv[2];
             Vector2f duv12 = uv[1] - uv[2];
-            Normal3f dn1 = mesh->n[v[0]] - mesh->n[v[2]];
-            Normal3f dn2 = mesh->n[v[1]] - mesh->n[v[2]];
+            Normal3f dn1 = n[0] - n[2];
+            Normal3f dn2 = n[1] - n[2];
             Float determinant = duv02[0] * duv12[1] - duv02[1] * duv12[0];
             bool degenerateUV = std::abs(determinant) < 1e-8;
             if (degenerateUV) {
@@ -394,8 +638,8 @@ bool Triangle::Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
                 // (rather than giving up) so that ray differentials for
                 // rays reflected from triangles with degenerate
                 // parameterizations are still reasonable.
-                Vector3f dn = Cross(Vector3f(mesh->n[v[2]] - mesh->n[v[0]]),
-                                    Vector3f(mesh->n[v[1]] - mesh->n[v[0]]));
+                Vector3f dn = Cross(Vector3f(n[2] - n[0]),
+                                    Vector3f(n[1] - n[0]));
                 if (dn.LengthSquared() == 0)
                     dndu = dndv = Normal3f(0, 0, 0);
                 else {
@@ -415,164 +659,108 @@ bool Triangle::Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
     }
 
     // Ensure correct orientation of the geometric normal
-    if (mesh->n)
+    if (mesh.HasNormals())
         isect->n = Faceforward(isect->n, isect->shading.n);
-    else if (reverseOrientation ^ transformSwapsHandedness)
+    else if (shape->reverseOrientation ^ shape->transformSwapsHandedness)
         isect->n = isect->shading.n = -isect->n;
     *tHit = t;
     ++nHits;
     return true;
 }
 
-bool Triangle::IntersectP(const Ray &ray, bool testAlphaTexture) const {
+bool IntersectPTriangle(const TriangleMesh &mesh, int triNumber,
+                        const Shape *shape, const Ray &ray,
+                        bool testAlphaTexture) {
     ProfilePhase p(Prof::TriIntersectP);
     ++nTests;
+    int v[3];
+    mesh.GetVertexIndices(triNumber, v);
     // Get triangle vertices in _p0_, _p1_, and _p2_
-    const Point3f &p0 = mesh->p[v[0]];
-    const Point3f &p1 = mesh->p[v[1]];
-    const Point3f &p2 = mesh->p[v[2]];
+    const Point3f &p0 = mesh.p[v[0]];
+    const Point3f &p1 = mesh.p[v[1]];
+    const Point3f &p2 = mesh.p[v[2]];
 
     // Perform ray--triangle intersection test
-
-    // Transform triangle vertices to ray coordinate space
-
-    // Translate vertices based on ray origin
-    Point3f p0t = p0 - Vector3f(ray.o);
-    Point3f p1t = p1 - Vector3f(ray.o);
-    Point3f p2t = p2 - Vector3f(ray.o);
-
-    // Permute components of triangle vertices and ray direction
-    int kz = MaxDimension(Abs(ray.d));
-    int kx = kz + 1;
-    if (kx == 3) kx = 0;
-    int ky = kx + 1;
-    if (ky == 3) ky = 0;
-    Vector3f d = Permute(ray.d, kx, ky, kz);
-    p0t = Permute(p0t, kx, ky, kz);
-    p1t = Permute(p1t, kx, ky, kz);
-    p2t = Permute(p2t, kx, ky, kz);
-
-    // Apply shear transformation to translated vertex positions
-    Float Sx = -d.x / d.z;
-    Float Sy = -d.y / d.z;
-    Float Sz = 1.f / d.z;
-    p0t.x += Sx * p0t.z;
-    p0t.y += Sy * p0t.z;
-    p1t.x += Sx * p1t.z;
-    p1t.y += Sy * p1t.z;
-    p2t.x += Sx * p2t.z;
-    p2t.y += Sy * p2t.z;
-
-    // Compute edge function coefficients _e0_, _e1_, and _e2_
-    Float e0 = p1t.x * p2t.y - p1t.y * p2t.x;
-    Float e1 = p2t.x * p0t.y - p2t.y * p0t.x;
-    Float e2 = p0t.x * p1t.y - p0t.y * p1t.x;
-
-    // Fall back to double precision test at triangle edges
-    if (sizeof(Float) == sizeof(float) &&
-        (e0 == 0.0f || e1 == 0.0f || e2 == 0.0f)) {
-        double p2txp1ty = (double)p2t.x * (double)p1t.y;
-        double p2typ1tx = (double)p2t.y * (double)p1t.x;
-        e0 = (float)(p2typ1tx - p2txp1ty);
-        double p0txp2ty = (double)p0t.x * (double)p2t.y;
-        double p0typ2tx = (double)p0t.y * (double)p2t.x;
-        e1 = (float)(p0typ2tx - p0txp2ty);
-        double p1txp0ty = (double)p1t.x * (double)p0t.y;
-        double p1typ0tx = (double)p1t.y * (double)p0t.x;
-        e2 = (float)(p1typ0tx - p1txp0ty);
-    }
-
-    // Perform triangle edge and determinant tests
-    if ((e0 < 0 || e1 < 0 || e2 < 0) && (e0 > 0 || e1 > 0 || e2 > 0))
-        return false;
-    Float det = e0 + e1 + e2;
-    if (det == 0) return false;
-
-    // Compute scaled hit distance to triangle and test against ray $t$ range
-    p0t.z *= Sz;
-    p1t.z *= Sz;
-    p2t.z *= Sz;
-    Float tScaled = e0 * p0t.z + e1 * p1t.z + e2 * p2t.z;
-    if (det < 0 && (tScaled >= 0 || tScaled < ray.tMax * det))
-        return false;
-    else if (det > 0 && (tScaled <= 0 || tScaled > ray.tMax * det))
-        return false;
-
-    // Compute barycentric coordinates and $t$ value for triangle intersection
-    Float invDet = 1 / det;
-    Float b0 = e0 * invDet;
-    Float b1 = e1 * invDet;
-    Float b2 = e2 * invDet;
-    Float t = tScaled * invDet;
-
-    // Ensure that computed triangle $t$ is conservatively greater than zero
-
-    // Compute $\delta_z$ term for triangle $t$ error bounds
-    Float maxZt = MaxComponent(Abs(Vector3f(p0t.z, p1t.z, p2t.z)));
-    Float deltaZ = gamma(3) * maxZt;
-
-    // Compute $\delta_x$ and $\delta_y$ terms for triangle $t$ error bounds
-    Float maxXt = MaxComponent(Abs(Vector3f(p0t.x, p1t.x, p2t.x)));
-    Float maxYt = MaxComponent(Abs(Vector3f(p0t.y, p1t.y, p2t.y)));
-    Float deltaX = gamma(5) * (maxXt + maxZt);
-    Float deltaY = gamma(5) * (maxYt + maxZt);
-
-    // Compute $\delta_e$ term for triangle $t$ error bounds
-    Float deltaE =
-        2 * (gamma(2) * maxXt * maxYt + deltaY * maxXt + deltaX * maxYt);
-
-    // Compute $\delta_t$ term for triangle $t$ error bounds and check _t_
-    Float maxE = MaxComponent(Abs(Vector3f(e0, e1, e2)));
-    Float deltaT = 3 *
-                   (gamma(3) * maxE * maxZt + deltaE * maxZt + deltaZ * maxE) *
-                   std::abs(invDet);
-    if (t <= deltaT) return false;
+    Float t, b[3];
+    if (!IntersectTriangleVertices(ray, p0, p1, p2, &t, b)) return false;
+    Float b0 = b[0], b1 = b[1], b2 = b[2];
 
     // Test shadow ray intersection against alpha texture, if present
-    if (testAlphaTexture && (mesh->alphaMask || mesh->shadowAlphaMask)) {
-        // Compute triangle partial derivatives
-        Vector3f dpdu, dpdv;
-        Point2f uv[3];
-        GetUVs(uv);
-
-        // Compute deltas for triangle partial derivatives
-        Vector2f duv02 = uv[0] - uv[2], duv12 = uv[1] - uv[2];
-        Vector3f dp02 = p0 - p2, dp12 = p1 - p2;
-        Float determinant = duv02[0] * duv12[1] - duv02[1] * duv12[0];
-        bool degenerateUV = std::abs(determinant) < 1e-8;
-        if (!degenerateUV) {
-            Float invdet = 1 / determinant;
-            dpdu = (duv12[1] * dp02 - duv02[1] * dp12) * invdet;
-            dpdv = (-duv12[0] * dp02 + duv02[0] * dp12) * invdet;
-        }
-        if (degenerateUV || Cross(dpdu, dpdv).LengthSquared() == 0) {
-            // Handle zero determinant for triangle partial derivative matrix
-            Vector3f ng = Cross(p2 - p0, p1 - p0);
-            if (ng.LengthSquared() == 0)
-                // The triangle is actually degenerate; the intersection is
-                // bogus.
-                return false;
+    if (testAlphaTexture && (mesh.alphaMask || mesh.shadowAlphaMask)) {
+        // Only look up the textures for hits in partial micro-cells
+        AlphaCells::Coverage alphaCoverage =
+            mesh.alphaMask ? LookupAlphaCell(mesh.alphaCells, triNumber, b1, b2)
+                           : AlphaCells::Opaque;
+        AlphaCells::Coverage shadowCoverage =
+            mesh.shadowAlphaMask
+                ? LookupAlphaCell(mesh.shadowAlphaCells, triNumber, b1, b2)
+                : AlphaCells::Opaque;
+        if (alphaCoverage == AlphaCells::Transparent ||
+            shadowCoverage == AlphaCells::Transparent)
+            return false;
+        if (alphaCoverage == AlphaCells::Partial ||
+            shadowCoverage == AlphaCells::Partial) {
+            // Compute triangle partial derivatives
+            Vector3f dpdu, dpdv;
+            Point2f uv[3];
+            GetTriangleUVs(mesh, v, uv);
+
+            // Compute deltas for triangle partial derivatives
+            Vector2f duv02 = uv[0] - uv[2], duv12 = uv[1] - uv[2];
+            Vector3f dp02 = p0 - p2, dp12 = p1 - p2;
+            Float determinant = duv02[0] * duv12[1] - duv02[1] * duv12[0];
+            bool degenerateUV = std::abs(determinant) < 1e-8;
+            if (!degenerateUV) {
+                Float invdet = 1 / determinant;
+                dpdu = (duv12[1] * dp02 - duv02[1] * dp12) * invdet;
+                dpdv = (-duv12[0] * dp02 + duv02[0] * dp12) * invdet;
+            }
+            if (degenerateUV || Cross(dpdu, dpdv).LengthSquared() == 0) {
+                // Handle zero determinant for triangle partial derivative
+                // matrix
+                Vector3f ng = Cross(p2 - p0, p1 - p0);
+                if (ng.LengthSquared() == 0)
+                    // The triangle is actually degenerate; the
+                    // intersection is bogus.
+                    return false;
+
+                CoordinateSystem(Normalize(Cross(p2 - p0, p1 - p0)), &dpdu,
+                                 &dpdv);
+            }
 
-            CoordinateSystem(Normalize(Cross(p2 - p0, p1 - p0)), &dpdu, &dpdv);
+            // Interpolate $(u,v)$ parametric coordinates and hit point
+            Point3f pHit = b0 * p0 + b1 * p1 + b2 * p2;
+            Point2f uvHit = b0 * uv[0] + b1 * uv[1] + b2 * uv[2];
+            SurfaceInteraction isectLocal(pHit, Vector3f(0, 0, 0), uvHit,
+                                          -ray.d, dpdu, dpdv,
+                                          Normal3f(0, 0, 0), Normal3f(0, 0, 0),
+                                          ray.time, shape);
+            if (alphaCoverage == AlphaCells::Partial &&
+                mesh.alphaMask->Evaluate(isectLocal) == 0)
+                return false;
+            if (shadowCoverage == AlphaCells::Partial &&
+                mesh.shadowAlphaMask->Evaluate(isectLocal) == 0)
+                return false;
         }
-
-        // Interpolate $(u,v)$ parametric coordinates and hit point
-        Point3f pHit = b0 * p0 + b1 * p1 + b2 * p2;
-        Point2f uvHit = b0 * uv[0] + b1 * uv[1] + b2 * uv[2];
-        SurfaceInteraction isectLocal(pHit, Vector3f(0, 0, 0), uvHit, -ray.d,
-                                      dpdu, dpdv, Normal3f(0, 0, 0),
-                                      Normal3f(0, 0, 0), ray.time, this);
-        if (mesh->alphaMask && mesh->alphaMask->Evaluate(isectLocal) == 0)
-            return false;
-        if (mesh->shadowAlphaMask &&
-            mesh->shadowAlphaMask->Evaluate(isectLocal) == 0)
-            return false;
     }
     ++nHits;
     return true;
 }
 
+bool Triangle::Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
+                         bool testAlphaTexture) const {
+    return IntersectTriangle(*mesh, TriangleNumber(), this, ray, tHit, isect,
+                             testAlphaTexture);
+}
+
+bool Triangle::IntersectP(const Ray &ray, bool testAlphaTexture) const {
+    return IntersectPTriangle(*mesh, TriangleNumber(), this, ray,
+                              testAlphaTexture);
+}
+
 Float Triangle::Area() const {
+    int v[3];
+    mesh->GetVertexIndices(triNumber, v);
     // Get triangle vertices in _p0_, _p1_, and _p2_
     const Point3f &p0 = mesh->p[v[0]];
     const Point3f &p1 = mesh->p[v[1]];
@@ -583,6 +771,8 @@ Float Triangle::Area() const {
 Interaction Triangle::Sample(const Point2f &u, Float *pdf) const {
     Point2f b = UniformSampleTriangle(u);
     // Get triangle vertices in _p0_, _p1_, and _p2_
+    int v[3];
+    mesh->GetVertexIndices(triNumber, v);
     const Point3f &p0 = mesh->p[v[0]];
     const Point3f &p1 = mesh->p[v[1]];
     const Point3f &p2 = mesh->p[v[2]];
@@ -592,9 +782,9 @@ Interaction Triangle::Sample(const Point2f &u, Float *pdf) const {
     it.n = Normalize(Normal3f(Cross(p1 - p0, p2 - p0)));
     // Ensure correct orientation of the geometric normal; follow the same
     // approach as was used in Triangle::Intersect().
-    if (mesh->n) {
-        Normal3f ns(b[0] * mesh->n[v[0]] + b[1] * mesh->n[v[1]] +
-                    (1 - b[0] - b[1]) * mesh->n[v[2]]);
+    if (mesh->HasNormals()) {
+        Normal3f ns(b[0] * mesh->N(v[0]) + b[1] * mesh->N(v[1]) +
+                    (1 - b[0] - b[1]) * mesh->N(v[2]));
         it.n = Faceforward(it.n, ns);
     } else if (reverseOrientation ^ transformSwapsHandedness)
         it.n *= -1;
@@ -609,6 +799,8 @@ Interaction Triangle::Sample(const Point2f &u, Float *pdf) const {
 
 Float Triangle::SolidAngle(const Point3f &p, int nSamples) const {
     // Project the vertices into the unit sphere around p.
+    int v[3];
+    mesh->GetVertexIndices(triNumber, v);
     std::array<Vector3f, 3> pSphere = {
         {Normalize(mesh->p[v[0]] - p), Normalize(mesh->p[v[1]] - p),
             Normalize(mesh->p[v[2]] - p)}
@@ -739,8 +931,11 @@ std::vector<std::shared_ptr<Shape>> CreateTriangleMeshShape(
     } else if (params.FindOneFloat("shadowalpha", 1.f) == 0.f)
         shadowAlphaTex.reset(new ConstantTexture<Float>(0.f));
 
+    bool compact = params.FindOneBool("compact", false);
+
     return CreateTriangleMesh(o2w, w2o, reverseOrientation, nvi / 3, vi, npi, P,
-                              S, N, uvs, alphaTex, shadowAlphaTex, faceIndices);
+                              S, N, uvs, alphaTex, shadowAlphaTex, faceIndices,
+                              compact);
 }
 
 }  // namespace pbrt
@@ -48,6 +48,36 @@ namespace pbrt {
 STAT_MEMORY_COUNTER("Memory/Triangle meshes", triMeshBytes);
 
 // Triangle Declarations
+struct TriangleMesh;
+
+// Classifies an alpha texture over a $\roman{Res} \times \roman{Res}$ grid
+// of micro-cells in each triangle's barycentric coordinates $(b_1,b_2)$:
+// cells the texture is zero throughout are transparent, cells it is
+// nonzero throughout are opaque, and the texture must be evaluated for
+// hits in the remaining, partial, cells.
+struct AlphaCells {
+    // AlphaCells Public Methods
+    enum Coverage { Partial, Opaque, Transparent };
+    // Classifies the cells of _mesh_'s triangles if _alpha_ can bound its
+    // values; otherwise every cell is left partial.
+    void Build(const TriangleMesh &mesh, const Texture<Float> &alpha);
+    Coverage Lookup(int triNumber, Float b1, Float b2) const {
+        if (bits.empty()) return Partial;
+        int x = std::min(int(b1 * Res), Res - 1);
+        int y = std::min(int(b2 * Res), Res - 1);
+        uint64_t bit = uint64_t(1) << (y * Res + x);
+        if (bits[2 * triNumber] & bit) return Opaque;
+        if (bits[2 * triNumber + 1] & bit) return Transparent;
+        return Partial;
+    }
+
+    // AlphaCells Public Data
+    static constexpr int Res = 8;
+    static_assert(Res * Res <= 64, "Cell bits must fit in a uint64_t");
+    // Opaque and transparent cell bits, in that order, for each triangle
+    std::vector<uint64_t> bits;
+};
+
 struct TriangleMesh {
     // TriangleMesh Public Methods
     TriangleMesh(const Transform &ObjectToWorld, int nTriangles,
@@ -55,16 +85,63 @@ struct TriangleMesh {
                  const Vector3f *S, const Normal3f *N, const Point2f *uv,
                  const std::shared_ptr<Texture<Float>> &alphaMask,
                  const std::shared_ptr<Texture<Float>> &shadowAlphaMask,
-                 const Int *faceIndices);
+                 const Int *faceIndices, bool compact = false);
+    // Replaces the mesh's vertex positions, and its normals and tangents
+    // if given, with the transformed values; its topology is unchanged.
+    // Accelerators that hold the mesh's triangles must be rebuilt or
+    // refit afterward. Normals and tangents can only be given if the mesh
+    // already has them, and can't be zero if the mesh encodes them;
+    // otherwise an error is reported and nothing changes.
+    void UpdateVertices(const Transform &ObjectToWorld, const Point3f *P,
+                        const Normal3f *N = nullptr,
+                        const Vector3f *S = nullptr);
+    void SetN(int i, const Normal3f &N);
+    void SetS(int i, const Vector3f &S);
+    // Returns the memory used by the mesh, not including its _Triangle_s.
+    size_t BytesUsed() const;
+
+    // Vertex attribute accessors; they decode the values of compact meshes
+    void GetVertexIndices(int triNumber, int v[3]) const {
+        if (!vertexIndices16.empty())
+            for (int i = 0; i < 3; ++i)
+                v[i] = vertexIndices16[3 * triNumber + i];
+        else
+            for (int i = 0; i < 3; ++i) v[i] = vertexIndices[3 * triNumber + i];
+    }
+    bool HasNormals() const { return n || nEncoded; }
+    Normal3f N(int i) const {
+        return nEncoded ? Normal3f(DecodeOctahedral(nEncoded[i])) : n[i];
+    }
+    bool HasTangents() const { return s || sEncoded; }
+    Vector3f S(int i) const {
+        return sEncoded ? DecodeOctahedral(sEncoded[i]) : s[i];
+    }
+    bool HasUVs() const { return uv || uvHalf; }
+    Point2f UV(int i) const {
+        return uvHalf ? Point2f(HalfToFloat(uvHalf[2 * i]),
+                                HalfToFloat(uvHalf[2 * i + 1]))
+                      : uv[i];
+    }
 
     // TriangleMesh Data
     const int nTriangles, nVertices;
+    // Compact meshes store normals and tangents as octahedrally encoded
+    // unit vectors, unless some are zero, $(u,v)$s as half floats and, if
+    // there are few enough vertices, 16-bit vertex indices; the
+    // full-precision arrays are then empty. Positions are always stored in
+    // full.
+    const bool compact;
     std::vector<int> vertexIndices;
+    std::vector<uint16_t> vertexIndices16;
     std::unique_ptr<Point3f[]> p;
     std::unique_ptr<Normal3f[]> n;
+    std::unique_ptr<uint32_t[]> nEncoded;
     std::unique_ptr<Vector3f[]> s;
+    std::unique_ptr<uint32_t[]> sEncoded;
     std::unique_ptr<Point2f[]> uv;
+    std::unique_ptr<uint16_t[]> uvHalf;
     std::shared_ptr<Texture<Float>> alphaMask, shadowAlphaMask;
+    AlphaCells alphaCells, shadowAlphaCells;
     std::vector<int> faceIndices;
 };
 
@@ -74,13 +151,14 @@ class Triangle : public Shape {
     Triangle(const Transform *ObjectToWorld, const Transform *WorldToObject,
              bool reverseOrientation, const std::shared_ptr<TriangleMesh> &mesh,
              int triNumber)
-        : Shape(ObjectToWorld, WorldToObject, reverseOrientation), mesh(mesh) {
-        v = &mesh->vertexIndices[3 * triNumber];
+        : Shape(ObjectToWorld, WorldToObject, reverseOrientation),
+          mesh(mesh),
+          triNumber(triNumber) {
         triMeshBytes += sizeof(*this);
-        faceIndex = mesh->faceIndices.size() ? mesh->faceIndices[triNumber] : 0;
     }
     Bounds3f ObjectBound() const;
     Bounds3f WorldBound() const;
+    Bounds3f ClippedWorldBound(const Bounds3f &clip) const;
     bool Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
                    bool testAlphaTexture = true) const;
     bool IntersectP(const Ray &ray, bool testAlphaTexture = true) const;
@@ -93,33 +171,51 @@ class Triangle : public Shape {
     // reference point p.
     Float SolidAngle(const Point3f &p, int nSamples = 0) const;
 
-  private:
-    // Triangle Private Methods
-    void GetUVs(Point2f uv[3]) const {
-        if (mesh->uv) {
-            uv[0] = mesh->uv[v[0]];
-            uv[1] = mesh->uv[v[1]];
-            uv[2] = mesh->uv[v[2]];
-        } else {
-            uv[0] = Point2f(0, 0);
-            uv[1] = Point2f(1, 0);
-            uv[2] = Point2f(1, 1);
-        }
+    // Returns the triangle's world space vertex positions.
+    void GetVertices(Point3f *p0, Point3f *p1, Point3f *p2) const {
+        int v[3];
+        mesh->GetVertexIndices(triNumber, v);
+        *p0 = mesh->p[v[0]];
+        *p1 = mesh->p[v[1]];
+        *p2 = mesh->p[v[2]];
     }
+    bool HasAlphaMask() const {
+        return mesh->alphaMask || mesh->shadowAlphaMask;
+    }
+    const std::shared_ptr<TriangleMesh> &GetMesh() const { return mesh; }
+    int TriangleNumber() const { return triNumber; }
 
+  private:
     // Triangle Private Data
     std::shared_ptr<TriangleMesh> mesh;
-    const int *v;
-    int faceIndex;
+    int triNumber;
 };
 
+// Watertight ray-triangle intersection test for the triangle with the given
+// vertices; returns the hit's $t$, which is before _ray.tMax_ and
+// conservatively greater than zero, and its barycentric coordinates.
+bool IntersectTriangleVertices(const Ray &ray, const Point3f &p0,
+                               const Point3f &p1, const Point3f &p2,
+                               Float *tHit, Float b[3]);
+
+// Ray-triangle intersection tests for the _triNumber_th triangle of _mesh_
+// that don't need a _Triangle_ object; _shape_ gives the triangle's
+// orientation and is stored in _isect_. _Triangle::Intersect()_ and
+// _Triangle::IntersectP()_ call these.
+bool IntersectTriangle(const TriangleMesh &mesh, int triNumber,
+                       const Shape *shape, const Ray &ray, Float *tHit,
+                       SurfaceInteraction *isect, bool testAlphaTexture = true);
+bool IntersectPTriangle(const TriangleMesh &mesh, int triNumber,
+                        const Shape *shape, const Ray &ray,
+                        bool testAlphaTexture = true);
+
 std::vector<std::shared_ptr<Shape>> CreateTriangleMesh(
     const Transform *o2w, const Transform *w2o, bool reverseOrientation,
     Int nTriangles, const Int *vertexIndices, Int nVertices, const Point3f *p,
     const Vector3f *s, const Normal3f *n, const Point2f *uv,
     const std::shared_ptr<Texture<Float>> &alphaTexture,
     const std::shared_ptr<Texture<Float>> &shadowAlphaTexture,
-    const Int *faceIndices = nullptr);
+    const Int *faceIndices = nullptr, bool compact = false);
 std::vector<std::shared_ptr<Shape>> CreateTriangleMeshShape(
     const Transform *o2w, const Transform *w2o, bool reverseOrientation,
     const ParamSet &params,
@@ -0,0 +1,755 @@
+#include "tests/gtest/gtest.h"
+#include "pbrt.h"
+#include "rng.h"
+#include "primitive.h"
+#include "interaction.h"
+#include "parallel.h"
+#include "sampling.h"
+#include "fileutil.h"
+#include "accelerators/bvh.h"
+#include "accelerators/curveprimitive.h"
+#include "accelerators/deferredprimitive.h"
+#include "accelerators/kdtreeaccel.h"
+#include "accelerators/meshprimitive.h"
+#include "paramset.h"
+#include "shapes/curve.h"
+#include "shapes/loopsubdiv.h"
+#include "shapes/sphere.h"
+#include "shapes/triangle.h"
+#ifndef PBRT_IS_WINDOWS
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <direct.h>
+#include <io.h>
+#endif
+
+using namespace pbrt;
+
+static std::string inTestDir(const std::string &path) { return path; }
+
+// Returns the paths of the files written to _dir_ by BVHAccel's cache.
+static std::vector<std::string> BVHCacheFiles(const std::string &dir) {
+    std::vector<std::string> files;
+#ifndef PBRT_IS_WINDOWS
+    DIR *d = opendir(dir.c_str());
+    if (!d) return files;
+    while (struct dirent *entry = readdir(d)) {
+        std::string name = entry->d_name;
+        if (name.compare(0, 4, "bvh-") == 0 && HasExtension(name, ".bin"))
+            files.push_back(dir + "/" + name);
+    }
+    closedir(d);
+#else
+    _finddata_t entry;
+    intptr_t handle = _findfirst((dir + "/bvh-*.bin").c_str(), &entry);
+    if (handle == -1) return files;
+    do
+        files.push_back(dir + "/" + entry.name);
+    while (_findnext(handle, &entry) == 0);
+    _findclose(handle);
+#endif
+    return files;
+}
+
+// Creates an empty directory for a test's files and returns its name.
+static std::string MakeTestDirectory(const std::string &prefix) {
+#ifndef PBRT_IS_WINDOWS
+    std::string dir = inTestDir(prefix + "-XXXXXX");
+    EXPECT_TRUE(mkdtemp(&dir[0]) != nullptr);
+#else
+    std::string dir = inTestDir(prefix);
+    _mkdir(dir.c_str());
+#endif
+    return dir;
+}
+
+// Returns a set of random, possibly overlapping, triangles and spheres.
+static std::vector<std::shared_ptr<Primitive>> RandomPrimitives(RNG &rng,
+                                                                int n) {
+    static Transform identity;
+    std::vector<Point3f> p;
+    std::vector<Int> indices;
+    for (int i = 0; i < n; ++i) {
+        Point3f base(Lerp(rng.UniformFloat(), -10, 10),
+                     Lerp(rng.UniformFloat(), -10, 10),
+                     Lerp(rng.UniformFloat(), -10, 10));
+        for (int j = 0; j < 3; ++j) {
+            indices.push_back(p.size());
+            p.push_back(base + Vector3f(Lerp(rng.UniformFloat(), -2, 2),
+                                        Lerp(rng.UniformFloat(), -2, 2),
+                                        Lerp(rng.UniformFloat(), -2, 2)));
+        }
+    }
+    std::vector<std::shared_ptr<Shape>> shapes = CreateTriangleMesh(
+        &identity, &identity, false, n, indices.data(), p.size(), p.data(),
+        nullptr, nullptr, nullptr, nullptr, nullptr);
+    for (int i = 0; i < n / 8; ++i) {
+        Transform *t = new Transform(Translate(
+            Vector3f(Lerp(rng.UniformFloat(), -10, 10),
+                     Lerp(rng.UniformFloat(), -10, 10),
+                     Lerp(rng.UniformFloat(), -10, 10))));
+        Transform *tInv = new Transform(Inverse(*t));
+        shapes.push_back(std::make_shared<Sphere>(
+            t, tInv, false, 0.1f + rng.UniformFloat(), -1000, 1000, 360));
+    }
+
+    std::vector<std::shared_ptr<Primitive>> prims;
+    for (const auto &s : shapes)
+        prims.push_back(std::make_shared<GeometricPrimitive>(
+            s, nullptr, nullptr, MediumInterface()));
+    return prims;
+}
+
+static Ray RandomRay(RNG &rng) {
+    Point3f o(Lerp(rng.UniformFloat(), -15, 15),
+              Lerp(rng.UniformFloat(), -15, 15),
+              Lerp(rng.UniformFloat(), -15, 15));
+    Vector3f d = UniformSampleSphere({rng.UniformFloat(), rng.UniformFloat()});
+    // Include some rays with a zero direction component.
+    if (rng.UniformFloat() < 0.1f) d[rng.UniformUInt32(3)] = 0;
+    if (d == Vector3f(0, 0, 0)) d = Vector3f(1, 0, 0);
+    return Ray(o, d, rng.UniformFloat() < 0.5f ? Infinity : 20);
+}
+
+// Checks that _accel_ finds the same closest intersections as testing
+// every primitive in _prims_. If _hitPrimitive_ is given, _accel_ holds
+// the shapes itself and must report _hitPrimitive_ as the primitive hit;
+// hit points and normals are then compared in place of shapes.
+static void TestAgainstBruteForce(const Primitive &accel,
+                                  const std::vector<std::shared_ptr<Primitive>> &prims,
+                                  RNG &rng,
+                                  const Primitive *hitPrimitive = nullptr) {
+    for (int i = 0; i < 2000; ++i) {
+        Ray ray = RandomRay(rng);
+
+        Ray bfRay = ray;
+        SurfaceInteraction bfIsect;
+        bool bfHit = false;
+        for (const auto &p : prims)
+            if (p->Intersect(bfRay, &bfIsect)) bfHit = true;
+        bool bfHitP = false;
+        for (const auto &p : prims)
+            if (p->IntersectP(ray)) bfHitP = true;
+
+        Ray accelRay = ray;
+        SurfaceInteraction accelIsect;
+        bool accelHit = accel.Intersect(accelRay, &accelIsect);
+        EXPECT_EQ(bfHit, accelHit);
+        EXPECT_EQ(bfHitP, accel.IntersectP(ray));
+        if (bfHit && accelHit) {
+            EXPECT_EQ(bfRay.tMax, accelRay.tMax);
+            if (hitPrimitive) {
+                EXPECT_EQ(bfIsect.p, accelIsect.p);
+                EXPECT_EQ(bfIsect.n, accelIsect.n);
+                EXPECT_EQ(hitPrimitive, accelIsect.primitive);
+            } else
+                EXPECT_EQ(bfIsect.shape, accelIsect.shape);
+        }
+    }
+}
+
+TEST(BVH, Binary) {
+    ParallelInit();
+    RNG rng;
+    auto prims = RandomPrimitives(rng, 1000);
+    BVHAccel bvh(prims, 4, BVHAccel::SplitMethod::SAH, 2);
+    TestAgainstBruteForce(bvh, prims, rng);
+    ParallelCleanup();
+}
+
+TEST(BVH, Wide4) {
+    ParallelInit();
+    RNG rng;
+    auto prims = RandomPrimitives(rng, 1000);
+    BVHAccel bvh(prims, 4, BVHAccel::SplitMethod::SAH, 4);
+    TestAgainstBruteForce(bvh, prims, rng);
+    ParallelCleanup();
+}
+
+TEST(BVH, Wide8) {
+    ParallelInit();
+    RNG rng;
+    auto prims = RandomPrimitives(rng, 1000);
+    BVHAccel bvh(prims, 4, BVHAccel::SplitMethod::SAH, 8);
+    TestAgainstBruteForce(bvh, prims, rng);
+    ParallelCleanup();
+}
+
+TEST(BVH, SpatialSplits) {
+    ParallelInit();
+    RNG rng;
+    auto prims = RandomPrimitives(rng, 1000);
+    BVHAccel bvh(prims, 4, BVHAccel::SplitMethod::SBVH);
+    TestAgainstBruteForce(bvh, prims, rng);
+    ParallelCleanup();
+}
+
+TEST(BVH, PackedTriangles) {
+    ParallelInit();
+    RNG rng;
+    // Just the triangles, in leaves large enough to be tested in several
+    // batches.
+    auto prims = RandomPrimitives(rng, 1000);
+    prims.resize(1000);
+    for (int width : {2, 4, 8}) {
+        BVHAccel bvh(prims, 20, BVHAccel::SplitMethod::SAH, width, 0.3f, "",
+                     0, true);
+        TestAgainstBruteForce(bvh, prims, rng);
+    }
+    ParallelCleanup();
+}
+
+TEST(BVH, Packets) {
+    ParallelInit();
+    RNG rng;
+    auto prims = RandomPrimitives(rng, 1000);
+    BVHAccel bvh(prims, 4, BVHAccel::SplitMethod::SAH);
+    for (int pass = 0; pass < 20; ++pass) {
+        // Alternate between batches of coherent rays, which share an origin
+        // and have similar directions, and incoherent ones.
+        const int n = 100;
+        std::vector<Ray> rays(n);
+        Ray base = RandomRay(rng);
+        for (int i = 0; i < n; ++i) {
+            rays[i] = RandomRay(rng);
+            if (pass & 1) {
+                rays[i].o = base.o;
+                rays[i].d = Normalize(base.d + .1f * rays[i].d);
+            }
+        }
+
+        std::vector<Ray> packetRays = rays;
+        std::vector<SurfaceInteraction> isects(n);
+        std::unique_ptr<bool[]> hits(new bool[n]), occluded(new bool[n]);
+        bvh.IntersectN(packetRays.data(), isects.data(), hits.get(), n);
+        bvh.IntersectPN(rays.data(), occluded.get(), n);
+        for (int i = 0; i < n; ++i) {
+            EXPECT_EQ(bvh.IntersectP(rays[i]), occluded[i]);
+            SurfaceInteraction isect;
+            EXPECT_EQ(bvh.Intersect(rays[i], &isect), hits[i]);
+            EXPECT_EQ(rays[i].tMax, packetRays[i].tMax);
+            if (hits[i]) EXPECT_EQ(isect.shape, isects[i].shape);
+        }
+    }
+    ParallelCleanup();
+}
+
+TEST(BVH, Quantized) {
+    ParallelInit();
+    for (int bits : {8, 16})
+        for (int width : {2, 4, 8}) {
+            RNG rng;
+            auto prims = RandomPrimitives(rng, 1000);
+            BVHAccel bvh(prims, 4, BVHAccel::SplitMethod::SAH, width, 0.3f,
+                         "", bits);
+            TestAgainstBruteForce(bvh, prims, rng);
+        }
+    ParallelCleanup();
+}
+
+TEST(BVH, Cache) {
+    ParallelInit();
+    RNG rng;
+    auto prims = RandomPrimitives(rng, 1000);
+    std::string cacheDir = MakeTestDirectory("bvh-cache-test");
+    {
+        // The first build writes the cache file and the second reads it.
+        BVHAccel bvh(prims, 4, BVHAccel::SplitMethod::SAH, 2, 0.3f, cacheDir);
+        EXPECT_FALSE(bvh.ReadFromCache());
+    }
+    EXPECT_EQ(1, BVHCacheFiles(cacheDir).size());
+    BVHAccel bvh(prims, 4, BVHAccel::SplitMethod::SAH, 4, 0.3f, cacheDir);
+    EXPECT_TRUE(bvh.ReadFromCache());
+    TestAgainstBruteForce(bvh, prims, rng);
+
+    // Reordering the primitives must not reuse the tree cached above.
+    std::vector<std::shared_ptr<Primitive>> reversedPrims(prims.rbegin(),
+                                                          prims.rend());
+    BVHAccel reversedBVH(reversedPrims, 4, BVHAccel::SplitMethod::SAH, 2,
+                         0.3f, cacheDir);
+    EXPECT_FALSE(reversedBVH.ReadFromCache());
+    TestAgainstBruteForce(reversedBVH, reversedPrims, rng);
+    std::vector<std::string> cacheFiles = BVHCacheFiles(cacheDir);
+    EXPECT_EQ(2, cacheFiles.size());
+    for (const std::string &file : cacheFiles)
+        EXPECT_EQ(0, remove(file.c_str()));
+#ifndef PBRT_IS_WINDOWS
+    EXPECT_EQ(0, rmdir(cacheDir.c_str()));
+#else
+    EXPECT_EQ(0, _rmdir(cacheDir.c_str()));
+#endif
+    ParallelCleanup();
+}
+
+TEST(BVH, ParallelBuild) {
+    // Enough primitives that both the parallel binning at the top of the
+    // tree and parallel subtree construction are exercised.
+    RNG rng;
+    auto prims = RandomPrimitives(rng, 150000);
+
+    PbrtOptions.nThreads = 1;
+    ParallelInit();
+    BVHAccel serialBVH(prims, 4, BVHAccel::SplitMethod::SAH);
+    ParallelCleanup();
+
+    PbrtOptions.nThreads = 4;
+    ParallelInit();
+    BVHAccel parallelBVH(prims, 4, BVHAccel::SplitMethod::SAH);
+    ParallelCleanup();
+    PbrtOptions.nThreads = 0;
+
+    EXPECT_TRUE(serialBVH.SameTree(parallelBVH));
+    for (int i = 0; i < 10000; ++i) {
+        Ray ray = RandomRay(rng);
+        Ray serialRay = ray, parallelRay = ray;
+        SurfaceInteraction serialIsect, parallelIsect;
+        EXPECT_EQ(serialBVH.Intersect(serialRay, &serialIsect),
+                  parallelBVH.Intersect(parallelRay, &parallelIsect));
+        EXPECT_EQ(serialRay.tMax, parallelRay.tMax);
+        EXPECT_EQ(serialBVH.IntersectP(ray), parallelBVH.IntersectP(ray));
+    }
+}
+
+TEST(BVH, HLBVH) {
+    // Enough primitives that the radix sort and the upper levels of the
+    // tree over the LBVH treelets are processed in parallel.
+    RNG rng;
+    auto prims = RandomPrimitives(rng, 150000);
+
+    PbrtOptions.nThreads = 4;
+    ParallelInit();
+    BVHAccel sahBVH(prims, 4, BVHAccel::SplitMethod::SAH);
+    BVHAccel hlbvh(prims, 4, BVHAccel::SplitMethod::HLBVH);
+    ParallelCleanup();
+    PbrtOptions.nThreads = 0;
+
+    for (int i = 0; i < 10000; ++i) {
+        Ray ray = RandomRay(rng);
+        Ray sahRay = ray, hlbvhRay = ray;
+        SurfaceInteraction sahIsect, hlbvhIsect;
+        EXPECT_EQ(sahBVH.Intersect(sahRay, &sahIsect),
+                  hlbvh.Intersect(hlbvhRay, &hlbvhIsect));
+        EXPECT_EQ(sahRay.tMax, hlbvhRay.tMax);
+        EXPECT_EQ(sahBVH.IntersectP(ray), hlbvh.IntersectP(ray));
+    }
+}
+
+TEST(BVH, Refit) {
+    ParallelInit();
+    for (int width : {2, 4, 8}) {
+        RNG rng;
+        static Transform identity;
+        const int nTriangles = 2000;
+        std::vector<Int> indices(3 * nTriangles);
+        for (int i = 0; i < 3 * nTriangles; ++i) indices[i] = i;
+        auto randomVertices = [&]() {
+            std::vector<Point3f> p;
+            for (int i = 0; i < nTriangles; ++i) {
+                Point3f base(Lerp(rng.UniformFloat(), -10, 10),
+                             Lerp(rng.UniformFloat(), -10, 10),
+                             Lerp(rng.UniformFloat(), -10, 10));
+                for (int j = 0; j < 3; ++j)
+                    p.push_back(base +
+                                Vector3f(Lerp(rng.UniformFloat(), -2, 2),
+                                         Lerp(rng.UniformFloat(), -2, 2),
+                                         Lerp(rng.UniformFloat(), -2, 2)));
+            }
+            return p;
+        };
+        std::vector<Point3f> p = randomVertices();
+        std::vector<std::shared_ptr<Shape>> shapes = CreateTriangleMesh(
+            &identity, &identity, false, nTriangles, indices.data(), p.size(),
+            p.data(), nullptr, nullptr, nullptr, nullptr, nullptr);
+        std::vector<std::shared_ptr<Primitive>> prims;
+        for (const auto &s : shapes)
+            prims.push_back(std::make_shared<GeometricPrimitive>(
+                s, nullptr, nullptr, MediumInterface()));
+        BVHAccel bvh(prims, 4, BVHAccel::SplitMethod::SAH, width, 0.3f, "",
+                     0, true);
+
+        // Move every vertex, making a few triangles degenerate.
+        p = randomVertices();
+        for (int i = 0; i < nTriangles; i += 100) p[3 * i + 1] = p[3 * i];
+        std::dynamic_pointer_cast<Triangle>(shapes[0])->GetMesh()->
+            UpdateVertices(identity, p.data());
+        bvh.Refit();
+        TestAgainstBruteForce(bvh, prims, rng);
+    }
+    ParallelCleanup();
+}
+
+TEST(BVH, MotionBounds) {
+    ParallelInit();
+    RNG rng;
+    // Random primitives, half of which translate and rotate over the
+    // shutter interval.
+    std::vector<std::shared_ptr<Primitive>> prims;
+    std::vector<std::unique_ptr<Transform>> transforms;
+    for (std::shared_ptr<Primitive> &prim : RandomPrimitives(rng, 400)) {
+        if (rng.UniformFloat() < .5f) {
+            prims.push_back(prim);
+            continue;
+        }
+        transforms.emplace_back(new Transform());
+        Transform *start = transforms.back().get();
+        transforms.emplace_back(new Transform(
+            Translate(Vector3f(Lerp(rng.UniformFloat(), -5, 5),
+                               Lerp(rng.UniformFloat(), -5, 5),
+                               Lerp(rng.UniformFloat(), -5, 5))) *
+            Rotate(360 * rng.UniformFloat(),
+                   UniformSampleSphere(
+                       {rng.UniformFloat(), rng.UniformFloat()}))));
+        Transform *end = transforms.back().get();
+        prims.push_back(std::make_shared<TransformedPrimitive>(
+            prim, AnimatedTransform(start, 0, end, 1)));
+    }
+    BVHAccel bvh(prims, 4, BVHAccel::SplitMethod::SAH);
+
+    for (int i = 0; i < 5000; ++i) {
+        Ray ray = RandomRay(rng);
+        ray.time = Lerp(rng.UniformFloat(), -.1f, 1.1f);
+
+        Ray bfRay = ray;
+        SurfaceInteraction bfIsect;
+        bool bfHit = false;
+        for (const auto &p : prims)
+            if (p->Intersect(bfRay, &bfIsect)) bfHit = true;
+
+        Ray accelRay = ray;
+        SurfaceInteraction accelIsect;
+        EXPECT_EQ(bfHit, bvh.Intersect(accelRay, &accelIsect));
+        EXPECT_EQ(bfHit, bvh.IntersectP(ray));
+        EXPECT_EQ(bfRay.tMax, accelRay.tMax);
+    }
+    ParallelCleanup();
+}
+
+TEST(KdTree, BruteForce) {
+    ParallelInit();
+    RNG rng;
+    auto prims = RandomPrimitives(rng, 1000);
+    KdTreeAccel kdTree(prims);
+    TestAgainstBruteForce(kdTree, prims, rng);
+    ParallelCleanup();
+}
+
+TEST(KdTree, ParallelBuild) {
+    // Enough primitives that subtrees are built in parallel and then
+    // stitched together.
+    RNG rng;
+    auto prims = RandomPrimitives(rng, 50000);
+
+    PbrtOptions.nThreads = 1;
+    ParallelInit();
+    KdTreeAccel serialKdTree(prims);
+    ParallelCleanup();
+
+    PbrtOptions.nThreads = 4;
+    ParallelInit();
+    KdTreeAccel parallelKdTree(prims);
+    ParallelCleanup();
+    PbrtOptions.nThreads = 0;
+
+    for (int i = 0; i < 10000; ++i) {
+        Ray ray = RandomRay(rng);
+        Ray serialRay = ray, parallelRay = ray;
+        SurfaceInteraction serialIsect, parallelIsect;
+        EXPECT_EQ(serialKdTree.Intersect(serialRay, &serialIsect),
+                  parallelKdTree.Intersect(parallelRay, &parallelIsect));
+        EXPECT_EQ(serialRay.tMax, parallelRay.tMax);
+        EXPECT_EQ(serialKdTree.IntersectP(ray), parallelKdTree.IntersectP(ray));
+    }
+}
+
+TEST(StaticTransformedPrimitive, MatchesTransformedPrimitive) {
+    ParallelInit();
+    RNG rng;
+    std::shared_ptr<Primitive> bvh =
+        std::make_shared<BVHAccel>(RandomPrimitives(rng, 500));
+    for (int i = 0; i < 10; ++i) {
+        Transform t =
+            Translate(Vector3f(Lerp(rng.UniformFloat(), -5, 5),
+                               Lerp(rng.UniformFloat(), -5, 5),
+                               Lerp(rng.UniformFloat(), -5, 5))) *
+            Rotate(360 * rng.UniformFloat(),
+                   UniformSampleSphere(
+                       {rng.UniformFloat(), rng.UniformFloat()})) *
+            Scale(Lerp(rng.UniformFloat(), .5, 2),
+                  Lerp(rng.UniformFloat(), .5, 2),
+                  Lerp(rng.UniformFloat(), .5, 2));
+        StaticTransformedPrimitive staticPrim(bvh, t);
+        TransformedPrimitive animatedPrim(bvh, AnimatedTransform(&t, 0, &t, 1));
+        EXPECT_EQ(animatedPrim.WorldBound(), staticPrim.WorldBound());
+
+        // Both should give exactly the same results.
+        for (int j = 0; j < 1000; ++j) {
+            Ray ray = RandomRay(rng);
+            Ray staticRay = ray, animatedRay = ray;
+            SurfaceInteraction staticIsect, animatedIsect;
+            bool staticHit = staticPrim.Intersect(staticRay, &staticIsect);
+            EXPECT_EQ(animatedPrim.Intersect(animatedRay, &animatedIsect),
+                      staticHit);
+            EXPECT_EQ(animatedRay.tMax, staticRay.tMax);
+            if (staticHit) {
+                EXPECT_EQ(animatedIsect.p, staticIsect.p);
+                EXPECT_EQ(animatedIsect.pError, staticIsect.pError);
+                EXPECT_EQ(animatedIsect.n, staticIsect.n);
+            }
+            EXPECT_EQ(animatedPrim.IntersectP(ray), staticPrim.IntersectP(ray));
+        }
+    }
+    ParallelCleanup();
+}
+
+TEST(MeshPrimitive, MatchesTriangles) {
+    ParallelInit();
+    RNG rng;
+    static Transform identity;
+    std::vector<Point3f> p;
+    std::vector<Int> indices;
+    for (int i = 0; i < 3000; ++i) {
+        indices.push_back(p.size());
+        p.push_back(Point3f(Lerp(rng.UniformFloat(), -10, 10),
+                            Lerp(rng.UniformFloat(), -10, 10),
+                            Lerp(rng.UniformFloat(), -10, 10)));
+    }
+    std::vector<std::shared_ptr<Shape>> shapes = CreateTriangleMesh(
+        &identity, &identity, false, 1000, indices.data(), p.size(), p.data(),
+        nullptr, nullptr, nullptr, nullptr, nullptr);
+    std::vector<std::shared_ptr<Primitive>> prims;
+    for (const auto &s : shapes)
+        prims.push_back(std::make_shared<GeometricPrimitive>(
+            s, nullptr, nullptr, MediumInterface()));
+    std::shared_ptr<MeshPrimitive> meshPrim =
+        CreateMeshPrimitive(shapes, nullptr, MediumInterface());
+    ASSERT_TRUE(meshPrim != nullptr);
+    EXPECT_TRUE(shapes.empty());
+    TestAgainstBruteForce(*meshPrim, prims, rng, meshPrim.get());
+    ParallelCleanup();
+}
+
+TEST(CurvePrimitive, MatchesCurves) {
+    ParallelInit();
+    Transform ObjectToWorld = Translate(Vector3f(1, -2, 3)) * Rotate(30, Vector3f(1, 1, 0));
+    Transform WorldToObject = Inverse(ObjectToWorld);
+    for (const char *type : {"flat", "cylinder", "ribbon"}) {
+        RNG rng;
+        std::vector<std::shared_ptr<Primitive>> prims;
+        std::unique_ptr<CurveArray> curves;
+        std::vector<Point3f> targets;
+        for (int i = 0; i < 300; ++i) {
+            // Use control points and widths that single-precision floats
+            // represent exactly, so that both store the same curves.
+            std::unique_ptr<Point3f[]> cp(new Point3f[4]);
+            for (int j = 0; j < 4; ++j)
+                cp[j] = Point3f(int(rng.UniformUInt32(256)) / 16. - 8,
+                                int(rng.UniformUInt32(256)) / 16. - 8,
+                                int(rng.UniformUInt32(256)) / 16. - 8);
+            targets.push_back(EvalBezier(cp.get(), rng.UniformFloat()));
+            std::unique_ptr<Normal3f[]> n(new Normal3f[2]);
+            n[0] = Normal3f(0, 0, 1);
+            n[1] = Normal3f(0, 1, 0);
+            std::unique_ptr<Float[]> width(new Float[1]);
+            width[0] = .25;
+            std::unique_ptr<std::string[]> typeName(new std::string[1]);
+            typeName[0] = type;
+            ParamSet params;
+            params.AddPoint3f("P", std::move(cp), 4);
+            params.AddNormal3f("N", std::move(n), 2);
+            params.AddFloat("width", std::move(width), 1);
+            params.AddString("type", std::move(typeName), 1);
+
+            for (const auto &s :
+                 CreateCurveShape(&ObjectToWorld, &WorldToObject, false, params))
+                prims.push_back(std::make_shared<GeometricPrimitive>(
+                    s, nullptr, nullptr, MediumInterface()));
+            CurveDescription curve;
+            ASSERT_TRUE(GetCurveDescription(params, &curve));
+            if (!curves)
+                curves.reset(new CurveArray(curve.type, curve.splitDepth));
+            curves->Add(curve);
+        }
+        CurvePrimitive curvePrim(std::move(curves), &ObjectToWorld,
+                                 &WorldToObject, false, nullptr,
+                                 MediumInterface());
+        BVHAccel bvh(prims);
+
+        // The two refine curves to different depths, so their hits may
+        // differ by a fraction of the curves' width, or along their edges.
+        int nHits = 0, nMismatches = 0;
+        for (int i = 0; i < 2000; ++i) {
+            Ray ray = RandomRay(rng);
+            if (i & 1) {
+                // Aim every other ray at a point near a curve
+                Point3f target = ObjectToWorld(
+                    targets[rng.UniformUInt32(targets.size())] +
+                    Vector3f(rng.UniformFloat() - .5f, rng.UniformFloat() - .5f,
+                             rng.UniformFloat() - .5f) * .25f);
+                ray.d = Normalize(target - ray.o);
+                ray.tMax = Infinity;
+            }
+            Ray curveRay = ray, bvhRay = ray;
+            SurfaceInteraction curveIsect, bvhIsect;
+            bool bvhHit = bvh.Intersect(bvhRay, &bvhIsect);
+            bool curveHit = curvePrim.Intersect(curveRay, &curveIsect);
+            EXPECT_EQ(curveHit, curvePrim.IntersectP(ray));
+            if (bvhHit != curveHit ||
+                (bvhHit && (std::abs(bvhRay.tMax - curveRay.tMax) > .125f ||
+                            std::abs(bvhIsect.uv[0] - curveIsect.uv[0]) > .05f))) {
+                ++nMismatches;
+                continue;
+            }
+            if (!bvhHit) continue;
+            ++nHits;
+            EXPECT_LT(Distance(bvhIsect.p, curveIsect.p), .125f);
+            EXPECT_GT(Dot(bvhIsect.n, curveIsect.n), .95f) << type;
+            EXPECT_EQ(&curvePrim, curveIsect.primitive);
+        }
+        EXPECT_GT(nHits, 200) << type;
+        EXPECT_LT(nMismatches, 20) << type;
+    }
+    ParallelCleanup();
+}
+
+// Adds Loop-subdivided octahedra with the given transformations to _eager_,
+// subdivided now, and to _deferred_, subdivided when they're first hit.
+static void AddSubdividedOctahedra(
+    const std::vector<Transform> &transforms,
+    const std::vector<Transform> &inverses, GeometryCache *cache,
+    std::vector<std::shared_ptr<Primitive>> *eager,
+    std::vector<std::shared_ptr<Primitive>> *deferred) {
+    for (size_t i = 0; i < transforms.size(); ++i) {
+        const Point3f vertices[6] = {{1, 0, 0}, {-1, 0, 0}, {0, 1, 0},
+                                     {0, -1, 0}, {0, 0, 1}, {0, 0, -1}};
+        const int faces[24] = {0, 2, 4, 2, 1, 4, 1, 3, 4, 3, 0, 4,
+                               2, 0, 5, 1, 2, 5, 3, 1, 5, 0, 3, 5};
+        std::unique_ptr<Point3f[]> P(new Point3f[6]);
+        std::copy(vertices, vertices + 6, P.get());
+        std::unique_ptr<Int[]> indices(new Int[24]);
+        std::copy(faces, faces + 24, indices.get());
+        std::unique_ptr<Int[]> levels(new Int[1]);
+        levels[0] = 3;
+        ParamSet params;
+        params.AddPoint3f("P", std::move(P), 6);
+        params.AddInt("indices", std::move(indices), 24);
+        params.AddInt("levels", std::move(levels), 1);
+
+        for (const auto &s : CreateLoopSubdiv(&transforms[i], &inverses[i],
+                                              false, params))
+            eager->push_back(std::make_shared<GeometricPrimitive>(
+                s, nullptr, nullptr, MediumInterface()));
+        Bounds3f objectBound;
+        auto tessellate = DeferLoopSubdiv(&transforms[i], &inverses[i], false,
+                                          params, &objectBound);
+        ASSERT_TRUE((bool)tessellate);
+        deferred->push_back(std::make_shared<DeferredPrimitive>(
+            std::move(tessellate), transforms[i](objectBound), &transforms[i],
+            &inverses[i], false, nullptr, MediumInterface(), cache));
+    }
+}
+
+TEST(DeferredPrimitive, MatchesEagerTessellation) {
+    ParallelInit();
+    RNG rng;
+    std::vector<Transform> transforms;
+    for (int i = 0; i < 20; ++i)
+        transforms.push_back(Translate(Vector3f(Lerp(rng.UniformFloat(), -8, 8),
+                                                Lerp(rng.UniformFloat(), -8, 8),
+                                                Lerp(rng.UniformFloat(), -8, 8))) *
+                             Scale(2, 2, 2));
+    std::vector<Transform> inverses;
+    for (const Transform &t : transforms) inverses.push_back(Inverse(t));
+
+    // Use a cache that only has room for a few of the subdivided
+    // octahedra, so that they're evicted and tessellated again.
+    GeometryCache cache(256 * 1024);
+    std::vector<std::shared_ptr<Primitive>> eager, deferred;
+    AddSubdividedOctahedra(transforms, inverses, &cache, &eager, &deferred);
+    BVHAccel eagerBVH(eager), deferredBVH(deferred);
+
+    int nHits = 0;
+    for (int i = 0; i < 5000; ++i) {
+        Ray ray = RandomRay(rng);
+        Ray eagerRay = ray, deferredRay = ray;
+        SurfaceInteraction eagerIsect, deferredIsect;
+        bool eagerHit = eagerBVH.Intersect(eagerRay, &eagerIsect);
+        ASSERT_EQ(eagerHit, deferredBVH.Intersect(deferredRay, &deferredIsect));
+        EXPECT_EQ(eagerHit, deferredBVH.IntersectP(ray));
+        if (!eagerHit) continue;
+        ++nHits;
+        EXPECT_EQ(eagerRay.tMax, deferredRay.tMax);
+        EXPECT_EQ(eagerIsect.p, deferredIsect.p);
+        EXPECT_EQ(eagerIsect.n, deferredIsect.n);
+        EXPECT_NE(nullptr, dynamic_cast<const DeferredPrimitive *>(
+                               deferredIsect.primitive));
+    }
+    EXPECT_GT(nHits, 100);
+    EXPECT_LE(cache.BytesUsed(), 256 * 1024);
+    int nResident = 0;
+    for (const auto &p : deferred)
+        nResident +=
+            static_cast<const DeferredPrimitive *>(p.get())->IsResident();
+    EXPECT_GT(nResident, 0);
+    EXPECT_LT(nResident, (int)deferred.size());
+
+    cache.Clear();
+    EXPECT_EQ(0, cache.BytesUsed());
+    ParallelCleanup();
+}
+
+TEST(DeferredPrimitive, ParallelTessellation) {
+    // Intersect rays with overlapping deferred primitives from several
+    // threads at once, so that they're tessellated, and with the fallback
+    // BVH over their triangles built, inside a parallel loop. The small
+    // cache makes them be evicted and tessellated again throughout.
+    PbrtOptions.nThreads = 4;
+    ParallelInit();
+    RNG rng;
+    std::vector<Transform> transforms, inverses;
+    for (int i = 0; i < 20; ++i) {
+        transforms.push_back(Translate(Vector3f(Lerp(rng.UniformFloat(), -2, 2),
+                                                Lerp(rng.UniformFloat(), -2, 2),
+                                                Lerp(rng.UniformFloat(), -2, 2))) *
+                             Scale(2, 2, 2));
+        inverses.push_back(Inverse(transforms.back()));
+    }
+    GeometryCache cache(256 * 1024);
+    std::vector<std::shared_ptr<Primitive>> eager, deferred;
+    AddSubdividedOctahedra(transforms, inverses, &cache, &eager, &deferred);
+    BVHAccel eagerBVH(eager), deferredBVH(deferred);
+
+    const int nRays = 20000;
+    std::vector<Ray> rays;
+    std::vector<Float> tHits(nRays, Infinity);
+    for (int i = 0; i < nRays; ++i) {
+        // Aim the rays at the octahedra
+        Ray ray = RandomRay(rng);
+        Point3f target(Lerp(rng.UniformFloat(), -3, 3),
+                       Lerp(rng.UniformFloat(), -3, 3),
+                       Lerp(rng.UniformFloat(), -3, 3));
+        ray.d = Normalize(target - ray.o);
+        rays.push_back(ray);
+        SurfaceInteraction isect;
+        if (eagerBVH.Intersect(ray, &isect)) tHits[i] = ray.tMax;
+    }
+
+    std::atomic<int> nMismatches{0}, nHits{0};
+    ParallelFor([&](int64_t i) {
+        Ray ray = rays[i];
+        SurfaceInteraction isect;
+        bool hit = deferredBVH.Intersect(ray, &isect);
+        if (hit) ++nHits;
+        if (hit != (tHits[i] < Infinity) || (hit && ray.tMax != tHits[i]) ||
+            hit != deferredBVH.IntersectP(rays[i]))
+            ++nMismatches;
+    }, nRays, 64);
+    EXPECT_EQ(0, nMismatches);
+    EXPECT_GT(nHits, nRays / 2);
+    EXPECT_LE(cache.BytesUsed(), 256 * 1024);
+
+    cache.Clear();
+    ParallelCleanup();
+    PbrtOptions.nThreads = 0;
+}
@@ -438,3 +438,63 @@ TEST_P(RenderTest, RadianceMatches) {
 
 INSTANTIATE_TEST_CASE_P(AnalyticTestScenes, RenderTest,
                         testing::ValuesIn(GetIntegrators()));
+
+// Renders _scene_ with a path tracer using a Halton sampler, whose samples
+// only depend on the pixel and sample index, and returns the image.
+static std::unique_ptr<RGBSpectrum[]> RenderPathImage(
+    const Scene &scene, bool sortRays, Point2i *resolution,
+    const Transform &cameraToWorld = Transform()) {
+    Point2i res(40, 24);
+    AnimatedTransform cameraTransform(new Transform(cameraToWorld), 0,
+                                      new Transform(cameraToWorld), 1);
+    std::unique_ptr<Filter> filter(new BoxFilter(Vector2f(0.5, 0.5)));
+    std::string filename = inTestDir(sortRays ? "test-sorted.exr"
+                                              : "test-unsorted.exr");
+    Film *film = new Film(res, Bounds2f(Point2f(0, 0), Point2f(1, 1)),
+                          std::move(filter), 1., filename, 1.);
+    std::shared_ptr<Camera> camera = std::make_shared<PerspectiveCamera>(
+        cameraTransform, Bounds2f(Point2f(-1, -1), Point2f(1, 1)), 0., 1., 0.,
+        10., 45, film, nullptr);
+    std::shared_ptr<Sampler> sampler = std::make_shared<HaltonSampler>(
+        16, Bounds2i(Point2i(0, 0), res));
+    // As above, the integrator must be deleted before the next render.
+    std::unique_ptr<Integrator> integrator(new PathIntegrator(
+        8, camera, sampler, film->croppedPixelBounds, 1, "spatial",
+        sortRays));
+    integrator->Render(scene);
+    integrator.reset();
+
+    std::unique_ptr<RGBSpectrum[]> image = ReadImage(filename, resolution);
+    EXPECT_EQ(0, remove(filename.c_str()));
+    return image;
+}
+
+TEST(PathIntegrator, SortedRaysMatchImmediate) {
+    Options options;
+    options.quiet = true;
+    pbrtInit(options);
+
+    // Each pixel's paths see the same samples in both modes, so sorting
+    // the rays must only change the order that they're traced in. The
+    // camera is also placed far outside of the scene, where its rays'
+    // origins are clamped to the edge of the sorting grid.
+    for (const TestScene &testScene : GetScenes())
+        for (const Transform &cameraToWorld :
+             {Transform(), Translate(Vector3f(0, 0, -1e12f))}) {
+            Point2i res, sortedRes;
+            std::unique_ptr<RGBSpectrum[]> image = RenderPathImage(
+                *testScene.scene, false, &res, cameraToWorld);
+            std::unique_ptr<RGBSpectrum[]> sortedImage = RenderPathImage(
+                *testScene.scene, true, &sortedRes, cameraToWorld);
+            ASSERT_TRUE(image && sortedImage) << testScene.description;
+            ASSERT_EQ(res, sortedRes);
+            for (int i = 0; i < res.x * res.y; ++i)
+                for (int c = 0; c < 3; ++c)
+                    EXPECT_NEAR(image[i][c], sortedImage[i][c],
+                                1e-5f * std::max((Float)1,
+                                                 std::abs(image[i][c])))
+                        << testScene.description << ", pixel " << i;
+        }
+
+    pbrtCleanup();
+}
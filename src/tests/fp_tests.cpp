@@ -90,6 +90,29 @@ TEST(FloatingPoint, DoubleBits) {
     }
 }
 
+TEST(FloatingPoint, HalfFloat) {
+    // Every half other than NaN survives a round trip through float
+    for (int i = 0; i < 65536; ++i) {
+        uint16_t h = i;
+        float f = HalfToFloat(h);
+        if (std::isnan(f)) continue;
+        EXPECT_EQ(h, FloatToHalf(f));
+    }
+
+    EXPECT_EQ(1.f, HalfToFloat(FloatToHalf(1.f)));
+    EXPECT_EQ(-0.5f, HalfToFloat(FloatToHalf(-0.5f)));
+    EXPECT_EQ(65504.f, HalfToFloat(FloatToHalf(65504.f)));
+    EXPECT_TRUE(std::isinf(HalfToFloat(FloatToHalf(1e6f))));
+    EXPECT_EQ(0x7c00, FloatToHalf(65520.f));
+
+    RNG rng(3);
+    for (int i = 0; i < 100000; ++i) {
+        float f = -1000 + 2000 * rng.UniformFloat();
+        EXPECT_LE(std::abs(HalfToFloat(FloatToHalf(f)) - f),
+                  std::abs(f) / 2048);
+    }
+}
+
 TEST(FloatingPoint, AtomicFloat) {
     AtomicFloat af(0);
     Float f = 0.;
@@ -37,3 +37,28 @@ TEST(Parallel, DoNothing) {
 
     ParallelCleanup();
 }
+
+TEST(Parallel, Nested) {
+    PbrtOptions.nThreads = 4;
+    ParallelInit();
+
+    // Loops started inside another loop's iterations must run all of
+    // their own iterations in the thread that started them
+    std::atomic<int> counter{0}, nOtherThread{0};
+    ParallelFor([&](int64_t) {
+        int threadIndex = ThreadIndex;
+        ParallelFor([&](int64_t) {
+            ++counter;
+            if (ThreadIndex != threadIndex) ++nOtherThread;
+        }, 100, 1);
+        ParallelFor2D([&](Point2i p) {
+            ++counter;
+            if (ThreadIndex != threadIndex) ++nOtherThread;
+        }, Point2i(5, 4));
+    }, 200, 1);
+    EXPECT_EQ(200 * 120, counter);
+    EXPECT_EQ(0, nOtherThread);
+
+    ParallelCleanup();
+    PbrtOptions.nThreads = 0;
+}
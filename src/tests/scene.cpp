@@ -0,0 +1,93 @@
+
+#include "tests/gtest/gtest.h"
+#include "pbrt.h"
+#include "rng.h"
+#include "scene.h"
+#include "primitive.h"
+#include "parallel.h"
+#include "accelerators/bvh.h"
+#include "lights/point.h"
+#include "shapes/sphere.h"
+
+using namespace pbrt;
+
+static std::shared_ptr<Primitive> SpherePrimitive(const Point3f &center,
+                                                  Float radius) {
+    Transform *t = new Transform(Translate(Vector3f(center)));
+    Transform *tInv = new Transform(Inverse(*t));
+    return std::make_shared<GeometricPrimitive>(
+        std::make_shared<Sphere>(t, tInv, false, radius, -radius, radius, 360),
+        nullptr, nullptr, MediumInterface());
+}
+
+TEST(Scene, OccluderCache) {
+    ParallelInit();
+    RNG rng;
+    std::vector<std::shared_ptr<Primitive>> prims;
+    for (int i = 0; i < 200; ++i)
+        prims.push_back(SpherePrimitive(
+            Point3f(Lerp(rng.UniformFloat(), -10, 10),
+                    Lerp(rng.UniformFloat(), -10, 10),
+                    Lerp(rng.UniformFloat(), -10, 10)),
+            .2f + rng.UniformFloat()));
+    // More lights than the cache has entries, so that some of them must
+    // share an entry
+    std::vector<std::shared_ptr<Light>> lights;
+    std::vector<Point3f> lightPositions;
+    for (int i = 0; i < 100; ++i) {
+        lightPositions.push_back(Point3f(Lerp(rng.UniformFloat(), -15, 15),
+                                         Lerp(rng.UniformFloat(), -15, 15),
+                                         Lerp(rng.UniformFloat(), -15, 15)));
+        lights.push_back(std::make_shared<PointLight>(
+            Translate(Vector3f(lightPositions.back())), MediumInterface(),
+            Spectrum(1.f)));
+    }
+    Scene scene(std::make_shared<BVHAccel>(prims), lights);
+
+    // Trace runs of shadow rays from nearby points toward the same light,
+    // so that the cached occluders are often hit, interleaved with rays
+    // toward other lights.
+    int nOccluded = 0;
+    for (int run = 0; run < 500; ++run) {
+        Point3f base(Lerp(rng.UniformFloat(), -12, 12),
+                     Lerp(rng.UniformFloat(), -12, 12),
+                     Lerp(rng.UniformFloat(), -12, 12));
+        int light = rng.UniformUInt32(lights.size());
+        for (int i = 0; i < 20; ++i) {
+            if (rng.UniformFloat() < .3f)
+                light = rng.UniformUInt32(lights.size());
+            Point3f o = base + Vector3f(rng.UniformFloat() - .5f,
+                                        rng.UniformFloat() - .5f,
+                                        rng.UniformFloat() - .5f);
+            Ray ray(o, lightPositions[light] - o, 1 - ShadowEpsilon);
+            bool occluded = scene.IntersectP(ray);
+            EXPECT_EQ(occluded, scene.IntersectP(ray, lights[light].get()));
+            nOccluded += occluded;
+        }
+    }
+    EXPECT_GT(nOccluded, 1000);
+    ParallelCleanup();
+}
+
+TEST(Scene, OccluderCacheNewScene) {
+    ParallelInit();
+    std::shared_ptr<Light> light = std::make_shared<PointLight>(
+        Translate(Vector3f(0, 0, 10)), MediumInterface(), Spectrum(1.f));
+    Ray ray(Point3f(0, 0, -10), Vector3f(0, 0, 20), 1 - ShadowEpsilon);
+
+    // The first scene's sphere blocks the ray and is cached as the
+    // light's occluder; it's kept alive so that a stale cache entry would
+    // report it as blocking the ray in the second scene.
+    std::vector<std::shared_ptr<Primitive>> blocking = {
+        SpherePrimitive(Point3f(0, 0, 0), 1)};
+    {
+        Scene scene(std::make_shared<BVHAccel>(blocking), {light});
+        EXPECT_TRUE(scene.IntersectP(ray, light.get()));
+        EXPECT_TRUE(scene.IntersectP(ray, light.get()));
+    }
+    std::vector<std::shared_ptr<Primitive>> clear = {
+        SpherePrimitive(Point3f(5, 0, 0), 1)};
+    Scene scene(std::make_shared<BVHAccel>(clear), {light});
+    EXPECT_FALSE(scene.IntersectP(ray, light.get()));
+    ParallelCleanup();
+}
@@ -1,19 +1,30 @@
 
 #include "tests/gtest/gtest.h"
 #include <array>
+#include <atomic>
 #include <cmath>
 #include <functional>
+#include <map>
 #include "pbrt.h"
+#include "imageio.h"
 #include "rng.h"
 #include "shape.h"
 #include "lowdiscrepancy.h"
+#include "paramset.h"
+#include "parallel.h"
 #include "sampling.h"
+#include "shapes/bilinear.h"
 #include "shapes/cone.h"
 #include "shapes/cylinder.h"
 #include "shapes/disk.h"
+#include "shapes/heightfield.h"
+#include "shapes/loopsubdiv.h"
 #include "shapes/paraboloid.h"
+#include "shapes/plymesh.h"
 #include "shapes/sphere.h"
 #include "shapes/triangle.h"
+#include "textures/constant.h"
+#include "textures/imagemap.h"
 
 using namespace pbrt;
 
@@ -545,7 +556,7 @@ TEST(Paraboloid, Reintersect) {
 
 TEST(Triangle, BadCases) {
     Transform identity;
-    int indices[3] = { 0, 1, 2 };
+    Int indices[3] = { 0, 1, 2 };
     Point3f p[3] = {  Point3f( -1113.45459, -79.049614, -56.2431908),
                       Point3f(-1113.45459, -87.0922699, -56.2431908),
                       Point3f(-1113.45459, -79.2090149, -56.2431908) };
@@ -559,3 +570,613 @@ TEST(Triangle, BadCases) {
     SurfaceInteraction isect;
     EXPECT_FALSE(mesh[0]->Intersect(ray, &thit, &isect));
 }
+
+TEST(Triangle, CompactMesh) {
+    // Create the same random mesh with full-precision and compact storage
+    RNG rng(7);
+    const int nVertices = 64, nTriangles = 96;
+    std::vector<Point3f> p;
+    std::vector<Normal3f> n;
+    std::vector<Point2f> uv;
+    for (int i = 0; i < nVertices; ++i) {
+        p.push_back(Point3f(rng.UniformFloat(), rng.UniformFloat(),
+                            rng.UniformFloat()));
+        n.push_back(Normal3f(Normalize(
+            Vector3f(-1 + 2 * rng.UniformFloat(), -1 + 2 * rng.UniformFloat(),
+                     -1 + 2 * rng.UniformFloat()))));
+        uv.push_back(Point2f(rng.UniformFloat(), rng.UniformFloat()));
+    }
+    std::vector<Int> indices;
+    for (int i = 0; i < 3 * nTriangles; ++i)
+        indices.push_back(rng.UniformUInt32(nVertices));
+
+    Transform identity;
+    std::vector<std::shared_ptr<Shape>> full = CreateTriangleMesh(
+        &identity, &identity, false, nTriangles, indices.data(), nVertices,
+        p.data(), nullptr, n.data(), uv.data(), nullptr, nullptr);
+    std::vector<std::shared_ptr<Shape>> compact = CreateTriangleMesh(
+        &identity, &identity, false, nTriangles, indices.data(), nVertices,
+        p.data(), nullptr, n.data(), uv.data(), nullptr, nullptr, nullptr,
+        true);
+
+    // Rays must hit the same triangles at the same points, with shading
+    // geometry that only differs by the encoding error
+    for (int i = 0; i < 1000; ++i) {
+        int tri = rng.UniformUInt32(nTriangles);
+        Point2f b = UniformSampleTriangle(
+            Point2f(rng.UniformFloat(), rng.UniformFloat()));
+        Point3f p0, p1, p2;
+        ((const Triangle *)full[tri].get())->GetVertices(&p0, &p1, &p2);
+        Point3f pTarget = b[0] * p0 + b[1] * p1 + (1 - b[0] - b[1]) * p2;
+        Point3f o(-1 + 3 * rng.UniformFloat(), -1 + 3 * rng.UniformFloat(),
+                  2);
+        Ray ray(o, pTarget - o);
+
+        Float tFull, tCompact;
+        SurfaceInteraction isectFull, isectCompact;
+        bool hitFull = full[tri]->Intersect(ray, &tFull, &isectFull);
+        bool hitCompact = compact[tri]->Intersect(ray, &tCompact,
+                                                  &isectCompact);
+        EXPECT_EQ(hitFull, hitCompact);
+        if (!hitFull || !hitCompact) continue;
+        EXPECT_EQ(tFull, tCompact);
+        EXPECT_LT(Distance(isectFull.uv, isectCompact.uv), 1e-3);
+        EXPECT_LT((isectFull.shading.n - isectCompact.shading.n).Length(),
+                  1e-3);
+    }
+}
+
+TEST(Triangle, CompactMeshZeroNormal) {
+    // A zero normal has no direction to encode, so the mesh must keep its
+    // normals at full precision while still compacting everything else
+    Point3f p[3] = {Point3f(0, 0, 0), Point3f(1, 0, 0), Point3f(0, 1, 0)};
+    Normal3f n[3] = {Normal3f(0, 0, 1), Normal3f(0, 0, 0), Normal3f(0, 0, 1)};
+    Point2f uv[3] = {Point2f(0, 0), Point2f(1, 0), Point2f(0, 1)};
+    Int indices[3] = {0, 1, 2};
+    TriangleMesh mesh(Transform(), 1, indices, 3, p, nullptr, n, uv, nullptr,
+                      nullptr, nullptr, true);
+    EXPECT_TRUE(mesh.n != nullptr);
+    EXPECT_TRUE(mesh.nEncoded == nullptr);
+    EXPECT_TRUE(mesh.uvHalf != nullptr);
+    for (int i = 0; i < 3; ++i) EXPECT_EQ(n[i], mesh.N(i));
+}
+
+TEST(Triangle, UpdateVerticesAddingNormals) {
+    // A mesh without normals has nowhere to store new ones, so the update
+    // must be refused without touching the mesh
+    Point3f p[3] = {Point3f(0, 0, 0), Point3f(1, 0, 0), Point3f(0, 1, 0)};
+    Int indices[3] = {0, 1, 2};
+    TriangleMesh mesh(Transform(), 1, indices, 3, p, nullptr, nullptr,
+                      nullptr, nullptr, nullptr, nullptr);
+    Point3f newP[3] = {Point3f(0, 0, 1), Point3f(1, 0, 1), Point3f(0, 1, 1)};
+    Normal3f newN[3] = {Normal3f(0, 0, 1), Normal3f(0, 0, 1),
+                        Normal3f(0, 0, 1)};
+    mesh.UpdateVertices(Transform(), newP, newN);
+    EXPECT_TRUE(mesh.n == nullptr);
+    for (int i = 0; i < 3; ++i) EXPECT_EQ(p[i], mesh.p[i]);
+}
+
+TEST(Triangle, UpdateVerticesZeroNormal) {
+    // Encoded normals can't represent a zero normal, so the update must be
+    // refused without touching the mesh
+    Point3f p[3] = {Point3f(0, 0, 0), Point3f(1, 0, 0), Point3f(0, 1, 0)};
+    Normal3f n[3] = {Normal3f(0, 0, 1), Normal3f(0, 0, 1), Normal3f(0, 0, 1)};
+    Int indices[3] = {0, 1, 2};
+    TriangleMesh mesh(Transform(), 1, indices, 3, p, nullptr, n, nullptr,
+                      nullptr, nullptr, nullptr, true);
+    ASSERT_TRUE(mesh.nEncoded != nullptr);
+    Point3f newP[3] = {Point3f(0, 0, 1), Point3f(1, 0, 1), Point3f(0, 1, 1)};
+    Normal3f newN[3] = {Normal3f(0, 1, 0), Normal3f(0, 0, 0),
+                        Normal3f(0, 1, 0)};
+    mesh.UpdateVertices(Transform(), newP, newN);
+    for (int i = 0; i < 3; ++i) {
+        EXPECT_EQ(p[i], mesh.p[i]);
+        EXPECT_LT((Vector3f(n[i]) - Vector3f(mesh.N(i))).Length(), 1e-3f);
+    }
+}
+
+TEST(Triangle, AlphaCells) {
+    ParallelInit();
+    // Write an alpha texture that's only nonzero inside a disk
+    Point2i res(32, 32);
+    std::vector<Float> pixels(3 * res.x * res.y);
+    for (int y = 0; y < res.y; ++y)
+        for (int x = 0; x < res.x; ++x) {
+            Float r = Distance(Point2f((x + .5f) / res.x, (y + .5f) / res.y),
+                               Point2f(.5, .5));
+            for (int c = 0; c < 3; ++c)
+                pixels[3 * (y * res.x + x) + c] = r < .3f ? 1 - r : 0;
+        }
+    WriteImage("alphacells.pfm", pixels.data(), Bounds2i({0, 0}, res), res);
+
+    // Create separate random triangles with small $(u,v)$ extents
+    RNG rng(13);
+    const int nTriangles = 256, nVertices = 3 * nTriangles;
+    std::vector<Point3f> p;
+    std::vector<Point2f> uv;
+    std::vector<Int> indices;
+    for (int i = 0; i < nTriangles; ++i) {
+        Point2f uvCenter(-.5f + 2 * rng.UniformFloat(),
+                         -.5f + 2 * rng.UniformFloat());
+        for (int j = 0; j < 3; ++j) {
+            p.push_back(Point3f(rng.UniformFloat(), rng.UniformFloat(),
+                                rng.UniformFloat()));
+            uv.push_back(uvCenter + Vector2f(-.2f + .4f * rng.UniformFloat(),
+                                             -.2f + .4f * rng.UniformFloat()));
+            indices.push_back(3 * i + j);
+        }
+    }
+
+    Transform identity;
+    for (ImageWrap wrap :
+         {ImageWrap::Repeat, ImageWrap::Black, ImageWrap::Clamp}) {
+        std::shared_ptr<Texture<Float>> alpha =
+            std::make_shared<ImageTexture<Float, Float>>(
+                std::unique_ptr<TextureMapping2D>(new UVMapping2D),
+                "alphacells.pfm", false, 8.f, wrap, 1.f, false);
+        std::shared_ptr<Texture<Float>> shadowAlpha =
+            std::make_shared<ConstantTexture<Float>>(.5f);
+        std::vector<std::shared_ptr<Shape>> tris = CreateTriangleMesh(
+            &identity, &identity, false, nTriangles, indices.data(), nVertices,
+            p.data(), nullptr, nullptr, uv.data(), alpha, shadowAlpha);
+        const TriangleMesh &mesh =
+            *((const Triangle *)tris[0].get())->GetMesh();
+
+        // Both kinds of cells must be resolved without texture lookups
+        ASSERT_EQ(2 * nTriangles, mesh.alphaCells.bits.size());
+        ASSERT_EQ(2 * nTriangles, mesh.shadowAlphaCells.bits.size());
+        int nOpaque = 0, nTransparent = 0;
+        for (int i = 0; i < nTriangles; ++i) {
+            nOpaque += mesh.alphaCells.bits[2 * i] != 0;
+            nTransparent += mesh.alphaCells.bits[2 * i + 1] != 0;
+            EXPECT_EQ(0, mesh.shadowAlphaCells.bits[2 * i + 1]);
+            EXPECT_EQ(AlphaCells::Opaque,
+                      mesh.shadowAlphaCells.Lookup(i, .1f, .2f));
+        }
+        EXPECT_GT(nOpaque, 0);
+        EXPECT_GT(nTransparent, 0);
+
+        // Alpha-tested rays must agree with evaluating the texture at the
+        // hits found without alpha testing
+        int nHits = 0;
+        for (int i = 0; i < 20000; ++i) {
+            int tri = rng.UniformUInt32(nTriangles);
+            Point2f b = UniformSampleTriangle(
+                Point2f(rng.UniformFloat(), rng.UniformFloat()));
+            Point3f p0, p1, p2;
+            ((const Triangle *)tris[tri].get())->GetVertices(&p0, &p1, &p2);
+            Point3f pTarget = b[0] * p0 + b[1] * p1 + (1 - b[0] - b[1]) * p2;
+            Point3f o(-1 + 3 * rng.UniformFloat(), -1 + 3 * rng.UniformFloat(),
+                      2);
+            Ray ray(o, pTarget - o);
+
+            Float tHit;
+            SurfaceInteraction isect;
+            if (!tris[tri]->Intersect(ray, &tHit, &isect, false)) continue;
+            bool expected = alpha->Evaluate(isect) != 0;
+            nHits += expected;
+            EXPECT_EQ(expected, tris[tri]->Intersect(ray, &tHit, &isect));
+            EXPECT_EQ(expected, tris[tri]->IntersectP(ray));
+        }
+        EXPECT_GT(nHits, 1000);
+    }
+    EXPECT_EQ(0, remove("alphacells.pfm"));
+    ParallelCleanup();
+}
+
+TEST(BilinearPatch, PlanarMatchesTriangles) {
+    // A planar quad as a bilinear patch and as two triangles
+    Transform identity;
+    Point3f p[4] = {Point3f(-1, -1, 0), Point3f(1.5, -1, 0),
+                    Point3f(-1, 1, 0), Point3f(0.5, 2, 0)};
+    Int patchIndices[4] = {0, 1, 2, 3};
+    Int triIndices[6] = {0, 1, 3, 0, 3, 2};
+    std::vector<std::shared_ptr<Shape>> patch = CreateBilinearPatchMesh(
+        &identity, &identity, false, 1, patchIndices, 4, p, nullptr, nullptr);
+    std::vector<std::shared_ptr<Shape>> tris =
+        CreateTriangleMesh(&identity, &identity, false, 2, triIndices, 4, p,
+                           nullptr, nullptr, nullptr, nullptr, nullptr);
+    EXPECT_FLOAT_EQ(tris[0]->Area() + tris[1]->Area(), patch[0]->Area());
+
+    RNG rng;
+    for (int i = 0; i < 10000; ++i) {
+        Point3f o(-3 + 6 * rng.UniformFloat(), -3 + 6 * rng.UniformFloat(),
+                  1 + rng.UniformFloat());
+        Point3f target(-2 + 4 * rng.UniformFloat(),
+                       -2 + 4 * rng.UniformFloat(), 0);
+        Ray ray(o, target - o);
+
+        Float tPatch, tTri = Infinity;
+        SurfaceInteraction isectPatch, isectTri;
+        bool hitPatch = patch[0]->Intersect(ray, &tPatch, &isectPatch);
+        bool hitTri = false;
+        for (const auto &tri : tris)
+            if (tri->Intersect(ray, &tTri, &isectTri)) hitTri = true;
+        // Rays that graze the quad's boundary may go either way
+        if (hitPatch != hitTri) {
+            Float dMin = Infinity;
+            for (int e = 0; e < 4; ++e) {
+                const int edge[4][2] = {{0, 1}, {1, 3}, {3, 2}, {2, 0}};
+                Point3f a = p[edge[e][0]], b = p[edge[e][1]];
+                Float s = Clamp(Dot(target - a, b - a) /
+                                    (b - a).LengthSquared(), 0, 1);
+                dMin = std::min(dMin, Distance(target, a + s * (b - a)));
+            }
+            EXPECT_LT(dMin, 1e-5);
+            continue;
+        }
+        if (!hitPatch) continue;
+        EXPECT_NEAR(tTri, tPatch, 1e-5);
+        EXPECT_LT(Distance(isectTri.p, isectPatch.p), 1e-5);
+        EXPECT_GT(Dot(isectTri.n, isectPatch.n), 0.9999);
+    }
+}
+
+TEST(BilinearPatch, NonPlanar) {
+    Transform identity;
+    Point3f p[4] = {Point3f(0, 0, 0), Point3f(1, 0, 0.5), Point3f(0, 1, 0.5),
+                    Point3f(1, 1, -0.25)};
+    Int indices[4] = {0, 1, 2, 3};
+    std::vector<std::shared_ptr<Shape>> patch = CreateBilinearPatchMesh(
+        &identity, &identity, false, 1, indices, 4, p, nullptr, nullptr);
+
+    // The area should match that of a fine triangulation of the patch
+    const int n = 256;
+    Float triArea = 0;
+    auto P = [&](int i, int j) {
+        Float u = Float(i) / n, v = Float(j) / n;
+        return (1 - u) * (1 - v) * p[0] + u * (1 - v) * p[1] +
+               (1 - u) * v * p[2] + u * v * p[3];
+    };
+    for (int i = 0; i < n; ++i)
+        for (int j = 0; j < n; ++j)
+            triArea += .5 * (Cross(P(i + 1, j) - P(i, j),
+                                   P(i, j + 1) - P(i, j)).Length() +
+                             Cross(P(i + 1, j) - P(i + 1, j + 1),
+                                   P(i, j + 1) - P(i + 1, j + 1)).Length());
+    EXPECT_NEAR(triArea, patch[0]->Area(), 1e-3 * triArea);
+
+    // Rays aimed at sampled points must hit the patch at or before them
+    RNG rng;
+    for (int i = 0; i < 1000; ++i) {
+        Float pdf;
+        Interaction it = patch[0]->Sample(
+            Point2f(rng.UniformFloat(), rng.UniformFloat()), &pdf);
+        EXPECT_NEAR(pdf, patch[0]->Pdf(it), 1e-4 * pdf);
+        Point3f o(-2 + 5 * rng.UniformFloat(), -2 + 5 * rng.UniformFloat(),
+                  rng.UniformFloat() < .5 ? -2 : 2);
+        Ray ray(o, it.p - o);
+        Float tHit;
+        SurfaceInteraction isect;
+        ASSERT_TRUE(patch[0]->Intersect(ray, &tHit, &isect));
+        EXPECT_LE(tHit, 1 + 1e-6);
+        EXPECT_LT(Distance(ray(tHit), isect.p), 1e-6);
+        EXPECT_TRUE(patch[0]->IntersectP(ray));
+
+        // Rays from the hit point must not hit the patch nearby
+        Ray spawned = isect.SpawnRay(Vector3f(isect.n));
+        Float tSpawn;
+        SurfaceInteraction isectSpawn;
+        if (patch[0]->Intersect(spawned, &tSpawn, &isectSpawn))
+            EXPECT_GT(Distance(isect.p, isectSpawn.p), 1e-4);
+    }
+
+    // The sample PDFs must integrate to one over the patch
+    const int nSamples = 128;
+    Float areaEstimate = 0;
+    for (int i = 0; i < nSamples; ++i)
+        for (int j = 0; j < nSamples; ++j) {
+            Float pdf;
+            patch[0]->Sample(
+                Point2f((i + .5f) / nSamples, (j + .5f) / nSamples), &pdf);
+            areaEstimate += 1 / (pdf * nSamples * nSamples);
+        }
+    EXPECT_NEAR(patch[0]->Area(), areaEstimate, 1e-3 * areaEstimate);
+}
+
+TEST(BilinearPatch, SampleUniform) {
+    // A trapezoid whose $(u,v)$ parameterization is far from uniform by area
+    Transform identity;
+    Point3f p[4] = {Point3f(0, 0, 0), Point3f(2, 0, 0), Point3f(0, 1, 0),
+                    Point3f(1, 1, 0)};
+    Int indices[4] = {0, 1, 2, 3};
+    std::vector<std::shared_ptr<Shape>> patch = CreateBilinearPatchMesh(
+        &identity, &identity, false, 1, indices, 4, p, nullptr, nullptr);
+    EXPECT_FLOAT_EQ(1.5, patch[0]->Area());
+
+    // Count stratified samples in the patch's cells of a grid over its
+    // bounds and compare them to the cells' areas
+    const int nSamples = 256, nCells = 4;
+    int count[nCells][nCells] = {};
+    for (int i = 0; i < nSamples; ++i)
+        for (int j = 0; j < nSamples; ++j) {
+            Float pdf;
+            Interaction it = patch[0]->Sample(
+                Point2f((i + .5f) / nSamples, (j + .5f) / nSamples), &pdf);
+            EXPECT_FLOAT_EQ(1 / patch[0]->Area(), pdf);
+            EXPECT_FLOAT_EQ(pdf, patch[0]->Pdf(it));
+            int x = Clamp(int(it.p.x / 2 * nCells), 0, nCells - 1);
+            int y = Clamp(int(it.p.y * nCells), 0, nCells - 1);
+            ++count[y][x];
+        }
+    for (int y = 0; y < nCells; ++y)
+        for (int x = 0; x < nCells; ++x) {
+            // The patch covers $0 \le x \le 2 - y$; integrate its overlap
+            // with the cell numerically
+            Float cellArea = 0;
+            const int n = 256;
+            Float y0 = Float(y) / nCells, y1 = Float(y + 1) / nCells;
+            Float x0 = 2 * Float(x) / nCells, x1 = 2 * Float(x + 1) / nCells;
+            for (int k = 0; k < n; ++k) {
+                Float py = Lerp((k + .5f) / n, y0, y1);
+                cellArea += std::max(Float(0), std::min(x1, 2 - py) - x0) *
+                            (y1 - y0) / n;
+            }
+            Float expected = cellArea / 1.5 * nSamples * nSamples;
+            EXPECT_NEAR(expected, count[y][x], .002 * nSamples * nSamples)
+                << "cell " << x << ", " << y;
+        }
+}
+
+TEST(BilinearPatch, PLYFaceIndices) {
+    // A quad and two triangles, each with its own face index
+    const char *filename = "mixedfaces.ply";
+    FILE *f = fopen(filename, "w");
+    ASSERT_TRUE(f != nullptr);
+    fprintf(f, "ply\nformat ascii 1.0\nelement vertex 6\n"
+               "property float x\nproperty float y\nproperty float z\n"
+               "element face 3\nproperty list uchar int vertex_indices\n"
+               "property int face_indices\nend_header\n"
+               "0 0 0\n1 0 0\n1 1 0\n0 1 0\n2 0 0\n2 1 0\n"
+               "4 0 1 2 3 10\n3 1 4 5 20\n3 1 5 2 30\n");
+    fclose(f);
+
+    Transform identity;
+    for (bool bilinearQuads : {false, true}) {
+        ParamSet params;
+        std::unique_ptr<std::string[]> name(new std::string[1]{filename});
+        std::unique_ptr<bool[]> quads(new bool[1]{bilinearQuads});
+        params.AddString("filename", std::move(name), 1);
+        params.AddBool("bilinearquads", std::move(quads), 1);
+        std::vector<std::shared_ptr<Shape>> shapes =
+            CreatePLYMesh(&identity, &identity, false, params);
+        std::vector<int> faceIndices;
+        int nPatches = 0;
+        for (const auto &shape : shapes) {
+            if (auto tri = std::dynamic_pointer_cast<Triangle>(shape))
+                faceIndices = tri->GetMesh()->faceIndices;
+            else
+                ++nPatches;
+        }
+        // Split quads give both of their triangles the quad's face index
+        std::vector<int> expected = bilinearQuads
+                                        ? std::vector<int>{20, 30}
+                                        : std::vector<int>{10, 10, 20, 30};
+        EXPECT_EQ(bilinearQuads ? 1 : 0, nPatches);
+        EXPECT_EQ(expected, faceIndices);
+    }
+    EXPECT_EQ(0, remove(filename));
+}
+
+// Returns the parameters of an _nx_ by _ny_ "heightfield" shape with
+// random heights that floats represent exactly.
+static ParamSet HeightfieldParams(int nx, int ny, const std::string &surface,
+                                  bool tessellate) {
+    RNG rng;
+    std::unique_ptr<Float[]> z(new Float[nx * ny]);
+    for (int i = 0; i < nx * ny; ++i) z[i] = float(rng.UniformFloat() * .2f);
+    std::unique_ptr<Int[]> nu(new Int[1]), nv(new Int[1]);
+    nu[0] = nx;
+    nv[0] = ny;
+    std::unique_ptr<std::string[]> surfaceName(new std::string[1]);
+    surfaceName[0] = surface;
+    std::unique_ptr<bool[]> tess(new bool[1]);
+    tess[0] = tessellate;
+    ParamSet params;
+    params.AddFloat("Pz", std::move(z), nx * ny);
+    params.AddInt("nu", std::move(nu), 1);
+    params.AddInt("nv", std::move(nv), 1);
+    params.AddString("surface", std::move(surfaceName), 1);
+    params.AddBool("tessellate", std::move(tess), 1);
+    return params;
+}
+
+TEST(Heightfield, MatchesTessellation) {
+    Transform ObjectToWorld =
+        Translate(Vector3f(1, 2, 3)) * Scale(4, 3, 2) * RotateZ(20);
+    Transform WorldToObject = Inverse(ObjectToWorld);
+    std::vector<std::shared_ptr<Shape>> hf =
+        CreateHeightfield(&ObjectToWorld, &WorldToObject, false,
+                          HeightfieldParams(37, 23, "triangles", false));
+    std::vector<std::shared_ptr<Shape>> tris =
+        CreateHeightfield(&ObjectToWorld, &WorldToObject, false,
+                          HeightfieldParams(37, 23, "triangles", true));
+    ASSERT_EQ(1, hf.size());
+    ASSERT_EQ(2 * 36 * 22, tris.size());
+    Float triArea = 0;
+    for (const auto &tri : tris) triArea += tri->Area();
+    EXPECT_NEAR(triArea, hf[0]->Area(), 1e-6 * triArea);
+
+    RNG rng;
+    int nHits = 0, nMismatches = 0;
+    for (int i = 0; i < 10000; ++i) {
+        Point3f o = ObjectToWorld(Point3f(Lerp(rng.UniformFloat(), -1, 2),
+                                          Lerp(rng.UniformFloat(), -1, 2),
+                                          Lerp(rng.UniformFloat(), -.5, 1)));
+        Point3f target = ObjectToWorld(
+            Point3f(rng.UniformFloat(), rng.UniformFloat(), .1));
+        Ray ray(o, target - o);
+        Float tHf, tTri = Infinity;
+        SurfaceInteraction isectHf, isectTri;
+        bool hitHf = hf[0]->Intersect(ray, &tHf, &isectHf);
+        EXPECT_EQ(hitHf, hf[0]->IntersectP(ray));
+        bool hitTri = false;
+        Ray triRay = ray;
+        for (const auto &tri : tris)
+            if (tri->Intersect(triRay, &tTri, &isectTri)) {
+                hitTri = true;
+                triRay.tMax = tTri;
+            }
+        // The mesh's vertices are rounded differently, so rays through
+        // its edges may go either way.
+        if (hitHf != hitTri || (hitHf && std::abs(tHf - tTri) > 1e-4)) {
+            ++nMismatches;
+            continue;
+        }
+        if (!hitHf) continue;
+        ++nHits;
+        EXPECT_LT(Distance(isectHf.p, isectTri.p), 1e-4);
+        EXPECT_GT(Dot(isectHf.n, isectTri.n), .9999);
+        EXPECT_LT(Distance(isectHf.uv, isectTri.uv), 1e-4);
+    }
+    EXPECT_GT(nHits, 5000);
+    EXPECT_LT(nMismatches, 10);
+}
+
+TEST(Heightfield, MissingHeights) {
+    // Fewer "Pz" values than the grid needs, or none, give no shape rather
+    // than reading past the end of them
+    Transform identity;
+    for (int nz : {0, 11}) {
+        ParamSet params;
+        std::unique_ptr<Int[]> nu(new Int[1]{4}), nv(new Int[1]{3});
+        params.AddInt("nu", std::move(nu), 1);
+        params.AddInt("nv", std::move(nv), 1);
+        if (nz > 0) {
+            std::unique_ptr<Float[]> z(new Float[nz]());
+            params.AddFloat("Pz", std::move(z), nz);
+        }
+        EXPECT_TRUE(
+            CreateHeightfield(&identity, &identity, false, params).empty());
+    }
+}
+
+TEST(Heightfield, Sampling) {
+    Transform ObjectToWorld = Scale(4, 3, 2) * RotateX(30);
+    Transform WorldToObject = Inverse(ObjectToWorld);
+    for (const char *surface : {"triangles", "bilinear"}) {
+        std::vector<std::shared_ptr<Shape>> hf = CreateHeightfield(
+            &ObjectToWorld, &WorldToObject, false,
+            HeightfieldParams(19, 42, surface, false));
+        ASSERT_EQ(1, hf.size());
+        // Rays aimed at sampled points must hit them, and the sampling
+        // density should integrate to the area
+        RNG rng;
+        Float invPdfSum = 0;
+        const int nSamples = 20000;
+        for (int i = 0; i < nSamples; ++i) {
+            Point2f u(rng.UniformFloat(), rng.UniformFloat());
+            Float pdf;
+            Interaction it = hf[0]->Sample(u, &pdf);
+            EXPECT_NEAR(pdf, hf[0]->Pdf(it), 1e-6 * pdf);
+            invPdfSum += 1 / pdf;
+
+            Point3f pObj = WorldToObject(it.p);
+            Point3f o = ObjectToWorld(Point3f(pObj.x, pObj.y, 2));
+            Ray ray(o, it.p - o);
+            Float tHit;
+            SurfaceInteraction isect;
+            ASSERT_TRUE(hf[0]->Intersect(ray, &tHit, &isect)) << surface;
+            EXPECT_NEAR(1, tHit, 1e-6) << surface;
+            EXPECT_GT(Dot(isect.n, it.n), .9999) << surface;
+        }
+        EXPECT_NEAR(hf[0]->Area(), invPdfSum / nSamples, 1e-2 * hf[0]->Area())
+            << surface;
+    }
+}
+
+TEST(LoopSubdiv, Octahedron) {
+    ParallelInit();
+    const Point3f vertices[6] = {{1, 0, 0},  {-1, 0, 0}, {0, 1, 0},
+                                 {0, -1, 0}, {0, 0, 1},  {0, 0, -1}};
+    const Int faces[24] = {0, 2, 4, 2, 1, 4, 1, 3, 4, 3, 0, 4,
+                           2, 0, 5, 1, 2, 5, 3, 1, 5, 0, 3, 5};
+    for (int levels = 0; levels <= 3; ++levels) {
+        std::unique_ptr<Point3f[]> P(new Point3f[6]);
+        std::copy(vertices, vertices + 6, P.get());
+        std::unique_ptr<Int[]> indices(new Int[24]);
+        std::copy(faces, faces + 24, indices.get());
+        std::unique_ptr<Int[]> nLevels(new Int[1]);
+        nLevels[0] = levels;
+        ParamSet params;
+        params.AddPoint3f("P", std::move(P), 6);
+        params.AddInt("indices", std::move(indices), 24);
+        params.AddInt("levels", std::move(nLevels), 1);
+        Transform identity;
+        std::vector<std::shared_ptr<Shape>> tris =
+            CreateLoopSubdiv(&identity, &identity, false, params);
+        ASSERT_EQ(8 << (2 * levels), (int)tris.size());
+
+        // The surface should be closed, with radial normals that all face
+        // the same way at vertices that are on the unit sphere or inside it.
+        const TriangleMesh &mesh =
+            *static_cast<const Triangle *>(tris[0].get())->GetMesh();
+        std::map<std::pair<int, int>, int> edgeCount;
+        for (int i = 0; i < mesh.nTriangles; ++i) {
+            int v[3];
+            mesh.GetVertexIndices(i, v);
+            for (int j = 0; j < 3; ++j)
+                ++edgeCount[std::make_pair(std::min(v[j], v[(j + 1) % 3]),
+                                           std::max(v[j], v[(j + 1) % 3]))];
+        }
+        for (const auto &e : edgeCount) EXPECT_EQ(2, e.second);
+        EXPECT_EQ(2 + mesh.nTriangles / 2, mesh.nVertices);
+        Float sign = Dot(mesh.N(0), Vector3f(mesh.p[0])) > 0 ? 1 : -1;
+        for (int i = 0; i < mesh.nVertices; ++i) {
+            Vector3f p(mesh.p[i]);
+            EXPECT_LE(p.Length(), 1.0001);
+            EXPECT_GT(sign * Dot(Normalize(mesh.N(i)), Normalize(p)), .9);
+        }
+    }
+    ParallelCleanup();
+}
+
+TEST(LoopSubdiv, InsideParallelLoop) {
+    // Subdivide the same surface from the iterations of a parallel loop, as
+    // deferred tessellation does during rendering, and at the top level
+    PbrtOptions.nThreads = 4;
+    ParallelInit();
+    const Point3f vertices[6] = {{1, 0, 0},  {-1, 0, 0}, {0, 1, 0},
+                                 {0, -1, 0}, {0, 0, 1},  {0, 0, -1}};
+    const Int faces[24] = {0, 2, 4, 2, 1, 4, 1, 3, 4, 3, 0, 4,
+                           2, 0, 5, 1, 2, 5, 3, 1, 5, 0, 3, 5};
+    std::unique_ptr<Point3f[]> P(new Point3f[6]);
+    std::copy(vertices, vertices + 6, P.get());
+    std::unique_ptr<Int[]> indices(new Int[24]);
+    std::copy(faces, faces + 24, indices.get());
+    std::unique_ptr<Int[]> levels(new Int[1]);
+    levels[0] = 4;
+    ParamSet params;
+    params.AddPoint3f("P", std::move(P), 6);
+    params.AddInt("indices", std::move(indices), 24);
+    params.AddInt("levels", std::move(levels), 1);
+    Transform identity;
+    Bounds3f bounds;
+    auto subdivide =
+        DeferLoopSubdiv(&identity, &identity, false, params, &bounds);
+    ASSERT_TRUE((bool)subdivide);
+    std::vector<std::shared_ptr<Shape>> expected = subdivide();
+    const TriangleMesh &expectedMesh =
+        *static_cast<const Triangle *>(expected[0].get())->GetMesh();
+
+    const int nSubdivisions = 16;
+    std::atomic<int> nMismatches{0};
+    ParallelFor([&](int64_t) {
+        std::vector<std::shared_ptr<Shape>> tris = subdivide();
+        const TriangleMesh &mesh =
+            *static_cast<const Triangle *>(tris[0].get())->GetMesh();
+        if (tris.size() != expected.size() ||
+            mesh.nVertices != expectedMesh.nVertices) {
+            ++nMismatches;
+            return;
+        }
+        for (int i = 0; i < mesh.nVertices; ++i)
+            if (mesh.p[i] != expectedMesh.p[i] ||
+                mesh.N(i) != expectedMesh.N(i))
+                ++nMismatches;
+    }, nSubdivisions, 1);
+    EXPECT_EQ(0, nMismatches);
+
+    ParallelCleanup();
+    PbrtOptions.nThreads = 0;
+}
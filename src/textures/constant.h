@@ -52,6 +52,10 @@ class ConstantTexture : public Texture<T> {
     // ConstantTexture Public Methods
     ConstantTexture(const T &value) : value(value) {}
     T Evaluate(const SurfaceInteraction &) const { return value; }
+    bool EvaluateRange(const Bounds2f &, T *min, T *max) const {
+        *min = *max = value;
+        return true;
+    }
 
   private:
     T value;
@@ -98,6 +98,34 @@ MIPMap<Tmemory> *ImageTexture<Tmemory, Treturn>::GetTexture(
     return mipmap;
 }
 
+template <typename Tmemory, typename Treturn>
+bool ImageTexture<Tmemory, Treturn>::EvaluateRange(const Bounds2f &uv,
+                                                   Treturn *min,
+                                                   Treturn *max) const {
+    // Spectral texels aren't ordered, so only float textures are bounded
+    return false;
+}
+
+template <>
+bool ImageTexture<Float, Float>::EvaluateRange(const Bounds2f &uv, Float *min,
+                                               Float *max) const {
+    Bounds2f st;
+    if (!mapping->MapBounds(uv, &st)) return false;
+    // Find the level 0 texels that bilinear lookups in _st_ interpolate,
+    // padded by a texel for round-off in the lookups' $(s,t)$
+    Bounds2i texels;
+    for (int axis = 0; axis < 2; ++axis) {
+        Float res = axis == 0 ? mipmap->Width() : mipmap->Height();
+        Float first = std::floor(st.pMin[axis] * res - .5f) - 1;
+        Float last = std::floor(st.pMax[axis] * res - .5f) + 2;
+        if (std::isnan(first) || std::isnan(last)) return false;
+        texels.pMin[axis] = Clamp(first, -1e12, 1e12);
+        texels.pMax[axis] = Clamp(last, -1e12, 1e12);
+    }
+    mipmap->TexelRange(texels, min, max);
+    return true;
+}
+
 template <typename Tmemory, typename Treturn>
 std::map<TexInfo, std::unique_ptr<MIPMap<Tmemory>>>
     ImageTexture<Tmemory, Treturn>::textures;
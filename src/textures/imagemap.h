@@ -92,6 +92,7 @@ class ImageTexture : public Texture<Treturn> {
         convertOut(mem, &ret);
         return ret;
     }
+    bool EvaluateRange(const Bounds2f &uv, Treturn *min, Treturn *max) const;
 
   private:
     // ImageTexture Private Methods
@@ -120,6 +121,10 @@ class ImageTexture : public Texture<Treturn> {
     static std::map<TexInfo, std::unique_ptr<MIPMap<Tmemory>>> textures;
 };
 
+template <>
+bool ImageTexture<Float, Float>::EvaluateRange(const Bounds2f &uv, Float *min,
+                                               Float *max) const;
+
 extern template class ImageTexture<Float, Float>;
 extern template class ImageTexture<RGBSpectrum, Spectrum>;
 
@@ -0,0 +1,457 @@
+//
+// pbrt_bench_accel.cpp
+//
+// Measures how quickly acceleration structures are built for a scene and
+// how quickly they trace primary, diffuse bounce and shadow rays, without
+// rendering. Results are written as JSON.
+//
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <chrono>
+#include "pbrt.h"
+#include "api.h"
+#include "camera.h"
+#include "film.h"
+#include "interaction.h"
+#include "light.h"
+#include "paramset.h"
+#include "parallel.h"
+#include "primitive.h"
+#include "rng.h"
+#include "sampling.h"
+#include "scene.h"
+#include "stats.h"
+#include "accelerators/bvh.h"
+#include "accelerators/kdtreeaccel.h"
+
+using namespace pbrt;
+
+static void usage(const char *msg = nullptr, ...) {
+    if (msg) {
+        va_list args;
+        va_start(args, msg);
+        fprintf(stderr, "pbrt_bench_accel: ");
+        vfprintf(stderr, msg, args);
+        fprintf(stderr, "\n");
+    }
+    fprintf(stderr, R"(usage: pbrt_bench_accel [<options>] <filename.pbrt>
+
+Builds acceleration structures for the scene and times tracing sets of
+primary, diffuse bounce and shadow rays with Intersect() and IntersectP().
+
+options:
+  --accel <names>      Comma-separated accelerators to measure ("bvh",
+                       "kdtree"). Default: the scene's accelerator.
+  --nthreads <counts>  Comma-separated thread counts to measure with.
+                       Default: 1 and the number of cores.
+  --outfile <name>     Write JSON results to the given file. Default: stdout.
+  --rays <n>           Number of camera rays to generate. Default: one per
+                       pixel.
+  --readrays <name>    Use ray sets previously saved with --writerays rather
+                       than generating them.
+  --repeat <n>         Trace each ray set <n> times and report the fastest.
+                       Default: 1.
+  --writerays <name>   Save the ray sets that were used.
+)");
+    exit(msg ? 1 : 0);
+}
+
+// A named set of rays traced together.
+struct RaySet {
+    std::string name;
+    std::vector<Ray> rays;
+};
+
+// Timing and traversal statistics for tracing one ray set.
+struct TraceResult {
+    std::string set, query;
+    size_t nRays;
+    double seconds;
+    int64_t hits;
+    // Accelerator nodes visited per ray, or a negative value if the
+    // accelerator doesn't count them
+    double nodesPerRay;
+};
+
+struct BenchResult {
+    std::string accelerator;
+    int nThreads;
+    double buildSeconds;
+    std::vector<TraceResult> traces;
+};
+
+static std::vector<int> parseIntList(const char *str, const char *flag) {
+    std::vector<int> values;
+    for (const char *ptr = str; *ptr;) {
+        char *end;
+        long v = strtol(ptr, &end, 10);
+        if (end == ptr || v <= 0) usage("invalid value \"%s\" for %s", str, flag);
+        values.push_back(v);
+        ptr = (*end == ',') ? end + 1 : end;
+        if (*end && *end != ',') usage("invalid value \"%s\" for %s", str, flag);
+    }
+    return values;
+}
+
+static std::vector<std::string> parseNameList(const char *str) {
+    std::vector<std::string> names(1);
+    for (const char *ptr = str; *ptr; ++ptr) {
+        if (*ptr == ',')
+            names.push_back(std::string());
+        else
+            names.back() += *ptr;
+    }
+    return names;
+}
+
+static std::shared_ptr<Primitive> makeAccelerator(
+    const std::string &name, std::vector<std::shared_ptr<Primitive>> prims,
+    const ParamSet &params) {
+    if (name == "bvh") return CreateBVHAccelerator(std::move(prims), params);
+    if (name == "kdtree")
+        return CreateKdTreeAccelerator(std::move(prims), params);
+    Error("Accelerator \"%s\" unknown.", name.c_str());
+    return nullptr;
+}
+
+// Title of the statistic that counts the nodes visited by the given
+// accelerator, if it has one.
+static const char *nodesVisitedStat(const std::string &name) {
+    if (name == "bvh") return "BVH/Nodes visited per ray";
+    if (name == "kdtree") return "Kd-Tree/Nodes visited per ray";
+    return nullptr;
+}
+
+// Generates camera rays at random film positions, along with a
+// cosine-distributed bounce ray and a ray toward a point on a randomly
+// chosen light from the first intersection of each one.
+static std::vector<RaySet> generateRays(const Camera &camera,
+                                        const Scene &scene, int nCameraRays) {
+    std::vector<RaySet> sets(3);
+    sets[0].name = "primary";
+    sets[1].name = "diffuse";
+    sets[2].name = "shadow";
+    Bounds2i sampleBounds = camera.film->GetSampleBounds();
+    if (nCameraRays <= 0) nCameraRays = sampleBounds.Area();
+    RNG rng;
+    for (int i = 0; i < nCameraRays; ++i) {
+        CameraSample cs;
+        cs.pFilm = Point2f(
+            Lerp(rng.UniformFloat(), sampleBounds.pMin.x, sampleBounds.pMax.x),
+            Lerp(rng.UniformFloat(), sampleBounds.pMin.y, sampleBounds.pMax.y));
+        cs.pLens = Point2f(rng.UniformFloat(), rng.UniformFloat());
+        cs.time = rng.UniformFloat();
+        Ray ray;
+        if (camera.GenerateRay(cs, &ray) == 0) continue;
+        sets[0].rays.push_back(ray);
+
+        SurfaceInteraction isect;
+        if (!scene.Intersect(ray, &isect)) continue;
+        Vector3f n(Faceforward(isect.n, isect.wo)), s, t;
+        CoordinateSystem(n, &s, &t);
+        Vector3f w = CosineSampleHemisphere(
+            Point2f(rng.UniformFloat(), rng.UniformFloat()));
+        sets[1].rays.push_back(isect.SpawnRay(w.x * s + w.y * t + w.z * n));
+
+        if (scene.lights.empty()) continue;
+        int lightNum = std::min<int>(rng.UniformFloat() * scene.lights.size(),
+                                     scene.lights.size() - 1);
+        Vector3f wi;
+        Float pdf;
+        VisibilityTester vis;
+        Spectrum Li = scene.lights[lightNum]->Sample_Li(
+            isect, Point2f(rng.UniformFloat(), rng.UniformFloat()), &wi, &pdf,
+            &vis);
+        if (pdf > 0 && !Li.IsBlack())
+            sets[2].rays.push_back(vis.P0().SpawnRayTo(vis.P1()));
+    }
+    return sets;
+}
+
+// Ray set files start with the number of sets; each set is stored as its
+// name's length and characters, its number of rays and then, for each ray,
+// its origin, direction, _tMax_ and time as doubles.
+static bool writeRays(const std::string &filename,
+                      const std::vector<RaySet> &sets) {
+    FILE *f = fopen(filename.c_str(), "wb");
+    if (!f) {
+        Error("%s: unable to open ray file for writing", filename.c_str());
+        return false;
+    }
+    uint64_t nSets = sets.size();
+    fwrite(&nSets, sizeof(nSets), 1, f);
+    for (const RaySet &set : sets) {
+        uint64_t nameLength = set.name.size(), nRays = set.rays.size();
+        fwrite(&nameLength, sizeof(nameLength), 1, f);
+        fwrite(set.name.data(), 1, nameLength, f);
+        fwrite(&nRays, sizeof(nRays), 1, f);
+        for (const Ray &r : set.rays) {
+            double v[8] = {r.o.x, r.o.y, r.o.z, r.d.x,
+                           r.d.y, r.d.z, r.tMax, r.time};
+            fwrite(v, sizeof(double), 8, f);
+        }
+    }
+    bool ok = !ferror(f);
+    if (fclose(f) != 0) ok = false;
+    if (!ok) Error("%s: error writing ray file", filename.c_str());
+    return ok;
+}
+
+static bool readRays(const std::string &filename, std::vector<RaySet> *sets) {
+    FILE *f = fopen(filename.c_str(), "rb");
+    if (!f) {
+        Error("%s: unable to open ray file", filename.c_str());
+        return false;
+    }
+    uint64_t nSets;
+    bool ok = fread(&nSets, sizeof(nSets), 1, f) == 1;
+    for (uint64_t i = 0; ok && i < nSets; ++i) {
+        RaySet set;
+        uint64_t nameLength, nRays;
+        ok = fread(&nameLength, sizeof(nameLength), 1, f) == 1 &&
+             nameLength < 256;
+        if (!ok) break;
+        set.name.resize(nameLength);
+        ok = fread(&set.name[0], 1, nameLength, f) == nameLength &&
+             fread(&nRays, sizeof(nRays), 1, f) == 1;
+        for (uint64_t j = 0; ok && j < nRays; ++j) {
+            double v[8];
+            ok = fread(v, sizeof(double), 8, f) == 8;
+            set.rays.push_back(Ray(Point3f(v[0], v[1], v[2]),
+                                   Vector3f(v[3], v[4], v[5]), v[6], v[7]));
+        }
+        sets->push_back(std::move(set));
+    }
+    fclose(f);
+    if (!ok) Error("%s: premature end of ray file", filename.c_str());
+    return ok;
+}
+
+static TraceResult traceRays(const Primitive &accel, const RaySet &set,
+                             bool occlusionOnly, int repeat,
+                             const char *statTitle) {
+    TraceResult result;
+    result.set = set.name;
+    result.query = occlusionOnly ? "IntersectP" : "Intersect";
+    result.nRays = set.rays.size();
+    result.seconds = Infinity;
+
+    // Discard statistics reported before tracing starts
+    MergeWorkerThreadStats();
+    ReportThreadStats();
+    ClearStats();
+
+    const int64_t chunkSize = 1024;
+    const int64_t nChunks = (set.rays.size() + chunkSize - 1) / chunkSize;
+    for (int iter = 0; iter < repeat; ++iter) {
+        std::atomic<int64_t> hits(0);
+        auto start = std::chrono::steady_clock::now();
+        ParallelFor([&](int64_t c) {
+            size_t end = std::min<size_t>(set.rays.size(), (c + 1) * chunkSize);
+            int64_t chunkHits = 0;
+            for (size_t i = c * chunkSize; i < end; ++i) {
+                Ray ray = set.rays[i];
+                if (occlusionOnly)
+                    chunkHits += accel.IntersectP(ray);
+                else {
+                    SurfaceInteraction isect;
+                    chunkHits += accel.Intersect(ray, &isect);
+                }
+            }
+            hits += chunkHits;
+        }, nChunks);
+        result.seconds = std::min(
+            result.seconds, std::chrono::duration<double>(
+                                std::chrono::steady_clock::now() - start)
+                                .count());
+        result.hits = hits;
+    }
+
+    // Count nodes visited per ray; instanced acceleration structures of
+    // the same type also contribute to the total
+    result.nodesPerRay = -1;
+    if (statTitle) {
+        MergeWorkerThreadStats();
+        ReportThreadStats();
+        int64_t nodesVisited, raysTraversed;
+        GetStatsRatio(statTitle, &nodesVisited, &raysTraversed);
+        if (result.nRays > 0)
+            result.nodesPerRay =
+                double(nodesVisited) / (double(result.nRays) * repeat);
+        ClearStats();
+    }
+    return result;
+}
+
+static std::string jsonString(const std::string &str) {
+    std::string result = "\"";
+    for (char c : str) {
+        if (c == '"' || c == '\\') result += '\\';
+        if (c >= 0 && c < ' ')
+            result += StringPrintf("\\u%04x", c);
+        else
+            result += c;
+    }
+    return result + "\"";
+}
+
+static void writeJSON(FILE *f, const std::string &sceneFilename,
+                      size_t nPrimitives, const std::vector<RaySet> &sets,
+                      const std::vector<BenchResult> &results) {
+    fprintf(f, "{\n  \"scene\": %s,\n  \"primitives\": %zu,\n",
+            jsonString(sceneFilename).c_str(), nPrimitives);
+    fprintf(f, "  \"raySets\": [");
+    for (size_t i = 0; i < sets.size(); ++i)
+        fprintf(f, "%s\n    { \"name\": %s, \"rays\": %zu }", i ? "," : "",
+                jsonString(sets[i].name).c_str(), sets[i].rays.size());
+    fprintf(f, "\n  ],\n  \"results\": [");
+    for (size_t i = 0; i < results.size(); ++i) {
+        const BenchResult &r = results[i];
+        fprintf(f,
+                "%s\n    {\n      \"accelerator\": %s,\n      \"threads\": "
+                "%d,\n      \"buildSeconds\": %.6f,\n      \"traces\": [",
+                i ? "," : "", jsonString(r.accelerator).c_str(), r.nThreads,
+                r.buildSeconds);
+        for (size_t j = 0; j < r.traces.size(); ++j) {
+            const TraceResult &t = r.traces[j];
+            double mrays = t.seconds > 0 ? t.nRays / t.seconds * 1e-6 : 0;
+            fprintf(f,
+                    "%s\n        { \"set\": %s, \"query\": %s, \"rays\": %zu, "
+                    "\"hits\": %lld, \"seconds\": %.6f, "
+                    "\"mraysPerSecond\": %.4f, \"nodesPerRay\": ",
+                    j ? "," : "", jsonString(t.set).c_str(),
+                    jsonString(t.query).c_str(), t.nRays, (long long)t.hits,
+                    t.seconds, mrays);
+            if (t.nodesPerRay < 0)
+                fprintf(f, "null }");
+            else
+                fprintf(f, "%.3f }", t.nodesPerRay);
+        }
+        fprintf(f, "\n      ]\n    }");
+    }
+    fprintf(f, "\n  ]\n}\n");
+}
+
+int main(int argc, char *argv[]) {
+    FLAGS_stderrthreshold = 1; // Warning and above.
+
+    std::vector<std::string> accelNames;
+    std::vector<int> threadCounts;
+    std::string outfile, readRaysFile, writeRaysFile, sceneFilename;
+    int nCameraRays = 0, repeat = 1;
+    for (int i = 1; i < argc; ++i) {
+        auto value = [&]() -> const char * {
+            if (i + 1 == argc) usage("missing value after %s", argv[i]);
+            return argv[++i];
+        };
+        if (!strcmp(argv[i], "--accel"))
+            accelNames = parseNameList(value());
+        else if (!strcmp(argv[i], "--nthreads"))
+            threadCounts = parseIntList(value(), "--nthreads");
+        else if (!strcmp(argv[i], "--outfile"))
+            outfile = value();
+        else if (!strcmp(argv[i], "--rays"))
+            nCameraRays = parseIntList(value(), "--rays")[0];
+        else if (!strcmp(argv[i], "--readrays"))
+            readRaysFile = value();
+        else if (!strcmp(argv[i], "--repeat"))
+            repeat = parseIntList(value(), "--repeat")[0];
+        else if (!strcmp(argv[i], "--writerays"))
+            writeRaysFile = value();
+        else if (!strcmp(argv[i], "--help") || !strcmp(argv[i], "-h"))
+            usage();
+        else if (argv[i][0] == '-')
+            usage("unknown option \"%s\"", argv[i]);
+        else if (!sceneFilename.empty())
+            usage("only one scene file may be given");
+        else
+            sceneFilename = argv[i];
+    }
+    if (sceneFilename.empty()) usage("no scene file given");
+    if (threadCounts.empty()) {
+        threadCounts.push_back(1);
+        if (NumSystemCores() > 1) threadCounts.push_back(NumSystemCores());
+    }
+
+    Options options;
+    options.quiet = true;
+    pbrtInit(options);
+    bool ok = true;
+    pbrtSetWorldEndCallback([&](
+        const Camera &camera, std::vector<std::shared_ptr<Primitive>> &prims,
+        std::vector<std::shared_ptr<Light>> &lights,
+        const std::string &sceneAccelName, const ParamSet &sceneAccelParams) {
+        if (accelNames.empty()) accelNames.push_back(sceneAccelName);
+
+        // Get the ray sets, using the first accelerator to find the
+        // intersections that secondary rays start from
+        std::vector<RaySet> sets;
+        if (!readRaysFile.empty()) {
+            if (!readRays(readRaysFile, &sets)) {
+                ok = false;
+                return;
+            }
+        } else {
+            std::shared_ptr<Primitive> accel =
+                makeAccelerator(accelNames[0], prims,
+                                accelNames[0] == sceneAccelName
+                                    ? sceneAccelParams : ParamSet());
+            if (!accel) {
+                ok = false;
+                return;
+            }
+            sets = generateRays(camera, Scene(accel, lights), nCameraRays);
+        }
+        if (!writeRaysFile.empty() && !writeRays(writeRaysFile, sets))
+            ok = false;
+
+        std::vector<BenchResult> results;
+        int defaultThreads = PbrtOptions.nThreads;
+        for (const std::string &name : accelNames) {
+            const ParamSet &params =
+                (name == sceneAccelName) ? sceneAccelParams : ParamSet();
+            for (int nThreads : threadCounts) {
+                ParallelCleanup();
+                PbrtOptions.nThreads = nThreads;
+                ParallelInit();
+
+                BenchResult result;
+                result.accelerator = name;
+                result.nThreads = nThreads;
+                auto start = std::chrono::steady_clock::now();
+                std::shared_ptr<Primitive> accel =
+                    makeAccelerator(name, prims, params);
+                result.buildSeconds = std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - start).count();
+                if (!accel) {
+                    ok = false;
+                    break;
+                }
+                for (const RaySet &set : sets)
+                    for (bool occlusionOnly : {false, true})
+                        result.traces.push_back(
+                            traceRays(*accel, set, occlusionOnly, repeat,
+                                      nodesVisitedStat(name)));
+                results.push_back(std::move(result));
+            }
+        }
+        ParallelCleanup();
+        PbrtOptions.nThreads = defaultThreads;
+        ParallelInit();
+
+        FILE *f = outfile.empty() ? stdout : fopen(outfile.c_str(), "w");
+        if (!f) {
+            Error("%s: unable to open output file", outfile.c_str());
+            ok = false;
+            return;
+        }
+        writeJSON(f, sceneFilename, prims.size(), sets, results);
+        if (f != stdout) fclose(f);
+    });
+    pbrtParseFile(sceneFilename);
+    pbrtCleanup();
+    return ok ? 0 : 1;
+}